@@ -213,7 +213,7 @@ static int ParseCPrecompiler(FILE *pInput)
 static int usage(FILE *pOut,  const char *argv0)
 {
     fprintf(pOut,
-            "usage: %s [-l=c] -o <output> -t <target> [-f] [-s] < - | <filename> | -e <cmdline> >\n"
+            "usage: %s [-l=c] <-o <output> | -d <dep-db>> -t <target> [-f] [-s] < - | <filename> | -e <cmdline> >\n"
             "   or: %s --help\n"
             "   or: %s --version\n",
             argv0, argv0, argv0);
@@ -229,6 +229,7 @@ int main(int argc, char *argv[])
     int         iExec = 0;
     FILE       *pOutput = NULL;
     const char *pszOutput = NULL;
+    const char *pszDb = NULL;
     FILE       *pInput = NULL;
     const char *pszTarget = NULL;
     int         fStubs = 0;
@@ -306,6 +307,29 @@ int main(int argc, char *argv[])
                     break;
                 }
 
+                /*
+                 * Binary dependency database to append to.
+                 */
+                case 'd':
+                {
+                    if (pszDb)
+                    {
+                        fprintf(stderr, "%s: syntax error: only one dependency database!\n", argv[0]);
+                        return 1;
+                    }
+                    pszDb = &argv[i][2];
+                    if (!*pszDb)
+                    {
+                        if (++i >= argc)
+                        {
+                            fprintf(stderr, "%s: syntax error: The '-d' argument is missing the filename.\n", argv[0]);
+                            return 1;
+                        }
+                        pszDb = argv[i];
+                    }
+                    break;
+                }
+
                 /*
                  * Target name.
                  */
@@ -426,7 +450,7 @@ int main(int argc, char *argv[])
         fprintf(stderr, "%s: syntax error: No input!\n", argv[0]);
         return 1;
     }
-    if (!pOutput)
+    if (!pOutput && !pszDb)
     {
         fprintf(stderr, "%s: syntax error: No output!\n", argv[0]);
         return 1;
@@ -465,25 +489,33 @@ int main(int argc, char *argv[])
     if (!i)
     {
         depOptimize(fFixCase, 0 /* fQuiet */);
-        fprintf(pOutput, "%s:", pszTarget);
-        depPrint(pOutput);
-        if (fStubs)
-            depPrintStubs(pOutput);
+        if (pOutput)
+        {
+            fprintf(pOutput, "%s:", pszTarget);
+            depPrint(pOutput);
+            if (fStubs)
+                depPrintStubs(pOutput);
+        }
+        if (pszDb)
+            i = depDbAppend(pszDb, pszTarget, fStubs);
     }
 
     /*
      * Close the output, delete output on failure.
      */
-    if (!i && ferror(pOutput))
+    if (pOutput)
     {
-        i = 1;
-        fprintf(stderr, "%s: error: Error writing to '%s'.\n", argv[0], pszOutput);
-    }
-    fclose(pOutput);
-    if (i)
-    {
-        if (unlink(pszOutput))
-            fprintf(stderr, "%s: warning: failed to remove output file '%s' on failure.\n", argv[0], pszOutput);
+        if (!i && ferror(pOutput))
+        {
+            i = 1;
+            fprintf(stderr, "%s: error: Error writing to '%s'.\n", argv[0], pszOutput);
+        }
+        fclose(pOutput);
+        if (i)
+        {
+            if (unlink(pszOutput))
+                fprintf(stderr, "%s: warning: failed to remove output file '%s' on failure.\n", argv[0], pszOutput);
+        }
     }
 
     return i;
@@ -73,6 +73,7 @@
 
 #include "crc32.h"
 #include "md5.h"
+#include "kDep.h"
 
 
 /*******************************************************************************
@@ -2373,6 +2374,83 @@ static const char *kOCEntryFindFileStatement(const char *pszStart, const char *p
 }
 
 
+/**
+ * Appends the dependencies found in the #line statements of the precompiler
+ * output to a binary dependency database.
+ *
+ * @param   pEntry      The cache entry.
+ * @param   pszDb       The dependency database.
+ * @param   pszTarget   The name of the target (usually the object).
+ * @param   fStubs      Whether to have kmk create empty rules for the dependencies.
+ */
+static void kOCEntryAppendDeps(PKOCENTRY pEntry, const char *pszDb, const char *pszTarget, int fStubs)
+{
+    const char *psz;
+    const char *pszEnd;
+    const char *pszPrev = NULL;
+    size_t      cchPrev = 0;
+
+    if (    !pEntry->New.pszCppMapping
+        &&  kOCEntryReadCppOutput(pEntry, &pEntry->New, 0 /* fatal */) != 0)
+        return;
+
+    /*
+     * Look for '#line <n> "file"' statements at the start of the lines,
+     * skipping quickly over consecutive ones for the same file.
+     */
+    psz = pEntry->New.pszCppMapping;
+    pszEnd = psz + pEntry->New.cbCpp;
+    while (psz < pszEnd)
+    {
+        const char *pszFile;
+        unsigned    iLine;
+        const char *pszEol = memchr(psz, '\n', pszEnd - psz);
+        if (!pszEol)
+            pszEol = pszEnd;
+
+        if (    *psz == '#'
+            &&  kOCEntryIsLineStatement(psz, &iLine, &pszFile)
+            &&  pszFile < pszEol
+            &&  *pszFile == '"')
+        {
+            const char *pszQuote;
+            size_t      cch;
+            pszFile++;
+            pszQuote = memchr(pszFile, '"', pszEol - pszFile);
+            cch = pszQuote ? pszQuote - pszFile : 0;
+            if (    cch
+                &&  cch < KOBJCACHE_MAX_LINE_LEN
+                &&  (cch != cchPrev || memcmp(pszFile, pszPrev, cch)))
+            {
+                char *pszDst = g_szLine;
+                pszPrev = pszFile;
+                cchPrev = cch;
+                while (pszFile < pszQuote)
+                {
+                    char ch = *pszFile++;
+                    if (ch == '\\' && pszFile < pszQuote)
+                    {
+                        ch = *pszFile++;
+                        if (ch == '\\')
+                            ch = '/';
+                    }
+                    *pszDst++ = ch;
+                }
+                *pszDst = '\0';
+                depAdd(g_szLine, pszDst - g_szLine);
+            }
+        }
+
+        psz = pszEol + 1;
+    }
+
+    depOptimize(0 /* fFixCase */, 1 /* fQuiet */);
+    if (depDbAppend(pszDb, pszTarget, fStubs))
+        FatalDie("failed to append the dependencies to '%s'\n", pszDb);
+    depCleanup();
+}
+
+
 /**
  * Worker for kOCEntryCompareOldAndNewOutput() that compares the
  * precompiled output using a fast but not very good method.
@@ -3644,6 +3722,7 @@ static int usage(FILE *pOut)
             "            <-f|--file <local-cache-file>>\n"
             "            <-t|--target <target-name>>\n"
             "            [-r|--redir-stdout] [-p|--passthru]\n"
+            "            [--dep-db <dep-db> --dep-target <target> [--dep-stubs]]\n"
             "            --kObjCache-cpp <filename> <precompiler + args>\n"
             "            --kObjCache-cc <object> <compiler + args>\n"
             "            [--kObjCache-both [args]]\n"
@@ -3684,6 +3763,10 @@ int main(int argc, char **argv)
 
     const char *pszTarget = NULL;
 
+    const char *pszDepDb = NULL;
+    const char *pszDepTarget = NULL;
+    int fDepStubs = 0;
+
     enum { kOC_Options, kOC_CppArgv, kOC_CcArgv, kOC_BothArgv } enmMode = kOC_Options;
 
     size_t cch;
@@ -3779,6 +3862,20 @@ int main(int argc, char **argv)
                 return SyntaxError("%s requires a target platform/arch name!\n", argv[i]);
             pszTarget = argv[++i];
         }
+        else if (!strcmp(argv[i], "--dep-db"))
+        {
+            if (i + 1 >= argc)
+                return SyntaxError("%s requires a dependency database filename!\n", argv[i]);
+            pszDepDb = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--dep-target"))
+        {
+            if (i + 1 >= argc)
+                return SyntaxError("%s requires a target name!\n", argv[i]);
+            pszDepTarget = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--dep-stubs"))
+            fDepStubs = 1;
         else if (!strcmp(argv[i], "-p") || !strcmp(argv[i], "--passthru"))
             fRedirPreCompStdOut = fRedirCompileStdIn = 1;
         else if (!strcmp(argv[i], "-r") || !strcmp(argv[i], "--redir-stdout"))
@@ -3811,6 +3908,8 @@ int main(int argc, char **argv)
         return SyntaxError("No compiler arguments (--kObjCache-cc)!\n");
     if (!cArgvPreComp)
         return SyntaxError("No precompiler arguments (--kObjCache-cc)!\n");
+    if (pszDepDb && !pszDepTarget)
+        return SyntaxError("No dependency target name (--dep-target)!\n");
 
     /*
      * Calc the cache file name.
@@ -3916,6 +4015,12 @@ int main(int argc, char **argv)
     kOCEntryWrite(pEntry);
     kObjCacheUnlock(pCache);
     kObjCacheDestroy(pCache);
+
+    /*
+     * Append the dependencies to the database.
+     */
+    if (pszDepDb)
+        kOCEntryAppendDeps(pEntry, pszDepDb, pszDepTarget, fDepStubs);
     return 0;
 }
 
@@ -102,6 +102,10 @@ STATIC void expredir(shinstance *, union node *);
 STATIC void evalpipe(shinstance *, union node *);
 STATIC void evalcommand(shinstance *, union node *, int, struct backcmd *);
 STATIC void prehash(shinstance *, union node *);
+STATIC int nofork_text(const char *);
+STATIC int nofork_arg(union node *);
+STATIC int nofork_redir(union node *);
+STATIC int nofork_cmd(shinstance *, union node *, int);
 
 
 /*
@@ -203,6 +207,42 @@ evalstring(shinstance *psh, char *s, int flag)
 }
 
 
+/*
+ * Execute a command string like evalstring does, but only if all of it
+ * can be done without forking (see evalnofork).  The whole string is
+ * parsed first and the shell exits after the last command.  Returns if
+ * the string has to be run by a forking shell, having run nothing.
+ */
+
+void
+evalstringnofork(shinstance *psh, char *s)
+{
+	struct cmdlist {
+		struct cmdlist *next;
+		union node *n;
+	} *head = NULL, **tailp = &head, *lp;
+	union node *n;
+
+	setinputstring(psh, s, 1);
+	while ((n = parsecmd(psh, 0)) != NEOF) {
+		lp = stalloc(psh, sizeof(*lp));
+		lp->next = NULL;
+		lp->n = n;
+		*tailp = lp;
+		tailp = &lp->next;
+	}
+	popfile(psh);
+
+	for (lp = head; lp; lp = lp->next)
+		if (!evalnofork(psh, lp->n, lp->next == NULL))
+			return;
+
+	for (lp = head; lp && !psh->evalskip; lp = lp->next)
+		evaltree(psh, lp->n, lp->next == NULL ? EV_EXIT : 0);
+	exitshell(psh, psh->exitstatus);
+}
+
+
 
 /*
  * Evaluate a parse tree.  The value is left in the global variable
@@ -302,6 +342,149 @@ out:
 }
 
 
+/*
+ * Check whether a parse tree can be evaluated without ever forking, that
+ * is, by running builtins in this shell and at most one external program
+ * as its last command (TAIL).  This leaves out pipelines, subshells,
+ * background commands, command substitutions and here documents as well
+ * as the builtins that evaluate text or change the process state.  Loops
+ * are left out too: the caller runs the tree to completion on its own
+ * thread, so it must not be able to spin there.  So are references to $$,
+ * which would give the caller's pid and thus the same value for every
+ * tree evaluated this way.
+ * Returns non-zero if it can.
+ */
+
+STATIC int
+nofork_text(const char *p)
+{
+	for (; *p; p++) {
+		if (*p == CTLESC) {
+			if (!*++p)
+				break;
+		} else if (*p == CTLVAR && p[1] && p[2] == '$')
+			return 0;
+	}
+	return 1;
+}
+
+STATIC int
+nofork_arg(union node *n)
+{
+	for (; n; n = n->narg.next)
+		if (n->narg.backquote || !nofork_text(n->narg.text))
+			return 0;
+	return 1;
+}
+
+STATIC int
+nofork_redir(union node *n)
+{
+	for (; n; n = n->nfile.next) {
+		switch (n->type) {
+		case NTOFD:
+		case NFROMFD:
+			if (n->ndup.vname && !nofork_arg(n->ndup.vname))
+				return 0;
+			break;
+		case NHERE:
+		case NXHERE:
+			return 0;
+		default:
+			if (!nofork_arg(n->nfile.fname))
+				return 0;
+			break;
+		}
+	}
+	return 1;
+}
+
+STATIC int
+nofork_cmd(shinstance *psh, union node *n, int tail)
+{
+	union node *argp;
+	int (*bltin)(shinstance *, int, char **);
+	char *p;
+
+	if (n->ncmd.backgnd
+	 || !nofork_arg(n->ncmd.args)
+	 || !nofork_redir(n->ncmd.redirect))
+		return 0;
+
+	/* Skip the 'name=value' assignments to get at the command name. */
+	for (argp = n->ncmd.args; argp; argp = argp->narg.next) {
+		p = argp->narg.text;
+		if (!is_name(*p))
+			break;
+		do
+			p++;
+		while (is_in_name(*p));
+		if (*p != '=')
+			break;
+	}
+	if (argp == NULL)
+		return 1;
+
+	/* The name must be a plain word so we know what it'll run. */
+	for (p = argp->narg.text; *p; p++)
+		if ((*p >= CTL_FIRST && *p <= CTL_LAST)
+		 || *p == '*' || *p == '?' || *p == '[' || *p == '~')
+			return 0;
+
+	bltin = find_splbltin(psh, argp->narg.text);
+	if (bltin == NULL)
+		bltin = find_builtin(psh, argp->narg.text);
+	if (bltin == NULL)
+		return tail;
+	return bltin != dotcmd
+	    && bltin != evalcmd
+	    && bltin != trapcmd
+	    && bltin != umaskcmd
+	    && bltin != ulimitcmd
+	    && bltin != bltincmd
+	    && bltin != histcmd;
+}
+
+int
+evalnofork(shinstance *psh, union node *n, int tail)
+{
+	if (n == NULL)
+		return 1;
+	switch (n->type) {
+	case NSEMI:
+	case NAND:
+	case NOR:
+		return evalnofork(psh, n->nbinary.ch1, 0)
+		    && evalnofork(psh, n->nbinary.ch2, tail);
+	case NREDIR:
+		return nofork_redir(n->nredir.redirect)
+		    && evalnofork(psh, n->nredir.n, tail);
+	case NIF:
+		return evalnofork(psh, n->nif.test, 0)
+		    && evalnofork(psh, n->nif.ifpart, tail)
+		    && evalnofork(psh, n->nif.elsepart, tail);
+	case NCASE: {
+		union node *cp;
+
+		if (!nofork_arg(n->ncase.expr))
+			return 0;
+		for (cp = n->ncase.cases; cp; cp = cp->nclist.next)
+			if (!nofork_arg(cp->nclist.pattern)
+			 || !evalnofork(psh, cp->nclist.body, tail))
+				return 0;
+		return 1;
+	}
+	case NNOT:
+		return evalnofork(psh, n->nnot.com, 0);
+	case NCMD:
+		return nofork_cmd(psh, n, tail);
+	default:
+		/* NPIPE, NSUBSHELL, NBACKGND, NDEFUN, NWHILE, NUNTIL, NFOR */
+		return 0;
+	}
+}
+
+
 STATIC void
 evalloop(shinstance *psh, union node *n, int flags)
 {
@@ -48,9 +48,11 @@ struct backcmd {		/* result of evalbackcmd */
 };
 
 void evalstring(struct shinstance *, char *, int);
+void evalstringnofork(struct shinstance *, char *);
 union node;	/* BLETCH for ansi C */
 void evaltree(struct shinstance *, union node *, int);
 void evalbackcmd(struct shinstance *, union node *, struct backcmd *);
+int evalnofork(struct shinstance *, union node *, int);
 
 /* in_function returns nonzero if we are currently evaluating a function */
 #define in_function(psh)	(psh)->funcnest
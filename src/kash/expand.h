@@ -75,5 +75,6 @@ int arith(struct shinstance *, const char *);
 int expcmd(struct shinstance *, int , char **);
 void arith_lex_reset(void);
 int yylex(void);
+int yyparse(void);
 
 #endif
@@ -250,6 +250,79 @@ state4:	/* XXX ??? - why isn't this before the "if" statement */
 }
 
 
+/*
+ * Run a "sh -c command" invocation in a new shell instance inside the
+ * calling process rather than in a new process.  This is used by kmk to
+ * run recipe lines: builtins, assignments, cd and redirections are done
+ * in the instance and only the last command is started as a process if
+ * it's an external program.  ENVP is the environment and STDIN_FD the
+ * descriptor the instance should use as its standard input.
+ *
+ * Returns 0 when the command has been dealt with, *PIDP is then the pid
+ * of the program started (-1 if none) and otherwise *STATUSP the exit
+ * status.  Returns -1 without running anything if the command needs a
+ * real shell process, e.g. for pipelines or command substitution.
+ */
+
+int
+shell_run_inproc(int argc, char **argv, char **envp, int stdin_fd,
+		 int *statusp, pid_t *pidp)
+{
+	struct jmploc jmploc;
+	struct jmploc exitjmp;
+	shinstance *psh;
+	int rc;
+
+	psh = sh_create_root_shell(NULL, argc, argv);
+	if (!psh)
+		return -1;
+	psh->shenviron = envp;
+	if (stdin_fd != 0 && shfile_inherit_native(&psh->fdtab, stdin_fd, 0)) {
+		sh_destroy(psh);
+		return -1;
+	}
+	shthread_set_shell(psh);
+
+	if (setjmp(exitjmp.loc)) {
+		rc = 0;
+		goto out;
+	}
+	psh->exitjmp = &exitjmp;
+	if (setjmp(jmploc.loc)) {
+		switch (psh->exception) {
+		case EXEXEC:
+			psh->exitstatus = psh->exerrno;
+			break;
+		case EXERROR:
+			psh->exitstatus = 2;
+			break;
+		case EXINT:
+			psh->exitstatus = SIGINT + 128;
+			break;
+		default:
+			break;
+		}
+		exitshell(psh, psh->exitstatus);
+	}
+	psh->handler = &jmploc;
+	psh->rootpid = psh->pid;
+	psh->rootshell = 1;
+
+	init(psh);
+	procargs(psh, argc, argv);
+	if (psh->minusc && !iflag(psh))
+		evalstringnofork(psh, psh->minusc);
+	rc = -1;
+
+out:
+	*statusp = psh->exitstatus;
+	*pidp = psh->spawnedpid;
+	shthread_set_shell(NULL);
+	sh_destroy(psh);
+	return rc;
+}
+
+
 /*
  * Read and execute commands.  "Top" is nonzero for the top level command
  * loop; it turns on prompting if the shell is interactive.
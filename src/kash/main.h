@@ -40,5 +40,6 @@
 
 void readcmdfile(struct shinstance *, char *);
 void cmdloop(struct shinstance *, int);
+int shell_run_inproc(int, char **, char **, int, int *, pid_t *);
 int dotcmd(struct shinstance *, int, char **);
 int exitcmd(struct shinstance *, int, char **);
@@ -44,7 +44,7 @@ void scopyn(const char *, char *, ssize_t);
 int prefix(const char *, const char *);
 int number(struct shinstance *, const char *);
 int is_number(const char *);
-#ifdef _MSC_VER
+#if defined(_MSC_VER) || defined(strlcpy) /* kmk renames it kash_strlcpy */
 size_t strlcpy(char *dst, const char *src, size_t siz);
 #endif
 
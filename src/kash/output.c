@@ -227,7 +227,7 @@ out1fmt(shinstance *psh, const char *fmt, ...)
 }
 
 void
-dprintf(shinstance *psh, const char *fmt, ...)
+sh_dprintf(shinstance *psh, const char *fmt, ...)
 {
 	va_list ap;
 
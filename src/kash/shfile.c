@@ -24,6 +24,9 @@
  *
  */
 
+#if !defined(SH_PURE_STUB_MODE) && !defined(SH_STUB_MODE) && !defined(_GNU_SOURCE)
+# define _GNU_SOURCE /* posix_spawn_file_actions_addchdir_np */
+#endif
 #include "shfile.h"
 #include "shinstance.h" /* TRACE2 */
 #include <stdlib.h>
@@ -39,6 +42,375 @@
 # include <fcntl.h>
 # include <dirent.h>
 #endif
+#if !defined(SH_PURE_STUB_MODE) && !defined(SH_STUB_MODE)
+# define SHFILE_IN_USE
+# include <string.h>
+# include <limits.h>
+# include <spawn.h>
+# include <signal.h>
+#endif
+
+
+#ifdef SHFILE_IN_USE
+/** The max path length we deal with. */
+# ifdef PATH_MAX
+#  define SHFILE_MAX_PATH   PATH_MAX
+# else
+#  define SHFILE_MAX_PATH   4096
+# endif
+
+/** The lowest native descriptor number used for the files we open.
+ * The shell only lets the user redirect descriptors 0 thru 9, so keeping the
+ * native ones above that means the dup2 actions of shfile_spawn can be done
+ * in any order without clobbering each other. */
+# define SHFILE_NATIVE_MIN  10
+
+
+/**
+ * Moves a native descriptor out of the range the shell redirects and makes
+ * it close-on-exec.
+ *
+ * @returns The new native descriptor, -1 and errno on failure.
+ * @param   native      The native descriptor. Consumed.
+ */
+static int shfile_native_relocate(int native)
+{
+    int native2;
+    int s;
+
+    if (native >= SHFILE_NATIVE_MIN)
+    {
+        fcntl(native, F_SETFD, FD_CLOEXEC);
+        return native;
+    }
+    native2 = fcntl(native, F_DUPFD, SHFILE_NATIVE_MIN);
+    s = errno;
+    close(native);
+    if (native2 != -1)
+        fcntl(native2, F_SETFD, FD_CLOEXEC);
+    errno = s;
+    return native2;
+}
+
+/**
+ * Inserts a native descriptor into the table at the lowest free slot that is
+ * equal or higher than @a fdmin.
+ *
+ * @returns The shell descriptor number, -1 and errno on failure.
+ * @param   pfdtab      The file descriptor table.
+ * @param   native      The native descriptor.
+ * @param   flags       The open and SHFILE_FLAGS_* flags.
+ * @param   fdmin       The lowest acceptable shell descriptor number.
+ */
+static int shfile_insert(shfdtab *pfdtab, intptr_t native, unsigned flags, int fdmin)
+{
+    unsigned fd;
+
+    if (fdmin < 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    for (fd = fdmin; fd < pfdtab->size; fd++)
+        if (pfdtab->tab[fd].fd == -1)
+            break;
+    if (fd >= pfdtab->size)
+    {
+        unsigned new_size = pfdtab->size ? pfdtab->size * 2 : 16;
+        shfile *new_tab;
+        unsigned i;
+
+        while (fd >= new_size)
+            new_size *= 2;
+        new_tab = realloc(pfdtab->tab, new_size * sizeof(shfile));
+        if (!new_tab)
+        {
+            errno = ENOMEM;
+            return -1;
+        }
+        for (i = pfdtab->size; i < new_size; i++)
+        {
+            new_tab[i].fd = -1;
+            new_tab[i].flags = 0;
+            new_tab[i].native = -1;
+        }
+        pfdtab->tab = new_tab;
+        pfdtab->size = new_size;
+    }
+
+    pfdtab->tab[fd].fd = fd;
+    pfdtab->tab[fd].flags = flags;
+    pfdtab->tab[fd].native = native;
+    return fd;
+}
+
+/**
+ * Looks up a shell descriptor.
+ *
+ * @returns Pointer to the file entry, NULL and EBADF if not open.
+ * @param   pfdtab      The file descriptor table.
+ * @param   fd          The shell descriptor number.
+ */
+static shfile *shfile_get(shfdtab *pfdtab, int fd)
+{
+    if (    fd >= 0
+        &&  (unsigned)fd < pfdtab->size
+        &&  pfdtab->tab[fd].fd == fd)
+        return &pfdtab->tab[fd];
+    errno = EBADF;
+    return NULL;
+}
+
+/**
+ * Makes a path absolute using the current directory of the shell.
+ *
+ * @returns 0 on success, -1 and errno on failure.
+ * @param   pfdtab      The file descriptor table.
+ * @param   path        The path.
+ * @param   buf         Where to put the result, SHFILE_MAX_PATH in size.
+ */
+static int shfile_make_path(shfdtab *pfdtab, const char *path, char *buf)
+{
+    size_t cch_path = strlen(path);
+    size_t cch_cwd;
+
+    if (*path == '/')
+    {
+        if (cch_path >= SHFILE_MAX_PATH)
+        {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        memcpy(buf, path, cch_path + 1);
+        return 0;
+    }
+    if (!*path)
+    {
+        errno = ENOENT;
+        return -1;
+    }
+
+    cch_cwd = strlen(pfdtab->cwd);
+    if (cch_cwd + 1 + cch_path >= SHFILE_MAX_PATH)
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memcpy(buf, pfdtab->cwd, cch_cwd);
+    if (cch_cwd == 0 || buf[cch_cwd - 1] != '/')
+        buf[cch_cwd++] = '/';
+    memcpy(&buf[cch_cwd], path, cch_path + 1);
+    return 0;
+}
+#endif /* SHFILE_IN_USE */
+
+
+/**
+ * Initializes a file descriptor table.
+ *
+ * @returns 0 on success, -1 and errno on failure.
+ * @param   pfdtab      The table to initialize.
+ * @param   inherit     The table to inherit descriptors and current directory
+ *                      from. If NULL the standard descriptors and current
+ *                      directory of the process are used; these are borrowed,
+ *                      not duplicated.
+ */
+int shfile_init(shfdtab *pfdtab, shfdtab *inherit)
+{
+#ifdef SHFILE_IN_USE
+    unsigned fd;
+
+    pfdtab->cwd = NULL;
+    pfdtab->size = 0;
+    pfdtab->tab = NULL;
+
+    if (inherit)
+    {
+        pfdtab->cwd = strdup(inherit->cwd);
+        if (!pfdtab->cwd)
+        {
+            errno = ENOMEM;
+            return -1;
+        }
+        for (fd = 0; fd < inherit->size; fd++)
+        {
+            shfile *file = &inherit->tab[fd];
+            int native;
+
+            if (file->fd == -1 || (file->flags & SHFILE_FLAGS_CLOEXEC))
+                continue;
+            native = fcntl((int)file->native, F_DUPFD, SHFILE_NATIVE_MIN);
+            if (native == -1)
+                break;
+            fcntl(native, F_SETFD, FD_CLOEXEC);
+            if (shfile_insert(pfdtab, native, file->flags & ~SHFILE_FLAGS_MASK, fd) != (int)fd)
+            {
+                close(native);
+                break;
+            }
+        }
+        if (fd < inherit->size)
+        {
+            int s = errno;
+            shfile_uninit(pfdtab);
+            errno = s;
+            return -1;
+        }
+    }
+    else
+    {
+        pfdtab->cwd = getcwd(NULL, 0);
+        if (!pfdtab->cwd)
+            return -1;
+        for (fd = 0; fd < 3; fd++)
+        {
+            int flags = fcntl(fd, F_GETFL, 0);
+            if (    flags != -1
+                &&  shfile_insert(pfdtab, fd, flags | SHFILE_FLAGS_INHERITED, fd) != (int)fd)
+            {
+                int s = errno;
+                shfile_uninit(pfdtab);
+                errno = s;
+                return -1;
+            }
+        }
+    }
+#else
+    (void)pfdtab;
+    (void)inherit;
+#endif
+    return 0;
+}
+
+/**
+ * Closes all the descriptors in a table and frees its resources.
+ *
+ * @param   pfdtab      The table.
+ */
+void shfile_uninit(shfdtab *pfdtab)
+{
+#ifdef SHFILE_IN_USE
+    unsigned fd;
+
+    for (fd = 0; fd < pfdtab->size; fd++)
+        if (pfdtab->tab[fd].fd != -1)
+            shfile_close(pfdtab, fd);
+    free(pfdtab->tab);
+    pfdtab->tab = NULL;
+    pfdtab->size = 0;
+    free(pfdtab->cwd);
+    pfdtab->cwd = NULL;
+#else
+    (void)pfdtab;
+#endif
+}
+
+/**
+ * Makes a copy of a native descriptor available as a shell descriptor,
+ * replacing whatever was there.
+ *
+ * @returns @a fd on success, -1 and errno on failure.
+ * @param   pfdtab      The file descriptor table.
+ * @param   native      The native descriptor. The caller keeps it.
+ * @param   fd          The shell descriptor number.
+ */
+int shfile_inherit_native(shfdtab *pfdtab, int native, int fd)
+{
+#ifdef SHFILE_IN_USE
+    int flags = fcntl(native, F_GETFL, 0);
+    int rc;
+
+    if (flags == -1)
+        return -1;
+    native = fcntl(native, F_DUPFD, SHFILE_NATIVE_MIN);
+    if (native == -1)
+        return -1;
+    fcntl(native, F_SETFD, FD_CLOEXEC);
+    if (shfile_get(pfdtab, fd))
+        shfile_close(pfdtab, fd);
+    rc = shfile_insert(pfdtab, native, flags, fd);
+    if (rc != fd)
+    {
+        if (rc != -1)
+            shfile_close(pfdtab, rc);
+        close(native);
+        errno = EBADF;
+        return -1;
+    }
+    return fd;
+#else
+    (void)pfdtab;
+    (void)native;
+    (void)fd;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/**
+ * Starts a program with the descriptors 0 thru 9 and the current directory
+ * of the shell, without waiting for it.
+ *
+ * @returns 0 on success, -1 and errno on failure.
+ * @param   pfdtab      The file descriptor table.
+ * @param   exe         The program.
+ * @param   argv        The argument vector.
+ * @param   envp        The environment.
+ * @param   ppid        Where to return the process id.
+ */
+int shfile_spawn(shfdtab *pfdtab, const char *exe, char * const *argv, char * const *envp, pid_t *ppid)
+{
+#ifdef SHFILE_IN_USE
+    posix_spawn_file_actions_t file_actions;
+    posix_spawnattr_t attr;
+    sigset_t empty;
+    int fd;
+    int rc;
+
+    posix_spawn_file_actions_init(&file_actions);
+    for (fd = 0; fd < SHFILE_NATIVE_MIN; fd++)
+    {
+        shfile *file = (unsigned)fd < pfdtab->size && pfdtab->tab[fd].fd == fd
+                     ? &pfdtab->tab[fd] : NULL;
+        if (!file || (file->flags & SHFILE_FLAGS_CLOEXEC))
+        {
+            /* Only the standard descriptors are borrowed from the process,
+               so they're the only ones that could leak into the child. */
+            if (fd < 3)
+                posix_spawn_file_actions_addclose(&file_actions, fd);
+        }
+        else if (file->native != fd)
+            posix_spawn_file_actions_adddup2(&file_actions, (int)file->native, fd);
+    }
+    posix_spawn_file_actions_addchdir_np(&file_actions, pfdtab->cwd);
+
+    posix_spawnattr_init(&attr);
+    sigemptyset(&empty);
+    posix_spawnattr_setsigmask(&attr, &empty);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+
+    rc = posix_spawn(ppid, exe, &file_actions, &attr, argv, envp);
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&file_actions);
+    TRACE2((NULL, "shfile_spawn(%s) -> %d pid=%d\n", exe, rc, rc ? -1 : *ppid));
+    if (rc)
+    {
+        errno = rc;
+        return -1;
+    }
+    return 0;
+#else
+    (void)pfdtab;
+    (void)exe;
+    (void)argv;
+    (void)envp;
+    (void)ppid;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
 
 
 int shfile_open(shfdtab *pfdtab, const char *name, unsigned flags, mode_t mode)
@@ -50,6 +422,18 @@ int shfile_open(shfdtab *pfdtab, const char *name, unsigned flags, mode_t mode)
 #elif defined(SH_STUB_MODE)
     fd = open(name, flags, mode);
 #else
+    char buf[SHFILE_MAX_PATH];
+    fd = -1;
+    if (!shfile_make_path(pfdtab, name, &buf[0]))
+    {
+        int native = open(buf, flags | O_CLOEXEC, mode);
+        if (native != -1)
+        {
+            native = shfile_native_relocate(native);
+            if (native != -1)
+                fd = shfile_insert(pfdtab, native, flags, 0);
+        }
+    }
 #endif
 
     TRACE2((NULL, "shfile_open(%p:{%s}, %#x, 0%o) -> %d [%d]\n", name, name, flags, mode, fd, errno));
@@ -67,6 +451,38 @@ int shfile_pipe(shfdtab *pfdtab, int fds[2])
     return pipe(fds);
 # endif
 #else
+    int native_fds[2];
+    if (pipe(native_fds))
+        return -1;
+    native_fds[0] = shfile_native_relocate(native_fds[0]);
+    native_fds[1] = shfile_native_relocate(native_fds[1]);
+    if (native_fds[0] == -1 || native_fds[1] == -1)
+    {
+        int s = errno;
+        if (native_fds[0] != -1)
+            close(native_fds[0]);
+        if (native_fds[1] != -1)
+            close(native_fds[1]);
+        errno = s;
+        return -1;
+    }
+    fds[0] = shfile_insert(pfdtab, native_fds[0], O_RDONLY, 0);
+    fds[1] = shfile_insert(pfdtab, native_fds[1], O_WRONLY, 0);
+    if (fds[0] == -1 || fds[1] == -1)
+    {
+        int s = errno;
+        if (fds[0] != -1)
+            shfile_close(pfdtab, fds[0]);
+        else
+            close(native_fds[0]);
+        if (fds[1] != -1)
+            shfile_close(pfdtab, fds[1]);
+        else
+            close(native_fds[1]);
+        errno = s;
+        return -1;
+    }
+    return 0;
 #endif
 }
 
@@ -78,6 +494,7 @@ int shfile_dup(shfdtab *pfdtab, int fd)
 #elif defined(SH_STUB_MODE)
     rc = dup(fd);
 #else
+    rc = shfile_fcntl(pfdtab, fd, F_DUPFD, 0);
 #endif
 
     TRACE2((NULL, "shfile_dup(%d) -> %d [%d]\n", fd, rc, errno));
@@ -93,6 +510,17 @@ int shfile_close(shfdtab *pfdtab, unsigned fd)
 #elif defined(SH_STUB_MODE)
     rc = close(fd);
 #else
+    shfile *file = shfile_get(pfdtab, fd);
+    rc = -1;
+    if (file)
+    {
+        rc = 0;
+        if (!(file->flags & SHFILE_FLAGS_INHERITED))
+            rc = close((int)file->native);
+        file->fd = -1;
+        file->flags = 0;
+        file->native = -1;
+    }
 #endif
 
     TRACE2((NULL, "shfile_close(%d) -> %d [%d]\n", fd, rc, errno));
@@ -110,6 +538,8 @@ long shfile_read(shfdtab *pfdtab, int fd, void *buf, size_t len)
     return read(fd, buf, len);
 # endif
 #else
+    shfile *file = shfile_get(pfdtab, fd);
+    return file ? (long)read((int)file->native, buf, len) : -1;
 #endif
 }
 
@@ -124,6 +554,8 @@ long shfile_write(shfdtab *pfdtab, int fd, const void *buf, size_t len)
     return write(fd, buf, len);
 # endif
 #else
+    shfile *file = shfile_get(pfdtab, fd);
+    return file ? (long)write((int)file->native, buf, len) : -1;
 #endif
 }
 
@@ -134,6 +566,8 @@ long shfile_lseek(shfdtab *pfdtab, int fd, long off, int whench)
 #elif defined(SH_STUB_MODE)
     return lseek(fd, off, whench);
 #else
+    shfile *file = shfile_get(pfdtab, fd);
+    return file ? (long)lseek((int)file->native, off, whench) : -1;
 #endif
 }
 
@@ -148,6 +582,48 @@ int shfile_fcntl(shfdtab *pfdtab, int fd, int cmd, int arg)
     return fcntl(fd, cmd, arg);
 # endif
 #else
+    shfile *file = shfile_get(pfdtab, fd);
+    int rc = -1;
+    if (file)
+    {
+        switch (cmd)
+        {
+            case F_DUPFD:
+            {
+                int native = fcntl((int)file->native, F_DUPFD, SHFILE_NATIVE_MIN);
+                if (native != -1)
+                {
+                    fcntl(native, F_SETFD, FD_CLOEXEC);
+                    rc = shfile_insert(pfdtab, native, file->flags & ~SHFILE_FLAGS_MASK, arg);
+                    if (rc == -1)
+                    {
+                        int s = errno;
+                        close(native);
+                        errno = s;
+                    }
+                }
+                break;
+            }
+            case F_GETFD:
+                rc = file->flags & SHFILE_FLAGS_CLOEXEC ? FD_CLOEXEC : 0;
+                break;
+            case F_SETFD:
+                if (arg & FD_CLOEXEC)
+                    file->flags |= SHFILE_FLAGS_CLOEXEC;
+                else
+                    file->flags &= ~SHFILE_FLAGS_CLOEXEC;
+                rc = 0;
+                break;
+            case F_GETFL:
+            case F_SETFL:
+                rc = fcntl((int)file->native, cmd, arg);
+                break;
+            default:
+                errno = EINVAL;
+                break;
+        }
+    }
+    return rc;
 #endif
 }
 
@@ -158,6 +634,10 @@ int shfile_stat(shfdtab *pfdtab, const char *path, struct stat *pst)
 #elif defined(SH_STUB_MODE)
     return stat(path, pst);
 #else
+    char buf[SHFILE_MAX_PATH];
+    if (shfile_make_path(pfdtab, path, &buf[0]))
+        return -1;
+    return stat(buf, pst);
 #endif
 }
 
@@ -172,6 +652,10 @@ int shfile_lstat(shfdtab *pfdtab, const char *link, struct stat *pst)
     return lstat(link, pst);
 # endif
 #else
+    char buf[SHFILE_MAX_PATH];
+    if (shfile_make_path(pfdtab, link, &buf[0]))
+        return -1;
+    return lstat(buf, pst);
 #endif
 }
 
@@ -186,6 +670,26 @@ int shfile_chdir(shfdtab *pfdtab, const char *path)
     return chdir(path);
 # endif
 #else
+    char buf[SHFILE_MAX_PATH];
+    struct stat st;
+    char *cwd;
+    if (shfile_make_path(pfdtab, path, &buf[0]))
+        return -1;
+    if (stat(buf, &st))
+        return -1;
+    if (!S_ISDIR(st.st_mode))
+    {
+        errno = ENOTDIR;
+        return -1;
+    }
+    if (access(buf, X_OK))
+        return -1;
+    cwd = realpath(buf, NULL);
+    if (!cwd)
+        return -1;
+    free(pfdtab->cwd);
+    pfdtab->cwd = cwd;
+    return 0;
 #endif
 }
 
@@ -196,6 +700,22 @@ char *shfile_getcwd(shfdtab *pfdtab, char *buf, int len)
 #elif defined(SH_STUB_MODE)
     return getcwd(buf, len);
 #else
+    size_t cch = strlen(pfdtab->cwd) + 1;
+    if (!buf)
+    {
+        if (len && (size_t)len < cch)
+        {
+            errno = ERANGE;
+            return NULL;
+        }
+        return strdup(pfdtab->cwd);
+    }
+    if ((size_t)len < cch)
+    {
+        errno = ERANGE;
+        return NULL;
+    }
+    return memcpy(buf, pfdtab->cwd, cch);
 #endif
 }
 
@@ -211,6 +731,10 @@ int shfile_access(shfdtab *pfdtab, const char *path, int type)
     return access(path, type);
 # endif
 #else
+    char buf[SHFILE_MAX_PATH];
+    if (shfile_make_path(pfdtab, path, &buf[0]))
+        return -1;
+    return access(buf, type);
 #endif
 }
 
@@ -223,6 +747,8 @@ int shfile_isatty(shfdtab *pfdtab, int fd)
 #elif defined(SH_STUB_MODE)
     rc = isatty(fd);
 #else
+    shfile *file = shfile_get(pfdtab, fd);
+    rc = file ? isatty((int)file->native) : 0;
 #endif
 
     TRACE2((NULL, "isatty(%d) -> %d [%d]\n", fd, rc, errno));
@@ -244,6 +770,7 @@ int shfile_cloexec(shfdtab *pfdtab, int fd, int closeit)
                           | (closeit ? FD_CLOEXEC : 0));
 # endif
 #else
+    rc = shfile_fcntl(pfdtab, fd, F_SETFD, closeit ? FD_CLOEXEC : 0);
 #endif
 
     TRACE2((NULL, "shfile_cloexec(%d, %d) -> %d [%d]\n", fd, closeit, rc, errno));
@@ -264,6 +791,8 @@ int shfile_ioctl(shfdtab *pfdtab, int fd, unsigned long request, void *buf)
     rc = ioctl(fd, request, buf);
 # endif
 #else
+    shfile *file = shfile_get(pfdtab, fd);
+    rc = file ? ioctl((int)file->native, request, buf) : -1;
 #endif
 
     TRACE2((NULL, "ioctl(%d, %#x, %p) -> %d\n", fd, request, buf, rc));
@@ -278,6 +807,9 @@ mode_t shfile_get_umask(shfdtab *pfdtab)
 #elif defined(SH_STUB_MODE)
     return 022;
 #else
+    mode_t mask = umask(022);
+    umask(mask);
+    return mask;
 #endif
 }
 
@@ -293,6 +825,10 @@ shdir *shfile_opendir(shfdtab *pfdtab, const char *dir)
     return (shdir *)opendir(dir);
 # endif
 #else
+    char buf[SHFILE_MAX_PATH];
+    if (shfile_make_path(pfdtab, dir, &buf[0]))
+        return NULL;
+    return (shdir *)opendir(buf);
 #endif
 }
 
@@ -308,6 +844,8 @@ shdirent *shfile_readdir(struct shdir *pdir)
     return pde ? (shdirent *)&pde->d_name[0] : NULL;
 # endif
 #else
+    struct dirent *pde = readdir((DIR *)pdir);
+    return pde ? (shdirent *)&pde->d_name[0] : NULL;
 #endif
 }
 
@@ -320,5 +858,6 @@ void shfile_closedir(struct shdir *pdir)
     closedir((DIR *)pdir);
 # endif
 #else
+    closedir((DIR *)pdir);
 #endif
 }
@@ -105,6 +105,16 @@ typedef struct shfile
     intptr_t            native;         /**< The native file descriptor number. */
 } shfile;
 
+/** @name shfile::flags bits used in addition to the open flags.
+ * @{ */
+/** Close-on-exec (FD_CLOEXEC) as seen by the shell. */
+#define SHFILE_FLAGS_CLOEXEC    0x40000000
+/** The native descriptor is borrowed from the process and isn't closed. */
+#define SHFILE_FLAGS_INHERITED  0x20000000
+/** Mask of the SHFILE_FLAGS_* bits. */
+#define SHFILE_FLAGS_MASK       0x60000000
+/** @} */
+
 /**
  * The file descriptor table for a shell.
  */
@@ -116,6 +126,11 @@ typedef struct shfdtab
     shfile             *tab;            /**< Pointer to the table. */
 } shfdtab;
 
+int shfile_init(shfdtab *, shfdtab *);
+void shfile_uninit(shfdtab *);
+int shfile_inherit_native(shfdtab *, int, int);
+int shfile_spawn(shfdtab *, const char *, char * const *, char * const *, pid_t *);
+
 int shfile_open(shfdtab *, const char *, unsigned, mode_t);
 int shfile_pipe(shfdtab *, int [2]);
 int shfile_close(shfdtab *, unsigned);
@@ -36,6 +36,15 @@
 extern char **environ;
 #endif
 #include "shinstance.h"
+#include "error.h"
+#include "alias.h"
+#include "input.h"
+#include "redir.h"
+#include "nodes.h"
+#include "memalloc.h"
+#if !defined(SH_PURE_STUB_MODE) && !defined(SH_STUB_MODE)
+# include <setjmp.h>
+#endif
 
 
 /*******************************************************************************
@@ -219,6 +228,17 @@ shinstance *sh_create_root_shell(shinstance *inherit, int argc, char **argv)
 #endif
         psh->ttyfd = -1;
 
+#if !defined(SH_PURE_STUB_MODE) && !defined(SH_STUB_MODE)
+        /* the process bits we share with the creator. */
+        psh->shenviron = inherit ? inherit->shenviron : environ;
+        psh->spawnedpid = -1;
+        if (shfile_init(&psh->fdtab, inherit ? &inherit->fdtab : NULL))
+        {
+            free(psh);
+            return NULL;
+        }
+#endif
+
         /* link it. */
         sh_int_link(psh);
 
@@ -226,6 +246,88 @@ shinstance *sh_create_root_shell(shinstance *inherit, int argc, char **argv)
     return psh;
 }
 
+/**
+ * Destroys a shell instance, freeing everything it allocated and closing
+ * its files.
+ *
+ * @param   psh     The shell.
+ */
+void sh_destroy(shinstance *psh)
+{
+    int i;
+
+    /* input.c, redir.c, options.c, alias.c */
+    popallfiles(psh);
+    while (psh->redirlist)
+        popredir(psh);
+    freeparam(&psh->shellparam);
+    rmaliases(psh);
+
+    /* var.c */
+    for (i = 0; i < VTABSIZE; i++)
+    {
+        struct var *vp = psh->vartab[i];
+        while (vp)
+        {
+            struct var *next = vp->next;
+            if (!(vp->flags & (VTEXTFIXED | VSTACK)))
+                ckfree(vp->text);
+            if (!(vp->flags & VSTRFIXED))
+                ckfree(vp);
+            vp = next;
+        }
+        psh->vartab[i] = NULL;
+    }
+
+    /* exec.c */
+    for (i = 0; i < CMDTABLESIZE; i++)
+    {
+        struct tblentry *cmdp = psh->cmdtable[i];
+        while (cmdp)
+        {
+            struct tblentry *next = cmdp->next;
+            if (cmdp->cmdtype == CMDFUNCTION)
+                freefunc(cmdp->param.func);
+            ckfree(cmdp);
+            cmdp = next;
+        }
+        psh->cmdtable[i] = NULL;
+    }
+
+    /* trap.c */
+    for (i = 0; i <= NSIG; i++)
+        if (psh->trap[i])
+            ckfree(psh->trap[i]);
+
+    /* cd.c, jobs.c, output.c */
+    if (psh->curdir)
+        ckfree(psh->curdir);
+    if (psh->prevdir)
+        ckfree(psh->prevdir);
+    if (psh->jobtab)
+        ckfree(psh->jobtab);
+    if (psh->output.buf)
+        ckfree(psh->output.buf);
+    if (psh->errout.buf)
+        ckfree(psh->errout.buf);
+    if (psh->memout.buf)
+        ckfree(psh->memout.buf);
+
+    /* memalloc.c */
+    while (psh->stackp && psh->stackp != &psh->stackbase)
+    {
+        struct stack_block *sp = psh->stackp;
+        psh->stackp = sp->prev;
+        ckfree(sp);
+    }
+
+#if !defined(SH_PURE_STUB_MODE) && !defined(SH_STUB_MODE)
+    shfile_uninit(&psh->fdtab);
+#endif
+    sh_int_unlink(psh);
+    free(psh);
+}
+
 
 char *sh_getenv(shinstance *psh, const char *var)
 {
@@ -235,6 +337,13 @@ char *sh_getenv(shinstance *psh, const char *var)
     (void)psh;
     return getenv(var);
 #else
+    char **envp = psh->shenviron;
+    size_t cch = strlen(var);
+    if (envp)
+        for (; *envp; envp++)
+            if (!strncmp(*envp, var, cch) && (*envp)[cch] == '=')
+                return *envp + cch + 1;
+    return NULL;
 #endif
 }
 
@@ -247,6 +356,8 @@ char **sh_environ(shinstance *psh)
     (void)psh;
     return environ;
 #else
+    static char *s_null[2] = {0,0};
+    return psh->shenviron ? psh->shenviron : &s_null[0];
 #endif
 }
 
@@ -263,6 +374,9 @@ const char *sh_gethomedir(shinstance *psh, const char *user)
     return pwd ? pwd->pw_dir : NULL;
 # endif
 #else
+    struct passwd *pwd = getpwnam(user);
+    (void)psh;
+    return pwd ? pwd->pw_dir : NULL;
 #endif
 }
 
@@ -535,6 +649,13 @@ int sh_sigprocmask(shinstance *psh, int operation, shsigset_t const *newp, shsig
     return sigprocmask(operation, newp, oldp);
 # endif
 #else
+    /* The signal mask belongs to the thread, which is shared with the
+       creator of the shell; leave it alone. */
+    (void)psh;
+    (void)operation;
+    if (oldp)
+        sh_sigemptyset(oldp);
+    return 0;
 #endif
 }
 
@@ -546,6 +667,7 @@ void sh_abort(shinstance *psh)
 #elif defined(SH_STUB_MODE)
     abort();
 #else
+    abort();
 #endif
 
     TRACE2((psh, "sh_abort returns!\n"));
@@ -561,6 +683,8 @@ void sh_raise_sigint(shinstance *psh)
     (void)psh;
     raise(SIGINT);
 #else
+    /* Interrupting the creator isn't our call, just give up. */
+    sh__exit(psh, 128 + SIGINT);
 #endif
 
     TRACE2((psh, "sh_raise(SIGINT) returns\n"));
@@ -581,6 +705,7 @@ int sh_kill(shinstance *psh, pid_t pid, int signo)
     rc = kill(pid, signo);
 # endif
 #else
+    rc = kill(pid, signo);
 #endif
 
     TRACE2((psh, "sh_kill(%d, %d) -> %d [%d]\n", pid, signo, rc, errno));
@@ -602,6 +727,7 @@ int sh_killpg(shinstance *psh, pid_t pgid, int signo)
     rc = killpg(pgid, signo);
 # endif
 #else
+    rc = killpg(pgid, signo);
 #endif
 
     TRACE2((psh, "sh_killpg(%d, %d) -> %d [%d]\n", pgid, signo, rc, errno));
@@ -621,6 +747,8 @@ clock_t sh_times(shinstance *psh, shtms *tmsp)
     return times(tmsp);
 # endif
 #else
+    (void)psh;
+    return times(tmsp);
 #endif
 }
 
@@ -651,6 +779,9 @@ pid_t sh_fork(shinstance *psh)
     pid = fork();
 # endif
 #else
+    /* Sharing the process with the creator, we cannot fork. */
+    errno = ENOSYS;
+    pid = -1;
 #endif
 
     TRACE2((psh, "sh_fork -> %d [%d]\n", pid, errno));
@@ -672,6 +803,7 @@ pid_t sh_waitpid(shinstance *psh, pid_t pid, int *statusp, int flags)
     pidret = waitpid(pid, statusp, flags);
 # endif
 #else
+    pidret = waitpid(pid, statusp, flags);
 #endif
 
     TRACE2((psh, "waitpid(%d, %p, %#x) -> %d [%d] *statusp=%#x (rc=%d)\n", pid, statusp, flags,
@@ -690,6 +822,11 @@ void sh__exit(shinstance *psh, int rc)
 #elif defined(SH_STUB_MODE)
     _exit(rc);
 #else
+    /* Unwind to whoever is running this shell instance. */
+    psh->exitstatus = rc;
+    if (psh->exitjmp)
+        longjmp(psh->exitjmp->loc, 1);
+    abort();
 #endif
 }
 
@@ -713,6 +850,31 @@ int sh_execve(shinstance *psh, const char *exe, const char * const *argv, const
     rc = execve(exe, (char **)argv, (char **)envp);
 # endif
 #else
+    /* There is no process to replace, so start the program and unwind
+       the shell instead of returning. */
+    if (!shfile_spawn(&psh->fdtab, exe, (char * const *)argv, (char * const *)envp, &psh->spawnedpid))
+        sh__exit(psh, 0);
+    if (errno == ENOEXEC)
+    {
+        /* Scripts without #! are run by /bin/sh, like execvp does. */
+        int argc = 0;
+        const char **argv2;
+        while (argv[argc])
+            argc++;
+        argv2 = malloc((argc + 2) * sizeof(char *));
+        if (argv2)
+        {
+            argv2[0] = _PATH_BSHELL;
+            argv2[1] = exe;
+            memcpy(&argv2[2], &argv[1], argc * sizeof(char *));
+            rc = shfile_spawn(&psh->fdtab, _PATH_BSHELL, (char * const *)argv2, (char * const *)envp, &psh->spawnedpid);
+            free(argv2);
+            if (!rc)
+                sh__exit(psh, 0);
+            errno = ENOEXEC;
+        }
+    }
+    rc = -1;
 #endif
 
     TRACE2((psh, "sh_execve -> %d [%d]\n", rc, errno));
@@ -731,6 +893,7 @@ uid_t sh_getuid(shinstance *psh)
     uid_t uid = getuid();
 # endif
 #else
+    uid_t uid = getuid();
 #endif
 
     TRACE2((psh, "sh_getuid() -> %d [%d]\n", uid, errno));
@@ -749,6 +912,7 @@ uid_t sh_geteuid(shinstance *psh)
     uid_t euid = geteuid();
 # endif
 #else
+    uid_t euid = geteuid();
 #endif
 
     TRACE2((psh, "sh_geteuid() -> %d [%d]\n", euid, errno));
@@ -767,6 +931,7 @@ gid_t sh_getgid(shinstance *psh)
     gid_t gid = getgid();
 # endif
 #else
+    gid_t gid = getgid();
 #endif
 
     TRACE2((psh, "sh_getgid() -> %d [%d]\n", gid, errno));
@@ -785,6 +950,7 @@ gid_t sh_getegid(shinstance *psh)
     gid_t egid = getegid();
 # endif
 #else
+    gid_t egid = getegid();
 #endif
 
     TRACE2((psh, "sh_getegid() -> %d [%d]\n", egid, errno));
@@ -805,6 +971,7 @@ pid_t sh_getpid(shinstance *psh)
     pid = getpid();
 # endif
 #else
+    pid = psh->pid;
 #endif
 
     (void)psh;
@@ -822,6 +989,7 @@ pid_t sh_getpgrp(shinstance *psh)
     pid_t pgrp = getpgrp();
 # endif
 #else
+    pid_t pgrp = getpgrp();
 #endif
 
     TRACE2((psh, "sh_getpgrp() -> %d [%d]\n", pgrp, errno));
@@ -840,6 +1008,7 @@ pid_t sh_getpgid(shinstance *psh, pid_t pid)
     pid_t pgid = getpgid(pid);
 # endif
 #else
+    pid_t pgid = getpgid(pid);
 #endif
 
     TRACE2((psh, "sh_getpgid(%d) -> %d [%d]\n", pid, pgid, errno));
@@ -858,6 +1027,9 @@ int sh_setpgid(shinstance *psh, pid_t pid, pid_t pgid)
     int rc = setpgid(pid, pgid);
 # endif
 #else
+    /* Process groups belong to the creator. */
+    int rc = -1;
+    errno = EPERM;
 #endif
 
     TRACE2((psh, "sh_setpgid(%d, %d) -> %d [%d]\n", pid, pgid, rc, errno));
@@ -878,6 +1050,7 @@ pid_t sh_tcgetpgrp(shinstance *psh, int fd)
     pgrp = tcgetpgrp(fd);
 # endif
 #else
+    pgrp = tcgetpgrp(fd);
 #endif
 
     TRACE2((psh, "sh_tcgetpgrp(%d) -> %d [%d]\n", fd, pgrp, errno));
@@ -899,6 +1072,9 @@ int sh_tcsetpgrp(shinstance *psh, int fd, pid_t pgrp)
     rc = tcsetpgrp(fd, pgrp);
 # endif
 #else
+    /* The terminal belongs to the creator. */
+    rc = -1;
+    errno = EPERM;
 #endif
 
     TRACE2((psh, "sh_tcsetpgrp(%d, %d) -> %d [%d]\n", fd, pgrp, rc, errno));
@@ -917,6 +1093,7 @@ int sh_getrlimit(shinstance *psh, int resid, shrlimit *limp)
     int rc = getrlimit(resid, limp);
 # endif
 #else
+    int rc = getrlimit(resid, limp);
 #endif
 
     TRACE2((psh, "sh_getrlimit(%d, %p) -> %d [%d] {%ld,%ld}\n",
@@ -936,6 +1113,9 @@ int sh_setrlimit(shinstance *psh, int resid, const shrlimit *limp)
     int rc = setrlimit(resid, limp);
 # endif
 #else
+    /* Limits apply to the whole process, i.e. the creator too. */
+    int rc = -1;
+    errno = EPERM;
 #endif
 
     TRACE2((psh, "sh_setrlimit(%d, %p:{%ld,%ld}) -> %d [%d]\n",
@@ -130,6 +130,9 @@ struct shinstance
     shtid               tid;            /**< The thread identifier of the thread for this shell. */
     shfdtab             fdtab;          /**< The file descriptor table. */
     shsigaction_t       sigactions[NSIG]; /**< The signal actions registered with this shell instance. */
+    char              **shenviron;      /**< The environment the shell was started with (sh_environ). */
+    struct jmploc      *exitjmp;        /**< Where sh__exit unwinds to when not in stub mode. */
+    pid_t               spawnedpid;     /**< The program sh_execve started when not in stub mode, -1 if none. */
 
     /* alias.c */
 #define ATABSIZE 39
@@ -327,6 +330,7 @@ struct shinstance
 
 
 extern shinstance *sh_create_root_shell(shinstance *, int, char **);
+extern void sh_destroy(shinstance *);
 
 /* environment & pwd.h */
 char *sh_getenv(shinstance *, const char *);
@@ -354,6 +358,9 @@ const char *sh_gethomedir(shinstance *, const char *);
 #ifdef __sun__
 #   define sys_siglist      _sys_siglist
 #endif
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 32))
+#   define sys_siglist      sys_signame /* glibc 2.32 dropped sys_siglist. */
+#endif
 #ifndef HAVE_SYS_SIGNAME
 extern char sys_signame[NSIG][16];
 #endif
@@ -34,14 +34,48 @@
 #endif
 
 
-void shthread_set_shell(struct shinstance *psh)
+#if !defined(_MSC_VER) && !defined(__EMX__)
+/** The TLS key for the current shell instance. */
+static pthread_key_t    g_shthread_key;
+/** Makes sure g_shthread_key is only created once. */
+static pthread_once_t   g_shthread_once = PTHREAD_ONCE_INIT;
+
+static void shthread_create_key(void)
 {
+    pthread_key_create(&g_shthread_key, NULL);
+}
+#endif
 
+
+/**
+ * Associates a shell instance with the calling thread.
+ *
+ * @param   psh     The shell instance, NULL to clear the association.
+ */
+void shthread_set_shell(struct shinstance *psh)
+{
+#if !defined(_MSC_VER) && !defined(__EMX__)
+    pthread_once(&g_shthread_once, shthread_create_key);
+    pthread_setspecific(g_shthread_key, psh);
+    if (psh)
+        psh->tid = (shtid)pthread_self();
+#else
+    (void)psh;
+#endif
 }
 
+/**
+ * Gets the shell instance associated with the calling thread.
+ *
+ * @returns The shell instance, NULL if none.
+ */
 struct shinstance *shthread_get_shell(void)
 {
     shinstance *psh = NULL;
+#if !defined(_MSC_VER) && !defined(__EMX__)
+    pthread_once(&g_shthread_once, shthread_create_key);
+    psh = (shinstance *)pthread_getspecific(g_shthread_key);
+#endif
     return psh;
 }
 
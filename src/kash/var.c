@@ -255,7 +255,7 @@ initvar(shinstance *psh)
 		vp->next = *vpp;
 		*vpp = vp;
 		vp->text = strdup(ip->text);
-		vp->flags = ip->flags;
+		vp->flags = ip->flags & ~VTEXTFIXED; /* the copy is ours to free */
 		vp->func = ip->func;
 	}
 	/*
@@ -265,7 +265,7 @@ initvar(shinstance *psh)
 		psh->vps1.next = *vpp;
 		*vpp = &psh->vps1;
 		psh->vps1.text = strdup(sh_geteuid(psh) ? "PS1=$ " : "PS1=# ");
-		psh->vps1.flags = VSTRFIXED|VTEXTFIXED;
+		psh->vps1.flags = VSTRFIXED;
 	}
 }
 
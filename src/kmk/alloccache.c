@@ -12,6 +12,13 @@
  *
  * Darwin also showed a significant amount of time spent just executing
  * free(), which is kind of silly.  The alloccache helps a bit here too.
+ *
+ * The plain alloc and free functions are only for the thread owning the
+ * cache.  The _mt variants can be used by any thread.  They work on two
+ * thread local magazines of ALLOCCACHE_MAGAZINE_SIZE items each.  Only when
+ * both are empty (or full) does the thread take the depot lock of the
+ * cache and trade a whole magazine.  This is the scheme from Bonwick and
+ * Adams' vmem/magazine paper, minus the per CPU bits.
  */
 
 /*
@@ -37,14 +44,80 @@
 /*******************************************************************************
 *   Header Files                                                               *
 *******************************************************************************/
+#ifdef __OS2__
+# define INCL_BASE
+# define INCL_ERRORS
+#endif
 #include "make.h"
 #include "dep.h"
 #include "debug.h"
 #include <assert.h>
 
+#ifdef CONFIG_WITH_ALLOCCACHE_MAGAZINES
+# if defined (CONFIG_WITHOUT_THREADS)
+  /* no locking */
+# elif defined (WINDOWS32)
+#  include <Windows.h>
+# elif defined (__OS2__)
+#  include <os2.h>
+#  include <sys/fmutex.h>
+# else
+#  include <pthread.h>
+# endif
+#endif
+
 
 #ifdef CONFIG_WITH_ALLOC_CACHES
 
+#ifdef CONFIG_WITH_ALLOCCACHE_MAGAZINES
+/*******************************************************************************
+*   Defined Constants And Macros                                               *
+*******************************************************************************/
+# if defined (CONFIG_WITHOUT_THREADS)
+#  define ALLOCCACHE_LOCK_T                 int
+#  define alloccache_lock_init(lock)        ((void)(lock))
+#  define alloccache_lock(lock)             ((void)(lock))
+#  define alloccache_unlock(lock)           ((void)(lock))
+# elif defined (WINDOWS32)
+#  define ALLOCCACHE_LOCK_T                 CRITICAL_SECTION
+#  define alloccache_lock_init(lock)        InitializeCriticalSection (lock)
+#  define alloccache_lock(lock)             EnterCriticalSection (lock)
+#  define alloccache_unlock(lock)           LeaveCriticalSection (lock)
+# elif defined (__OS2__)
+#  define ALLOCCACHE_LOCK_T                 _fmutex
+#  define alloccache_lock_init(lock)        _fmutex_create (lock, 0)
+#  define alloccache_lock(lock)             _fmutex_request (lock, 0)
+#  define alloccache_unlock(lock)           _fmutex_release (lock)
+# else
+#  define ALLOCCACHE_LOCK_T                 pthread_mutex_t
+#  define alloccache_lock_init(lock)        pthread_mutex_init (lock, NULL)
+#  define alloccache_lock(lock)             pthread_mutex_lock (lock)
+#  define alloccache_unlock(lock)           pthread_mutex_unlock (lock)
+# endif
+
+
+/*******************************************************************************
+*   Global Variables                                                           *
+*******************************************************************************/
+/* The magazines of the current thread, NULL until it uses a _mt function. */
+ALLOCCACHE_TLS struct alloccache_thread *alloccache_cur_thread;
+/* The caches by slot and the depot locks. */
+static struct alloccache *alloccache_slots[ALLOCCACHE_MAX_SLOTS];
+static ALLOCCACHE_LOCK_T alloccache_depot_locks[ALLOCCACHE_MAX_SLOTS];
+static unsigned int alloccache_slot_count;
+/* All the threads that have used magazines and the terminated ones that
+   can be reused, protected by alloccache_threads_lock. */
+static struct alloccache_thread *alloccache_threads;
+static struct alloccache_thread *alloccache_idle_threads;
+static unsigned int alloccache_thread_count;
+static ALLOCCACHE_LOCK_T alloccache_threads_lock;
+# ifdef ALLOCCACHE_NO_TLS
+/* Without thread local storage all threads share one set of magazines. */
+static ALLOCCACHE_LOCK_T alloccache_no_tls_lock;
+# endif
+#endif /* CONFIG_WITH_ALLOCCACHE_MAGAZINES */
+
+
 /* Free am item.
    This was not inlined because of aliasing issues arrising with GCC.
    It is also in a separate file for this reason (it used to be in misc.c
@@ -79,7 +152,35 @@ struct alloccache_free_ent *
 alloccache_alloc_grow (struct alloccache *cache)
 {
   void *item;
-  unsigned int items = (64*1024 - 32) / cache->size;
+  unsigned int items;
+
+#ifdef CONFIG_WITH_ALLOCCACHE_MAGAZINES
+  /* Take back a magazine that other threads have freed into the depot. */
+  struct alloccache_magazine *mag;
+  alloccache_lock (&alloccache_depot_locks[cache->slot]);
+  mag = cache->depot_full;
+  if (mag)
+    {
+      cache->depot_full = mag->next;
+      cache->depot_full_count--;
+      cache->depot_full_items -= mag->count;
+      item = mag->items[--mag->count];
+      while (mag->count > 0)
+        {
+          struct alloccache_free_ent *f = (struct alloccache_free_ent *)mag->items[--mag->count];
+          f->next = cache->free_head;
+          cache->free_head = f;
+        }
+      mag->next = cache->depot_empty;
+      cache->depot_empty = mag;
+      cache->depot_empty_count++;
+    }
+  alloccache_unlock (&alloccache_depot_locks[cache->slot]);
+  if (mag)
+    return (struct alloccache_free_ent *)item;
+#endif
+
+  items = (64*1024 - 32) / cache->size;
   cache->free_start  = cache->grow_alloc (cache->grow_arg, items * cache->size);
   cache->free_end    = cache->free_start + items * cache->size;
   cache->total_count+= items;
@@ -129,6 +230,34 @@ alloccache_init (struct alloccache *cache, unsigned int size, const char *name,
   cache->grow_arg    = grow_arg;
   cache->grow_alloc  = grow_alloc ? grow_alloc : alloccache_default_grow_alloc;
 
+#ifdef CONFIG_WITH_ALLOCCACHE_MAGAZINES
+  /* assign it a slot and init the depot. */
+  if (alloccache_slot_count >= ALLOCCACHE_MAX_SLOTS)
+    fatal (NILF, _("alloccache: too many caches (max %d)"), ALLOCCACHE_MAX_SLOTS);
+  if (!alloccache_slot_count)
+    {
+      alloccache_lock_init (&alloccache_threads_lock);
+# ifdef ALLOCCACHE_NO_TLS
+      alloccache_lock_init (&alloccache_no_tls_lock);
+# endif
+    }
+  alloccache_lock_init (&alloccache_depot_locks[alloccache_slot_count]);
+  alloccache_lock (&alloccache_threads_lock); /* exiting threads walk the slots */
+  cache->slot = alloccache_slot_count;
+  alloccache_slots[cache->slot] = cache;
+  alloccache_slot_count++;
+  alloccache_unlock (&alloccache_threads_lock);
+  cache->depot_total_count = 0;
+  cache->depot_start       = NULL;
+  cache->depot_end         = NULL;
+  cache->depot_full        = NULL;
+  cache->depot_empty       = NULL;
+  cache->depot_full_count  = 0;
+  cache->depot_empty_count = 0;
+  cache->depot_full_items  = 0;
+  cache->depot_fills       = 0;
+#endif
+
   /* link it. */
   cache->next        = alloccache_head;
   alloccache_head    = cache;
@@ -213,18 +342,314 @@ alloccache_join (struct alloccache *cache, struct alloccache *eat)
   eat->free_head = NULL;
 }
 
+#ifdef CONFIG_WITH_ALLOCCACHE_MAGAZINES
+
+/* Gets the magazines of the current thread, registering it if new. */
+static struct alloccache_thread *
+alloccache_thread_get (void)
+{
+  struct alloccache_thread *thrd = alloccache_cur_thread;
+  if (thrd)
+    return thrd;
+
+  alloccache_lock (&alloccache_threads_lock);
+  thrd = alloccache_idle_threads;
+  if (thrd)
+    alloccache_idle_threads = thrd->next_idle;
+  else
+    {
+      thrd = xmalloc (sizeof (*thrd));
+      memset (thrd, '\0', sizeof (*thrd));
+      thrd->id = alloccache_thread_count++;
+      thrd->next = alloccache_threads;
+      alloccache_threads = thrd;
+    }
+  thrd->next_idle = NULL;
+  thrd->active = 1;
+  alloccache_unlock (&alloccache_threads_lock);
+
+  alloccache_cur_thread = thrd;
+  return thrd;
+}
+
+/* Takes an empty magazine from the depot or allocates a new one.
+   The depot lock must be held. */
+static struct alloccache_magazine *
+alloccache_depot_get_empty (struct alloccache *cache)
+{
+  struct alloccache_magazine *mag = cache->depot_empty;
+  if (mag)
+    {
+      cache->depot_empty = mag->next;
+      cache->depot_empty_count--;
+    }
+  else
+    {
+      mag = xmalloc (sizeof (*mag));
+      mag->count = 0;
+    }
+  mag->next = NULL;
+  return mag;
+}
+
+/* Takes a full magazine from the depot, filling an empty one from fresh
+   space if there are none.  The depot lock must be held. */
+static struct alloccache_magazine *
+alloccache_depot_get_full (struct alloccache *cache)
+{
+  struct alloccache_magazine *mag = cache->depot_full;
+  unsigned int i;
+  if (mag)
+    {
+      cache->depot_full = mag->next;
+      cache->depot_full_count--;
+      cache->depot_full_items -= mag->count;
+      mag->next = NULL;
+      return mag;
+    }
+
+  /* Filled from the top so the items are handed out in address order. */
+  mag = alloccache_depot_get_empty (cache);
+  i = ALLOCCACHE_MAGAZINE_SIZE;
+  while (i-- > 0)
+    {
+      if (cache->depot_start == cache->depot_end)
+        {
+          unsigned int items = (64*1024 - 32) / cache->size;
+          cache->depot_start = cache->grow_alloc (cache->grow_arg, items * cache->size);
+          cache->depot_end   = cache->depot_start + items * cache->size;
+          cache->depot_total_count += items;
+        }
+      mag->items[i] = cache->depot_start;
+      cache->depot_start += cache->size;
+    }
+  mag->count = ALLOCCACHE_MAGAZINE_SIZE;
+  cache->depot_fills++;
+  return mag;
+}
+
+/* Gives a magazine to the depot, full or partially full ones go on the
+   full list.  The depot lock must be held. */
+static void
+alloccache_depot_put (struct alloccache *cache, struct alloccache_magazine *mag)
+{
+  if (mag->count)
+    {
+      mag->next = cache->depot_full;
+      cache->depot_full = mag;
+      cache->depot_full_count++;
+      cache->depot_full_items += mag->count;
+    }
+  else
+    {
+      mag->next = cache->depot_empty;
+      cache->depot_empty = mag;
+      cache->depot_empty_count++;
+    }
+}
+
+/* Allocates an item when the loaded magazine is empty: swaps in the
+   previous magazine if it has items, otherwise trades the empty previous
+   magazine for a full one at the depot. */
+void *
+alloccache_alloc_mt_slow (struct alloccache *cache)
+{
+  unsigned int slot = cache->slot;
+  struct alloccache_thread *thrd;
+  struct alloccache_magazine *mag;
+  struct alloccache_magazine *prev;
+  void *item;
+
+#ifdef ALLOCCACHE_NO_TLS
+  alloccache_lock (&alloccache_no_tls_lock);
+#endif
+  thrd = alloccache_thread_get ();
+  MAKE_STATS(thrd->alloc_count[slot]++;);
+
+  mag = thrd->loaded[slot];
+  if (!mag || !mag->count)
+    {
+      prev = thrd->previous[slot];
+      if (prev && prev->count)
+        {
+          thrd->previous[slot] = mag;
+          thrd->loaded[slot] = mag = prev;
+        }
+      else
+        {
+          alloccache_lock (&alloccache_depot_locks[slot]);
+          if (prev)
+            alloccache_depot_put (cache, prev);
+          thrd->previous[slot] = mag;
+          thrd->loaded[slot] = mag = alloccache_depot_get_full (cache);
+          thrd->loads[slot]++;
+          alloccache_unlock (&alloccache_depot_locks[slot]);
+        }
+    }
+  item = mag->items[--mag->count];
+
+#ifdef ALLOCCACHE_NO_TLS
+  alloccache_unlock (&alloccache_no_tls_lock);
+#endif
+  return item;
+}
+
+/* Frees an item when the loaded magazine is full: swaps in the previous
+   magazine if it has room, otherwise gives the full previous magazine to
+   the depot and loads an empty one. */
+void
+alloccache_free_mt_slow (struct alloccache *cache, void *item)
+{
+  unsigned int slot = cache->slot;
+  struct alloccache_thread *thrd;
+  struct alloccache_magazine *mag;
+  struct alloccache_magazine *prev;
+
+#ifdef ALLOCCACHE_NO_TLS
+  alloccache_lock (&alloccache_no_tls_lock);
+#endif
+  thrd = alloccache_thread_get ();
+  MAKE_STATS(thrd->free_count[slot]++;);
+
+  mag = thrd->loaded[slot];
+  if (!mag || mag->count >= ALLOCCACHE_MAGAZINE_SIZE)
+    {
+      prev = thrd->previous[slot];
+      if (prev && prev->count < ALLOCCACHE_MAGAZINE_SIZE)
+        {
+          thrd->previous[slot] = mag;
+          thrd->loaded[slot] = mag = prev;
+        }
+      else
+        {
+          alloccache_lock (&alloccache_depot_locks[slot]);
+          if (prev)
+            {
+              alloccache_depot_put (cache, prev);
+              thrd->unloads[slot]++;
+            }
+          thrd->previous[slot] = mag;
+          thrd->loaded[slot] = mag = alloccache_depot_get_empty (cache);
+          alloccache_unlock (&alloccache_depot_locks[slot]);
+        }
+    }
+  mag->items[mag->count++] = item;
+
+#ifdef ALLOCCACHE_NO_TLS
+  alloccache_unlock (&alloccache_no_tls_lock);
+#endif
+}
+
+/* Called by a thread that is about to exit.  Returns its magazines to the
+   depots and keeps the statistics around for a new thread to reuse. */
+void
+alloccache_thread_term (void)
+{
+#ifndef ALLOCCACHE_NO_TLS
+  struct alloccache_thread *thrd = alloccache_cur_thread;
+  unsigned int slot_count;
+  unsigned int slot;
+  if (!thrd)
+    return;
+
+  alloccache_lock (&alloccache_threads_lock);
+  slot_count = alloccache_slot_count;
+  alloccache_unlock (&alloccache_threads_lock);
+
+  for (slot = 0; slot < slot_count; slot++)
+    if (thrd->loaded[slot] || thrd->previous[slot])
+      {
+        struct alloccache *cache = alloccache_slots[slot];
+        alloccache_lock (&alloccache_depot_locks[slot]);
+        if (thrd->loaded[slot])
+          {
+            thrd->unloads[slot] += thrd->loaded[slot]->count != 0;
+            alloccache_depot_put (cache, thrd->loaded[slot]);
+            thrd->loaded[slot] = NULL;
+          }
+        if (thrd->previous[slot])
+          {
+            thrd->unloads[slot] += thrd->previous[slot]->count != 0;
+            alloccache_depot_put (cache, thrd->previous[slot]);
+            thrd->previous[slot] = NULL;
+          }
+        alloccache_unlock (&alloccache_depot_locks[slot]);
+      }
+
+  alloccache_lock (&alloccache_threads_lock);
+  thrd->active = 0;
+  thrd->next_idle = alloccache_idle_threads;
+  alloccache_idle_threads = thrd;
+  alloccache_unlock (&alloccache_threads_lock);
+  alloccache_cur_thread = NULL;
+#endif
+}
+
+#endif /* CONFIG_WITH_ALLOCCACHE_MAGAZINES */
+
 /* Print one alloc cache. */
 void
 alloccache_print (struct alloccache *cache)
 {
+#ifdef CONFIG_WITH_ALLOCCACHE_MAGAZINES
+  /* Items allocated from magazines are often freed to the owner and vice
+     versa, so the in-use count is only correct for the sum.  The counts of
+     threads that are still running are a snapshot. */
+  struct alloccache_thread *thrd;
+  unsigned long in_use = cache->alloc_count - cache->free_count;
+  int used_mt;
+  alloccache_lock (&alloccache_threads_lock);
+  alloccache_lock (&alloccache_depot_locks[cache->slot]);
+  used_mt = cache->depot_total_count || cache->depot_full_count || cache->depot_empty_count;
+  for (thrd = alloccache_threads; thrd; thrd = thrd->next)
+    {
+      MAKE_STATS(in_use += thrd->alloc_count[cache->slot] - thrd->free_count[cache->slot];);
+      used_mt |= thrd->loaded[cache->slot] || thrd->previous[cache->slot]
+              || thrd->loads[cache->slot] || thrd->unloads[cache->slot];
+    }
+  (void)in_use;
+#endif
+
   printf (_("\n# Alloc Cache: %s\n"
               "#  Items: size = %-3u  total = %-6u"),
           cache->name, cache->size, cache->total_count);
+#ifdef CONFIG_WITH_ALLOCCACHE_MAGAZINES
+  MAKE_STATS(printf (_("  in-use = %-6lu"), in_use););
+#else
   MAKE_STATS(printf (_("  in-use = %-6lu"),
                      cache->alloc_count - cache->free_count););
+#endif
   MAKE_STATS(printf (_("\n#         alloc calls = %-7lu  free calls = %-7lu"),
                      cache->alloc_count, cache->free_count););
   printf ("\n");
+
+#ifdef CONFIG_WITH_ALLOCCACHE_MAGAZINES
+  if (used_mt)
+    {
+      printf (_("#  Depot: total = %-6u  full magazines = %u (%u items)  empty magazines = %u  fills = %lu\n"),
+              cache->depot_total_count, cache->depot_full_count, cache->depot_full_items,
+              cache->depot_empty_count, cache->depot_fills);
+      for (thrd = alloccache_threads; thrd; thrd = thrd->next)
+        {
+          unsigned int slot = cache->slot;
+          unsigned int items = 0;
+          if (   !thrd->loads[slot] && !thrd->unloads[slot]
+              && !thrd->loaded[slot] && !thrd->previous[slot])
+            continue;
+          if (thrd->loaded[slot])
+            items += thrd->loaded[slot]->count;
+          if (thrd->previous[slot])
+            items += thrd->previous[slot]->count;
+          printf (_("#  Thread %u: magazine items = %-3u  loads = %-6lu  unloads = %-6lu"),
+                  thrd->id, items, thrd->loads[slot], thrd->unloads[slot]);
+          MAKE_STATS(printf (_("  alloc calls = %-7lu  free calls = %-7lu"),
+                             thrd->alloc_count[slot], thrd->free_count[slot]););
+          printf ("%s\n", thrd->active ? "" : _("  (exited)"));
+        }
+    }
+  alloccache_unlock (&alloccache_depot_locks[cache->slot]);
+  alloccache_unlock (&alloccache_threads_lock);
+#endif
 }
 
 /* Print all alloc caches. */
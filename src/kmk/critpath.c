@@ -0,0 +1,566 @@
+#ifdef CONFIG_WITH_CRITICAL_PATH
+/* $Id$ */
+/** @file
+ * critpath - Job scheduling along the critical path.
+ *
+ * update_goal_chain() walks the goals and starts the jobs in the order it
+ * finds them, so in wide builds the long link and code generation chains
+ * are often started last and leave the job slots idle towards the end.
+ *
+ * With --job-history=FILE the wall time of each recipe is recorded and
+ * saved to FILE at exit.  On later runs critpath_prepare() loads it and
+ * computes, for every file reachable from the goals, the longest path of
+ * recorded recipe times from the file to a goal, its own recipe included.
+ * job.c then keeps the ready jobs on the waiting_jobs chain ordered by this
+ * priority and hands each free job slot to the one at the head.
+ *
+ * At exit a report of the predicted critical path and the one actually
+ * taken by the build is printed.
+ *
+ * The history also keeps the peak resident set size of each recipe, which
+ * jobadmit.c uses to keep memory hungry jobs apart.
+ */
+
+/*
+ * Copyright (c) 2026 The kBuild contributors
+ *
+ * This file is part of kBuild.
+ *
+ * kBuild is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * kBuild is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with kBuild.  If not, see <http://www.gnu.org/licenses/>
+ *
+ */
+
+/*******************************************************************************
+*   Header Files                                                               *
+*******************************************************************************/
+#include "make.h"
+#include <assert.h>
+#include "dep.h"
+#include "filedef.h"
+#include "debug.h"
+#include "strcache2.h"
+
+#if !defined (CONFIG_WITH_STRCACHE2) || !defined (CONFIG_WITH_PRINT_TIME_SWITCH)
+# error "CONFIG_WITH_CRITICAL_PATH requires CONFIG_WITH_STRCACHE2 and CONFIG_WITH_PRINT_TIME_SWITCH"
+#endif
+
+
+/*******************************************************************************
+*   Defined Constants And Macros                                               *
+*******************************************************************************/
+/* The first line of the history file.  Version 1 files lack the peak
+   resident set size column, they are still accepted. */
+#define CRITPATH_SIGNATURE  "# kmk job history v2: <milliseconds> <peak-rss-kb> <target>"
+#define CRITPATH_SIGNATURE_V1 "# kmk job history v1: <milliseconds> <target>"
+/* The max number of jobs of each path listed in the report. */
+#define CRITPATH_MAX_REPORT 16
+/* The max length of a history file line. */
+#define CRITPATH_MAX_LINE   8192
+
+
+/*******************************************************************************
+*   Structures and Typedefs                                                    *
+*******************************************************************************/
+/* The recorded recipe times of a target, attached to the (file strcache)
+   name as user value. */
+struct critpath_entry
+{
+  const char *name;
+  unsigned long predicted;      /* Milliseconds, from the history file. */
+  unsigned long actual;         /* Milliseconds, from this run. */
+  unsigned long predicted_rss;  /* Peak RSS in KB, from the history file. */
+  unsigned long actual_rss;     /* Peak RSS in KB, from this run. */
+  unsigned int has_predicted:1;
+  unsigned int has_actual:1;
+};
+
+/* A critical path for the report. */
+struct critpath_path
+{
+  unsigned long length;         /* Milliseconds. */
+  unsigned int count;
+  struct file **files;
+};
+
+
+/*******************************************************************************
+*   Global Variables                                                           *
+*******************************************************************************/
+/* Nonzero if job.c should order the waiting jobs by critpath_priority. */
+int critpath_scheduling;
+
+/* The history file, NULL if not recording. */
+static const char *critpath_filename;
+
+/* All the entries, for saving. */
+static struct critpath_entry **critpath_entries;
+static unsigned int critpath_num_entries;
+static unsigned int critpath_max_entries;
+
+/* The generation of the walk the cp_visited members refer to. */
+static unsigned int critpath_generation;
+
+/* The files reachable from the goals, dependencies before dependents. */
+static struct file **critpath_order;
+static unsigned int critpath_num_order;
+
+/* The goals given to critpath_prepare and when it was called. */
+static struct dep *critpath_goals;
+static big_int critpath_start_ts;
+
+/* The predicted critical path. */
+static struct critpath_path critpath_predicted;
+
+
+/* Gets the entry for the file strcache string NAME, optionally adding it. */
+
+static struct critpath_entry *
+critpath_entry (const char *name, int add)
+{
+  struct critpath_entry *entry;
+
+  entry = strcache2_get_user_val (&file_strcache, name);
+  if (entry || !add)
+    return entry;
+
+  entry = xmalloc (sizeof (*entry));
+  memset (entry, 0, sizeof (*entry));
+  entry->name = name;
+  strcache2_set_user_val (&file_strcache, name, entry);
+
+  if (critpath_num_entries >= critpath_max_entries)
+    {
+      critpath_max_entries = critpath_max_entries ? critpath_max_entries * 2 : 1024;
+      critpath_entries = xrealloc (critpath_entries,
+                                   critpath_max_entries * sizeof (critpath_entries[0]));
+    }
+  critpath_entries[critpath_num_entries++] = entry;
+  return entry;
+}
+
+/* Starts recording job times to FILENAME, loading the times recorded by
+   earlier runs from it if it exists.  */
+
+void
+critpath_load_history (const char *filename)
+{
+  char line[CRITPATH_MAX_LINE];
+  unsigned int loaded = 0;
+  int v1;
+  FILE *in;
+
+  critpath_filename = filename;
+
+  in = fopen (filename, "r");
+  if (!in)
+    return;
+
+  if (!fgets (line, sizeof (line), in))
+    line[0] = '\0';
+  v1 = !strncmp (line, CRITPATH_SIGNATURE_V1, sizeof (CRITPATH_SIGNATURE_V1) - 1);
+  if (!v1 && strncmp (line, CRITPATH_SIGNATURE, sizeof (CRITPATH_SIGNATURE) - 1))
+    error (NILF, _("%s: not a job history file, ignoring it"), filename);
+  else
+    while (fgets (line, sizeof (line), in))
+      {
+        char *name;
+        char *rss_end;
+        unsigned int len;
+        unsigned long ms = strtoul (line, &name, 10);
+        unsigned long rss = 0;
+        struct critpath_entry *entry;
+
+        if (name == line || *name != ' ')
+          continue;
+        name++;
+        if (!v1)
+          {
+            rss = strtoul (name, &rss_end, 10);
+            if (rss_end == name || *rss_end != ' ')
+              continue;
+            name = rss_end + 1;
+          }
+        len = strlen (name);
+        while (len > 0 && (name[len - 1] == '\n' || name[len - 1] == '\r'))
+          len--;
+        if (!len)
+          continue;
+
+        entry = critpath_entry (strcache_add_len (name, len), 1);
+        entry->predicted = ms;
+        entry->predicted_rss = rss;
+        entry->has_predicted = 1;
+        loaded++;
+      }
+
+  fclose (in);
+  DB (DB_VERBOSE, (_("Loaded %u job times from `%s'.\n"), loaded, filename));
+}
+
+/* Resolves renaming and double-colon entries. */
+
+MY_INLINE struct file *
+critpath_file (struct file *file)
+{
+  while (file->renamed)
+    file = file->renamed;
+  return file->double_colon ? file->double_colon : file;
+}
+
+/* The recipe time of FILE in milliseconds, predicted or actual. */
+
+static unsigned long
+critpath_duration (struct file *file, int actual)
+{
+  struct critpath_entry *entry = critpath_entry (file->name, 0);
+  if (!entry)
+    return 0;
+  return actual ? entry->actual : entry->predicted;
+}
+
+/* Collects the files reachable from GOALS in critpath_order, each after
+   all its dependencies.  Cycles are broken at the first back edge.  */
+
+static void
+critpath_walk (struct dep *goals)
+{
+  struct critpath_frame { struct file *file, *entry; struct dep *dep; } *stack;
+  unsigned int stack_size = 256;
+  unsigned int depth = 0;
+  unsigned int max_order = critpath_num_order > 1024 ? critpath_num_order : 1024;
+  struct dep *g;
+
+  critpath_generation++;
+  critpath_num_order = 0;
+  critpath_order = xrealloc (critpath_order, max_order * sizeof (critpath_order[0]));
+  stack = xmalloc (stack_size * sizeof (stack[0]));
+
+  for (g = goals; g; g = g->next)
+    {
+      struct file *f;
+      if (!g->file)
+        continue;
+      f = critpath_file (g->file);
+      if (f->cp_visited == critpath_generation)
+        continue;
+      f->cp_visited = critpath_generation;
+      stack[0].file = stack[0].entry = f;
+      stack[0].dep = f->deps;
+      depth = 1;
+
+      while (depth > 0)
+        {
+          struct critpath_frame *top = &stack[depth - 1];
+          struct dep *d = top->dep;
+
+          if (!d)
+            {
+              /* Next double-colon entry or done with this file. */
+              if (top->entry->prev)
+                {
+                  top->entry = top->entry->prev;
+                  top->dep = top->entry->deps;
+                  continue;
+                }
+              if (critpath_num_order >= max_order)
+                {
+                  max_order *= 2;
+                  critpath_order = xrealloc (critpath_order,
+                                             max_order * sizeof (critpath_order[0]));
+                }
+              critpath_order[critpath_num_order++] = top->file;
+              depth--;
+              continue;
+            }
+
+          top->dep = d->next;
+          if (d->file)
+            {
+              f = critpath_file (d->file);
+              if (f->cp_visited != critpath_generation)
+                {
+                  f->cp_visited = critpath_generation;
+                  if (depth >= stack_size)
+                    {
+                      stack_size *= 2;
+                      stack = xrealloc (stack, stack_size * sizeof (stack[0]));
+                    }
+                  stack[depth].file = stack[depth].entry = f;
+                  stack[depth].dep = f->deps;
+                  depth++;
+                }
+            }
+        }
+    }
+
+  free (stack);
+}
+
+/* Calculates the priorities of the walked files, using the predicted or
+   actual recipe times, and returns the critical path in PATH.  */
+
+static void
+critpath_compute (int actual, struct critpath_path *path)
+{
+  struct file *start = 0;
+  struct file *f;
+  unsigned int i;
+
+  for (i = 0; i < critpath_num_order; i++)
+    {
+      critpath_order[i]->cp_priority = 0;
+      critpath_order[i]->cp_next = 0;
+    }
+
+  /* Dependents come before their dependencies in reverse order, so by the
+     time we get to a file it holds the longest path of its dependents. */
+  for (i = critpath_num_order; i-- > 0; )
+    {
+      struct file *f2;
+      struct dep *d;
+
+      f = critpath_order[i];
+      f->cp_priority += critpath_duration (f, actual);
+      if (!start || f->cp_priority > start->cp_priority)
+        start = f;
+
+      for (f2 = f; f2; f2 = f2->prev)
+        for (d = f2->deps; d; d = d->next)
+          if (d->file)
+            {
+              struct file *dep = critpath_file (d->file);
+              if (   dep->cp_visited == critpath_generation
+                  && f->cp_priority > dep->cp_priority)
+                {
+                  dep->cp_priority = f->cp_priority;
+                  dep->cp_next = f;
+                }
+            }
+    }
+
+  path->length = start ? start->cp_priority : 0;
+  path->count = 0;
+  for (f = start; f; f = f->cp_next)
+    path->count++;
+  path->files = xrealloc (path->files, (path->count + 1) * sizeof (path->files[0]));
+  path->count = 0;
+  for (f = start; f; f = f->cp_next)
+    path->files[path->count++] = f;
+}
+
+/* Called before updating GOALS.  Calculates the job priorities from the
+   history and turns on the scheduling if there is any history.  */
+
+void
+critpath_prepare (struct dep *goals)
+{
+  if (!critpath_filename)
+    return;
+
+  critpath_goals = goals;
+  critpath_start_ts = nano_timestamp ();
+
+  critpath_walk (goals);
+  critpath_compute (0 /* predicted */, &critpath_predicted);
+
+  critpath_scheduling = critpath_num_entries > 0
+                     && !just_print_flag && !question_flag && !touch_flag;
+  DB (DB_VERBOSE, (_("Critical path of %u files: %lu ms over %u jobs.\n"),
+                   critpath_num_order, critpath_predicted.length,
+                   critpath_predicted.count));
+}
+
+/* The priority of the job making FILE.  Files that weren't around when
+   critpath_prepare was called (implicit rules) get the priority of the
+   dependent that made us look at them plus their own recipe time.  */
+
+unsigned long
+critpath_priority (struct file *file)
+{
+  file = critpath_file (file);
+  if (file->cp_visited != critpath_generation)
+    {
+      file->cp_visited = critpath_generation;
+      file->cp_next = file->parent;
+      file->cp_priority = critpath_duration (file, 0)
+                        + (file->parent ? critpath_priority (file->parent) : 0);
+    }
+  return file->cp_priority;
+}
+
+/* Records ELAPSED nano seconds as the recipe time of FILE and PEAK_RSS
+   (KB, 0 if unknown) as the peak resident set size of its commands. */
+
+void
+critpath_record_job (struct file *file, big_int elapsed, unsigned long peak_rss)
+{
+  struct critpath_entry *entry;
+
+  if (!critpath_filename || just_print_flag || question_flag || touch_flag)
+    return;
+
+  entry = critpath_entry (critpath_file (file)->name, 1);
+  entry->actual += (unsigned long)(elapsed / 1000000);
+  if (peak_rss > entry->actual_rss)
+    entry->actual_rss = peak_rss;
+  entry->has_actual = 1;
+}
+
+/* The peak resident set size of the commands of FILE in KB as recorded
+   by an earlier run, 0 if unknown. */
+
+unsigned long
+critpath_peak_rss (struct file *file)
+{
+  struct critpath_entry *entry;
+
+  if (!critpath_filename)
+    return 0;
+  entry = critpath_entry (critpath_file (file)->name, 0);
+  return entry && entry->has_predicted ? entry->predicted_rss : 0;
+}
+
+/* Writes the history file, replacing it. */
+
+static void
+critpath_save_history (void)
+{
+  unsigned int len = strlen (critpath_filename);
+  char *tmp = alloca (len + sizeof (".new"));
+  unsigned int i;
+  FILE *out;
+
+  memcpy (tmp, critpath_filename, len);
+  memcpy (tmp + len, ".new", sizeof (".new"));
+
+  out = fopen (tmp, "w");
+  if (!out)
+    {
+      perror_with_name (_("writing job history: "), tmp);
+      return;
+    }
+
+  fputs (CRITPATH_SIGNATURE "\n", out);
+  for (i = 0; i < critpath_num_entries; i++)
+    {
+      struct critpath_entry *entry = critpath_entries[i];
+      if (entry->has_actual)
+        fprintf (out, "%lu %lu %s\n", entry->actual,
+                 entry->actual_rss ? entry->actual_rss : entry->predicted_rss,
+                 entry->name);
+      else if (entry->has_predicted)
+        fprintf (out, "%lu %lu %s\n", entry->predicted, entry->predicted_rss,
+                 entry->name);
+    }
+
+  if (fclose (out) != 0)
+    perror_with_name (_("writing job history: "), tmp);
+  else
+    {
+#ifdef WINDOWS32
+      unlink (critpath_filename);
+#endif
+      if (rename (tmp, critpath_filename))
+        perror_with_name (_("renaming job history: "), tmp);
+    }
+}
+
+/* Prints the jobs of PATH with their predicted and actual times. */
+
+static void
+critpath_print_path (const char *title, struct critpath_path *path)
+{
+  unsigned int i;
+  unsigned int shown = 0;
+
+  printf (_("#  %s:\n"), title);
+  for (i = 0; i < path->count; i++)
+    {
+      struct critpath_entry *entry = critpath_entry (path->files[i]->name, 0);
+      char predicted[64];
+      char actual[64];
+
+      if (!entry || (!entry->predicted && !entry->actual))
+        continue;
+      if (++shown > CRITPATH_MAX_REPORT)
+        {
+          printf (_("#    ... %u more\n"), path->count - i);
+          break;
+        }
+      if (entry->has_predicted)
+        format_elapsed_nano (predicted, sizeof (predicted), entry->predicted * BIG_INT_C(1000000));
+      else
+        strcpy (predicted, "-");
+      if (entry->has_actual)
+        format_elapsed_nano (actual, sizeof (actual), entry->actual * BIG_INT_C(1000000));
+      else
+        strcpy (actual, "-");
+      printf ("#    %10s %10s  %s\n", predicted, actual, path->files[i]->name);
+    }
+}
+
+/* Called at exit.  Prints the critical path report and saves the history
+   if any jobs were run.  */
+
+void
+critpath_finish (void)
+{
+  struct critpath_path actual;
+  unsigned long predicted_actual = 0;
+  unsigned int i;
+  int any = 0;
+  char buf1[64];
+  char buf2[64];
+  char buf3[64];
+  char buf4[64];
+
+  if (!critpath_filename)
+    return;
+  critpath_scheduling = 0;
+
+  for (i = 0; i < critpath_num_entries && !any; i++)
+    any = critpath_entries[i]->has_actual;
+  if (!any)
+    return;
+  critpath_save_history ();
+  if (!critpath_goals)
+    return;
+
+  /* The actual path, including the dependencies added by implicit rules. */
+  memset (&actual, 0, sizeof (actual));
+  critpath_walk (critpath_goals);
+  critpath_compute (1 /* actual */, &actual);
+
+  for (i = 0; i < critpath_predicted.count; i++)
+    predicted_actual += critpath_duration (critpath_predicted.files[i], 1);
+
+  format_elapsed_nano (buf1, sizeof (buf1), critpath_predicted.length * BIG_INT_C(1000000));
+  format_elapsed_nano (buf2, sizeof (buf2), predicted_actual * BIG_INT_C(1000000));
+  format_elapsed_nano (buf3, sizeof (buf3), actual.length * BIG_INT_C(1000000));
+  format_elapsed_nano (buf4, sizeof (buf4), nano_timestamp () - critpath_start_ts);
+  if (critpath_predicted.length)
+    printf (_("\n# Critical path: predicted %s (took %s), actual %s, build time %s\n"),
+            buf1, buf2, buf3, buf4);
+  else
+    printf (_("\n# Critical path: actual %s, build time %s (no history)\n"),
+            buf3, buf4);
+  printf (_("#    predicted     actual  target\n"));
+  if (critpath_predicted.length)
+    critpath_print_path (_("predicted path"), &critpath_predicted);
+  critpath_print_path (_("actual path"), &actual);
+
+  free (actual.files);
+}
+
+#endif /* CONFIG_WITH_CRITICAL_PATH */
@@ -96,9 +96,12 @@ void uniquize_deps (struct dep *);
 
 #ifdef CONFIG_WITH_INCLUDEDEP
 /* incdep.c */
-enum incdep_op { incdep_read_it, incdep_queue, incdep_flush };
+enum incdep_op { incdep_read_it, incdep_queue, incdep_flush, incdep_db };
 void eval_include_dep (const char *name, struct floc *f, enum incdep_op op);
 void incdep_flush_and_term (void);
+#ifdef CONFIG_WITH_PRINT_STATS_SWITCH
+void print_incdep_stats (void);
+#endif
 
 /* read.c */
 void record_files (struct nameseq *filenames, const char *pattern,
@@ -108,3 +111,12 @@ void record_files (struct nameseq *filenames, const char *pattern,
                    const struct floc *flocp);
 #endif
 
+#ifdef CONFIG_WITH_MAKEFILE_SNAPSHOT
+/* snapshot.c */
+int snapshot_load (const char *filename, int argc, char **argv, char **envp,
+                   struct dep **read_makefilesp);
+void snapshot_save (struct dep *read_makefiles);
+void snapshot_record_input (const char *name, unsigned int len);
+void print_snapshot_stats (void);
+#endif
+
@@ -18,6 +18,12 @@ this program.  If not, see <http://www.gnu.org/licenses/>.  */
 
 #include "make.h"
 #include "hash.h"
+#ifdef CONFIG_WITH_DIR_SNAPSHOTS
+# include "filedef.h"
+# ifndef WINDOWS32
+#  include <fcntl.h>
+# endif
+#endif
 
 #ifdef	HAVE_DIRENT_H
 # include <dirent.h>
@@ -252,6 +258,14 @@ struct directory_contents
 #endif /* WINDOWS32 */
     struct hash_table dirfiles;	/* Files in this directory.  */
     DIR *dirstream;		/* Stream reading this directory.  */
+#ifdef CONFIG_WITH_DIR_SNAPSHOTS
+    const char *snap_dir;       /* Name to open it by (strcache'ed).  */
+    time_t snap_time;           /* When the last snapshot was started.  */
+    unsigned int snap_gen;      /* dir_snapshot_gen when it was taken.  */
+    unsigned int snap_checked;  /* dir_snapshot_gen when last checked.  */
+    unsigned int snap_misses;   /* Lookups passed on since it was taken.  */
+    int snap_listed;            /* Nonzero if the listing is current.  */
+#endif
   };
 
 static unsigned long
@@ -421,8 +435,19 @@ struct dirfile
     const char *name;		/* Name of the file.  */
     short length;
     short impossible;		/* This file is impossible.  */
+#ifdef CONFIG_WITH_DIR_SNAPSHOTS
+    unsigned char snap;         /* DIRFILE_SNAP_XXX.  */
+    FILE_TIMESTAMP mtime;       /* The mtime if DIRFILE_SNAP_FILE.  */
+#endif
   };
 
+#ifdef CONFIG_WITH_DIR_SNAPSHOTS
+/* dirfile::snap values. */
+# define DIRFILE_SNAP_NONE      0   /* Not known, ask the system.  */
+# define DIRFILE_SNAP_FILE      1   /* Exists, mtime is valid.  */
+# define DIRFILE_SNAP_MISSING   2   /* Doesn't exist (any more).  */
+#endif
+
 #ifndef CONFIG_WITH_STRCACHE2
 static unsigned long
 dirfile_hash_1 (const void *key)
@@ -628,6 +653,13 @@ find_directory (const char *name)
 	      dc->ino = st.st_ino;
 # endif
 #endif /* WINDOWS32 */
+#ifdef CONFIG_WITH_DIR_SNAPSHOTS
+	      dc->snap_dir = dir->name;
+	      dc->snap_time = 0;
+	      dc->snap_gen = dc->snap_checked = 0;
+	      dc->snap_misses = 0;
+	      dc->snap_listed = 0;
+#endif
 	      hash_insert_at (&directory_contents, dc, dc_slot);
 	      ENULLLOOP (dc->dirstream, opendir (name));
 	      if (dc->dirstream == 0)
@@ -845,6 +877,9 @@ dir_contents_file_exists_p (struct directory_contents *dir,
 #endif
 	  df->length = len;
 	  df->impossible = 0;
+#ifdef CONFIG_WITH_DIR_SNAPSHOTS
+	  df->snap = DIRFILE_SNAP_NONE;
+#endif
 	  hash_insert_at (&dir->dirfiles, df, dirfile_slot);
 	}
       /* Check if the name matches the one we're searching for.  */
@@ -939,6 +974,398 @@ file_exists_p (const char *name)
   return dir_file_exists_p (dirname, slash + 1);
 }
 
+#ifdef CONFIG_WITH_DIR_SNAPSHOTS
+
+/* Directory snapshots.
+
+   f_mtime() used to stat() every file by name.  For a directory that is
+   looked up a lot we can instead read it once and fstatat() every entry
+   through the directory handle, recording the mtimes in the dirfiles.  The
+   complete listing also lets us answer `doesn't exist' without asking the
+   system at all.
+
+   The mtimes are only trusted until something might have changed the file
+   system, that is until dir_snapshot_gen is bumped by a job or $(shell ).
+   The listing itself survives as long as the ctime of the directory is
+   older than the time we started reading it, since adding, removing or
+   renaming an entry updates it.  */
+
+# if defined (AT_FDCWD) && !defined (WINDOWS32) && !defined (VMS) \
+  && !defined (__MSDOS__) && !defined (_AMIGA)
+#  define HAVE_DIR_SNAPSHOTS
+# endif
+
+/* Don't take a snapshot until this many lookups in a directory have gone
+   to the system, and at least one for every DIR_SNAPSHOT_RATIO entries in
+   it.  This bounds the cost of snapshots that are thrown away right after
+   by a busy build to a small multiple of the stat() calls they replace.  */
+# define DIR_SNAPSHOT_MIN_MISSES    8
+# define DIR_SNAPSHOT_RATIO         2
+
+/* Bumped whenever something may have changed the file system.  */
+unsigned int dir_snapshot_gen = 1;
+
+static unsigned long dir_snapshot_stat_taken;
+static unsigned long dir_snapshot_stat_files;
+static unsigned long dir_snapshot_stat_dropped;
+static unsigned long dir_snapshot_stat_hits;
+static unsigned long dir_snapshot_stat_missing;
+static unsigned long dir_snapshot_stat_fallbacks;
+
+# ifdef HAVE_DIR_SNAPSHOTS
+
+/* Check whether DC's listing is still current, dropping it if not.  */
+
+static void
+dir_snapshot_check (struct directory_contents *dc)
+{
+  struct stat st;
+  int r;
+
+  dc->snap_checked = dir_snapshot_gen;
+  EINTRLOOP (r, stat (dc->snap_dir, &st));
+  if (   r != 0
+      || st.st_dev != dc->dev
+      || st.st_ino != dc->ino
+      || st.st_ctime >= dc->snap_time)
+    {
+      dc->snap_listed = 0;
+      dir_snapshot_stat_dropped++;
+    }
+}
+
+/* Read DC again and get the mtimes of everything in it.  */
+
+static void
+dir_snapshot_take (struct directory_contents *dc)
+{
+  struct dirfile **df_slot;
+  struct dirfile **df_end;
+  struct dirent *d;
+  DIR *stream;
+  int fd;
+
+  /* Let the lazy reader finish first, it doesn't expect company.  */
+  if (dc->dirstream != 0)
+    dir_contents_file_exists_p (dc, 0);
+
+  dc->snap_listed = 0;
+  dc->snap_misses = 0;
+  dc->snap_time = time ((time_t *) 0);
+  ENULLLOOP (stream, opendir (dc->snap_dir));
+  if (stream == 0)
+    return;
+  fd = dirfd (stream);
+
+  /* Anything not seen in this pass has been removed.  */
+  df_slot = (struct dirfile **) dc->dirfiles.ht_vec;
+  df_end = df_slot + dc->dirfiles.ht_size;
+  for ( ; df_slot < df_end; df_slot++)
+    if (! HASH_VACANT (*df_slot))
+      (*df_slot)->snap = DIRFILE_SNAP_MISSING;
+
+  while (1)
+    {
+      struct dirfile dirfile_key;
+      struct dirfile *df;
+      struct stat st;
+      unsigned int len;
+      int r;
+
+      ENULLLOOP (d, readdir (stream));
+      if (d == 0)
+        break;
+      if (!REAL_DIR_ENTRY (d))
+        continue;
+
+      len = NAMLEN (d);
+      dirfile_key.name = strcache_add_len (d->d_name, len);
+      dirfile_key.length = len;
+#  ifndef CONFIG_WITH_STRCACHE2
+      df_slot = (struct dirfile **) hash_find_slot (&dc->dirfiles, &dirfile_key);
+#  else
+      df_slot = (struct dirfile **) hash_find_slot_strcached (&dc->dirfiles, &dirfile_key);
+#  endif
+      df = *df_slot;
+      if (HASH_VACANT (df))
+        {
+#  ifndef CONFIG_WITH_ALLOC_CACHES
+          df = xmalloc (sizeof (struct dirfile));
+#  else
+          df = alloccache_alloc (&dirfile_cache);
+#  endif
+          df->name = dirfile_key.name;
+          df->length = len;
+          df->impossible = 0;
+          hash_insert_at (&dc->dirfiles, df, df_slot);
+        }
+
+      /* Timestamps out of range are left to name_mtime, which warns.  */
+      EINTRLOOP (r, fstatat (fd, d->d_name, &st, 0));
+      if (r == 0)
+        {
+          if (st.st_mtime > 0
+           && st.st_mtime < (time_t) FILE_TIMESTAMP_S (ORDINARY_MTIME_MAX))
+            {
+              df->mtime = FILE_TIMESTAMP_STAT_MODTIME (df->name, st);
+              df->snap = DIRFILE_SNAP_FILE;
+            }
+          else
+            df->snap = DIRFILE_SNAP_NONE;
+        }
+      else
+        df->snap = errno == ENOENT ? DIRFILE_SNAP_MISSING : DIRFILE_SNAP_NONE;
+      dir_snapshot_stat_files++;
+    }
+
+  /* A read error leaves us with an incomplete listing.  */
+  if (errno == 0)
+    {
+      dc->snap_listed = 1;
+      dc->snap_gen = dc->snap_checked = dir_snapshot_gen;
+      dir_snapshot_stat_taken++;
+    }
+  closedir (stream);
+}
+
+/* Look up NAME in the current listing of DC, see dir_snapshot_mtime.  */
+
+static int
+dir_snapshot_lookup (struct directory_contents *dc, const char *name,
+                     FILE_TIMESTAMP *mtimep)
+{
+  struct dirfile dirfile_key;
+  struct dirfile *df;
+
+  dirfile_key.length = strlen (name);
+  dirfile_key.name = strcache_add_len (name, dirfile_key.length);
+#  ifndef CONFIG_WITH_STRCACHE2
+  df = hash_find_item (&dc->dirfiles, &dirfile_key);
+#  else
+  df = hash_find_item_strcached (&dc->dirfiles, &dirfile_key);
+#  endif
+  if (df == 0)
+    {
+      /* Not in a current listing, so it doesn't exist.  */
+      dir_snapshot_stat_missing++;
+      return 0;
+    }
+  if (dc->snap_gen == dir_snapshot_gen && !df->impossible)
+    {
+      if (df->snap == DIRFILE_SNAP_FILE)
+        {
+          *mtimep = df->mtime;
+          dir_snapshot_stat_hits++;
+          return 1;
+        }
+      if (df->snap == DIRFILE_SNAP_MISSING)
+        {
+          dir_snapshot_stat_missing++;
+          return 0;
+        }
+    }
+  return -1;
+}
+
+# endif /* HAVE_DIR_SNAPSHOTS */
+
+/* Get the mtime of NAME from its directory's snapshot, taking one if the
+   directory is looked up frequently enough.
+
+   Returns 1 and sets *MTIMEP if the file exists, 0 if it doesn't, and -1
+   if the snapshot doesn't know and the caller must ask the system.  */
+
+int
+dir_snapshot_mtime (const char *name, FILE_TIMESTAMP *mtimep)
+{
+# ifdef HAVE_DIR_SNAPSHOTS
+  struct directory_contents *dc;
+  const char *dirend;
+  const char *dirname;
+  int rc;
+
+  /* -L wants to look at the symlinks themselves.  */
+  if (check_symlink_flag)
+    return -1;
+
+  dirend = strrchr (name, '/');
+  if (dirend == 0)
+    dirname = ".";
+  else if (dirend == name)
+    dirname = "/";
+  else
+    {
+      char *p = alloca (dirend - name + 1);
+      memcpy (p, name, dirend - name);
+      p[dirend - name] = '\0';
+      dirname = p;
+    }
+  if (dirend != 0)
+    name = dirend + 1;
+  if (*name == '\0')
+    return -1;
+
+  dc = find_directory (dirname)->contents;
+  if (dc == 0 || dc->dirfiles.ht_vec == 0 || dc->snap_dir == 0)
+    {
+      dir_snapshot_stat_fallbacks++;
+      return -1;
+    }
+
+  if (dc->snap_listed && dc->snap_checked != dir_snapshot_gen)
+    dir_snapshot_check (dc);
+  if (dc->snap_listed)
+    {
+      rc = dir_snapshot_lookup (dc, name, mtimep);
+      if (rc >= 0)
+        return rc;
+    }
+
+  /* Take a new snapshot when we've asked the system often enough to pay
+     for reading the whole directory.  */
+  dc->snap_misses++;
+  if (   dc->snap_misses >= DIR_SNAPSHOT_MIN_MISSES
+      && dc->snap_misses * DIR_SNAPSHOT_RATIO >= dc->dirfiles.ht_fill)
+    {
+      dir_snapshot_take (dc);
+      if (dc->snap_listed)
+        {
+          rc = dir_snapshot_lookup (dc, name, mtimep);
+          if (rc >= 0)
+            return rc;
+        }
+    }
+  dir_snapshot_stat_fallbacks++;
+  return -1;
+
+# else  /* !HAVE_DIR_SNAPSHOTS */
+  (void)name;
+  (void)mtimep;
+  dir_snapshot_stat_fallbacks++;
+  return -1;
+# endif /* !HAVE_DIR_SNAPSHOTS */
+}
+
+/* Prints the statistics. */
+
+void
+print_dir_snapshot_stats (void)
+{
+  printf (_("\n# directory snapshots: %lu taken, %lu dropped, %lu files stat'ed\n"),
+          dir_snapshot_stat_taken, dir_snapshot_stat_dropped,
+          dir_snapshot_stat_files);
+  printf (_("#  lookups: %lu mtimes, %lu missing, %lu passed on to stat()\n"),
+          dir_snapshot_stat_hits, dir_snapshot_stat_missing,
+          dir_snapshot_stat_fallbacks);
+}
+
+#endif /* CONFIG_WITH_DIR_SNAPSHOTS */
+
+#ifdef CONFIG_WITH_SERVER
+/* Forget what we know about the contents of the directory NAME because the
+   server has been told that entries were added to or removed from it, and
+   read it again.  */
+
+void
+dir_contents_forget (const char *name)
+{
+  struct directory dir_key;
+  struct directory *dir;
+  struct directory_contents *dc;
+
+#ifndef CONFIG_WITH_STRCACHE2
+  dir_key.name = name;
+  dir = hash_find_item (&directories, &dir_key);
+#else
+  dir_key.name = strcache_add (name);
+  dir = hash_find_item_strcached (&directories, &dir_key);
+#endif
+  if (dir == 0)
+    return;
+
+#ifdef CONFIG_WITH_VPATH_CACHE
+  /* Files may have appeared in it.  */
+  vpath_cache_flush ();
+#endif
+
+  dc = dir->contents;
+  if (dc != 0)
+    {
+      if (dc->dirstream != 0)
+        {
+          --open_directories;
+          closedir (dc->dirstream);
+          dc->dirstream = 0;
+        }
+#ifdef CONFIG_WITH_DIR_SNAPSHOTS
+      dc->snap_listed = 0;
+      dc->snap_misses = 0;
+#endif
+
+      if (dc->dirfiles.ht_vec != 0)
+        {
+#ifndef CONFIG_WITH_ALLOC_CACHES
+          hash_free_items (&dc->dirfiles);
+#else
+          hash_free_items_cached (&dc->dirfiles, &dirfile_cache);
+#endif
+          /* Read all of it right away, see read_open_directories.  */
+          ENULLLOOP (dc->dirstream, opendir (name));
+          if (dc->dirstream != 0)
+            {
+              ++open_directories;
+              dir_contents_file_exists_p (dc, 0);
+              return;
+            }
+        }
+
+      /* It can't be read (any more), so look it up from scratch next
+         time.  Other names for it will be forgotten separately, so the
+         contents are just left behind.  */
+      hash_delete (&directory_contents, dc);
+    }
+
+#ifndef CONFIG_WITH_STRCACHE2
+  hash_delete (&directories, dir);
+#else
+  hash_delete_strcached (&directories, dir);
+#endif
+#ifndef CONFIG_WITH_ALLOC_CACHES
+  free (dir);
+#else
+  alloccache_free (&directories_cache, dir);
+#endif
+}
+
+/* Finishes reading the directories that are still open.  The server does
+   this before forking a child, since the children would otherwise share
+   the position in the directory streams and miss entries.  */
+
+void
+read_open_directories (void)
+{
+  struct directory_contents **vec = (struct directory_contents **) directory_contents.ht_vec;
+  struct directory_contents **end = vec + directory_contents.ht_size;
+
+  for (; vec < end && open_directories > 0; vec++)
+    if (!HASH_VACANT (*vec) && (*vec)->dirstream != 0)
+      dir_contents_file_exists_p (*vec, 0);
+}
+
+/* Calls FUNC with the name of every directory we have looked at.  */
+
+void
+map_directories (void (*func) (const char *name))
+{
+  struct directory **vec = (struct directory **) directories.ht_vec;
+  struct directory **end = vec + directories.ht_size;
+
+  for (; vec < end; vec++)
+    if (!HASH_VACANT (*vec))
+      func ((*vec)->name);
+}
+#endif /* CONFIG_WITH_SERVER */
+
 /* Mark FILENAME as `impossible' for `file_impossible_p'.
    This means an attempt has been made to search for FILENAME
    as an intermediate file, and it has failed.  */
@@ -1035,6 +1462,9 @@ file_impossible (const char *filename)
   new->length = strlen (filename);
   new->name = strcache_add_len (filename, new->length);
   new->impossible = 1;
+#ifdef CONFIG_WITH_DIR_SNAPSHOTS
+  new->snap = DIRFILE_SNAP_NONE;
+#endif
 #ifndef CONFIG_WITH_STRCACHE2
   hash_insert (&dir->contents->dirfiles, new);
 #else  /* CONFIG_WITH_STRCACHE2 */
@@ -1282,6 +1712,10 @@ open_dirstream (const char *directory)
   struct dirstream *new;
   struct directory *dir = find_directory (directory);
 
+#ifdef CONFIG_WITH_SERVER
+  if (server_recording)
+    server_record_dir_read (directory);
+#endif
   if (dir->contents == 0 || dir->contents->dirfiles.ht_vec == 0)
     /* DIR->contents is nil if the directory could not be stat'd.
        DIR->contents->dirfiles is nil if it could not be opened.  */
@@ -1374,13 +1808,29 @@ local_stat (const char *path, struct stat *buf)
 }
 #endif
 
+#ifdef CONFIG_WITH_SERVER
+/* glob checks names without wildcards with this, let the server know when
+   it happens while reading the makefiles.  */
+static int
+server_glob_stat (const char *path, struct stat *buf)
+{
+  if (server_recording)
+    server_record_input (path, strlen (path));
+  return local_stat (path, buf);
+}
+#endif
+
 void
 dir_setup_glob (glob_t *gl)
 {
   gl->gl_opendir = open_dirstream;
   gl->gl_readdir = read_dirstream;
   gl->gl_closedir = ansi_free;
+#ifndef CONFIG_WITH_SERVER
   gl->gl_stat = local_stat;
+#else
+  gl->gl_stat = server_glob_stat;
+#endif
 #ifdef __EMX__ /* The FreeBSD implementation actually uses gl_lstat!! */
   gl->gl_lstat = local_stat;
 #endif
@@ -1398,6 +1848,9 @@ hash_init_directories (void)
   hash_init_strcached (&directories, DIRECTORY_BUCKETS, &file_strcache,
                        offsetof (struct directory, name));
 #endif /* CONFIG_WITH_STRCACHE2 */
+#ifdef CONFIG_WITH_HASH_TAGS
+  hash_enable_tags (&directories);
+#endif
   hash_init (&directory_contents, DIRECTORY_BUCKETS,
 	     directory_contents_hash_1, directory_contents_hash_2,
              directory_contents_hash_cmp);
@@ -130,6 +130,12 @@ initialize_variable_output (void)
 /* Recursively expand V.  The returned string is malloc'd.  */
 
 static char *allocated_variable_append (const struct variable *v);
+#ifdef CONFIG_WITH_COMPILER
+static struct expand_prog *variable_expand_prog (struct variable *v);
+static char *reference_expand_prog (char *o, struct expand_prog *prog);
+static char *allocated_expand_prog (struct expand_prog *prog,
+                                    unsigned int *value_lenp);
+#endif
 
 char *
 #ifndef CONFIG_WITH_VALUE_LENGTH
@@ -185,7 +191,15 @@ recursively_expand_for_file (struct variable *v, struct file *file,
     value = allocated_variable_expand (v->value);
 #else  /* CONFIG_WITH_VALUE_LENGTH */
   if (!v->append)
-    value = allocated_variable_expand_2 (v->value, v->value_length, value_lenp);
+    {
+# ifdef CONFIG_WITH_COMPILER
+      struct expand_prog *prog = variable_expand_prog (v);
+      if (prog)
+        value = allocated_expand_prog (prog, value_lenp);
+      else
+# endif
+        value = allocated_variable_expand_2 (v->value, v->value_length, value_lenp);
+    }
   else
     {
       value = allocated_variable_append (v);
@@ -246,8 +260,16 @@ reference_recursive_variable (char *o, struct variable *v)
 
   v->expanding = 1;
   if (!v->append)
-    /* Expand directly into the variable buffer.  */
-    variable_expand_string_2 (o, v->value, v->value_length, &o);
+    {
+#ifdef CONFIG_WITH_COMPILER
+      struct expand_prog *prog = variable_expand_prog (v);
+      if (prog)
+        o = reference_expand_prog (o, prog);
+      else
+#endif
+      /* Expand directly into the variable buffer.  */
+      variable_expand_string_2 (o, v->value, v->value_length, &o);
+    }
   else
     {
       /* XXX: Feel free to optimize appending target variables as well.  */
@@ -548,6 +570,101 @@ variable_expand_string (char *line, const char *string, long length)
 }
 
 #else /* CONFIG_WITH_VALUE_LENGTH */
+/* Worker for variable_expand_string_2 and the expansion programs that
+   handles the variable reference BEG thru END after any variable
+   references in the name have been expanded: either a substitution
+   reference, $(FOO:A=B), or an ordinary variable reference.  */
+
+MY_INLINE char *
+reference_variable_or_subst (char *o, const char *beg, const char *end)
+{
+  struct variable *v;
+  const char *colon;
+
+  /* Is the text a substitution reference?  */
+
+  colon = lindex (beg, end, ':');
+  if (colon)
+    {
+      /* This looks like a substitution reference: $(FOO:A=B).  */
+      const char *subst_beg, *subst_end, *replace_beg, *replace_end;
+
+      subst_beg = colon + 1;
+      subst_end = lindex (subst_beg, end, '=');
+      if (subst_end == 0)
+        /* There is no = in sight.  Punt on the substitution
+           reference and treat this as a variable name containing
+           a colon, in the code below.  */
+        colon = 0;
+      else
+        {
+          replace_beg = subst_end + 1;
+          replace_end = end;
+
+          /* Extract the variable name before the colon
+             and look up that variable.  */
+          v = lookup_variable (beg, colon - beg);
+          if (v == 0)
+            warn_undefined (beg, colon - beg);
+
+          /* If the variable is not empty, perform the
+             substitution.  */
+          if (v != 0 && *v->value != '\0')
+            {
+              char *pattern, *replace, *ppercent, *rpercent;
+              char *value = (v->recursive
+                             ? recursively_expand (v)
+                             : v->value);
+
+              /* Copy the pattern and the replacement.  Add in an
+                 extra % at the beginning to use in case there
+                 isn't one in the pattern.  */
+              pattern = alloca (subst_end - subst_beg + 2);
+              *(pattern++) = '%';
+              memcpy (pattern, subst_beg, subst_end - subst_beg);
+              pattern[subst_end - subst_beg] = '\0';
+
+              replace = alloca (replace_end - replace_beg + 2);
+              *(replace++) = '%';
+              memcpy (replace, replace_beg,
+                     replace_end - replace_beg);
+              replace[replace_end - replace_beg] = '\0';
+
+              /* Look for %.  Set the percent pointers properly
+                 based on whether we find one or not.  */
+              ppercent = find_percent (pattern);
+              if (ppercent)
+                {
+                  ++ppercent;
+                  rpercent = find_percent (replace);
+                  if (rpercent)
+                    ++rpercent;
+                }
+              else
+                {
+                  ppercent = pattern;
+                  rpercent = replace;
+                  --pattern;
+                  --replace;
+                }
+
+              o = patsubst_expand_pat (o, value, pattern, replace,
+                                       ppercent, rpercent);
+
+              if (v->recursive)
+                free (value);
+            }
+        }
+    }
+
+  if (colon == 0)
+    /* This is an ordinary variable reference.
+       Look up the value of the variable.  */
+    o = reference_variable (o, beg, end - beg);
+
+  return o;
+}
+
 /* Scan STRING for variable references and expansion-function calls.  Only
    LENGTH bytes of STRING are actually scanned.  If LENGTH is -1, scan until
    a null byte is found.
@@ -560,7 +677,6 @@ variable_expand_string (char *line, const char *string, long length)
 char *
 variable_expand_string_2 (char *line, const char *string, long length, char **eolp)
 {
-  struct variable *v;
   const char *p, *p1, *eos;
   char *o;
   unsigned int line_offset;
@@ -631,7 +747,7 @@ variable_expand_string_2 (char *line, const char *string, long length, char **eo
 	    char *op;
             char *abeg = NULL;
             unsigned int alen = 0;
-	    const char *end, *colon;
+	    const char *end;
 
 	    op = o;
 	    begp = p;
@@ -690,87 +806,9 @@ variable_expand_string_2 (char *line, const char *string, long length, char **eo
 	      p = end;
 
 	    /* This is not a reference to a built-in function and
-	       any variable references inside are now expanded.
-	       Is the resultant text a substitution reference?  */
-
-	    colon = lindex (beg, end, ':');
-	    if (colon)
-	      {
-		/* This looks like a substitution reference: $(FOO:A=B).  */
-		const char *subst_beg, *subst_end, *replace_beg, *replace_end;
-
-		subst_beg = colon + 1;
-		subst_end = lindex (subst_beg, end, '=');
-		if (subst_end == 0)
-		  /* There is no = in sight.  Punt on the substitution
-		     reference and treat this as a variable name containing
-		     a colon, in the code below.  */
-		  colon = 0;
-		else
-		  {
-		    replace_beg = subst_end + 1;
-		    replace_end = end;
-
-		    /* Extract the variable name before the colon
-		       and look up that variable.  */
-		    v = lookup_variable (beg, colon - beg);
-		    if (v == 0)
-		      warn_undefined (beg, colon - beg);
-
-                    /* If the variable is not empty, perform the
-                       substitution.  */
-		    if (v != 0 && *v->value != '\0')
-		      {
-			char *pattern, *replace, *ppercent, *rpercent;
-			char *value = (v->recursive
-                                       ? recursively_expand (v)
-				       : v->value);
-
-                        /* Copy the pattern and the replacement.  Add in an
-                           extra % at the beginning to use in case there
-                           isn't one in the pattern.  */
-                        pattern = alloca (subst_end - subst_beg + 2);
-                        *(pattern++) = '%';
-                        memcpy (pattern, subst_beg, subst_end - subst_beg);
-                        pattern[subst_end - subst_beg] = '\0';
+	       any variable references inside are now expanded.  */
 
-                        replace = alloca (replace_end - replace_beg + 2);
-                        *(replace++) = '%';
-                        memcpy (replace, replace_beg,
-                               replace_end - replace_beg);
-                        replace[replace_end - replace_beg] = '\0';
-
-                        /* Look for %.  Set the percent pointers properly
-                           based on whether we find one or not.  */
-			ppercent = find_percent (pattern);
-			if (ppercent)
-                          {
-                            ++ppercent;
-                            rpercent = find_percent (replace);
-                            if (rpercent)
-                              ++rpercent;
-                          }
-			else
-                          {
-                            ppercent = pattern;
-                            rpercent = replace;
-                            --pattern;
-                            --replace;
-                          }
-
-                        o = patsubst_expand_pat (o, value, pattern, replace,
-                                                 ppercent, rpercent);
-
-			if (v->recursive)
-			  free (value);
-		      }
-		  }
-	      }
-
-	    if (colon == 0)
-	      /* This is an ordinary variable reference.
-		 Look up the value of the variable.  */
-		o = reference_variable (o, beg, end - beg);
+	    o = reference_variable_or_subst (o, beg, end);
 
 	  if (abeg)
             recycle_variable_buffer (abeg, alen);
@@ -806,6 +844,632 @@ variable_expand_string_2 (char *line, const char *string, long length, char **eo
   return (variable_buffer + line_offset);
 }
 #endif /* CONFIG_WITH_VALUE_LENGTH */
+
+#ifdef CONFIG_WITH_COMPILER
+/* Expansion programs.
+
+   The value of a recursive variable that keeps being expanded (templates,
+   the kBuild header and footer macros, ...) is compiled into a program
+   the second time it is expanded.  The program is a list of instructions:
+   literal text, references to variables with the name already entered
+   into variable_strcache, and calls to builtin functions that have been
+   looked up and had their arguments split up and compiled into
+   sub-programs.  Executing it saves rescanning the value for `$',
+   parentheses and function names every time.
+
+   The compiler follows variable_expand_string_2 to the letter and gives
+   up on anything unusual (unterminated references or calls, too few
+   arguments, ...), leaving that value to variable_expand_string_2 so it
+   gets to report the errors.  The program is dropped whenever the value
+   changes, see VARIABLE_CHANGED in variable.h.  */
+
+enum expand_op
+  {
+    eop_copy,           /* Copy TEXT.  */
+    eop_var,            /* Reference to the variable TEXT (strcached).  */
+    eop_var_ref,        /* Reference or substitution reference TEXT.  */
+    eop_dyn_var,        /* Reference with a name that needs expanding.  */
+    eop_func,           /* Builtin function taking expanded arguments.  */
+    eop_func_raw        /* Builtin function taking the arguments as-is.  */
+  };
+
+struct expand_instr
+  {
+    enum expand_op op;
+    unsigned int len;           /* The length of TEXT.  */
+    const char *text;
+    union
+      {
+        struct expand_prog *name;       /* eop_dyn_var */
+        struct
+          {
+            make_function_ptr_t func_ptr;
+            const char *name;
+            unsigned int nargs;
+            struct expand_prog **args;  /* eop_func, NULL if empty.  */
+            unsigned int *arg_offs;     /* eop_func_raw, offsets into TEXT.  */
+          } func;
+      } u;
+  };
+
+struct expand_prog
+  {
+    unsigned int refs;          /* The variable + executions in progress.  */
+    unsigned int ninstrs;
+    int interpret;              /* Left to variable_expand_string_2.  */
+    char *text;                 /* Copy of the value (top program only).  */
+    const char *value;          /* The value it was compiled from.  */
+    unsigned int value_length;
+    struct expand_instr instrs[1];
+  };
+
+/* Instructions being collected for a program.  */
+
+struct expand_compiler
+  {
+    struct expand_instr *instrs;
+    unsigned int ninstrs;
+    unsigned int size;
+  };
+
+static struct
+  {
+    unsigned int compiled;
+    unsigned int interpreted;
+    unsigned int dropped;
+    unsigned long executions;
+  } expand_prog_stats;
+
+static struct expand_prog *compile_expand_slice (const char *string,
+                                                 const char *eos);
+
+static void
+free_expand_instrs (struct expand_instr *instr, unsigned int ninstrs)
+{
+  struct expand_instr *end = instr + ninstrs;
+  unsigned int i;
+
+  for (; instr < end; instr++)
+    switch (instr->op)
+      {
+      case eop_dyn_var:
+        free_expand_instrs (instr->u.name->instrs, instr->u.name->ninstrs);
+        free (instr->u.name);
+        break;
+      case eop_func:
+        for (i = 0; i < instr->u.func.nargs; i++)
+          if (instr->u.func.args[i])
+            {
+              free_expand_instrs (instr->u.func.args[i]->instrs,
+                                  instr->u.func.args[i]->ninstrs);
+              free (instr->u.func.args[i]);
+            }
+        free (instr->u.func.args);
+        break;
+      case eop_func_raw:
+        free ((char *)instr->text);
+        free (instr->u.func.arg_offs);
+        break;
+      default:
+        break;
+      }
+}
+
+static void
+release_expand_prog (struct expand_prog *prog)
+{
+  if (--prog->refs == 0)
+    {
+      free_expand_instrs (prog->instrs, prog->ninstrs);
+      if (prog->text)
+        free (prog->text);
+      free (prog);
+    }
+}
+
+static struct expand_instr *
+emit_expand_instr (struct expand_compiler *c, enum expand_op op,
+                   const char *text, unsigned int len)
+{
+  struct expand_instr *instr;
+
+  if (c->ninstrs >= c->size)
+    {
+      c->size = c->size ? c->size * 2 : 8;
+      c->instrs = xrealloc (c->instrs, c->size * sizeof (c->instrs[0]));
+    }
+  instr = &c->instrs[c->ninstrs++];
+  memset (instr, 0, sizeof (*instr));
+  instr->op = op;
+  instr->text = text;
+  instr->len = len;
+  return instr;
+}
+
+/* Compiles the call to a builtin function at P (the opening paren), the
+   way handle_function2 parses it.  Returns the closing paren, or NULL if
+   the compiler should give up.  */
+
+static const char *
+compile_function_call (struct expand_compiler *c, const char *p,
+                       const char *eos, unsigned int name_len,
+                       make_function_ptr_t func_ptr, const char *fname,
+                       unsigned char min_args, unsigned char max_args,
+                       char expand_args)
+{
+  char openparen = *p;
+  char closeparen = openparen == '(' ? ')' : '}';
+  struct expand_instr *instr;
+  const char *beg;
+  const char *end;
+  int count = 0;
+  unsigned int nargs;
+
+  beg = next_token (p + 1 + name_len);
+  for (nargs = 1, end = beg; *end != '\0'; ++end)
+    if (*end == ',')
+      ++nargs;
+    else if (*end == openparen)
+      ++count;
+    else if (*end == closeparen && --count < 0)
+      break;
+  if (count >= 0 || end >= eos)
+    return 0;
+
+  if (expand_args)
+    {
+      struct expand_prog **args = xmalloc (sizeof (args[0]) * nargs);
+      const char *q;
+
+      for (q = beg, nargs = 0; q <= end; q++)
+        {
+          const char *next;
+
+          ++nargs;
+          if (nargs == max_args
+              || (! (next = find_next_argument (openparen, closeparen, q, end))))
+            next = end;
+
+          args[nargs - 1] = 0;
+          if (   q != next
+              && !(args[nargs - 1] = compile_expand_slice (q, next)))
+            break;
+          q = next;
+        }
+
+      if (q <= end || nargs < min_args)
+        {
+          while (nargs-- > 0)
+            if (args[nargs])
+              {
+                free_expand_instrs (args[nargs]->instrs, args[nargs]->ninstrs);
+                free (args[nargs]);
+              }
+          free (args);
+          return 0;
+        }
+
+      instr = emit_expand_instr (c, eop_func, p, end - p);
+      instr->u.func.args = args;
+    }
+  else
+    {
+      unsigned int len = end - beg;
+      unsigned int *offs;
+      char *abeg, *aend, *q;
+
+      if (nargs < min_args)
+        return 0; /* Can only get smaller, let handle_function2 complain.  */
+
+      abeg = xmalloc (len + 1);
+      memcpy (abeg, beg, len);
+      abeg[len] = '\0';
+      aend = abeg + len;
+      offs = xmalloc (sizeof (offs[0]) * nargs);
+
+      for (q = abeg, nargs = 0; q <= aend; ++q)
+        {
+          char *next;
+
+          ++nargs;
+          if (nargs == max_args
+              || (! (next = find_next_argument (openparen, closeparen, q, aend))))
+            next = aend;
+
+          offs[nargs - 1] = q - abeg;
+          *next = '\0';
+          q = next;
+        }
+
+      if (nargs < min_args)
+        {
+          free (offs);
+          free (abeg);
+          return 0;
+        }
+
+      instr = emit_expand_instr (c, eop_func_raw, abeg, len + 1);
+      instr->u.func.arg_offs = offs;
+    }
+
+  instr->u.func.func_ptr = func_ptr;
+  instr->u.func.name = fname;
+  instr->u.func.nargs = nargs;
+  return end;
+}
+
+/* Compiles the text STRING thru EOS the way variable_expand_string_2
+   would expand it.  Returns NULL if the compiler gives up.  */
+
+static struct expand_prog *
+compile_expand_slice (const char *string, const char *eos)
+{
+  struct expand_compiler c;
+  struct expand_prog *prog;
+  const char *p, *p1;
+
+  c.instrs = 0;
+  c.ninstrs = c.size = 0;
+
+  p = string;
+  p1 = memchr (p, '$', eos - p);
+  while (1)
+    {
+      if (p1 != p && p != eos)
+        emit_expand_instr (&c, eop_copy, p, (p1 != 0 ? p1 : eos) - p);
+      if (p1 == 0)
+        break;
+      p = p1 + 1;
+
+      /* A `$' ending the text makes variable_expand_string_2 look at the
+         character following the text, which isn't worth getting right.  */
+      if (p >= eos && *p != '\0')
+        goto give_up;
+
+      switch (*p)
+        {
+        case '$':
+          emit_expand_instr (&c, eop_copy, p, 1);
+          break;
+
+        case '(':
+        case '{':
+          {
+            char openparen = *p;
+            char closeparen = (openparen == '(') ? ')' : '}';
+            const char *beg = p + 1;
+            const char *end;
+
+            end = may_be_function_name (p + 1, eos);
+            if (end)
+              {
+                make_function_ptr_t func_ptr;
+                unsigned char min_args, max_args;
+                char expand_args;
+                const char *fname;
+
+                if (lookup_function_for_compiler (beg, end - beg, &func_ptr,
+                                                  &min_args, &max_args,
+                                                  &expand_args, &fname))
+                  {
+                    if (!func_ptr)
+                      goto give_up;
+                    p = compile_function_call (&c, p, eos, end - beg,
+                                               func_ptr, fname, min_args,
+                                               max_args, expand_args);
+                    if (!p)
+                      goto give_up;
+                    break;
+                  }
+              }
+
+            end = memchr (beg, closeparen, eos - beg);
+            if (end == 0)
+              goto give_up;
+            if (lindex (beg, end, '$') != 0)
+              {
+                struct expand_prog *name;
+                int count = 0;
+
+                for (p = beg; p < eos; ++p)
+                  {
+                    if (*p == openparen)
+                      ++count;
+                    else if (*p == closeparen && --count < 0)
+                      break;
+                  }
+                if (count >= 0)
+                  goto give_up;
+                name = compile_expand_slice (beg, p);
+                if (!name)
+                  goto give_up;
+                emit_expand_instr (&c, eop_dyn_var, beg, p - beg)->u.name = name;
+              }
+            else
+              {
+                p = end;
+                if (beg == end || lindex (beg, end, ':') != 0)
+                  emit_expand_instr (&c, eop_var_ref, beg, end - beg);
+                else
+                  emit_expand_instr (&c, eop_var,
+                                     strcache2_add (&variable_strcache, beg, end - beg),
+                                     end - beg);
+              }
+          }
+          break;
+
+        case '\0':
+          break;
+
+        default:
+          emit_expand_instr (&c, eop_var,
+                             strcache2_add (&variable_strcache, p, 1), 1);
+          break;
+        }
+
+      if (++p >= eos)
+        break;
+      p1 = memchr (p, '$', eos - p);
+    }
+
+  prog = xmalloc (sizeof (*prog)
+                  + sizeof (prog->instrs[0]) * (c.ninstrs ? c.ninstrs - 1 : 0));
+  prog->refs = 1;
+  prog->ninstrs = c.ninstrs;
+  prog->interpret = 0;
+  prog->text = 0;
+  prog->value = 0;
+  prog->value_length = 0;
+  if (c.ninstrs)
+    memcpy (prog->instrs, c.instrs, sizeof (c.instrs[0]) * c.ninstrs);
+  if (c.instrs)
+    free (c.instrs);
+  return prog;
+
+give_up:
+  free_expand_instrs (c.instrs, c.ninstrs);
+  if (c.instrs)
+    free (c.instrs);
+  return 0;
+}
+
+/* Compiles VALUE, VALUE_LENGTH chars long.  */
+
+static struct expand_prog *
+compile_expand_prog (const char *value, unsigned int value_length)
+{
+  struct expand_prog *prog;
+  char *text;
+
+  text = xmalloc (value_length + 1);
+  memcpy (text, value, value_length + 1);
+  prog = compile_expand_slice (text, text + value_length);
+  if (prog)
+    {
+      prog->text = text;
+      expand_prog_stats.compiled++;
+    }
+  else
+    {
+      free (text);
+      prog = xmalloc (sizeof (*prog));
+      prog->refs = 1;
+      prog->ninstrs = 0;
+      prog->interpret = 1;
+      prog->text = 0;
+      expand_prog_stats.interpreted++;
+    }
+  prog->value = value;
+  prog->value_length = value_length;
+  return prog;
+}
+
+static char *execute_expand_prog (char *o, const struct expand_prog *prog);
+
+/* Executes PROG into a new variable buffer which is returned, like
+   allocated_variable_expand_3 does.  */
+
+static char *
+expand_prog_to_new_buffer (const struct expand_prog *prog,
+                           unsigned int *value_lenp,
+                           unsigned int *buffer_lengthp)
+{
+  char *obuf = variable_buffer;
+  unsigned int olen = variable_buffer_length;
+  char *value;
+  char *o;
+
+  variable_buffer = 0;
+
+  o = execute_expand_prog (initialize_variable_output (), prog);
+  o = variable_buffer_output (o, "\0", 2) - 2;
+  value = variable_buffer;
+  if (value_lenp)
+    *value_lenp = o - value;
+  if (buffer_lengthp)
+    *buffer_lengthp = variable_buffer_length;
+
+  variable_buffer = obuf;
+  variable_buffer_length = olen;
+
+  return value;
+}
+
+static char *
+execute_expand_prog (char *o, const struct expand_prog *prog)
+{
+  const struct expand_instr *instr = &prog->instrs[0];
+  const struct expand_instr *end = instr + prog->ninstrs;
+
+  for (; instr < end; instr++)
+    switch (instr->op)
+      {
+      case eop_copy:
+        o = variable_buffer_output (o, instr->text, instr->len);
+        break;
+
+      case eop_var:
+        {
+          struct variable *v = lookup_variable_strcached (instr->text);
+
+          if (v == 0)
+            warn_undefined (instr->text, instr->len);
+          else if (*v->value != '\0' || v->append)
+            {
+              if (!v->recursive)
+                o = variable_buffer_output (o, v->value, v->value_length);
+              else
+                o = reference_recursive_variable (o, v);
+            }
+          break;
+        }
+
+      case eop_var_ref:
+        o = reference_variable_or_subst (o, instr->text,
+                                         instr->text + instr->len);
+        break;
+
+      case eop_dyn_var:
+        {
+          unsigned int len, alen;
+          char *name = expand_prog_to_new_buffer (instr->u.name, &len, &alen);
+
+          o = reference_variable_or_subst (o, name, name + len);
+          recycle_variable_buffer (name, alen);
+          break;
+        }
+
+      case eop_func:
+      case eop_func_raw:
+        {
+          unsigned int i, nargs = instr->u.func.nargs;
+          char **argv = alloca (sizeof (char *) * (nargs + 1));
+          char *abeg = 0;
+#ifdef CONFIG_WITH_EXPAND_PROFILER
+          int profiling = 0;
+          size_t profile_off = 0;
+
+          if (MY_PREDICT_FALSE (expand_profile_enabled)
+           && !is_func_call (instr->u.func.func_ptr))
+            {
+              profiling = 1;
+              profile_off = o - variable_buffer;
+              expand_profile_enter (NULL, instr->u.func.name);
+            }
+#endif
+
+          if (instr->op == eop_func)
+            for (i = 0; i < nargs; i++)
+              argv[i] = instr->u.func.args[i]
+                ? expand_prog_to_new_buffer (instr->u.func.args[i], NULL, NULL)
+                : xstrdup ("");
+          else
+            {
+              abeg = xmalloc (instr->len);
+              memcpy (abeg, instr->text, instr->len);
+              for (i = 0; i < nargs; i++)
+                argv[i] = abeg + instr->u.func.arg_offs[i];
+            }
+          argv[nargs] = 0;
+
+          o = instr->u.func.func_ptr (o, argv, instr->u.func.name);
+
+          if (!abeg)
+            for (i = 0; argv[i] != 0; i++)
+              free (argv[i]);
+          else
+            free (abeg);
+#ifdef CONFIG_WITH_EXPAND_PROFILER
+          if (MY_PREDICT_FALSE (profiling))
+            expand_profile_leave ((long)(o - variable_buffer - profile_off));
+#endif
+          break;
+        }
+      }
+
+  return o;
+}
+
+/* Returns the expansion program for the recursive variable V, compiling
+   it on the second expansion, or NULL if variable_expand_string_2 should
+   expand the value.  */
+
+static struct expand_prog *
+variable_expand_prog (struct variable *v)
+{
+  struct expand_prog *prog = v->expandprog;
+
+  if (prog)
+    {
+      if (MY_PREDICT_TRUE (   prog->value == v->value
+                           && prog->value_length == v->value_length))
+        return !prog->interpret ? prog : 0;
+      /* Someone forgot VARIABLE_CHANGED.  */
+      variable_expand_prog_changed (v);
+    }
+  else if (v->expand_count < 1)
+    {
+      v->expand_count++;
+      return 0;
+    }
+
+  prog = compile_expand_prog (v->value, v->value_length);
+  v->expandprog = prog;
+  return !prog->interpret ? prog : 0;
+}
+
+/* Executes PROG into the variable buffer at O and returns the end of the
+   output like variable_expand_string_2 does.  */
+
+static char *
+reference_expand_prog (char *o, struct expand_prog *prog)
+{
+  prog->refs++;
+  expand_prog_stats.executions++;
+  o = execute_expand_prog (o, prog);
+  o = variable_buffer_output (o, "\0", 2) - 2;
+  release_expand_prog (prog);
+  return o;
+}
+
+/* Executes PROG into a new buffer like allocated_variable_expand_2.  */
+
+static char *
+allocated_expand_prog (struct expand_prog *prog, unsigned int *value_lenp)
+{
+  char *value;
+
+  prog->refs++;
+  expand_prog_stats.executions++;
+  value = expand_prog_to_new_buffer (prog, value_lenp, NULL);
+  release_expand_prog (prog);
+  return value;
+}
+
+/* Drops the expansion program of V after its value changed.  The program
+   lives on until any executions of it have finished.  */
+
+void
+variable_expand_prog_changed (struct variable *v)
+{
+  struct expand_prog *prog = v->expandprog;
+
+  v->expandprog = 0;
+  expand_prog_stats.dropped++;
+  release_expand_prog (prog);
+}
+
+#ifdef CONFIG_WITH_PRINT_STATS_SWITCH
+void
+print_expand_prog_stats (void)
+{
+  printf (_("\n# Expansion programs: %u compiled, %u left to the interpreter, %u dropped, %lu executions\n"),
+          expand_prog_stats.compiled, expand_prog_stats.interpreted,
+          expand_prog_stats.dropped, expand_prog_stats.executions);
+}
+#endif
+#endif /* CONFIG_WITH_COMPILER */
+
 
 /* Scan LINE for variable references and expansion-function calls.
    Build in `variable_buffer' the result of expanding the references and calls.
@@ -1048,6 +1712,7 @@ append_expanded_string_to_variable (struct variable *v, const char *value,
       v->value = variable_buffer;
       v->value_length = p - v->value;
       v->value_alloc_len = variable_buffer_length;
+      VARIABLE_CHANGED (v);
 
       /* Restore the variable buffer, but without freeing the current. */
       variable_buffer = NULL;
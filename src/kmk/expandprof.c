@@ -0,0 +1,452 @@
+#ifdef CONFIG_WITH_EXPAND_PROFILER
+/* $Id$ */
+/** @file
+ * expandprof - Function and user variable expansion profiler.
+ *
+ * When --profile=FILE is given, every builtin function invocation and every
+ * user variable expanded thru $(call)/$(evalcall)/$(evalcall2) is recorded
+ * in a call tree rooted at the makefile being read (or the recipes) at the
+ * time.  Each node keeps the call count, the inclusive and exclusive time
+ * and the number of bytes produced.  At exit the tree is written to FILE in
+ * the folded stack format used by the flame graph tools, one line per node
+ * with the exclusive time in nano seconds, and a summary of the most
+ * expensive functions and variables is printed.
+ *
+ * When the profiler is off the only cost is a test of
+ * expand_profile_enabled in the callers.
+ */
+
+/*
+ * Copyright (c) 2026 The kBuild contributors
+ *
+ * This file is part of kBuild.
+ *
+ * kBuild is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * kBuild is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with kBuild.  If not, see <http://www.gnu.org/licenses/>
+ *
+ */
+
+/*******************************************************************************
+*   Header Files                                                               *
+*******************************************************************************/
+#include "make.h"
+#include <assert.h>
+#include "hash.h"
+
+
+/*******************************************************************************
+*   Structures and Typedefs                                                    *
+*******************************************************************************/
+/* A node in the call tree.  KIND is NULL for builtin functions, the name of
+   the calling function ("call", "evalcall", ...) for user variables and
+   "file" for the roots.  NAME is the function, variable or makefile name.  */
+struct expand_profile_node
+{
+  struct expand_profile_node *parent;
+  struct expand_profile_node *children;
+  struct expand_profile_node *next;
+  const char *kind;
+  const char *name;
+  unsigned long calls;
+  big_int bytes;
+  big_int inclusive;
+  big_int exclusive;
+};
+
+/* An active invocation. */
+struct expand_profile_frame
+{
+  struct expand_profile_node *node;
+  big_int start;
+  big_int children;             /* Time spent in callees. */
+};
+
+/* The per name totals for the summary. */
+struct expand_profile_total
+{
+  const char *kind;
+  const char *name;
+  unsigned long calls;
+  big_int bytes;
+  big_int inclusive;
+  big_int exclusive;
+};
+
+
+/*******************************************************************************
+*   Global Variables                                                           *
+*******************************************************************************/
+/* Whether the profiler is active, checked by the callers. */
+int expand_profile_enabled;
+
+/* The file to write the folded stacks to and the summary length. */
+static const char *expand_profile_filename;
+static unsigned int expand_profile_top;
+
+/* The invisible root of the call tree; its children are the makefiles. */
+static struct expand_profile_node expand_profile_root;
+
+/* The stack of active invocations. */
+static struct expand_profile_frame *expand_profile_frames;
+static unsigned int expand_profile_depth;
+static unsigned int expand_profile_max_depth;
+
+/* The number of nodes in the tree. */
+static unsigned int expand_profile_nodes;
+
+/* The nodes below the makefile roots, hashed on parent, kind and name. */
+static struct hash_table expand_profile_node_table;
+
+
+static unsigned long
+expand_profile_node_hash_1 (const void *key)
+{
+  const struct expand_profile_node *node = (const struct expand_profile_node *)key;
+  return ((size_t)node->parent >> 3) ^ ((size_t)node->name >> 3) ^ ((size_t)node->kind >> 3);
+}
+
+static unsigned long
+expand_profile_node_hash_2 (const void *key)
+{
+  const struct expand_profile_node *node = (const struct expand_profile_node *)key;
+  return (((size_t)node->parent >> 6) ^ ((size_t)node->name >> 6) ^ ((size_t)node->kind >> 6)) | 1;
+}
+
+static int
+expand_profile_node_hash_cmp (const void *x, const void *y)
+{
+  const struct expand_profile_node *n1 = (const struct expand_profile_node *)x;
+  const struct expand_profile_node *n2 = (const struct expand_profile_node *)y;
+  if (n1->parent != n2->parent)
+    return n1->parent < n2->parent ? -1 : 1;
+  if (n1->name != n2->name)
+    return n1->name < n2->name ? -1 : 1;
+  if (n1->kind != n2->kind)
+    return n1->kind < n2->kind ? -1 : 1;
+  return 0;
+}
+
+/* Turns on the profiler, writing the results to FILENAME at exit and
+   printing the TOP most expensive entries.  */
+
+void
+expand_profile_start (const char *filename, unsigned int top)
+{
+  expand_profile_filename = filename;
+  expand_profile_top = top;
+  expand_profile_max_depth = 64;
+  expand_profile_frames = xmalloc (expand_profile_max_depth
+                                   * sizeof (expand_profile_frames[0]));
+  hash_init (&expand_profile_node_table, 4096, expand_profile_node_hash_1,
+             expand_profile_node_hash_2, expand_profile_node_hash_cmp);
+  expand_profile_enabled = 1;
+}
+
+/* Finds or adds the child of PARENT for KIND and NAME.  The names are
+   either constant or strcached, so pointer compares are sufficient except
+   for the makefile roots.  There are few of those, the rest are looked up
+   in expand_profile_node_table.  */
+
+static struct expand_profile_node *
+expand_profile_child (struct expand_profile_node *parent, const char *kind,
+                      const char *name)
+{
+  struct expand_profile_node **slot = 0;
+  struct expand_profile_node *node;
+
+  if (parent == &expand_profile_root)
+    {
+      for (node = parent->children; node; node = node->next)
+        if (node->name == name || !strcmp (node->name, name))
+          return node;
+    }
+  else
+    {
+      struct expand_profile_node key;
+      key.parent = parent;
+      key.kind = kind;
+      key.name = name;
+      slot = (struct expand_profile_node **)
+        hash_find_slot (&expand_profile_node_table, &key);
+      if (!HASH_VACANT (*slot))
+        return *slot;
+    }
+
+  node = xmalloc (sizeof (*node));
+  memset (node, 0, sizeof (*node));
+  node->parent = parent;
+  node->kind = kind;
+  node->name = name;
+  node->next = parent->children;
+  parent->children = node;
+  if (slot)
+    hash_insert_at (&expand_profile_node_table, node, slot);
+  expand_profile_nodes++;
+  return node;
+}
+
+/* Called before a builtin function (KIND is NULL) or a user variable
+   (KIND is the calling function) called NAME is expanded.  */
+
+void
+expand_profile_enter (const char *kind, const char *name)
+{
+  struct expand_profile_node *parent;
+  struct expand_profile_frame *frame;
+
+  if (expand_profile_depth)
+    parent = expand_profile_frames[expand_profile_depth - 1].node;
+  else
+    parent = expand_profile_child (&expand_profile_root, "file",
+                                   reading_file && reading_file->filenm
+                                   ? reading_file->filenm : "(commands)");
+
+  if (expand_profile_depth >= expand_profile_max_depth)
+    {
+      expand_profile_max_depth *= 2;
+      expand_profile_frames = xrealloc (expand_profile_frames,
+                                        expand_profile_max_depth
+                                        * sizeof (expand_profile_frames[0]));
+    }
+
+  frame = &expand_profile_frames[expand_profile_depth++];
+  frame->node = expand_profile_child (parent, kind, name);
+  frame->children = 0;
+  frame->start = nano_timestamp ();
+}
+
+/* Called when the expansion started by the matching expand_profile_enter
+   call is done.  BYTES is what it added to the variable buffer.  */
+
+void
+expand_profile_leave (long bytes)
+{
+  big_int elapsed = nano_timestamp ();
+  struct expand_profile_frame *frame;
+  struct expand_profile_node *node;
+
+  assert (expand_profile_depth > 0);
+  frame = &expand_profile_frames[--expand_profile_depth];
+  node = frame->node;
+  elapsed -= frame->start;
+
+  node->calls++;
+  if (bytes > 0)
+    node->bytes += bytes;
+  node->inclusive += elapsed;
+  node->exclusive += elapsed - frame->children;
+
+  /* The makefile roots are charged with the outermost invocations. */
+  if (expand_profile_depth)
+    expand_profile_frames[expand_profile_depth - 1].children += elapsed;
+  else
+    node->parent->inclusive += elapsed;
+}
+
+/* Writes the name of NODE to OUT, replacing the folded format separator. */
+
+static void
+expand_profile_write_name (FILE *out, struct expand_profile_node *node)
+{
+  const char *psz;
+
+  if (node->kind && node->parent != &expand_profile_root)
+    fprintf (out, "%s:", node->kind);
+  for (psz = node->name; *psz; psz++)
+    putc (*psz != ';' ? *psz : '_', out);
+}
+
+/* Writes a folded stack line for NODE and all its descendants. */
+
+static void
+expand_profile_write_folded (FILE *out, struct expand_profile_node *node)
+{
+  struct expand_profile_node *child;
+
+  if (node->exclusive > 0)
+    {
+      struct expand_profile_node *stack[256];
+      unsigned int depth = 0;
+      struct expand_profile_node *cur;
+
+      for (cur = node; cur != &expand_profile_root; cur = cur->parent)
+        if (depth < sizeof (stack) / sizeof (stack[0]))
+          stack[depth++] = cur;
+      while (depth-- > 0)
+        {
+          expand_profile_write_name (out, stack[depth]);
+          putc (depth ? ';' : ' ', out);
+        }
+      fprintf (out, "%lu\n", (unsigned long)node->exclusive);
+    }
+
+  for (child = node->children; child; child = child->next)
+    expand_profile_write_folded (out, child);
+}
+
+/* The totals are hashed on the name and kind pointers, see
+   expand_profile_child for why that is sufficient below the roots.  */
+
+static unsigned long
+expand_profile_total_hash_1 (const void *key)
+{
+  const struct expand_profile_total *total = (const struct expand_profile_total *)key;
+  return ((size_t)total->name >> 3) ^ ((size_t)total->kind >> 3);
+}
+
+static unsigned long
+expand_profile_total_hash_2 (const void *key)
+{
+  const struct expand_profile_total *total = (const struct expand_profile_total *)key;
+  return (((size_t)total->name >> 6) ^ ((size_t)total->kind >> 6)) | 1;
+}
+
+static int
+expand_profile_total_hash_cmp (const void *x, const void *y)
+{
+  const struct expand_profile_total *t1 = (const struct expand_profile_total *)x;
+  const struct expand_profile_total *t2 = (const struct expand_profile_total *)y;
+  if (t1->name != t2->name)
+    return t1->name < t2->name ? -1 : 1;
+  if (t1->kind != t2->kind)
+    return t1->kind < t2->kind ? -1 : 1;
+  return 0;
+}
+
+/* Adds NODE and its descendants to the TOTALS, using TABLE to find the
+   entry for a name.  The inclusive time is only added for the outermost
+   invocation of recursive functions.  */
+
+static void
+expand_profile_sum (struct expand_profile_node *node,
+                    struct expand_profile_total *totals, unsigned int *countp,
+                    struct hash_table *table)
+{
+  struct expand_profile_node *child;
+  struct expand_profile_node *cur;
+  struct expand_profile_total key;
+  struct expand_profile_total **slot;
+  struct expand_profile_total *total;
+
+  key.kind = node->kind;
+  key.name = node->name;
+  slot = (struct expand_profile_total **) hash_find_slot (table, &key);
+  if (HASH_VACANT (*slot))
+    {
+      total = &totals[(*countp)++];
+      memset (total, 0, sizeof (*total));
+      total->kind = node->kind;
+      total->name = node->name;
+      hash_insert_at (table, total, slot);
+    }
+  else
+    total = *slot;
+
+  total->calls += node->calls;
+  total->bytes += node->bytes;
+  total->exclusive += node->exclusive;
+  for (cur = node->parent; cur; cur = cur->parent)
+    if (cur->name == node->name && cur->kind == node->kind)
+      break;
+  if (!cur)
+    total->inclusive += node->inclusive;
+
+  for (child = node->children; child; child = child->next)
+    expand_profile_sum (child, totals, countp, table);
+}
+
+/* qsort callback ordering the totals by descending exclusive time. */
+
+static int
+expand_profile_compare (const void *pv1, const void *pv2)
+{
+  const struct expand_profile_total *t1 = (const struct expand_profile_total *)pv1;
+  const struct expand_profile_total *t2 = (const struct expand_profile_total *)pv2;
+  if (t1->exclusive != t2->exclusive)
+    return t1->exclusive > t2->exclusive ? -1 : 1;
+  return t1->calls > t2->calls ? -1 : t1->calls < t2->calls;
+}
+
+/* Called at exit.  Writes the folded stacks and prints the summary. */
+
+void
+expand_profile_finish (void)
+{
+  struct expand_profile_total *totals;
+  struct hash_table table;
+  struct expand_profile_node *root;
+  unsigned int count = 0;
+  unsigned int i;
+  unsigned long calls = 0;
+  big_int total = 0;
+  FILE *out;
+
+  if (!expand_profile_enabled)
+    return;
+  expand_profile_enabled = 0;
+
+  /* Unwind whatever is active if we're dying in the middle of something. */
+  while (expand_profile_depth > 0)
+    expand_profile_leave (0);
+
+  out = fopen (expand_profile_filename, "w");
+  if (!out)
+    perror_with_name (_("writing profile: "), expand_profile_filename);
+  else
+    {
+      for (root = expand_profile_root.children; root; root = root->next)
+        expand_profile_write_folded (out, root);
+      if (fclose (out) != 0)
+        perror_with_name (_("writing profile: "), expand_profile_filename);
+    }
+
+  /* The summary skips the makefile roots. */
+  totals = xmalloc ((expand_profile_nodes + 1) * sizeof (totals[0]));
+  hash_init (&table, expand_profile_nodes + 1, expand_profile_total_hash_1,
+             expand_profile_total_hash_2, expand_profile_total_hash_cmp);
+  for (root = expand_profile_root.children; root; root = root->next)
+    {
+      struct expand_profile_node *child;
+      total += root->inclusive;
+      for (child = root->children; child; child = child->next)
+        expand_profile_sum (child, totals, &count, &table);
+    }
+  hash_free (&table, 0);
+  for (i = 0; i < count; i++)
+    calls += totals[i].calls;
+  qsort (totals, count, sizeof (totals[0]), expand_profile_compare);
+
+  {
+    char buf[64];
+    format_elapsed_nano (buf, sizeof (buf), total);
+    printf (_("\n# Expansion profile: %lu calls, %s, %u stacks written to `%s'\n"),
+            calls, buf, expand_profile_nodes, expand_profile_filename);
+  }
+  printf (_("#  exclusive   inclusive      calls        bytes  name\n"));
+  for (i = 0; i < count && i < expand_profile_top; i++)
+    {
+      char excl[64];
+      char incl[64];
+      format_elapsed_nano (excl, sizeof (excl), totals[i].exclusive);
+      format_elapsed_nano (incl, sizeof (incl), totals[i].inclusive);
+      printf ("# %10s  %10s %10lu %12lu  %s%s%s\n", excl, incl, totals[i].calls,
+              (unsigned long)totals[i].bytes,
+              totals[i].kind ? totals[i].kind : "",
+              totals[i].kind ? ":" : "",
+              totals[i].name);
+    }
+
+  free (totals);
+}
+
+#endif /* CONFIG_WITH_EXPAND_PROFILER */
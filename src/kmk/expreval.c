@@ -40,6 +40,9 @@
 #include "rule.h"
 #include "debug.h"
 #include "hash.h"
+#ifdef CONFIG_WITH_STRCACHE2
+# include "strcache2.h"
+#endif
 #include <ctype.h>
 #ifndef _MSC_VER
 # include <stdint.h>
@@ -58,6 +61,16 @@
 /** The max operand depth. */
 #define EXPR_MAX_OPERANDS   128
 
+/** Cache the tokens of each expression, keyed by the (unexpanded) text.
+ * Conditionals in loops and in templates evaluated for every target will
+ * then only be parsed once. */
+#ifdef CONFIG_WITH_STRCACHE2
+# define EXPR_WITH_CACHE
+#endif
+/** The max number of cached expressions. Once reached, new expressions
+ * are parsed every time. */
+#define EXPR_CACHE_MAX_PROGS 16384
+
 
 /*******************************************************************************
 *   Structures and Typedefs                                                    *
@@ -151,6 +164,43 @@ typedef struct
 /** Pointer to a const operator. */
 typedef EXPROP const *PCEXPROP;
 
+#ifdef EXPR_WITH_CACHE
+/**
+ * A token in a cached expression.
+ */
+typedef struct EXPRTOKEN
+{
+    /** The operator, NULL if it's an operand. */
+    PCEXPROP    pOp;
+    /** The operand type, the '$' check has been done. */
+    EXPRVARTYPE enmType;
+    /** The length of the operand string. */
+    unsigned    cch;
+    /** The operand string, this points into the cached expression text. */
+    const char *psz;
+} EXPRTOKEN;
+/** Pointer to a const token. */
+typedef EXPRTOKEN const *PCEXPRTOKEN;
+
+/**
+ * A cached expression.
+ *
+ * The tokens are in the order the evaluator asked for them the first time
+ * around. Since the evaluator only looks at the token types and operator
+ * precedences when deciding what to ask for next, it will ask for the same
+ * sequence when evaluating the expression again.
+ */
+typedef struct EXPRPROG
+{
+    /** The number of tokens. */
+    unsigned    cTokens;
+    /** The tokens. */
+    EXPRTOKEN   aTokens[1];
+} EXPRPROG;
+/** Pointer to a const cached expression. */
+typedef EXPRPROG const *PCEXPRPROG;
+#endif /* EXPR_WITH_CACHE */
+
 /**
  * Expression evaluator instance.
  */
@@ -172,6 +222,18 @@ typedef struct EXPR
     PCEXPROP apOps[EXPR_MAX_OPERATORS];
     /** The operand stack. */
     EXPRVAR aVars[EXPR_MAX_OPERANDS];
+#ifdef EXPR_WITH_CACHE
+    /** The cached expression we're taking the tokens from, NULL if parsing. */
+    PCEXPRPROG pProg;
+    /** The index of the next token in pProg. */
+    unsigned iToken;
+    /** The tokens recorded while parsing, NULL if not recording. */
+    EXPRTOKEN *paRecTokens;
+    /** The number of recorded tokens. */
+    unsigned cRecTokens;
+    /** The size of the paRecTokens allocation. */
+    unsigned cRecTokensAlloc;
+#endif
 } EXPR;
 
 
@@ -184,6 +246,19 @@ static char g_auchOpStartCharMap[256];
 /** Whether we've initialized the map. */
 static int g_fExprInitializedMap = 0;
 
+#ifdef EXPR_WITH_CACHE
+/** The cached expressions, the user value of each string is its EXPRPROG. */
+static struct strcache2 g_ExprCache;
+/** Whether g_ExprCache has been initialized. */
+static int g_fExprCacheInitialized = 0;
+/** The number of cached expressions. */
+static unsigned g_cExprCacheProgs = 0;
+/** The number of evaluations using a cached expression. */
+static unsigned long g_cExprCacheHits = 0;
+/** The number of evaluations that had to parse the expression. */
+static unsigned long g_cExprCacheMisses = 0;
+#endif
+
 
 /*******************************************************************************
 *   Internal Functions                                                         *
@@ -469,6 +544,23 @@ static void expr_var_init_substring(PEXPRVAR pVar, const char *psz, size_t cch,
 }
 
 
+#ifdef EXPR_WITH_CACHE
+/**
+ * Initializes a new variable with the value of a cached operand.
+ *
+ * @param   pVar    The new variable.
+ * @param   pToken  The operand token.
+ */
+static void expr_var_init_token(PEXPRVAR pVar, PCEXPRTOKEN pToken)
+{
+    pVar->enmType = pToken->enmType;
+    pVar->uVal.psz = xmalloc(pToken->cch + 1);
+    memcpy(pVar->uVal.psz, pToken->psz, pToken->cch);
+    pVar->uVal.psz[pToken->cch] = '\0';
+}
+#endif /* EXPR_WITH_CACHE */
+
+
 #if 0  /* unused */
 /**
  * Initializes a new variables with a string value.
@@ -1723,6 +1815,44 @@ static PCEXPROP expr_lookup_op(char const *psz, unsigned char uchVal, int fUnary
 }
 
 
+#ifdef EXPR_WITH_CACHE
+/**
+ * Records a token if we're recording.
+ *
+ * @param   pThis       The evaluator instance.
+ * @param   pOp         The operator, NULL if operand.
+ * @param   pVar        The operand variable if pOp is NULL.
+ * @param   psz         The operand string if pOp is NULL.
+ * @param   cch         The length of the operand string.
+ */
+static void expr_record_token(PEXPR pThis, PCEXPROP pOp, PCEXPRVAR pVar, const char *psz, size_t cch)
+{
+    EXPRTOKEN *pToken;
+    if (!pThis->paRecTokens)
+        return;
+    if (pThis->cRecTokens >= pThis->cRecTokensAlloc)
+    {
+        pThis->cRecTokensAlloc *= 2;
+        pThis->paRecTokens = xrealloc(pThis->paRecTokens, pThis->cRecTokensAlloc * sizeof(pThis->paRecTokens[0]));
+    }
+    pToken = &pThis->paRecTokens[pThis->cRecTokens++];
+    pToken->pOp = pOp;
+    if (!pOp)
+    {
+        pToken->enmType = pVar->enmType;
+        pToken->cch = (unsigned)cch;
+        pToken->psz = psz;
+    }
+    else
+    {
+        pToken->enmType = kExprVar_Invalid;
+        pToken->cch = 0;
+        pToken->psz = NULL;
+    }
+}
+#endif /* EXPR_WITH_CACHE */
+
+
 /**
  * Ungets a binary operator.
  *
@@ -1764,6 +1894,13 @@ static EXPRRET expr_get_binary_or_eoe_or_rparen(PEXPR pThis)
     PCEXPROP pOp = pThis->pPending;
     if (pOp)
         pThis->pPending = NULL;
+#ifdef EXPR_WITH_CACHE
+    else if (pThis->pProg)
+    {
+        pOp = pThis->pProg->aTokens[pThis->iToken++].pOp;
+        assert(pOp);
+    }
+#endif
     else
     {
         /*
@@ -1790,6 +1927,9 @@ static EXPRRET expr_get_binary_or_eoe_or_rparen(PEXPR pThis)
         else
             pOp = &g_ExprEndOfExpOp;
         pThis->psz = psz;
+#ifdef EXPR_WITH_CACHE
+        expr_record_token(pThis, pOp, NULL, NULL, 0);
+#endif
     }
 
     /*
@@ -1833,6 +1973,25 @@ static EXPRRET expr_get_unary_or_operand(PEXPR pThis)
     PCEXPROP      pOp;
     char const   *psz = pThis->psz;
 
+#ifdef EXPR_WITH_CACHE
+    /*
+     * Take the next token from the cached expression?
+     */
+    if (pThis->pProg)
+    {
+        PCEXPRTOKEN pToken = &pThis->pProg->aTokens[pThis->iToken++];
+        if (pToken->pOp)
+        {
+            assert(pThis->iOp < EXPR_MAX_OPERATORS - 1);
+            pThis->apOps[++pThis->iOp] = pToken->pOp;
+            return kExprRet_Operator;
+        }
+        assert(pThis->iVar < EXPR_MAX_OPERANDS - 1);
+        expr_var_init_token(&pThis->aVars[++pThis->iVar], pToken);
+        return kExprRet_Ok;
+    }
+#endif
+
     /*
      * Eat white space and make sure there is something after it.
      */
@@ -1860,6 +2019,9 @@ static EXPRRET expr_get_unary_or_operand(PEXPR pThis)
         {
             pThis->apOps[++pThis->iOp] = pOp;
             rc = kExprRet_Operator;
+#ifdef EXPR_WITH_CACHE
+            expr_record_token(pThis, pOp, NULL, NULL, 0);
+#endif
         }
         else
         {
@@ -1883,6 +2045,9 @@ static EXPRRET expr_get_unary_or_operand(PEXPR pThis)
             while (*psz && *psz != '"')
                 psz++;
             expr_var_init_substring(&pThis->aVars[++pThis->iVar], pszStart, psz - pszStart, kExprVar_QuotedString);
+#ifdef EXPR_WITH_CACHE
+            expr_record_token(pThis, NULL, &pThis->aVars[pThis->iVar], pszStart, psz - pszStart);
+#endif
             if (*psz)
                 psz++;
         }
@@ -1892,6 +2057,9 @@ static EXPRRET expr_get_unary_or_operand(PEXPR pThis)
             while (*psz && *psz != '\'')
                 psz++;
             expr_var_init_substring(&pThis->aVars[++pThis->iVar], pszStart, psz - pszStart, kExprVar_QuotedSimpleString);
+#ifdef EXPR_WITH_CACHE
+            expr_record_token(pThis, NULL, &pThis->aVars[pThis->iVar], pszStart, psz - pszStart);
+#endif
             if (*psz)
                 psz++;
         }
@@ -1943,7 +2111,12 @@ static EXPRRET expr_get_unary_or_operand(PEXPR pThis)
             }
 
             if (rc == kExprRet_Ok)
+            {
                 expr_var_init_substring(&pThis->aVars[++pThis->iVar], pszStart, psz - pszStart, kExprVar_String);
+#ifdef EXPR_WITH_CACHE
+                expr_record_token(pThis, NULL, &pThis->aVars[pThis->iVar], pszStart, psz - pszStart);
+#endif
+            }
         }
     }
     else
@@ -2042,6 +2215,9 @@ static void expr_destroy(PEXPR pThis)
         expr_var_delete(pThis->aVars);
         pThis->iVar--;
     }
+#ifdef EXPR_WITH_CACHE
+    free(pThis->paRecTokens);
+#endif
     free(pThis);
 }
 
@@ -2063,12 +2239,99 @@ static PEXPR expr_create(char const *pszExpr)
     pThis->pPending = NULL;
     pThis->iVar = -1;
     pThis->iOp = -1;
+#ifdef EXPR_WITH_CACHE
+    pThis->pProg = NULL;
+    pThis->iToken = 0;
+    pThis->paRecTokens = NULL;
+    pThis->cRecTokens = 0;
+    pThis->cRecTokensAlloc = 0;
+#endif
 
     expr_map_init();
     return pThis;
 }
 
 
+#ifdef EXPR_WITH_CACHE
+/**
+ * Instantiates an expression evaluator for an expression that may be cached.
+ *
+ * If the expression is in the cache, the evaluator will take the tokens
+ * from there instead of parsing the text. Otherwise it will record the
+ * tokens for expr_cache_commit.
+ *
+ * @returns The instance.
+ *
+ * @param   pszExpr     What to parse.
+ */
+static PEXPR expr_create_cached(char const *pszExpr)
+{
+    PEXPR pThis;
+    const char *pszCached;
+    unsigned cchExpr = (unsigned)strlen(pszExpr);
+
+    if (!g_fExprCacheInitialized)
+    {
+        strcache2_init(&g_ExprCache, "expr", 1024, 0, 0, 0);
+        g_fExprCacheInitialized = 1;
+    }
+    if (g_cExprCacheProgs < EXPR_CACHE_MAX_PROGS)
+        pszCached = strcache2_add(&g_ExprCache, pszExpr, cchExpr);
+    else
+        pszCached = strcache2_lookup(&g_ExprCache, pszExpr, cchExpr);
+
+    if (!pszCached)
+    {
+        g_cExprCacheMisses++;
+        return expr_create(pszExpr);
+    }
+
+    /* Parse the cached copy of the string so the recorded operands can
+       point into it. */
+    pThis = expr_create(pszCached);
+    pThis->pProg = (PCEXPRPROG)strcache2_get_user_val(&g_ExprCache, pszCached);
+    if (pThis->pProg)
+        g_cExprCacheHits++;
+    else
+    {
+        g_cExprCacheMisses++;
+        pThis->cRecTokensAlloc = 16;
+        pThis->paRecTokens = xmalloc(pThis->cRecTokensAlloc * sizeof(pThis->paRecTokens[0]));
+    }
+    return pThis;
+}
+
+
+/**
+ * Puts the recorded tokens into the cache after a successful evaluation.
+ *
+ * @param   pThis       The evaluator instance.
+ */
+static void expr_cache_commit(PEXPR pThis)
+{
+    EXPRPROG *pProg;
+    if (!pThis->paRecTokens)
+        return;
+
+    /* A nested evaluation of the same expression may have beaten us to it. */
+    if (!strcache2_get_user_val(&g_ExprCache, pThis->pszExpr))
+    {
+        pProg = xmalloc(sizeof(*pProg) + pThis->cRecTokens * sizeof(pProg->aTokens[0]));
+        pProg->cTokens = pThis->cRecTokens;
+        memcpy(pProg->aTokens, pThis->paRecTokens, pThis->cRecTokens * sizeof(pProg->aTokens[0]));
+        strcache2_set_user_val(&g_ExprCache, pThis->pszExpr, pProg);
+        g_cExprCacheProgs++;
+    }
+
+    free(pThis->paRecTokens);
+    pThis->paRecTokens = NULL;
+}
+#else  /* !EXPR_WITH_CACHE */
+# define expr_create_cached(pszExpr)    expr_create(pszExpr)
+# define expr_cache_commit(pThis)       do { } while (0)
+#endif /* !EXPR_WITH_CACHE */
+
+
 /**
  * Evaluates the given if expression.
  *
@@ -2087,10 +2350,12 @@ int expr_eval_if_conditionals(const char *line, const struct floc *flocp)
      * it have a go at it.
      */
     int rc = -1;
-    PEXPR pExpr = expr_create(line);
+    PEXPR pExpr = expr_create_cached(line);
     pExpr->pFileLoc = flocp;
     if (expr_eval(pExpr) >= kExprRet_Ok)
     {
+        expr_cache_commit(pExpr);
+
         /*
          * Convert the result (on top of the stack) to boolean and
          * set our return value accordingly.
@@ -2120,9 +2385,11 @@ char *expr_eval_to_string(char *o, const char *expr)
      * Instantiate the expression evaluator and let
      * it have a go at it.
      */
-    PEXPR pExpr = expr_create(expr);
+    PEXPR pExpr = expr_create_cached(expr);
     if (expr_eval(pExpr) >= kExprRet_Ok)
     {
+        expr_cache_commit(pExpr);
+
         /*
          * Convert the result (on top of the stack) to a string
          * and copy it out the variable buffer.
@@ -2139,5 +2406,19 @@ char *expr_eval_to_string(char *o, const char *expr)
 }
 
 
+#if defined(CONFIG_WITH_PRINT_STATS_SWITCH) && defined(EXPR_WITH_CACHE)
+/**
+ * Prints the expression cache statistics.
+ */
+void print_expr_stats(void)
+{
+    if (!g_cExprCacheHits && !g_cExprCacheMisses)
+        return;
+    printf(_("\n# expreval: %u cached expressions, %lu hits, %lu misses\n"),
+           g_cExprCacheProgs, g_cExprCacheHits, g_cExprCacheMisses);
+}
+#endif
+
+
 #endif /* CONFIG_WITH_IF_CONDITIONALS */
 
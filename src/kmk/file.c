@@ -241,6 +241,9 @@ enter_file (const char *name)
     {
       new->last = new;
       hash_insert_at (&files, new, file_slot);
+#ifdef CONFIG_WITH_VPATH_CACHE
+      vpath_cache_file_entered (name);
+#endif
     }
   else
     {
@@ -318,6 +321,9 @@ rehash_file (struct file *from_file, const char *to_hname)
   if (HASH_VACANT (to_file))
     {
       hash_insert_at (&files, from_file, file_slot);
+#ifdef CONFIG_WITH_VPATH_CACHE
+      vpath_cache_file_entered (to_hname);
+#endif
       return;
     }
 
@@ -1285,6 +1291,17 @@ print_file_stats (void)
 }
 #endif
 
+#if defined (CONFIG_WITH_MAKEFILE_SNAPSHOT) || defined (CONFIG_WITH_SERVER)
+/* Calls FUNC for each entry in the file hash table (the double-colon
+   chains are not walked).  Used by snapshot_save and server_run.  */
+
+void
+map_file_data_base (hash_map_arg_func_t func, void *arg)
+{
+  hash_map_arg (&files, func, arg);
+}
+#endif
+
 /* Verify the integrity of the data base of files.  */
 
 #define VERIFY_CACHED(_p,_n) \
@@ -1384,6 +1401,9 @@ init_hash_files (void)
                        offsetof (struct file, hname));
 # endif
 #endif /* CONFIG_WITH_STRCACHE2 */
+#ifdef CONFIG_WITH_HASH_TAGS
+  hash_enable_tags (&files);
+#endif
 }
 
 /* EOF */
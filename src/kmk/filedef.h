@@ -116,6 +116,19 @@ struct file
                                   can receive this is decided at parse time,
                                   and the expanding done in snap_deps. */
 #endif
+#ifdef CONFIG_WITH_STAT_PREFETCH
+    unsigned int stat_prefetched:1; /* Nonzero if prefetch_goal_mtimes has
+                                   visited this file.  */
+#endif
+#ifdef CONFIG_WITH_SERVER
+    unsigned int server_queued:1; /* Nonzero if the server is going to
+                                   get the timestamp again.  */
+#endif
+#ifdef CONFIG_WITH_CRITICAL_PATH
+    unsigned int cp_visited;    /* critpath walk generation.  */
+    unsigned long cp_priority;  /* Longest recipe time path to a goal (ms).  */
+    struct file *cp_next;       /* The dependent on that path.  */
+#endif
 
   };
 
@@ -138,6 +151,31 @@ void set_command_state (struct file *file, enum cmd_state state);
 void notice_finished_file (struct file *file);
 void init_hash_files (void);
 char *build_target_list (char *old_list);
+#if defined (CONFIG_WITH_MAKEFILE_SNAPSHOT) || defined (CONFIG_WITH_SERVER)
+void map_file_data_base (hash_map_arg_func_t func, void *arg);
+#endif
+#ifdef CONFIG_WITH_STAT_PREFETCH
+void prefetch_goal_mtimes (struct dep *goals);
+void print_stat_prefetch_stats (void);
+# ifdef CONFIG_WITH_DIR_SNAPSHOTS
+void stat_prefetch_check_gen (void);
+# endif
+#endif
+#ifdef CONFIG_WITH_DIR_SNAPSHOTS
+extern unsigned int dir_snapshot_gen;
+int dir_snapshot_mtime (const char *name, FILE_TIMESTAMP *mtimep);
+void print_dir_snapshot_stats (void);
+#endif
+#ifdef CONFIG_WITH_CRITICAL_PATH
+extern int critpath_scheduling;
+void critpath_load_history (const char *filename);
+void critpath_prepare (struct dep *goals);
+unsigned long critpath_priority (struct file *file);
+void critpath_record_job (struct file *file, big_int elapsed,
+                          unsigned long peak_rss);
+unsigned long critpath_peak_rss (struct file *file);
+void critpath_finish (void);
+#endif
 
 #if FILE_TIMESTAMP_HI_RES
 # define FILE_TIMESTAMP_STAT_MODTIME(fname, st) \
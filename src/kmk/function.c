@@ -121,6 +121,7 @@ long          make_stats_reallocations = 0;
 unsigned long make_stats_allocated = 0;
 unsigned long make_stats_ht_lookups = 0;
 unsigned long make_stats_ht_collisions = 0;
+unsigned long make_stats_ht_probes = 0;
 #endif
 
 
@@ -465,7 +466,10 @@ pattern_matches (const char *pattern, const char *percent, const char *str)
    If no next argument is found, return NULL.
 */
 
-static char *
+#ifndef CONFIG_WITH_COMPILER
+static
+#endif
+char *
 find_next_argument (char startparen, char endparen,
                     const char *ptr, const char *end)
 {
@@ -1137,6 +1141,7 @@ func_foreach (char *o, char **argv, const char *funcname UNUSED)
       memcpy (var->value, p, len);
       var->value[len] = '\0';
       var->value_length = len;
+      VARIABLE_CHANGED (var);
 
       variable_expand_string_2 (o, body, body_len, &o);
       o = variable_buffer_output (o, " ", 1);
@@ -1281,8 +1286,144 @@ struct a_pattern
   char *percent;
   int length;
   int save_c;
+#ifdef CONFIG_WITH_FILTER_PATTERN_INDEX
+  struct a_pattern *node_next;  /* The next pattern ending in the same node. */
+  unsigned int prefix_len;      /* The length of the part before the %.  */
+  unsigned int suffix_len;      /* The length of the part after the %.  */
+#endif
+};
+
+#ifdef CONFIG_WITH_FILTER_PATTERN_INDEX
+
+/* A trie node in the %-pattern index.  */
+struct a_pattern_node
+{
+  struct a_pattern_node *next;      /* Sibling.  */
+  struct a_pattern_node *children;
+  struct a_pattern *patterns;       /* The patterns ending here.  */
+  unsigned char ch;
 };
 
+/* The %-patterns of a filter or filter-out call.  The patterns with a
+   suffix are in a trie of their reversed suffixes, the ones with just a
+   prefix in a trie of their prefixes, and a lone % matches everything.  */
+struct a_pattern_index
+{
+  struct a_pattern_node suffixes;
+  struct a_pattern_node prefixes;
+  struct a_pattern_node *nodes;
+  unsigned int num_nodes;
+  int match_all;
+};
+
+/* Returns the child of NODE for CH, adding it if ADD is set.  */
+static struct a_pattern_node *
+a_pattern_child (struct a_pattern_index *idx, struct a_pattern_node *node,
+                 unsigned char ch, int add)
+{
+  struct a_pattern_node *child;
+
+  for (child = node->children; child; child = child->next)
+    if (child->ch == ch)
+      return child;
+  if (!add)
+    return NULL;
+
+  child = &idx->nodes[idx->num_nodes++];
+  child->next = node->children;
+  child->children = NULL;
+  child->patterns = NULL;
+  child->ch = ch;
+  node->children = child;
+  return child;
+}
+
+/* Builds the index of the %-patterns in the PATHEAD list.  CHARS is the
+   total length of those patterns.  */
+static void
+a_pattern_index_init (struct a_pattern_index *idx, struct a_pattern *pathead,
+                      unsigned int chars)
+{
+  struct a_pattern *pp;
+
+  memset (idx, 0, sizeof (*idx));
+  idx->nodes = xmalloc ((chars + 1) * sizeof (struct a_pattern_node));
+
+  for (pp = pathead; pp != 0; pp = pp->next)
+    {
+      struct a_pattern_node *node;
+      unsigned int i;
+
+      if (!pp->percent)
+        continue;
+      pp->prefix_len = pp->percent - pp->str;
+      pp->suffix_len = strlen (pp->percent + 1);
+
+      if (pp->suffix_len)
+        {
+          node = &idx->suffixes;
+          for (i = pp->suffix_len; i > 0; i--)
+            node = a_pattern_child (idx, node, pp->percent[i], 1);
+        }
+      else if (pp->prefix_len)
+        {
+          node = &idx->prefixes;
+          for (i = 0; i < pp->prefix_len; i++)
+            node = a_pattern_child (idx, node, pp->str[i], 1);
+        }
+      else
+        {
+          idx->match_all = 1;
+          continue;
+        }
+      pp->node_next = node->patterns;
+      node->patterns = pp;
+    }
+}
+
+/* Returns 1 if any of the indexed %-patterns matches the LEN chars long
+   WORD, 0 if not.  */
+static int
+a_pattern_index_match (struct a_pattern_index *idx, const char *word,
+                       unsigned int len)
+{
+  struct a_pattern_node *node;
+  struct a_pattern *pp;
+  unsigned int i;
+
+  if (idx->match_all)
+    return 1;
+
+  /* Walk the suffix trie from the end of the word, checking the prefix
+     of each pattern whose suffix has matched.  */
+  node = &idx->suffixes;
+  for (i = len; i > 0; i--)
+    {
+      node = a_pattern_child (idx, node, word[i - 1], 0);
+      if (!node)
+        break;
+      for (pp = node->patterns; pp; pp = pp->node_next)
+        if (pp->prefix_len <= i - 1
+            && strneq (word, pp->str, pp->prefix_len))
+          return 1;
+    }
+
+  /* Then the prefix trie from the start of it.  */
+  node = &idx->prefixes;
+  for (i = 0; i < len; i++)
+    {
+      node = a_pattern_child (idx, node, word[i], 0);
+      if (!node)
+        break;
+      if (node->patterns)
+        return 1;
+    }
+
+  return 0;
+}
+
+#endif /* CONFIG_WITH_FILTER_PATTERN_INDEX */
+
 static char *
 func_filter_filterout (char *o, char **argv, const char *funcname)
 {
@@ -1300,6 +1441,12 @@ func_filter_filterout (char *o, char **argv, const char *funcname)
   int literals = 0;
   int words = 0;
   int hashing = 0;
+#ifdef CONFIG_WITH_FILTER_PATTERN_INDEX
+  struct a_pattern_index pattern_index;
+  unsigned int pattern_chars = 0;
+  int percents = 0;
+  int indexing = 0;
+#endif
   char *p;
   unsigned int len;
 
@@ -1323,6 +1470,13 @@ func_filter_filterout (char *o, char **argv, const char *funcname)
       pat->percent = find_percent (p);
       if (pat->percent == 0)
 	literals++;
+#ifdef CONFIG_WITH_FILTER_PATTERN_INDEX
+      else
+        {
+          percents++;
+          pattern_chars += len;
+        }
+#endif
     }
   *pattail = 0;
 
@@ -1362,6 +1516,14 @@ func_filter_filterout (char *o, char **argv, const char *funcname)
 	}
     }
 
+#ifdef CONFIG_WITH_FILTER_PATTERN_INDEX
+  /* Likewise, only index the %-patterns when there are enough of them to
+     make up for building the index.  */
+  indexing = (percents >= 4 && (percents * words) >= 100);
+  if (indexing)
+    a_pattern_index_init (&pattern_index, pathead, pattern_chars);
+#endif
+
   if (words)
     {
       int doneany = 0;
@@ -1369,6 +1531,10 @@ func_filter_filterout (char *o, char **argv, const char *funcname)
       /* Run each pattern through the words, killing words.  */
       for (pp = pathead; pp != 0; pp = pp->next)
 	{
+#ifdef CONFIG_WITH_FILTER_PATTERN_INDEX
+	  if (pp->percent && indexing)
+	    continue;
+#endif
 	  if (pp->percent)
 	    for (wp = wordhead; wp != 0; wp = wp->next)
 	      wp->matched |= pattern_matches (pp->str, pp->percent, wp->str);
@@ -1390,6 +1556,15 @@ func_filter_filterout (char *o, char **argv, const char *funcname)
 			      && strneq (pp->str, wp->str, wp->length));
 	}
 
+#ifdef CONFIG_WITH_FILTER_PATTERN_INDEX
+      /* Run the words through the %-pattern index, one pass each.  */
+      if (indexing)
+        for (wp = wordhead; wp != 0; wp = wp->next)
+          if (!wp->matched)
+            wp->matched = a_pattern_index_match (&pattern_index, wp->str,
+                                                 wp->length);
+#endif
+
       /* Output the words that matched (or didn't, for filter-out).  */
       for (wp = wordhead; wp != 0; wp = wp->next)
 	if (is_filter ? wp->matched : !wp->matched)
@@ -1409,6 +1584,10 @@ func_filter_filterout (char *o, char **argv, const char *funcname)
 
   if (hashing)
     hash_free (&a_word_table, 0);
+#ifdef CONFIG_WITH_FILTER_PATTERN_INDEX
+  if (indexing)
+    free (pattern_index.nodes);
+#endif
 
   return o;
 }
@@ -1493,6 +1672,208 @@ func_error (char *o, char **argv, const char *funcname)
 }
 
 
+#ifdef CONFIG_WITH_MULTIKEY_SORT
+/* Multikey quicksort for $(sort) and $(rsort).
+
+   The lists are mostly paths with long common prefixes, which qsort and
+   alpha_compare go over again in every comparison.  This partitions on 8
+   chars at a time instead, cached as a big endian integer per word, and
+   only moves on to the next 8 chars within the partition that has the same
+   ones.  When those include the end of the words, the words are equal and
+   all but the first are dropped (set to NULL), so the duplicates are gone
+   when the sorting is done.  */
+
+/* Partitions smaller than this are insertion sorted.  */
+# define SORT_INSERTION_THRESHOLD  12
+
+/* Returns the 8 chars at DEPTH of WORD as a big endian key, padded with
+   zeros after the end of the word.  alpha_compare compares the first char
+   as a plain char, so it is biased to get the same order when that is
+   signed.  */
+MY_INLINE big_uint
+sort_key (const char *word, unsigned int depth)
+{
+  const unsigned char *p = (const unsigned char *) word + depth;
+  big_uint key = 0;
+  unsigned int i;
+
+  for (i = 0; i < 8; i++)
+    {
+      key <<= 8;
+      if (*p)
+        key |= *p++;
+    }
+# if CHAR_MIN < 0
+  if (depth == 0)
+    key ^= BIG_UINT_C(0x80) << 56;
+# endif
+  return key;
+}
+
+/* Compares two words which are equal before DEPTH.  */
+MY_INLINE int
+sort_compare_keyed (const char *w1, big_uint k1, const char *w2, big_uint k2,
+                    unsigned int depth)
+{
+  if (k1 != k2)
+    return k1 < k2 ? -1 : 1;
+  if (!(k1 & 0xff))
+    return 0;
+  return strcmp (w1 + depth + 8, w2 + depth + 8);
+}
+
+MY_INLINE void
+sort_swap (char **words, big_uint *keys, unsigned int i, unsigned int j)
+{
+  char *w = words[i];
+  big_uint k = keys[i];
+  words[i] = words[j];
+  keys[i] = keys[j];
+  words[j] = w;
+  keys[j] = k;
+}
+
+/* Insertion sorts the N WORDS which are equal before DEPTH, then drops the
+   duplicates.  */
+static void
+sort_words_small (char **words, big_uint *keys, unsigned int n,
+                  unsigned int depth)
+{
+  unsigned int i, j, prev;
+
+  for (i = 1; i < n; i++)
+    {
+      char *w = words[i];
+      big_uint k = keys[i];
+      for (j = i;
+           j > 0 && sort_compare_keyed (words[j - 1], keys[j - 1], w, k, depth) > 0;
+           j--)
+        {
+          words[j] = words[j - 1];
+          keys[j] = keys[j - 1];
+        }
+      words[j] = w;
+      keys[j] = k;
+    }
+
+  for (prev = 0, i = 1; i < n; i++)
+    if (!sort_compare_keyed (words[prev], keys[prev], words[i], keys[i], depth))
+      words[i] = NULL;
+    else
+      prev = i;
+}
+
+/* Sorts the N WORDS which are equal before DEPTH.  KEYS holds their keys
+   at DEPTH.  */
+static void
+sort_words (char **words, big_uint *keys, unsigned int n, unsigned int depth)
+{
+  while (n >= SORT_INSERTION_THRESHOLD)
+    {
+      big_uint pivot, a, b, c;
+      unsigned int lt, gt, i;
+
+      /* Median of three.  */
+      a = keys[0];
+      b = keys[n / 2];
+      c = keys[n - 1];
+      if (a < b)
+        pivot = b < c ? b : a < c ? c : a;
+      else
+        pivot = a < c ? a : b < c ? c : b;
+
+      /* Three way partitioning: [0,LT) < PIVOT, [LT,GT) == PIVOT and
+         [GT,N) > PIVOT.  */
+      lt = i = 0;
+      gt = n;
+      while (i < gt)
+        if (keys[i] < pivot)
+          sort_swap (words, keys, lt++, i++);
+        else if (keys[i] > pivot)
+          sort_swap (words, keys, i, --gt);
+        else
+          i++;
+
+      /* The equal ones continue with the next 8 chars, unless they all end
+         here and are duplicates.  */
+      if (gt - lt > 1)
+        {
+          if (!(pivot & 0xff))
+            for (i = lt + 1; i < gt; i++)
+              words[i] = NULL;
+          else
+            {
+              for (i = lt; i < gt; i++)
+                keys[i] = sort_key (words[i], depth + 8);
+              sort_words (words + lt, keys + lt, gt - lt, depth + 8);
+            }
+        }
+
+      /* Recurse on the smaller side and loop on the larger one.  */
+      if (lt < n - gt)
+        {
+          sort_words (words, keys, lt, depth);
+          words += gt;
+          keys += gt;
+          n -= gt;
+        }
+      else
+        {
+          sort_words (words + gt, keys + gt, n - gt, depth);
+          n = lt;
+        }
+    }
+
+  if (n > 1)
+    sort_words_small (words, keys, n, depth);
+}
+
+/* Sorts the N WORDS, dropping the duplicates, and returns how many are
+   left.  The first RUN words are already sorted, so only the rest is
+   sorted and then merged with them.  */
+static unsigned int
+sort_words_after_run (char **words, unsigned int n, unsigned int run)
+{
+  char **tail = words + run;
+  unsigned int ntail = n - run;
+  big_uint *keys = xmalloc (ntail * sizeof (big_uint));
+  char **head;
+  const char *last = NULL;
+  unsigned int i, a, b, m;
+
+  for (i = 0; i < ntail; i++)
+    keys[i] = sort_key (tail[i], 0);
+  sort_words (tail, keys, ntail, 0);
+  free (keys);
+
+  /* Only the sorted run needs a copy, the merged words never overtake the
+     tail ones that are still to be read.  */
+  head = xmalloc (run * sizeof (char *));
+  memcpy (head, words, run * sizeof (char *));
+
+  a = b = m = 0;
+  while (a < run || b < ntail)
+    {
+      char *w;
+      if (b < ntail && !tail[b])
+        {
+          b++;
+          continue;
+        }
+      if (b >= ntail || (a < run && alpha_compare (&head[a], &tail[b]) <= 0))
+        w = head[a++];
+      else
+        w = tail[b++];
+      if (!last || strcmp (last, w))
+        words[m++] = w;
+      last = w;
+    }
+
+  free (head);
+  return m;
+}
+#endif /* CONFIG_WITH_MULTIKEY_SORT */
+
 /*
   chop argv[0] into words, and sort them.
  */
@@ -1536,8 +1917,37 @@ func_sort (char *o, char **argv, const char *funcname UNUSED)
 
   if (wordi)
     {
+#ifndef CONFIG_WITH_MULTIKEY_SORT
       /* Now sort the list of words.  */
       qsort (words, wordi, sizeof (char *), alpha_compare);
+#else
+      /* Nonzero if the duplicates have already been dropped.  */
+      int uniq = 0;
+
+      /* Lists that are already sorted are common, e.g. after appending a
+         few words to a sorted list and sorting it again.  Check for that
+         first, it costs one comparison per word.  */
+      for (i = 1; i < wordi; ++i)
+        if (alpha_compare (&words[i - 1], &words[i]) > 0)
+          break;
+
+      /* Now sort the list of words, the duplicates are set to NULL or
+         dropped.  A long sorted run is merged with the rest.  */
+      if (i < wordi && i >= wordi / 2)
+        {
+          wordi = sort_words_after_run (words, wordi, i);
+          uniq = 1;
+        }
+      else if (i < wordi)
+        {
+          big_uint *keys = xmalloc (wordi * sizeof (big_uint));
+          for (i = 0; i < wordi; ++i)
+            keys[i] = sort_key (words[i], 0);
+          sort_words (words, keys, wordi, 0);
+          free (keys);
+          uniq = 1;
+        }
+#endif
 
       /* Now write the sorted list, uniquified.  */
 #ifdef CONFIG_WITH_RSORT
@@ -1547,9 +1957,17 @@ func_sort (char *o, char **argv, const char *funcname UNUSED)
 #endif
           for (i = 0; i < wordi; ++i)
             {
+#ifndef CONFIG_WITH_MULTIKEY_SORT
               len = strlen (words[i]);
               if (i == wordi - 1 || strlen (words[i + 1]) != len
                   || strcmp (words[i], words[i + 1]))
+#else
+              if (!words[i])
+                continue;
+              len = strlen (words[i]);
+              if (uniq || i == wordi - 1 || strlen (words[i + 1]) != len
+                  || strcmp (words[i], words[i + 1]))
+#endif
                 {
                   o = variable_buffer_output (o, words[i], len);
                   o = variable_buffer_output (o, " ", 1);
@@ -1563,9 +1981,17 @@ func_sort (char *o, char **argv, const char *funcname UNUSED)
           i = wordi;
           while (i-- > 0)
             {
+#ifndef CONFIG_WITH_MULTIKEY_SORT
               len = strlen (words[i]);
               if (i == 0 || strlen (words[i - 1]) != len
                   || strcmp (words[i], words[i - 1]))
+#else
+              if (!words[i])
+                continue;
+              len = strlen (words[i]);
+              if (uniq || i == 0 || strlen (words[i - 1]) != len
+                  || strcmp (words[i], words[i - 1]))
+#endif
                 {
                   o = variable_buffer_output (o, words[i], len);
                   o = variable_buffer_output (o, " ", 1);
@@ -1872,6 +2298,7 @@ func_eval_optimize_variable (char *o, char **argv, const char *funcname)
 
           eos = collapse_continuations (v->value, v->value_length);
           v->value_length = eos - v->value;
+          VARIABLE_CHANGED (v);
 
           /* remove comments */
 
@@ -1913,6 +2340,7 @@ func_eval_optimize_variable (char *o, char **argv, const char *funcname)
 
               *dst = '\0';
               v->value_length = dst - v->value;
+              VARIABLE_CHANGED (v);
             }
         }
       else if (v)
@@ -1975,6 +2403,9 @@ fold_newlines (char *buffer, unsigned int *length)
 
 
 int shell_function_pid = 0, shell_function_completed;
+#ifdef CONFIG_WITH_SHELL_CACHE
+int shell_function_status;
+#endif
 
 
 #ifdef WINDOWS32
@@ -2153,6 +2584,11 @@ func_shell (char *o, char **argv, const char *funcname UNUSED)
     return o;
 #endif
 
+#ifdef CONFIG_WITH_DIR_SNAPSHOTS
+  /* The command may change any file.  */
+  dir_snapshot_gen++;
+#endif
+
   /* Using a target environment for `shell' loses in cases like:
      export var = $(shell echo foobie)
      because target_environment hits a loop trying to expand $(var)
@@ -2210,6 +2646,10 @@ func_shell (char *o, char **argv, const char *funcname UNUSED)
   if (pid < 0)
     perror_with_name (error_prefix, "spawn");
 # else /* ! __EMX__ */
+#  ifdef CONFIG_WITH_POSIX_SPAWN
+  pid = child_spawn_job (0, pipedes[1], command_argv, envp, 0);
+  if (pid < 0)
+#  endif
   pid = vfork ();
   if (pid < 0)
     perror_with_name (error_prefix, "fork");
@@ -2399,6 +2839,292 @@ func_shell (char *o, char **argv, const char *funcname)
 #endif  /* _AMIGA */
 #endif  /* !VMS */
 
+#ifdef CONFIG_WITH_SHELL_CACHE
+# ifndef CONFIG_WITH_NANOTS
+#  error "CONFIG_WITH_SHELL_CACHE requires CONFIG_WITH_NANOTS"
+# endif
+
+/* The signature on the first line of a shell cache entry.  */
+# define SHELL_CACHE_SIGNATURE "kmk-shell-cache 1"
+
+static unsigned long shell_cache_hits;
+static unsigned long shell_cache_misses;
+static unsigned long shell_cache_uncached;
+static unsigned long shell_cache_stores;
+static big_int shell_cache_saved_ns;
+static big_int shell_cache_run_ns;
+
+/* A growing buffer for the key of a shell-cached call.  */
+struct shell_cache_key
+{
+  char *buf;
+  unsigned int len;
+  unsigned int size;
+};
+
+static void
+shell_cache_key_add (struct shell_cache_key *key, const char *str,
+                     unsigned int len)
+{
+  if (key->len + len + 1 > key->size)
+    {
+      key->size = (key->len + len + 1 + 255) & ~255U;
+      key->buf = xrealloc (key->buf, key->size);
+    }
+  memcpy (key->buf + key->len, str, len);
+  key->len += len;
+  key->buf[key->len++] = '\0';
+}
+
+/* Makes the key of a shell-cached call from the command, the directory it
+   runs in, the size and modification time of the INPUTS and the values of
+   the environment variables named in ENV_VARS.  */
+static void
+shell_cache_make_key (struct shell_cache_key *key, const char *inputs,
+                      const char *env_vars, const char *command)
+{
+  const char *p;
+  unsigned int len;
+  char buf[64];
+
+  shell_cache_key_add (key, command, strlen (command));
+  p = starting_directory ? starting_directory : "";
+  shell_cache_key_add (key, p, strlen (p));
+
+  while ((p = find_next_token (&inputs, &len)) != 0)
+    {
+      char *name = alloca (len + 1);
+      struct stat st;
+      int rc;
+
+      memcpy (name, p, len);
+      name[len] = '\0';
+      shell_cache_key_add (key, name, len);
+      EINTRLOOP (rc, stat (name, &st));
+      if (rc == 0)
+        sprintf (buf, "%lu %lu", (unsigned long) st.st_size,
+                 (unsigned long) FILE_TIMESTAMP_STAT_MODTIME (name, st));
+      else
+        strcpy (buf, "-");
+      shell_cache_key_add (key, buf, strlen (buf));
+    }
+
+  while ((p = find_next_token (&env_vars, &len)) != 0)
+    {
+      char *name = alloca (len + 1);
+      const char *value;
+
+      memcpy (name, p, len);
+      name[len] = '\0';
+      shell_cache_key_add (key, name, len);
+      value = getenv (name);
+      if (value)
+        shell_cache_key_add (key, value, strlen (value));
+      else
+        shell_cache_key_add (key, "", 0);
+    }
+}
+
+/* Returns the name of the cache entry for KEY in DIR.  The name is a hash
+   of the key, the entry itself holds the whole key.  */
+static char *
+shell_cache_entry_name (const char *dir, const struct shell_cache_key *key)
+{
+  big_uint hash = BIG_UINT_C(14695981039346656037);
+  unsigned int i;
+  char *name;
+
+  for (i = 0; i < key->len; i++)
+    {
+      hash ^= (unsigned char) key->buf[i];
+      hash *= BIG_UINT_C(1099511628211);
+    }
+
+  name = xmalloc (strlen (dir) + 1 + 16 + sizeof (".shc"));
+  sprintf (name, "%s/%08lx%08lx.shc", dir,
+           (unsigned long) (hash >> 32), (unsigned long) (hash & 0xffffffff));
+  return name;
+}
+
+/* Reads the cache entry NAME and returns its output if it is for KEY.  */
+static char *
+shell_cache_read (const char *name, const struct shell_cache_key *key,
+                  unsigned int *out_len, unsigned long *run_us)
+{
+  char line[128];
+  unsigned int key_len;
+  char *buf = NULL;
+  struct stat st;
+  FILE *fp;
+
+  fp = fopen (name, "rb");
+  if (!fp)
+    return NULL;
+
+  if (fgets (line, sizeof (line), fp)
+      && strneq (line, SHELL_CACHE_SIGNATURE " ",
+                 sizeof (SHELL_CACHE_SIGNATURE " ") - 1)
+      && sscanf (line + sizeof (SHELL_CACHE_SIGNATURE " ") - 1, "%u %u %lu",
+                 &key_len, out_len, run_us) == 3
+      && key_len == key->len
+      /* The sizes come from the file, so don't trust them further than
+         its size goes; anything else is a damaged entry and a miss.  */
+      && fstat (fileno (fp), &st) == 0
+      && (big_int) ftell (fp) + key_len + *out_len == (big_int) st.st_size)
+    {
+      buf = xmalloc (key_len + *out_len + 1);
+      if (fread (buf, 1, key_len + *out_len, fp) != key_len + *out_len
+          || memcmp (buf, key->buf, key_len))
+        {
+          free (buf);
+          buf = NULL;
+        }
+      else
+        {
+          memmove (buf, buf + key_len, *out_len);
+          buf[*out_len] = '\0';
+        }
+    }
+
+  fclose (fp);
+  return buf;
+}
+
+/* Writes the cache entry NAME.  The entry is written to a temporary file
+   which is renamed into place, so other kmk processes sharing the cache
+   see either the complete entry or none.  */
+static void
+shell_cache_write (const char *dir, const char *name,
+                   const struct shell_cache_key *key, const char *out,
+                   unsigned int out_len, unsigned long run_us)
+{
+  char *tmp_name = alloca (strlen (name) + 48);
+  FILE *fp;
+  int ok;
+
+  sprintf (tmp_name, "%s.%ld.%lx.tmp", name, (long) getpid (),
+           (unsigned long) nano_timestamp ());
+  fp = fopen (tmp_name, "wb");
+  if (!fp && errno == ENOENT)
+    {
+# ifdef WINDOWS32
+      mkdir (dir);
+# else
+      mkdir (dir, 0777);
+# endif
+      fp = fopen (tmp_name, "wb");
+    }
+  if (!fp)
+    {
+      error (NILF, _("warning: failed to create shell cache entry `%s': %s"),
+             tmp_name, strerror (errno));
+      return;
+    }
+
+  ok = fprintf (fp, SHELL_CACHE_SIGNATURE " %u %u %lu\n",
+                key->len, out_len, run_us) > 0
+    && fwrite (key->buf, 1, key->len, fp) == key->len
+    && fwrite (out, 1, out_len, fp) == out_len;
+  ok = fclose (fp) == 0 && ok;
+# if defined (WINDOWS32) || defined (__OS2__)
+  if (ok)
+    unlink (name);
+# endif
+  if (!ok || rename (tmp_name, name) != 0)
+    {
+      error (NILF, _("warning: failed to write shell cache entry `%s': %s"),
+             name, strerror (errno));
+      unlink (tmp_name);
+    }
+  else
+    shell_cache_stores++;
+}
+
+/*
+  $(shell-cached inputs,env-vars,command)
+
+  Like $(shell command), but the output is kept in a cache entry in the
+  KMK_SHELL_CACHE_DIR directory and reused while the command, the sizes
+  and times of the INPUTS files and the values of the ENV-VARS environment
+  variables stay the same.  Only commands that succeed are cached.  The
+  command comes last so that it may contain commas.
+ */
+static char *
+func_shell_cached (char *o, char **argv, const char *funcname)
+{
+  const char *command = argv[2];
+  struct variable *dir_var;
+  struct shell_cache_key key;
+  char *dir;
+  char *name;
+  char *out;
+  unsigned int out_len;
+  unsigned long run_us;
+  big_int start;
+
+  dir_var = lookup_variable (STRING_SIZE_TUPLE ("KMK_SHELL_CACHE_DIR"));
+  dir = !dir_var ? NULL
+      : dir_var->recursive ? allocated_variable_expand (dir_var->value)
+      : xstrdup (dir_var->value);
+  if (!dir || !*dir)
+    {
+      free (dir);
+      shell_cache_uncached++;
+      return func_shell (o, &argv[2], funcname);
+    }
+
+  key.buf = NULL;
+  key.len = key.size = 0;
+  shell_cache_make_key (&key, argv[0], argv[1], command);
+  name = shell_cache_entry_name (dir, &key);
+
+  out = shell_cache_read (name, &key, &out_len, &run_us);
+  if (out)
+    {
+      shell_cache_hits++;
+      shell_cache_saved_ns += (big_int) run_us * 1000;
+      DB (DB_BASIC, (_("shell-cached: hit, saved %lu us: %s\n"),
+                     run_us, command));
+      o = variable_buffer_output (o, out, out_len);
+      free (out);
+    }
+  else
+    {
+      unsigned long offset = o - variable_buffer;
+
+      shell_cache_misses++;
+      start = nano_timestamp ();
+      o = func_shell (o, &argv[2], funcname);
+      run_us = (unsigned long) ((nano_timestamp () - start) / 1000);
+      shell_cache_run_ns += (big_int) run_us * 1000;
+      DB (DB_BASIC, (_("shell-cached: miss, ran for %lu us: %s\n"),
+                     run_us, command));
+
+      if (shell_function_completed == 1 && shell_function_status == 0)
+        shell_cache_write (dir, name, &key, variable_buffer + offset,
+                           o - variable_buffer - offset, run_us);
+    }
+
+  free (name);
+  free (key.buf);
+  free (dir);
+  return o;
+}
+
+void
+print_shell_cache_stats (void)
+{
+  if (!shell_cache_hits && !shell_cache_misses && !shell_cache_uncached)
+    return;
+  printf (_("\n# shell cache: %lu hits, %lu misses, %lu stored, %lu without a cache directory\n"),
+          shell_cache_hits, shell_cache_misses, shell_cache_stores,
+          shell_cache_uncached);
+  printf (_("#  %lu us saved by the hits, %lu us spent running the misses\n"),
+          (unsigned long) (shell_cache_saved_ns / 1000),
+          (unsigned long) (shell_cache_run_ns / 1000));
+}
+#endif /* CONFIG_WITH_SHELL_CACHE */
+
 #ifdef EXPERIMENTAL
 
 /*
@@ -4329,6 +5055,7 @@ func_stack_pop_top (char *o, char **argv, const char *funcname)
 #ifdef CONFIG_WITH_VALUE_LENGTH
               stack_var->value_length = lastitem - stack_var->value;
 #endif
+              VARIABLE_CHANGED (stack_var);
             }
         }
     }
@@ -4783,6 +5510,8 @@ func_make_stats (char *o, char **argv, const char *funcname UNUSED)
             val = make_stats_ht_collisions;
           else if (!strcmp(argv[i], "ht_collisions_pct"))
             val = (make_stats_ht_collisions * 100) / make_stats_ht_lookups;
+          else if (!strcmp(argv[i], "ht_probes"))
+            val = make_stats_ht_probes;
 #endif
           else
             {
@@ -5063,6 +5792,9 @@ static struct function_table_entry function_table_init[] =
   { STRING_SIZE_TUPLE("rsort"),         0,  1,  1,  func_sort},
 #endif
   { STRING_SIZE_TUPLE("shell"),         0,  1,  1,  func_shell},
+#ifdef CONFIG_WITH_SHELL_CACHE
+  { STRING_SIZE_TUPLE("shell-cached"),  3,  3,  1,  func_shell_cached},
+#endif
   { STRING_SIZE_TUPLE("sort"),          0,  1,  1,  func_sort},
   { STRING_SIZE_TUPLE("strip"),         0,  1,  1,  func_strip},
   { STRING_SIZE_TUPLE("wildcard"),      0,  1,  1,  func_wildcard},
@@ -5244,6 +5976,10 @@ handle_function2 (const struct function_table_entry *entry_p, char **op, const c
   char *abeg = NULL;
   char **argv, **argvp;
   int nargs;
+#ifdef CONFIG_WITH_EXPAND_PROFILER
+  int profiling = 0;
+  size_t profile_off = 0;
+#endif
 
   beg = *stringp + 1;
 
@@ -5272,6 +6008,18 @@ handle_function2 (const struct function_table_entry *entry_p, char **op, const c
 
   *stringp = end;
 
+#ifdef CONFIG_WITH_EXPAND_PROFILER
+  /* The argument expansion is charged to the function.  func_call makes
+     its own entry for the function or variable it calls.  */
+  if (MY_PREDICT_FALSE (expand_profile_enabled)
+   && entry_p->func_ptr != func_call)
+    {
+      profiling = 1;
+      profile_off = *op - variable_buffer;
+      expand_profile_enter (NULL, entry_p->name);
+    }
+#endif
+
   /* Get some memory to store the arg pointers.  */
   argvp = argv = alloca (sizeof (char *) * (nargs + 2));
 
@@ -5337,6 +6085,10 @@ handle_function2 (const struct function_table_entry *entry_p, char **op, const c
   if (abeg)
     free (abeg);
 
+#ifdef CONFIG_WITH_EXPAND_PROFILER
+  if (MY_PREDICT_FALSE (profiling))
+    expand_profile_leave ((long)(*op - variable_buffer - profile_off));
+#endif
   return 1;
 }
 
@@ -5361,6 +6113,43 @@ handle_function (char **op, const char **stringp, const char *nameend, const cha
   return handle_function2 (entry_p, op, stringp);
 }
 #endif /* CONFIG_WITH_VALUE_LENGTH */
+
+#ifdef CONFIG_WITH_COMPILER
+/* Look up the builtin function NAME (LEN chars) for the expansion program
+   compiler in expand.c.  Returns zero if there is no such function.
+   Otherwise it sets the function pointer (NULL if not implemented on this
+   platform), the argument limits, whether the arguments are expanded and
+   the name to pass to the function, and returns nonzero.  */
+
+int
+lookup_function_for_compiler (const char *name, unsigned int len,
+                              make_function_ptr_t *func_ptrp,
+                              unsigned char *minargsp, unsigned char *maxargsp,
+                              char *expargsp, const char **funcnamep)
+{
+  const struct function_table_entry *entry_p;
+
+  entry_p = lookup_function_in_hash_tab (name, len);
+  if (!entry_p)
+    return 0;
+  *func_ptrp = entry_p->func_ptr;
+  *minargsp  = entry_p->minimum_args;
+  *maxargsp  = entry_p->maximum_args;
+  *expargsp  = entry_p->expand_args;
+  *funcnamep = entry_p->name;
+  return 1;
+}
+
+# ifdef CONFIG_WITH_EXPAND_PROFILER
+/* Whether FUNC_PTR is func_call, which makes its own profiler entries.  */
+
+int
+is_func_call (make_function_ptr_t func_ptr)
+{
+  return func_ptr == func_call;
+}
+# endif
+#endif /* CONFIG_WITH_COMPILER */
 
 
 /* User-defined functions.  Expand the first argument as either a builtin
@@ -5386,6 +6175,9 @@ func_call (char *o, char **argv, const char *funcname UNUSED)
 #if defined (CONFIG_WITH_EVALPLUS) || defined (CONFIG_WITH_VALUE_LENGTH)
   char num[11];
 #endif
+#ifdef CONFIG_WITH_EXPAND_PROFILER
+  size_t profile_off = 0;
+#endif
 
   /* There is no way to define a variable with a space in the name, so strip
      leading and trailing whitespace as a favor to the user.  */
@@ -5414,6 +6206,16 @@ func_call (char *o, char **argv, const char *funcname UNUSED)
       /* How many arguments do we have?  */
       for (i=0; argv[i+1]; ++i)
         ;
+#ifdef CONFIG_WITH_EXPAND_PROFILER
+      if (MY_PREDICT_FALSE (expand_profile_enabled))
+        {
+          size_t off = o - variable_buffer;
+          expand_profile_enter (NULL, entry_p->name);
+          o = expand_builtin_function (o, i, argv+1, entry_p);
+          expand_profile_leave ((long)(o - variable_buffer - off));
+          return o;
+        }
+#endif
       return expand_builtin_function (o, i, argv+1, entry_p);
     }
 
@@ -5436,6 +6238,14 @@ func_call (char *o, char **argv, const char *funcname UNUSED)
   body[flen+2] = ')';
   body[flen+3] = '\0';
 
+#ifdef CONFIG_WITH_EXPAND_PROFILER
+  if (MY_PREDICT_FALSE (expand_profile_enabled))
+    {
+      profile_off = o - variable_buffer;
+      expand_profile_enter (funcname, v->name);
+    }
+#endif
+
   /* Set up arguments $(1) .. $(N).  $(0) is the function name.  */
 
   push_new_variable_scope ();
@@ -5551,6 +6361,10 @@ func_call (char *o, char **argv, const char *funcname UNUSED)
 
   pop_variable_scope ();
 
+#ifdef CONFIG_WITH_EXPAND_PROFILER
+  if (MY_PREDICT_FALSE (expand_profile_enabled))
+    expand_profile_leave ((long)(o - variable_buffer - profile_off));
+#endif
   return o;
 }
 
@@ -16,9 +16,15 @@ this program.  If not, see <http://www.gnu.org/licenses/>.  */
 
 #include "make.h"
 #include "hash.h"
-#ifdef CONFIG_WITH_STRCACHE2
+#if defined (CONFIG_WITH_STRCACHE2) || defined (CONFIG_WITH_HASH_TAGS)
 # include <assert.h>
 #endif
+#ifdef CONFIG_WITH_HASH_TAGS
+# if defined (__SSE2__) || defined (_M_X64) || (defined (_M_IX86_FP) && _M_IX86_FP >= 2)
+#  include <emmintrin.h>
+#  define HASH_TAGS_SSE2
+# endif
+#endif
 
 
 #define	CALLOC(t, n) ((t *) calloc (sizeof (t), (n)))
@@ -28,6 +34,10 @@ this program.  If not, see <http://www.gnu.org/licenses/>.  */
 
 static void hash_rehash __P((struct hash_table* ht));
 static unsigned long round_up_2 __P((unsigned long rough));
+#ifdef CONFIG_WITH_HASH_TAGS
+static void **hash_find_slot_tagged __P((struct hash_table *ht, const void *key,
+                                         unsigned int hash));
+#endif
 
 /* Implement double hashing with open addressing.  The table size is
    always a power of two.  The secondary (`increment') hash function
@@ -59,6 +69,7 @@ hash_init (struct hash_table *ht, unsigned long size,
   ht->ht_fill = 0;
   ht->ht_collisions = 0;
   ht->ht_lookups = 0;
+  ht->ht_probes = 0;
   ht->ht_rehashes = 0;
   ht->ht_hash_1 = hash_1;
   ht->ht_hash_2 = hash_2;
@@ -67,6 +78,9 @@ hash_init (struct hash_table *ht, unsigned long size,
   ht->ht_strcache = 0;
   ht->ht_off_string = 0;
 #endif
+#ifdef CONFIG_WITH_HASH_TAGS
+  ht->ht_tags = 0;
+#endif
 }
 
 #ifdef CONFIG_WITH_STRCACHE2
@@ -133,11 +147,17 @@ hash_find_slot (struct hash_table *ht, const void *key)
 #ifdef CONFIG_WITH_STRCACHE2
   assert (ht->ht_strcache == 0);
 #endif
+#ifdef CONFIG_WITH_HASH_TAGS
+  if (ht->ht_tags)
+    return hash_find_slot_tagged (ht, key, hash_1);
+#endif
 
   MAKE_STATS (ht->ht_lookups++);
   MAKE_STATS_3 (make_stats_ht_lookups++);
   for (;;)
     {
+      MAKE_STATS (ht->ht_probes++);
+      MAKE_STATS_3 (make_stats_ht_probes++);
       hash_1 &= (ht->ht_size - 1);
       slot = &ht->ht_vec[hash_1];
 
@@ -178,9 +198,15 @@ hash_find_slot_strcached (struct hash_table *ht, const void *key)
 #ifdef CONFIG_WITH_STRCACHE2
   assert (ht->ht_strcache != 0);
 #endif
+#ifdef CONFIG_WITH_HASH_TAGS
+  if (ht->ht_tags)
+    return hash_find_slot_tagged (ht, key, hash_1);
+#endif
 
   MAKE_STATS (ht->ht_lookups++);
   MAKE_STATS_3 (make_stats_ht_lookups++);
+  MAKE_STATS (ht->ht_probes++);
+  MAKE_STATS_3 (make_stats_ht_probes++);
 
   /* first iteration unrolled. */
 
@@ -206,6 +232,8 @@ hash_find_slot_strcached (struct hash_table *ht, const void *key)
   hash_1 += hash_2;
   for (;;)
     {
+      MAKE_STATS (ht->ht_probes++);
+      MAKE_STATS_3 (make_stats_ht_probes++);
       hash_1 &= (ht->ht_size - 1);
       slot = &ht->ht_vec[hash_1];
 
@@ -231,6 +259,215 @@ hash_find_slot_strcached (struct hash_table *ht, const void *key)
 }
 #endif /* CONFIG_WITH_STRCACHE2 */
 
+#ifdef CONFIG_WITH_HASH_TAGS
+/* Tagged tables (see hash_enable_tags) keep a byte per slot in ht_tags
+   holding 7 bits of the item hash, or one of the markers below which have
+   the high bit set.  Lookups probe groups of HASH_GROUP_SIZE consecutive
+   slots, comparing all the tags of a group at once and only looking at the
+   items whose tags match, so a miss rarely touches the items at all.  The
+   tags of the first group are repeated after the end of the array so a
+   group can start at any slot.  The groups are probed at triangular
+   offsets, which visits all of them since the table size is a power of
+   two, and a lookup ends at the first group with an empty slot.
+
+   The hash is scrambled before use as the strcache pointer hashes of
+   strings added one after the other are almost consecutive, which would
+   otherwise pack them into long runs of full groups.  The tag is taken
+   from the top bits and the position from the bottom ones.  */
+
+# define HASH_GROUP_SIZE    16
+# define HASH_TAG_EMPTY     0x80
+# define HASH_TAG_DELETED   0xfe
+# define HASH_TAG(mix)      ((unsigned char) ((mix) >> 25))
+
+/* Scrambles HASH, this is the murmur3 finalizer. */
+
+MY_INLINE unsigned int
+hash_mix (unsigned int hash)
+{
+  hash ^= hash >> 16;
+  hash *= 0x85ebca6bU;
+  hash ^= hash >> 13;
+  hash *= 0xc2b2ae35U;
+  hash ^= hash >> 16;
+  return hash;
+}
+
+/* Returns a mask with a bit set for each tag in the group at TAGS that
+   equals TAG.  */
+
+MY_INLINE unsigned int
+hash_group_match (const unsigned char *tags, unsigned char tag)
+{
+# ifdef HASH_TAGS_SSE2
+  __m128i group = _mm_loadu_si128 ((const __m128i *) tags);
+  return _mm_movemask_epi8 (_mm_cmpeq_epi8 (group, _mm_set1_epi8 ((char) tag)));
+# else
+  unsigned int mask = 0;
+  unsigned int i;
+  for (i = 0; i < HASH_GROUP_SIZE; i++)
+    mask |= (unsigned int) (tags[i] == tag) << i;
+  return mask;
+# endif
+}
+
+/* Returns a mask with a bit set for each empty or deleted slot in the
+   group at TAGS.  */
+
+MY_INLINE unsigned int
+hash_group_vacant (const unsigned char *tags)
+{
+# ifdef HASH_TAGS_SSE2
+  return _mm_movemask_epi8 (_mm_loadu_si128 ((const __m128i *) tags));
+# else
+  unsigned int mask = 0;
+  unsigned int i;
+  for (i = 0; i < HASH_GROUP_SIZE; i++)
+    mask |= (unsigned int) (tags[i] >> 7) << i;
+  return mask;
+# endif
+}
+
+/* Returns the index of the lowest bit set in MASK, which isn't zero. */
+
+MY_INLINE unsigned int
+hash_first_bit (unsigned int mask)
+{
+# if defined (__GNUC__)
+  return __builtin_ctz (mask);
+# else
+  unsigned int bit = 0;
+  while (!(mask & 1))
+    {
+      mask >>= 1;
+      bit++;
+    }
+  return bit;
+# endif
+}
+
+/* Sets the tag of SLOT, keeping the copy of the first group in sync. */
+
+MY_INLINE void
+hash_set_tag (struct hash_table *ht, const void *slot, unsigned char tag)
+{
+  unsigned long idx = (void **) slot - ht->ht_vec;
+  ht->ht_tags[idx] = tag;
+  if (idx < HASH_GROUP_SIZE)
+    ht->ht_tags[ht->ht_size + idx] = tag;
+}
+
+/* Marks all the slots as empty. */
+
+static void
+hash_clear_tags (struct hash_table *ht)
+{
+  memset (ht->ht_tags, HASH_TAG_EMPTY, ht->ht_size + HASH_GROUP_SIZE);
+}
+
+/* Calculates the hash of ITEM the same way the lookups do. */
+
+static unsigned int
+hash_item_hash (struct hash_table *ht, const void *item)
+{
+# ifdef CONFIG_WITH_STRCACHE2
+  if (ht->ht_strcache)
+    return strcache2_calc_ptr_hash (ht->ht_strcache,
+                                    *(const char **)((const char *)item + ht->ht_off_string));
+# endif
+  return (*ht->ht_hash_1) (item);
+}
+
+/* Turns on tagging for the empty table HT.  This uses a little more memory
+   and a lower loading factor than the double hashing, but lookups, and
+   misses in particular, touch far fewer cache lines.  */
+
+void
+hash_enable_tags (struct hash_table *ht)
+{
+  assert (ht->ht_fill == 0 && ht->ht_tags == 0);
+  if (ht->ht_size < HASH_GROUP_SIZE)
+    {
+      free (ht->ht_vec);
+      ht->ht_size = HASH_GROUP_SIZE;
+      ht->ht_vec = (void **) CALLOC (struct token *, ht->ht_size);
+    }
+  ht->ht_empty_slots = ht->ht_size;
+  ht->ht_capacity = ht->ht_size - (ht->ht_size / 8); /* 87.5% loading factor */
+  ht->ht_tags = MALLOC (unsigned char, ht->ht_size + HASH_GROUP_SIZE);
+  hash_clear_tags (ht);
+}
+
+/* hash_find_slot version for tagged tables.  HASH is the primary hash of
+   KEY as calculated by hash_find_slot or hash_find_slot_strcached.  */
+
+static void **
+hash_find_slot_tagged (struct hash_table *ht, const void *key, unsigned int hash)
+{
+  unsigned int mix = hash_mix (hash);
+  unsigned char tag = HASH_TAG (mix);
+  unsigned long mask = ht->ht_size - 1;
+  unsigned long pos = mix & mask;
+  unsigned long step = 0;
+  void **deleted_slot = 0;
+# ifdef CONFIG_WITH_STRCACHE2
+  const char *str1 = ht->ht_strcache
+                   ? *(const char **)((const char *)key + ht->ht_off_string) : 0;
+# endif
+
+  /* The item is nearly always in the first group, so start loading its
+     slots while the tags are being compared.  */
+# ifdef __GNUC__
+  __builtin_prefetch (&ht->ht_vec[pos]);
+  __builtin_prefetch (&ht->ht_vec[(pos + HASH_GROUP_SIZE - 1) & mask]);
+# endif
+
+  MAKE_STATS (ht->ht_lookups++);
+  MAKE_STATS_3 (make_stats_ht_lookups++);
+  for (;;)
+    {
+      const unsigned char *tags = &ht->ht_tags[pos];
+      unsigned int hits = hash_group_match (tags, tag);
+      unsigned int vacant;
+      unsigned int empty;
+
+      MAKE_STATS (ht->ht_probes++);
+      MAKE_STATS_3 (make_stats_ht_probes++);
+      while (hits)
+        {
+          void **slot = &ht->ht_vec[(pos + hash_first_bit (hits)) & mask];
+# ifdef CONFIG_WITH_STRCACHE2
+          if (str1)
+            {
+              if (*(const char **)((const char *)(*slot) + ht->ht_off_string) == str1)
+                return slot;
+            }
+          else
+# endif
+          if (key == *slot || (*ht->ht_compare) (key, *slot) == 0)
+            return slot;
+          MAKE_STATS (ht->ht_collisions++);
+          MAKE_STATS_3 (make_stats_ht_collisions++);
+          hits &= hits - 1;
+        }
+
+      vacant = hash_group_vacant (tags);
+      if (vacant)
+        {
+          empty = hash_group_match (tags, HASH_TAG_EMPTY);
+          if (!deleted_slot && (vacant & ~empty))
+            deleted_slot = &ht->ht_vec[(pos + hash_first_bit (vacant & ~empty)) & mask];
+          if (empty)
+            return deleted_slot
+                 ? deleted_slot : &ht->ht_vec[(pos + hash_first_bit (empty)) & mask];
+        }
+
+      step += HASH_GROUP_SIZE;
+      pos = (pos + step) & mask;
+    }
+}
+#endif /* CONFIG_WITH_HASH_TAGS */
+
 void *
 hash_find_item (struct hash_table *ht, const void *key)
 {
@@ -277,6 +514,10 @@ hash_insert_at (struct hash_table *ht, const void *item, const void *slot)
       if (old_item == 0)
 	ht->ht_empty_slots--;
       old_item = item;
+#ifdef CONFIG_WITH_HASH_TAGS
+      if (ht->ht_tags)
+        hash_set_tag (ht, slot, HASH_TAG (hash_mix (hash_item_hash (ht, item))));
+#endif
     }
   *(void const **) slot = item;
   if (ht->ht_empty_slots < ht->ht_size - ht->ht_capacity)
@@ -315,6 +556,10 @@ hash_delete_at (struct hash_table *ht, const void *slot)
   if (!HASH_VACANT (item))
     {
       *(void const **) slot = hash_deleted_item;
+#ifdef CONFIG_WITH_HASH_TAGS
+      if (ht->ht_tags)
+        hash_set_tag (ht, slot, HASH_TAG_DELETED);
+#endif
       ht->ht_fill--;
       return item;
     }
@@ -334,6 +579,10 @@ hash_free_items (struct hash_table *ht)
 	free (item);
       *vec = 0;
     }
+#ifdef CONFIG_WITH_HASH_TAGS
+  if (ht->ht_tags)
+    hash_clear_tags (ht);
+#endif
   ht->ht_fill = 0;
   ht->ht_empty_slots = ht->ht_size;
 }
@@ -351,6 +600,10 @@ hash_free_items_cached (struct hash_table *ht, struct alloccache *cache)
 	alloccache_free (cache, item);
       *vec = 0;
     }
+#ifdef CONFIG_WITH_HASH_TAGS
+  if (ht->ht_tags)
+    hash_clear_tags (ht);
+#endif
   ht->ht_fill = 0;
   ht->ht_empty_slots = ht->ht_size;
 }
@@ -363,9 +616,14 @@ hash_delete_items (struct hash_table *ht)
   void **end = &vec[ht->ht_size];
   for (; vec < end; vec++)
     *vec = 0;
+#ifdef CONFIG_WITH_HASH_TAGS
+  if (ht->ht_tags)
+    hash_clear_tags (ht);
+#endif
   ht->ht_fill = 0;
   ht->ht_collisions = 0;
   ht->ht_lookups = 0;
+  ht->ht_probes = 0;
   ht->ht_rehashes = 0;
   ht->ht_empty_slots = ht->ht_size;
 }
@@ -382,6 +640,10 @@ hash_free (struct hash_table *ht, int free_items)
     }
   free (ht->ht_vec);
   ht->ht_vec = 0;
+#ifdef CONFIG_WITH_HASH_TAGS
+  free (ht->ht_tags);
+  ht->ht_tags = 0;
+#endif
   ht->ht_capacity = 0;
 }
 
@@ -398,6 +660,10 @@ hash_free_cached (struct hash_table *ht, int free_items, struct alloccache *cach
     }
   free (ht->ht_vec);
   ht->ht_vec = 0;
+#ifdef CONFIG_WITH_HASH_TAGS
+  free (ht->ht_tags);
+  ht->ht_tags = 0;
+#endif
   ht->ht_capacity = 0;
 }
 #endif /* CONFIG_WITH_ALLOC_CACHES */
@@ -445,6 +711,28 @@ hash_rehash (struct hash_table *ht)
   ht->ht_rehashes++;
   ht->ht_vec = (void **) CALLOC (struct token *, ht->ht_size);
 
+#ifdef CONFIG_WITH_HASH_TAGS
+  if (ht->ht_tags)
+    {
+      ht->ht_capacity = ht->ht_size - (ht->ht_size >> 3);
+      free (ht->ht_tags);
+      ht->ht_tags = MALLOC (unsigned char, ht->ht_size + HASH_GROUP_SIZE);
+      hash_clear_tags (ht);
+      for (ovp = old_vec; ovp < &old_vec[old_ht_size]; ovp++)
+        {
+          if (! HASH_VACANT (*ovp))
+            {
+              unsigned int hash = hash_item_hash (ht, *ovp);
+              void **slot = hash_find_slot_tagged (ht, *ovp, hash);
+              *slot = *ovp;
+              hash_set_tag (ht, slot, HASH_TAG (hash_mix (hash)));
+            }
+        }
+      ht->ht_empty_slots = ht->ht_size - ht->ht_fill;
+      free (old_vec);
+      return;
+    }
+#endif /* CONFIG_WITH_HASH_TAGS */
 #ifndef CONFIG_WITH_STRCACHE2
   for (ovp = old_vec; ovp < &old_vec[old_ht_size]; ovp++)
     {
@@ -485,11 +773,19 @@ hash_print_stats (struct hash_table *ht, FILE *out_FILE)
   fprintf (out_FILE, _("Load=%ld/%ld=%.0f%%, "), ht->ht_fill, ht->ht_size,
 	   100.0 * (double) ht->ht_fill / (double) ht->ht_size);
   fprintf (out_FILE, _("Rehash=%d, "), ht->ht_rehashes);
+#ifdef CONFIG_WITH_HASH_TAGS
+  if (ht->ht_tags)
+    fputs (_("Tagged, "), out_FILE);
+#endif
   MAKE_STATS(
   fprintf (out_FILE, _("Collisions=%ld/%ld=%.0f%%"), ht->ht_collisions, ht->ht_lookups,
 	   (ht->ht_lookups
 	    ? (100.0 * (double) ht->ht_collisions / (double) ht->ht_lookups)
 	    : 0));
+  fprintf (out_FILE, _(", Probes=%lu/%lu=%.2f"), ht->ht_probes, ht->ht_lookups,
+	   (ht->ht_lookups
+	    ? (double) ht->ht_probes / (double) ht->ht_lookups
+	    : 0));
   );
 }
 
@@ -47,6 +47,7 @@ struct hash_table
   unsigned long ht_empty_slots;	/* empty slots not including deleted slots */
   unsigned long ht_collisions;	/* # of failed calls to comparison function */
   unsigned long ht_lookups;	/* # of queries */
+  unsigned long ht_probes;	/* # of slots (tag groups if tagged) probed */
   unsigned int ht_rehashes;	/* # of times we've expanded table */
   hash_func_t ht_hash_1;	/* primary hash function */
   hash_func_t ht_hash_2;	/* secondary hash function */
@@ -55,6 +56,9 @@ struct hash_table
   struct strcache2 *ht_strcache; /* the string cache pointer. */
   unsigned int ht_off_string;  /* offsetof (struct key, string) */
 #endif
+#ifdef CONFIG_WITH_HASH_TAGS
+  unsigned char *ht_tags;	/* hash tag byte per slot, 0 if not tagged */
+#endif
 };
 
 typedef int (*qsort_cmp_t) __P((void const *, void const *));
@@ -89,6 +93,9 @@ void *hash_find_item_strcached __P((struct hash_table *ht, void const *key));
 void *hash_insert_strcached __P((struct hash_table *ht, const void *item));
 void *hash_delete_strcached __P((struct hash_table *ht, void const *item));
 #endif /* CONFIG_WITH_STRCACHE2 */
+#ifdef CONFIG_WITH_HASH_TAGS
+void hash_enable_tags __P((struct hash_table *ht));
+#endif
 
 extern void *hash_deleted_item;
 #define HASH_VACANT(item) ((item) == 0 || (void *) (item) == hash_deleted_item)
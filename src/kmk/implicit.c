@@ -229,6 +229,27 @@ pattern_search (struct file *file, int archive,
   unsigned int stemlen = 0;
   unsigned int fullstemlen = 0;
 
+#ifdef CONFIG_WITH_PATTERN_RULE_INDEX
+  /* The rule targets which the file name ends like, in rule order.  */
+  unsigned int ncandidates;
+  const struct rule_target *candidates =
+    find_pattern_rule_targets (filename, namelen, &ncandidates);
+  unsigned int ci;
+
+  /* Buffer in which we store all the rules that are possibly applicable.  */
+  struct rule **tryrules = xmalloc (ncandidates * sizeof (struct rule *));
+
+  /* Number of valid elements in TRYRULES.  */
+  unsigned int nrules;
+
+  /* The numbers of the rule targets of each rule
+     in TRYRULES that matched the target file.  */
+  unsigned int *matches = alloca (ncandidates * sizeof (unsigned int));
+
+  /* Each element is nonzero if LASTSLASH was used in
+     matching the corresponding element of TRYRULES.  */
+  char *checked_lastslash = alloca (ncandidates * sizeof (char));
+#else
   /* Buffer in which we store all the rules that are possibly applicable.  */
   struct rule **tryrules = xmalloc (num_pattern_rules * max_pattern_targets
                                     * sizeof (struct rule *));
@@ -243,6 +264,7 @@ pattern_search (struct file *file, int archive,
   /* Each element is nonzero if LASTSLASH was used in
      matching the corresponding element of TRYRULES.  */
   char *checked_lastslash = alloca (num_pattern_rules * sizeof (char));
+#endif
 
   /* The index in TRYRULES of the rule we found.  */
   unsigned int foundrule;
@@ -304,9 +326,19 @@ pattern_search (struct file *file, int archive,
      and may be considered.  Put them in TRYRULES.  */
 
   nrules = 0;
+#ifndef CONFIG_WITH_PATTERN_RULE_INDEX
   for (rule = pattern_rules; rule != 0; rule = rule->next)
     {
       unsigned int ti;
+#else
+  /* Only the targets with a suffix matching the end of the file name are
+     looked at.  A rule with several such targets comes up once for each.  */
+  for (ci = 0; ci < ncandidates; ci++)
+    {
+      unsigned int ti = candidates[ci].ti;
+      rule = candidates[ci].rule;
+      pattern_rule_stat_examined++;
+#endif
 
       /* If the pattern rule has deps but no commands, ignore it.
 	 Users cancel built-in rules by redefining them without commands.  */
@@ -321,7 +353,9 @@ pattern_search (struct file *file, int archive,
 	  continue;
 	}
 
+#ifndef CONFIG_WITH_PATTERN_RULE_INDEX
       for (ti = 0; ti < rule->num; ++ti)
+#endif
 	{
 	  const char *target = rule->targets[ti];
 	  const char *suffix = rule->suffixes[ti];
@@ -393,6 +427,10 @@ pattern_search (struct file *file, int archive,
 	      || (*suffix != '\0' && !streq (&suffix[1], &stem[stemlen + 1])))
 	    continue;
 
+#ifdef CONFIG_WITH_PATTERN_RULE_INDEX
+	  pattern_rule_stat_matched++;
+#endif
+
 	  /* Record if we match a rule that not all filenames will match.  */
 	  if (target[1] != '\0')
 	    specific_rule_matched = 1;
@@ -50,6 +50,7 @@
 #include "rule.h"
 #include "debug.h"
 #include "strcache2.h"
+#include "../lib/kDep.h"
 
 #ifdef HAVE_FCNTL_H
 # include <fcntl.h>
@@ -82,6 +83,45 @@
 # define PARSE_IN_WORKER
 #endif
 
+/* Map the bigger files instead of reading them. The parser must not write
+   to the file data for this to work, which isn't the case for the old
+   string cache (it needs terminated strings). */
+#if !defined(WINDOWS32) && !defined(__OS2__) && defined(CONFIG_WITH_STRCACHE2)
+# include <sys/mman.h>
+# define INCDEP_USE_MMAP
+#endif
+
+/* Dependency databases that are mostly superseded records are rewritten when
+   loaded. This relies on the fcntl locking done by the writers in kDep.c. */
+#if !defined(WINDOWS32) && !defined(__OS2__)
+# define INCDEP_DB_COMPACT
+#endif
+
+/* When the string cache can do concurrent insertion, the workers add the
+   names straight into the file string cache instead of recording them in
+   per thread caches and having the main thread replay them. */
+#if defined (PARSE_IN_WORKER) && defined (STRCACHE2_HAVE_CONCURRENT)
+# define INTERN_IN_WORKER
+#endif
+
+
+/*******************************************************************************
+*   Defined Constants And Macros                                               *
+*******************************************************************************/
+/* The max number of worker threads.  With INTERN_IN_WORKER each of them
+   needs its own file strcache thread slot besides the main thread's. */
+#define INCDEP_MAX_THREADS      16
+#if defined (INTERN_IN_WORKER) && INCDEP_MAX_THREADS >= STRCACHE2_MAX_THREADS
+# error "INCDEP_MAX_THREADS must be less than STRCACHE2_MAX_THREADS"
+#endif
+/* Files smaller than this are read into a heap buffer instead of being
+   mapped, as the mapping and unmapping is more expensive than the copying
+   for small files. */
+#define INCDEP_MMAP_MIN         (16*1024)
+/* The size of the chunks that bigger files are split into so that more than
+   one worker can parse them. */
+#define INCDEP_CHUNK_SIZE       (256*1024)
+
 
 /*******************************************************************************
 *   Structures and Typedefs                                                    *
@@ -90,7 +130,7 @@ struct incdep_variable_in_set
 {
     struct incdep_variable_in_set *next;
     /* the parameters */
-    struct strcache2_entry *name_entry;     /* dep strcache - WRONG */
+    const char *name;                       /* file strcache, or var strcache entry. */
     const char *value;                      /* xmalloc'ed */
     unsigned int value_length;
     int duplicate_value;                    /* 0 */
@@ -105,7 +145,7 @@ struct incdep_variable_def
     struct incdep_variable_def *next;
     /* the parameters */
     const struct floc *flocp;               /* NILF */
-    struct strcache2_entry *name_entry;     /* dep strcache - WRONG */
+    const char *name;                       /* file strcache, or var strcache entry. */
     char *value;                            /* xmalloc'ed, free it */
     unsigned int value_length;
     enum variable_origin origin;
@@ -118,7 +158,7 @@ struct incdep_recorded_files
     struct incdep_recorded_files *next;
 
     /* the parameters */
-    struct strcache2_entry *filename_entry; /* dep strcache; converted to a nameseq record. */
+    const char *filename;                   /* file strcache, or dep strcache entry; converted to a nameseq record. */
     const char *pattern;                    /* NULL */
     const char *pattern_percent;            /* NULL */
     struct dep *deps;                       /* All the names are dep strcache entries. */
@@ -136,9 +176,16 @@ struct incdep
   struct incdep *next;
   char *file_base;
   char *file_end;
+#ifdef INCDEP_USE_MMAP
+  size_t map_size;              /* Non-zero if file_base is a mapping. */
+#endif
 
   int worker_tid;
 #ifdef PARSE_IN_WORKER
+  struct incdep *chunk_leader;  /* The first chunk if the file was split up. */
+  struct incdep *chunk_next;    /* The next chunk of the file. */
+  unsigned int chunks_pending;  /* Leader: the number of unparsed chunks. */
+
   unsigned int err_line_no;
   const char *err_msg;
 
@@ -156,6 +203,40 @@ struct incdep
 };
 
 
+/* per thread statistics. */
+struct incdep_stats
+{
+  big_int read_time;            /* Nanoseconds spent reading / mapping files. */
+  big_int parse_time;           /* Nanoseconds spent parsing. */
+  unsigned long bytes;          /* The number of bytes read or mapped. */
+  unsigned int files;           /* The number of files read. */
+  unsigned int mapped;          /* The number of files mapped. */
+  unsigned int chunks;          /* The number of extra chunks files were split into. */
+};
+
+
+/* a target found in a dependency database. */
+struct incdep_db_target
+{
+  const char *name;             /* file strcache. */
+  const KDEPDBREC *rec;         /* The record it was found in. */
+  const unsigned *edges;        /* {iTarget, cDeps, iDep0..iDepN} */
+  unsigned int seq;             /* The order it was found in. */
+  int superseded;               /* Set if a later record has the same target. */
+};
+
+/* includedep-db statistics. */
+struct incdep_db_stats
+{
+  big_int time;                 /* Nanoseconds spent reading and inserting. */
+  unsigned int files;           /* The number of databases read. */
+  unsigned int records;         /* The number of records. */
+  unsigned int targets;         /* The number of targets inserted. */
+  unsigned int superseded;      /* The number of targets replaced by later records. */
+  unsigned int compacted;       /* The number of databases rewritten without them. */
+};
+
+
 /*******************************************************************************
 *   Global Variables                                                           *
 *******************************************************************************/
@@ -199,27 +280,37 @@ static struct incdep * volatile incdep_tail_done;
 
 /* The handles to the worker threads. */
 #ifdef HAVE_PTHREAD
-# define INCDEP_MAX_THREADS 1
 static pthread_t incdep_threads[INCDEP_MAX_THREADS];
 
 #elif defined (WINDOWS32)
-# define INCDEP_MAX_THREADS 2
 static HANDLE incdep_threads[INCDEP_MAX_THREADS];
 
 #elif defined (__OS2__)
-# define INCDEP_MAX_THREADS 2
 static TID incdep_threads[INCDEP_MAX_THREADS];
 #endif
 
+#ifdef CONFIG_WITH_ALLOCCACHE_MAGAZINES
+/* The workers allocate records from magazines, the main thread frees them. */
+static struct alloccache incdep_rec_cache;
+#else
 static struct alloccache incdep_rec_caches[INCDEP_MAX_THREADS];
 static struct alloccache incdep_dep_caches[INCDEP_MAX_THREADS];
+#endif
+#ifndef INTERN_IN_WORKER
 static struct strcache2 incdep_dep_strcaches[INCDEP_MAX_THREADS];
 static struct strcache2 incdep_var_strcaches[INCDEP_MAX_THREADS];
+#endif
 static unsigned incdep_num_threads;
 
 /* flag indicating whether the worker threads should terminate or not. */
 static int volatile incdep_terminate;
 
+/* Statistics, the main thread is at index 0 and the workers follow. */
+static struct incdep_stats incdep_stats[INCDEP_MAX_THREADS + 1];
+static big_int incdep_flush_time;
+static unsigned incdep_max_threads_used;
+static struct incdep_db_stats incdep_db_stats;
+
 #ifdef __APPLE__
 /* malloc zone for the incdep threads. */
 static malloc_zone_t *incdep_zone;
@@ -295,26 +386,42 @@ incdep_xfree (struct incdep *cur, void *ptr)
 struct dep *
 incdep_alloc_dep (struct incdep *cur)
 {
+#ifdef CONFIG_WITH_ALLOCCACHE_MAGAZINES
+  if (cur->worker_tid != -1)
+    return alloccache_calloc_mt (&dep_cache);
+  return alloccache_calloc (&dep_cache);
+#else
   struct alloccache *cache;
   if (cur->worker_tid != -1)
     cache = &incdep_dep_caches[cur->worker_tid];
   else
     cache = &dep_cache;
   return alloccache_calloc (cache);
+#endif
 }
 
 /* allocate a record. */
 static void *
 incdep_alloc_rec (struct incdep *cur)
 {
+#ifdef CONFIG_WITH_ALLOCCACHE_MAGAZINES
+  (void)cur;
+  return alloccache_alloc_mt (&incdep_rec_cache);
+#else
   return alloccache_alloc (&incdep_rec_caches[cur->worker_tid]);
+#endif
 }
 
 /* free a record. */
 static void
 incdep_free_rec (struct incdep *cur, void *rec)
 {
+#ifdef CONFIG_WITH_ALLOCCACHE_MAGAZINES
+  (void)cur;
+  alloccache_free_mt (&incdep_rec_cache, rec);
+#else
   /*alloccache_free (&incdep_rec_caches[cur->worker_tid], rec); - doesn't work of course. */
+#endif
 }
 
 
@@ -330,6 +437,7 @@ incdep_cache_allocator (void *thrd, unsigned int size)
 #endif
 }
 
+#ifndef CONFIG_WITH_ALLOCCACHE_MAGAZINES
 /* term a cache. */
 static void
 incdep_cache_deallocator (void *thrd, void *ptr, unsigned int size)
@@ -338,6 +446,7 @@ incdep_cache_deallocator (void *thrd, void *ptr, unsigned int size)
   (void)size;
   free (ptr);
 }
+#endif
 
 /* acquires the lock */
 void
@@ -447,9 +556,9 @@ incdep_wait_todo (void)
 #endif
 }
 
-/* Reads a dep file into memory. */
+/* Reads or maps a dep file into memory. */
 static int
-incdep_read_file (struct incdep *cur, struct floc *f)
+incdep_read_file_it (struct incdep *cur, struct floc *f)
 {
   int fd;
   struct stat st;
@@ -471,6 +580,20 @@ incdep_read_file (struct incdep *cur, struct floc *f)
     }
   if (!fstat (fd, &st))
     {
+#ifdef INCDEP_USE_MMAP
+      if (st.st_size >= INCDEP_MMAP_MIN)
+        {
+          void *pv = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+          if (pv != MAP_FAILED)
+            {
+              close (fd);
+              cur->map_size = st.st_size;
+              cur->file_base = (char *)pv;
+              cur->file_end = cur->file_base + st.st_size;
+              return 0;
+            }
+        }
+#endif
       cur->file_base = incdep_xmalloc (cur, st.st_size + 1);
       if (read (fd, cur->file_base, st.st_size) == st.st_size)
         {
@@ -493,6 +616,42 @@ incdep_read_file (struct incdep *cur, struct floc *f)
   return -1;
 }
 
+/* Reads a dep file into memory, keeping count. */
+static int
+incdep_read_file (struct incdep *cur, struct floc *f)
+{
+  struct incdep_stats *stats = &incdep_stats[cur->worker_tid + 1];
+  big_int start = nano_timestamp ();
+  int rc = incdep_read_file_it (cur, f);
+  if (!rc)
+    {
+      stats->files++;
+      stats->bytes += cur->file_end - cur->file_base;
+#ifdef INCDEP_USE_MMAP
+      if (cur->map_size)
+        stats->mapped++;
+#endif
+    }
+  stats->read_time += nano_timestamp () - start;
+  return rc;
+}
+
+/* Frees the file data. */
+static void
+incdep_free_file_data (struct incdep *cur)
+{
+#ifdef INCDEP_USE_MMAP
+  if (cur->map_size)
+    {
+      munmap (cur->file_base, cur->map_size);
+      cur->map_size = 0;
+    }
+  else
+#endif
+    incdep_xfree (cur, cur->file_base);
+  cur->file_base = cur->file_end = NULL;
+}
+
 /* Free the incdep structure. */
 static void
 incdep_freeit (struct incdep *cur)
@@ -503,11 +662,123 @@ incdep_freeit (struct incdep *cur)
   assert (!cur->recorded_files_head);
 #endif
 
-  incdep_xfree (cur, cur->file_base);
+  incdep_free_file_data (cur);
   cur->next = NULL;
   free (cur);
 }
 
+#ifdef PARSE_IN_WORKER
+/* Checks if the line ending at EOL is continued on the next one. */
+MY_INLINE int
+incdep_is_continued (const char *start, const char *eol)
+{
+  if (eol > start && eol[-1] == '\r')
+    eol--;
+  return eol > start && eol[-1] == '\\';
+}
+
+/* Splits a big file into chunks that can be parsed by different workers,
+   queuing all but the first one.  The split points are at the start of
+   lines that are not continuations, and files with define statements are
+   not split as we would have to track the endefs.  The records of the
+   chunks are flushed together and in order when the last one has been
+   parsed.  Called by a worker without the lock. */
+static void
+incdep_split_file (struct incdep *cur)
+{
+  const char *file_end = cur->file_end;
+  const char *p = cur->file_base;
+  const char *next_split;
+  struct incdep *head = NULL;
+  struct incdep **tailp = &head;
+  struct incdep *chunk;
+  unsigned int chunks = 0;
+  size_t name_len;
+
+  if (   incdep_num_threads < 2
+      || !p
+      || (size_t)(file_end - p) < 2 * INCDEP_CHUNK_SIZE)
+    return;
+
+  name_len = strlen (cur->name);
+  next_split = p + INCDEP_CHUNK_SIZE;
+  while (p < file_end && file_end - next_split >= INCDEP_CHUNK_SIZE / 2)
+    {
+      const char *eol;
+
+      while (p < file_end && isblank ((unsigned char)*p))
+        p++;
+      if (file_end - p >= 7 && strneq (p, "define ", 7))
+        {
+          /* Give up. */
+          while (head)
+            {
+              chunk = head->chunk_next;
+              free (head);
+              head = chunk;
+            }
+          return;
+        }
+
+      eol = memchr (p, '\n', file_end - p);
+      if (!eol)
+        break;
+      if (eol + 1 >= next_split && !incdep_is_continued (p, eol))
+        {
+          /* Start a new chunk at the next line. */
+          if (*tailp)
+            (*tailp)->file_end = (char *)eol + 1;
+          chunk = xmalloc (sizeof (*chunk) + name_len);
+          memcpy (chunk->name, cur->name, name_len + 1);
+          chunk->file_base = (char *)eol + 1;
+          chunk->file_end = cur->file_end;
+#ifdef INCDEP_USE_MMAP
+          chunk->map_size = 0;
+#endif
+          chunk->worker_tid = -1;
+          chunk->chunk_leader = cur;
+          chunk->chunk_next = NULL;
+          chunk->chunks_pending = 0;
+          chunk->err_line_no = 0;
+          chunk->err_msg = NULL;
+          chunk->recorded_variables_in_set_head = NULL;
+          chunk->recorded_variables_in_set_tail = NULL;
+          chunk->recorded_variable_defs_head = NULL;
+          chunk->recorded_variable_defs_tail = NULL;
+          chunk->recorded_files_head = NULL;
+          chunk->recorded_files_tail = NULL;
+          chunk->next = NULL;
+          if (head)
+            tailp = &(*tailp)->chunk_next;
+          *tailp = chunk;
+          chunks++;
+          next_split = eol + 1 + INCDEP_CHUNK_SIZE;
+        }
+      p = eol + 1;
+    }
+  if (!head)
+    return;
+
+  /* The leader gets the first chunk and owns the file data. */
+  cur->file_end = head->file_base;
+  cur->chunk_leader = cur;
+  cur->chunk_next = head;
+  cur->chunks_pending = chunks + 1;
+  incdep_stats[cur->worker_tid + 1].chunks += chunks;
+
+  /* Queue the other chunks first in line. */
+  incdep_lock ();
+  for (chunk = head; chunk; chunk = chunk->chunk_next)
+    chunk->next = chunk->chunk_next;
+  (*tailp)->next = incdep_head_todo;
+  if (!incdep_head_todo)
+    incdep_tail_todo = *tailp;
+  incdep_head_todo = head;
+  incdep_signal_todo ();
+  incdep_unlock ();
+}
+#endif /* PARSE_IN_WORKER */
+
 /* A worker thread. */
 void
 incdep_worker (int thrd)
@@ -535,17 +806,29 @@ incdep_worker (int thrd)
       incdep_unlock ();
       cur->worker_tid = thrd;
 
-      incdep_read_file (cur, NILF);
+      if (!cur->file_base)
+        incdep_read_file (cur, NILF);
 #ifdef PARSE_IN_WORKER
+      if (!cur->chunk_leader)
+        incdep_split_file (cur);
       eval_include_dep_file (cur, NILF);
 #endif
 
       cur->worker_tid = -1;
       incdep_lock ();
 
-      /* insert finished job into the done list. */
+      /* insert finished job into the done list. The chunks of a split file
+         are inserted as one when the last of them is done. */
 
       incdep_num_reading--;
+#ifdef PARSE_IN_WORKER
+      if (cur->chunk_leader)
+        {
+          if (--cur->chunk_leader->chunks_pending != 0)
+            continue;
+          cur = cur->chunk_leader;
+        }
+#endif
       cur->next = NULL;
       if (incdep_tail_done)
         incdep_tail_done->next = cur;
@@ -557,6 +840,9 @@ incdep_worker (int thrd)
    }
 
   incdep_unlock ();
+#ifdef CONFIG_WITH_ALLOCCACHE_MAGAZINES
+  alloccache_thread_term ();
+#endif
 }
 
 /* Thread library specific thread functions wrapping incdep_wroker. */
@@ -647,6 +933,45 @@ incdep_are_threads_enabled (void)
   return 1;
 }
 
+/* Figures out how many worker threads to use.  This is the number of
+   online CPUs unless overridden by the KMK_INCDEP_THREADS variable. */
+static unsigned
+incdep_get_thread_count (void)
+{
+  long count = -1;
+  struct variable *var = lookup_variable (STRING_SIZE_TUPLE ("KMK_INCDEP_THREADS"));
+
+  if (var && *var->value)
+    {
+      char *endp;
+      count = strtol (var->value, &endp, 10);
+      if (*endp || count < 0)
+        {
+          error (NILF, _("KMK_INCDEP_THREADS: invalid thread count `%s'"), var->value);
+          count = -1;
+        }
+    }
+
+  if (count < 0)
+    {
+#if defined (WINDOWS32)
+      SYSTEM_INFO si;
+      GetSystemInfo (&si);
+      count = si.dwNumberOfProcessors;
+#elif defined (_SC_NPROCESSORS_ONLN)
+      count = sysconf (_SC_NPROCESSORS_ONLN);
+#else
+      count = 2;
+#endif
+      if (count < 1)
+        count = 1;
+    }
+
+  if (count > INCDEP_MAX_THREADS)
+    count = INCDEP_MAX_THREADS;
+  return (unsigned)count;
+}
+
 /* Creates the the worker threads. */
 static void
 incdep_init (struct floc *f)
@@ -716,11 +1041,30 @@ incdep_init (struct floc *f)
   incdep_terminate = 0;
   if (incdep_are_threads_enabled())
     {
-      incdep_num_threads = sizeof (incdep_threads) / sizeof (incdep_threads[0]);
-      if (incdep_num_threads + 1 > job_slots)
-        incdep_num_threads = job_slots <= 1 ? 1 : job_slots - 1;
+      incdep_num_threads = incdep_get_thread_count ();
+#ifdef INTERN_IN_WORKER
+      /* Thread 0 of the file strcache is the main thread, the workers are
+         1 thru incdep_num_threads and must all get a segment slot. */
+      if (incdep_num_threads > STRCACHE2_MAX_THREADS - 1)
+        incdep_num_threads = STRCACHE2_MAX_THREADS - 1;
+#endif
+      if (incdep_num_threads > incdep_max_threads_used)
+        incdep_max_threads_used = incdep_num_threads;
+#ifdef CONFIG_WITH_ALLOCCACHE_MAGAZINES
+      if (!incdep_rec_cache.size)
+        {
+          unsigned rec_size = sizeof (struct incdep_variable_in_set);
+          if (rec_size < sizeof (struct incdep_variable_def))
+            rec_size = sizeof (struct incdep_variable_def);
+          if (rec_size < sizeof (struct incdep_recorded_files))
+            rec_size = sizeof (struct incdep_recorded_files);
+          alloccache_init (&incdep_rec_cache, rec_size, "incdep rec",
+                           incdep_cache_allocator, NULL);
+        }
+#endif
       for (i = 0; i < incdep_num_threads; i++)
         {
+#ifndef CONFIG_WITH_ALLOCCACHE_MAGAZINES
           /* init caches */
           unsigned rec_size = sizeof (struct incdep_variable_in_set);
           if (rec_size < sizeof (struct incdep_variable_def))
@@ -731,6 +1075,8 @@ incdep_init (struct floc *f)
                            incdep_cache_allocator, (void *)(size_t)i);
           alloccache_init (&incdep_dep_caches[i], sizeof(struct dep), "incdep dep",
                            incdep_cache_allocator, (void *)(size_t)i);
+#endif
+#ifndef INTERN_IN_WORKER
           strcache2_init (&incdep_dep_strcaches[i],
                           "incdep dep", /* name */
                           65536,        /* hash size */
@@ -748,6 +1094,7 @@ incdep_init (struct floc *f)
                           0,            /* default segment size*/
                           0,            /* case insensitive */
                           0);           /* thread safe */
+#endif
 
           /* create the thread. */
 #if defined (HAVE_PTHREAD) && !defined (CONFIG_WITHOUT_THREADS)
@@ -813,11 +1160,15 @@ incdep_flush_and_term (void)
     {
       /* more later? */
 
+#ifndef CONFIG_WITH_ALLOCCACHE_MAGAZINES
       /* terminate or join up the allocation caches. */
       alloccache_term (&incdep_rec_caches[i], incdep_cache_deallocator, (void *)(size_t)i);
       alloccache_join (&dep_cache, &incdep_dep_caches[i]);
+#endif
+#ifndef INTERN_IN_WORKER
       strcache2_term (&incdep_dep_strcaches[i]);
       strcache2_term (&incdep_var_strcaches[i]);
+#endif
     }
   incdep_num_threads = 0;
 
@@ -832,13 +1183,19 @@ incdep_flush_and_term (void)
 /* Flushes a strcache entry returning the actual string cache entry.
    The input is freed! */
 static const char *
-incdep_flush_strcache_entry (struct strcache2_entry *entry)
+incdep_flush_strcache_entry (const char *name)
 {
+#ifdef INTERN_IN_WORKER
+  /* Already in the file string cache. */
+  return name;
+#else
+  struct strcache2_entry *entry = (struct strcache2_entry *)name;
   if (!entry->user)
     entry->user = (void *) strcache2_add_hashed_file (&file_strcache,
                                                       (const char *)(entry + 1),
                                                       entry->length, entry->hash);
   return (const char *)entry->user;
+#endif
 }
 
 /* Flushes the recorded instructions. */
@@ -857,9 +1214,9 @@ incdep_flush_recorded_instructions (struct incdep *cur)
     do
       {
         void *free_me = rec_vis;
-        unsigned int name_length = rec_vis->name_entry->length;
-        define_variable_in_set (incdep_flush_strcache_entry (rec_vis->name_entry),
-                                name_length,
+        const char *name = incdep_flush_strcache_entry (rec_vis->name);
+        define_variable_in_set (name,
+                                strcache2_get_len (&file_strcache, name),
                                 rec_vis->value,
                                 rec_vis->value_length,
                                 rec_vis->duplicate_value,
@@ -881,7 +1238,7 @@ incdep_flush_recorded_instructions (struct incdep *cur)
       {
         void *free_me = rec_vd;
         do_variable_definition_2 (rec_vd->flocp,
-                                  incdep_flush_strcache_entry (rec_vd->name_entry),
+                                  incdep_flush_strcache_entry (rec_vd->name),
                                   rec_vd->value,
                                   rec_vd->value_length,
                                   0,
@@ -906,11 +1263,11 @@ incdep_flush_recorded_instructions (struct incdep *cur)
         struct nameseq *filenames;
 
         for (dep = rec_f->deps; dep; dep = dep->next)
-          dep->name = incdep_flush_strcache_entry ((struct strcache2_entry *)dep->name);
+          dep->name = incdep_flush_strcache_entry (dep->name);
 
         filenames = (struct nameseq *) alloccache_alloc (&nameseq_cache);
         filenames->next = 0;
-        filenames->name = incdep_flush_strcache_entry (rec_f->filename_entry);
+        filenames->name = incdep_flush_strcache_entry (rec_f->filename);
 
         record_files (filenames,
                       rec_f->pattern,
@@ -951,6 +1308,11 @@ incdep_dep_strcache (struct incdep *cur, const char *str, int len)
   const char *ret;
   if (cur->worker_tid == -1)
     {
+#ifdef CONFIG_WITH_STRCACHE2
+      /* The file data may be mapped read-only, and strcache2 doesn't
+         need the string to be terminated anyway. */
+      ret = strcache_add_len (str, len);
+#else
       /* Make sure the string is terminated before we hand it to
          strcache_add_len so it does have to make a temporary copy
          of it on the stack. */
@@ -958,12 +1320,18 @@ incdep_dep_strcache (struct incdep *cur, const char *str, int len)
       ((char *)str)[len] = '\0';
       ret = strcache_add_len (str, len);
       ((char *)str)[len] = ch;
+#endif
     }
   else
     {
+#ifdef INTERN_IN_WORKER
+      /* Add it straight to the file strcache. */
+      ret = strcache2_add_concurrent (&file_strcache, cur->worker_tid + 1, str, len);
+#else
       /* Add it out the strcache of the thread. */
       ret = strcache2_add (&incdep_dep_strcaches[cur->worker_tid], str, len);
       ret = (const char *)strcache2_get_entry(&incdep_dep_strcaches[cur->worker_tid], ret);
+#endif
     }
   return ret;
 }
@@ -982,9 +1350,14 @@ incdep_var_strcache (struct incdep *cur, const char *str, int len)
     }
   else
     {
+#ifdef INTERN_IN_WORKER
+      /* Add it straight to the file strcache. */
+      ret = strcache2_add_concurrent (&file_strcache, cur->worker_tid + 1, str, len);
+#else
       /* Add it out the strcache of the thread. */
       ret = strcache2_add (&incdep_var_strcaches[cur->worker_tid], str, len);
       ret = (const char *)strcache2_get_entry(&incdep_var_strcaches[cur->worker_tid], ret);
+#endif
     }
   return ret;
 }
@@ -1013,7 +1386,7 @@ incdep_record_variable_in_set (struct incdep *cur,
     {
       struct incdep_variable_in_set *rec =
         (struct incdep_variable_in_set *)incdep_alloc_rec (cur);
-      rec->name_entry = (struct strcache2_entry *)name;
+      rec->name = name;
       rec->value = value;
       rec->value_length = value_length;
       rec->duplicate_value = duplicate_value;
@@ -1053,7 +1426,7 @@ incdep_record_variable_def (struct incdep *cur,
       struct incdep_variable_def *rec =
         (struct incdep_variable_def *)incdep_alloc_rec (cur);
       rec->flocp = flocp;
-      rec->name_entry = (struct strcache2_entry *)name;
+      rec->name = name;
       rec->value = value;
       rec->value_length = value_length;
       rec->origin = origin;
@@ -1095,7 +1468,7 @@ incdep_record_files (struct incdep *cur,
       struct incdep_recorded_files *rec =
         (struct incdep_recorded_files *) incdep_alloc_rec (cur);
 
-      rec->filename_entry = (struct strcache2_entry *)filename;
+      rec->filename = filename;
       rec->pattern = pattern;
       rec->pattern_percent = pattern_percent;
       rec->deps = deps;
@@ -1142,10 +1515,12 @@ eval_include_dep_file (struct incdep *curdep, struct floc *f)
   const char *file_end = curdep->file_end;
   const char *cur = curdep->file_base;
   const char *endp;
+  big_int start;
 
   /* if no file data, just return immediately. */
   if (!cur)
     return;
+  start = nano_timestamp ();
 
   /* now parse the file. */
   while (cur < file_end)
@@ -1183,7 +1558,7 @@ eval_include_dep_file (struct incdep *curdep, struct floc *f)
       /* define var
          ...
          endef */
-      if (strneq (cur, "define ", 7))
+      if (file_end - cur >= 7 && strneq (cur, "define ", 7))
         {
           const char *var;
           unsigned var_len;
@@ -1195,7 +1570,7 @@ eval_include_dep_file (struct incdep *curdep, struct floc *f)
 
           /* extract the variable name. */
           cur += 7;
-          while (isblank ((unsigned char)*cur))
+          while (cur < file_end && isblank ((unsigned char)*cur))
             ++cur;
           value_start = endp = memchr (cur, '\n', file_end - cur);
           if (!endp)
@@ -1535,22 +1910,370 @@ eval_include_dep_file (struct incdep *curdep, struct floc *f)
         }
     }
 
-  /* free the file data */
-  incdep_xfree (curdep, curdep->file_base);
-  curdep->file_base = curdep->file_end = NULL;
+  incdep_stats[curdep->worker_tid + 1].parse_time += nano_timestamp () - start;
+
+  /* free the file data, the chunks of a split file share the leader's. */
+#ifdef PARSE_IN_WORKER
+  if (curdep->chunk_leader)
+    {
+      if (curdep->chunk_leader != curdep)
+        curdep->file_base = curdep->file_end = NULL;
+      return;
+    }
+#endif
+  incdep_free_file_data (curdep);
+}
+
+/* Gets the path string of path table entry IPATH in REC. */
+MY_INLINE const char *
+incdep_db_path (const KDEPDBREC *rec, unsigned int ipath, unsigned int *lenp)
+{
+  const KDEPDBPATH *path = (const KDEPDBPATH *)(rec + 1) + ipath;
+  const char *strings = (const char *)((const unsigned *)((const KDEPDBPATH *)(rec + 1) + rec->cPaths)
+                                       + rec->cEdges);
+  *lenp = path->cchString;
+  return strings + path->offString;
+}
+
+/* Checks that the dependency database record REC is sane and fits inside
+   the CB bytes at its address. Returns the number of targets, or -1. */
+static int
+incdep_db_validate_record (const KDEPDBREC *rec, size_t cb)
+{
+  const KDEPDBPATH *paths;
+  const unsigned *edges;
+  const unsigned *edges_end;
+  const char *strings;
+  size_t needed;
+  unsigned int i;
+  int targets = 0;
+
+  if (   cb < sizeof (*rec)
+      || rec->u32Magic != KDEPDBREC_MAGIC
+      || rec->cbRec < sizeof (*rec)
+      || rec->cbRec > cb
+      || rec->cbRec % KDEPDB_ALIGN)
+    return -1;
+  if (   rec->cPaths > rec->cbRec / sizeof (KDEPDBPATH)
+      || rec->cEdges > rec->cbRec / sizeof (unsigned)
+      || rec->cbStrings > rec->cbRec)
+    return -1;
+  needed = sizeof (*rec)
+         + (size_t)rec->cPaths * sizeof (KDEPDBPATH)
+         + (size_t)rec->cEdges * sizeof (unsigned)
+         + rec->cbStrings;
+  if (needed > rec->cbRec)
+    return -1;
+
+  /* the path table. */
+  paths = (const KDEPDBPATH *)(rec + 1);
+  edges = (const unsigned *)(paths + rec->cPaths);
+  edges_end = edges + rec->cEdges;
+  strings = (const char *)edges_end;
+  for (i = 0; i < rec->cPaths; i++)
+    if (   paths[i].offString >= rec->cbStrings
+        || paths[i].cchString == 0
+        || paths[i].cchString >= rec->cbStrings - paths[i].offString
+        || strings[paths[i].offString + paths[i].cchString] != '\0')
+      return -1;
+
+  /* the edge groups. */
+  while (edges < edges_end)
+    {
+      if (   edges_end - edges < 2
+          || edges[0] >= rec->cPaths
+          || edges[1] > (unsigned)(edges_end - edges) - 2)
+        return -1;
+      for (i = 0; i < edges[1]; i++)
+        if (edges[2 + i] >= rec->cPaths)
+          return -1;
+      edges += 2 + edges[1];
+      targets++;
+    }
+
+  return targets;
+}
+
+/* qsort callback ordering the targets by name and then by descending
+   sequence number. */
+static int
+incdep_db_target_cmp (const void *pv1, const void *pv2)
+{
+  const struct incdep_db_target *t1 = *(const struct incdep_db_target **)pv1;
+  const struct incdep_db_target *t2 = *(const struct incdep_db_target **)pv2;
+  if (t1->name != t2->name)
+    return (const char *)t1->name < (const char *)t2->name ? -1 : 1;
+  return t1->seq < t2->seq ? 1 : t1->seq > t2->seq ? -1 : 0;
+}
+
+#ifdef INCDEP_DB_COMPACT
+/* Replaces the dependency database of CURDEP with a copy holding only the
+   targets that weren't superseded, one record each. Quietly leaves it alone
+   if a writer holds the lock or has appended to it since it was read, the
+   next load will get it. Returns 1 if the database was compacted, else 0. */
+static int
+incdep_db_compact (struct incdep *curdep, const struct incdep_db_target *targets,
+                   unsigned int num_targets)
+{
+  size_t file_size = curdep->file_end - curdep->file_base;
+  struct flock lock;
+  struct stat st_fd;
+  struct stat st_path;
+  char *buf = NULL;
+  size_t buf_size = 0;
+  size_t buf_len = 0;
+  char *tmp_name;
+  int tmp_fd;
+  int fd;
+  int rc = 0;
+  unsigned int i;
+
+  /* the writers take a shared lock and start over if the file is replaced. */
+
+  fd = open (curdep->name, O_RDWR, 0);
+  if (fd < 0)
+    return 0;
+  memset (&lock, 0, sizeof (lock));
+  lock.l_type = F_WRLCK;
+  lock.l_whence = SEEK_SET;
+  if (   fcntl (fd, F_SETLK, &lock) != 0
+      || fstat (fd, &st_fd) != 0
+      || stat (curdep->name, &st_path) != 0
+      || st_fd.st_ino != st_path.st_ino
+      || st_fd.st_dev != st_path.st_dev
+      || (size_t)st_fd.st_size != file_size)
+    {
+      close (fd);
+      return 0;
+    }
+
+  /* build the new database in memory. */
+
+  for (i = 0; i < num_targets; i++)
+    {
+      const struct incdep_db_target *target = &targets[i];
+      unsigned int num_paths = target->edges[1] + 1;
+      size_t strings_size = 0;
+      size_t rec_size;
+      KDEPDBREC *rec;
+      KDEPDBPATH *paths;
+      unsigned *edges;
+      char *strings;
+      unsigned int j;
+      if (target->superseded)
+        continue;
+
+      /* path 0 is the target, the dependencies follow. */
+      for (j = 0; j < num_paths; j++)
+        {
+          unsigned int len;
+          incdep_db_path (target->rec, target->edges[j ? j + 1 : 0], &len);
+          strings_size += len + 1;
+        }
+      rec_size = sizeof (*rec) + num_paths * sizeof (*paths)
+               + (num_paths + 1) * sizeof (*edges) + strings_size;
+      rec_size = (rec_size + KDEPDB_ALIGN - 1) & ~(size_t)(KDEPDB_ALIGN - 1);
+      if (buf_len + rec_size > buf_size)
+        {
+          buf_size = (buf_len + rec_size) * 2;
+          buf = xrealloc (buf, buf_size);
+        }
+
+      rec = (KDEPDBREC *)(buf + buf_len);
+      memset (rec, 0, rec_size);
+      paths = (KDEPDBPATH *)(rec + 1);
+      edges = (unsigned *)(paths + num_paths);
+      strings = (char *)(edges + num_paths + 1);
+      rec->u32Magic = KDEPDBREC_MAGIC;
+      rec->cbRec = (unsigned)rec_size;
+      rec->fFlags = target->rec->fFlags;
+      rec->cPaths = num_paths;
+      rec->cEdges = num_paths + 1;
+      rec->cbStrings = (unsigned)strings_size;
+      edges[0] = 0;
+      edges[1] = num_paths - 1;
+      strings_size = 0;
+      for (j = 0; j < num_paths; j++)
+        {
+          unsigned int len;
+          const char *name = incdep_db_path (target->rec, target->edges[j ? j + 1 : 0], &len);
+          paths[j].offString = (unsigned)strings_size;
+          paths[j].cchString = len;
+          memcpy (strings + strings_size, name, len + 1);
+          strings_size += len + 1;
+          if (j)
+            edges[j + 1] = j;
+        }
+      buf_len += rec_size;
+    }
+
+  /* write it next to the old one and rename it over it while still holding
+     the lock. */
+
+  tmp_name = xmalloc (strlen (curdep->name) + 32);
+  sprintf (tmp_name, "%s.%ld.tmp", curdep->name, (long)getpid ());
+  tmp_fd = open (tmp_name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (tmp_fd >= 0)
+    {
+      int ok = buf_len == 0
+            || write (tmp_fd, buf, buf_len) == (ssize_t)buf_len;
+      fchmod (tmp_fd, st_fd.st_mode & 07777);
+      if (close (tmp_fd) == 0 && ok && rename (tmp_name, curdep->name) == 0)
+        rc = 1;
+      else
+        unlink (tmp_name);
+    }
+
+  free (tmp_name);
+  free (buf);
+  close (fd);
+  return rc;
+}
+#endif /* INCDEP_DB_COMPACT */
+
+/* Inserts the contents of a binary dependency database (see kDep.h) that has
+   been read into memory. Since the tools append to the database, a target
+   can have more than one record and only the last one counts. */
+static void
+eval_include_dep_db (struct incdep *curdep, struct floc *f)
+{
+  const char *cur = curdep->file_base;
+  const char *file_end = curdep->file_end;
+  struct incdep_db_target *targets = NULL;
+  struct incdep_db_target **sorted;
+  unsigned int num_targets = 0;
+  unsigned int max_targets = 0;
+  unsigned int num_superseded = 0;
+  unsigned int i;
+
+  /* collect the targets of the sane records. */
+
+  while (cur < file_end)
+    {
+      const KDEPDBREC *rec = (const KDEPDBREC *)cur;
+      const unsigned *edges;
+      int rec_targets = incdep_db_validate_record (rec, file_end - cur);
+      if (rec_targets < 0)
+        {
+          /* Probably a truncated append, the rest is useless. */
+          error (f, _("%s: bad dependency database record at offset %lu, ignoring the rest"),
+                 curdep->name, (unsigned long)(cur - curdep->file_base));
+          break;
+        }
+      incdep_db_stats.records++;
+
+      if (num_targets + rec_targets > max_targets)
+        {
+          max_targets = (num_targets + rec_targets) * 2 + 16;
+          targets = xrealloc (targets, max_targets * sizeof (targets[0]));
+        }
+      edges = (const unsigned *)((const KDEPDBPATH *)(rec + 1) + rec->cPaths);
+      while (rec_targets-- > 0)
+        {
+          struct incdep_db_target *target = &targets[num_targets];
+          unsigned int len;
+          const char *name = incdep_db_path (rec, edges[0], &len);
+          target->name = incdep_dep_strcache (curdep, name, len);
+          target->rec = rec;
+          target->edges = edges;
+          target->seq = num_targets++;
+          target->superseded = 0;
+          edges += 2 + edges[1];
+        }
+
+      cur += rec->cbRec;
+    }
+
+  /* weed out the targets that have later records. */
+
+  if (num_targets > 1)
+    {
+      sorted = xmalloc (num_targets * sizeof (sorted[0]));
+      for (i = 0; i < num_targets; i++)
+        sorted[i] = &targets[i];
+      qsort (sorted, num_targets, sizeof (sorted[0]), incdep_db_target_cmp);
+      for (i = 1; i < num_targets; i++)
+        if (sorted[i]->name == sorted[i - 1]->name)
+          {
+            sorted[i]->superseded = 1;
+            num_superseded++;
+          }
+      free (sorted);
+      incdep_db_stats.superseded += num_superseded;
+    }
+
+#ifdef INCDEP_DB_COMPACT
+  /* rewrite it once half of it is dead weight, so the load time follows the
+     number of targets rather than the number of builds. Not if the tail is
+     bad, it may be an append in progress. */
+  if (   cur >= file_end
+      && num_superseded
+      && num_superseded * 2 >= num_targets
+      && incdep_db_compact (curdep, targets, num_targets))
+    incdep_db_stats.compacted++;
+#endif
+
+  /* enter the files with their dependencies in the order they were added. */
+
+  for (i = 0; i < num_targets; i++)
+    {
+      const struct incdep_db_target *target = &targets[i];
+      const unsigned *iter;
+      const unsigned *end;
+      struct dep *deps = NULL;
+      struct dep **nextdep = &deps;
+      if (target->superseded)
+        continue;
+
+      iter = target->edges + 2;
+      end = iter + target->edges[1];
+      for (; iter < end; iter++)
+        {
+          unsigned int len;
+          const char *name = incdep_db_path (target->rec, *iter, &len);
+          struct dep *dep = incdep_alloc_dep (curdep);
+          dep->name = incdep_dep_strcache (curdep, name, len);
+          dep->includedep = 1;
+          *nextdep = dep;
+          nextdep = &dep->next;
+        }
+      incdep_record_files (curdep, target->name, NULL, NULL, deps, 0, NULL, 0, 0, f);
+      incdep_db_stats.targets++;
+
+      /* the empty rules for the dependencies. */
+      if (target->rec->fFlags & KDEPDBREC_F_STUBS)
+        for (iter = target->edges + 2; iter < end; iter++)
+          {
+            unsigned int len;
+            const char *name = incdep_db_path (target->rec, *iter, &len);
+            incdep_record_files (curdep, incdep_dep_strcache (curdep, name, len),
+                                 NULL, NULL, NULL, 0, NULL, 0, 0, f);
+          }
+    }
+
+  free (targets);
 }
 
 /* Flushes the incdep todo and done lists. */
 static void
 incdep_flush_it (struct floc *f)
 {
+  big_int start;
+
   incdep_lock ();
   for (;;)
     {
       struct incdep *cur = incdep_head_done;
 
-      /* if the done list is empty, grab a todo list entry. */
-      if (!cur && incdep_head_todo)
+      /* if the done list is empty, grab a todo list entry. Leave the
+         chunks of split files to the workers, their records must be
+         flushed together. */
+      if (   !cur
+          && incdep_head_todo
+#ifdef PARSE_IN_WORKER
+          && !incdep_head_todo->chunk_leader
+#endif
+         )
         {
           cur = incdep_head_todo;
           if (cur->next)
@@ -1569,7 +2292,7 @@ incdep_flush_it (struct floc *f)
 
       /* if the todo list and done list are empty we're either done
          or will have to wait for the thread(s) to finish. */
-      if (!cur && !incdep_num_reading)
+      if (!cur && !incdep_head_todo && !incdep_num_reading)
           break; /* done */
       if (!cur)
         {
@@ -1582,20 +2305,36 @@ incdep_flush_it (struct floc *f)
       incdep_head_done = incdep_tail_done = NULL;
       incdep_unlock ();
 
+      start = nano_timestamp ();
       while (cur)
         {
           struct incdep *next = cur->next;
 #ifdef PARSE_IN_WORKER
+          struct incdep *chunk = cur->chunk_next;
           incdep_flush_recorded_instructions (cur);
+          while (chunk)
+            {
+              struct incdep *next_chunk = chunk->chunk_next;
+              incdep_flush_recorded_instructions (chunk);
+              incdep_freeit (chunk);
+              chunk = next_chunk;
+            }
 #else
           eval_include_dep_file (cur, f);
 #endif
           incdep_freeit (cur);
           cur = next;
         }
+      incdep_flush_time += nano_timestamp () - start;
 
       incdep_lock ();
     } /* outer loop */
+
+#ifdef INTERN_IN_WORKER
+  /* The workers are all idle now, so leave concurrent mode and let the
+     file strcache do any rehashing it has pending. */
+  strcache2_set_concurrent (&file_strcache, 0);
+#endif
   incdep_unlock ();
 }
 
@@ -1618,10 +2357,23 @@ eval_include_dep (const char *names, struct floc *f, enum incdep_op op)
     {
        cur = xmalloc (sizeof (*cur) + name_len); /* not incdep_xmalloc here */
        cur->file_base = cur->file_end = NULL;
+#ifdef INCDEP_USE_MMAP
+       cur->map_size = 0;
+#endif
        memcpy (cur->name, name, name_len);
        cur->name[name_len] = '\0';
        cur->worker_tid = -1;
+#ifdef CONFIG_WITH_MAKEFILE_SNAPSHOT
+       snapshot_record_input (name, name_len);
+#endif
+#ifdef CONFIG_WITH_SERVER
+       if (server_recording)
+         server_record_input (name, name_len);
+#endif
 #ifdef PARSE_IN_WORKER
+       cur->chunk_leader = NULL;
+       cur->chunk_next = NULL;
+       cur->chunks_pending = 0;
        cur->err_line_no = 0;
        cur->err_msg = NULL;
        cur->recorded_variables_in_set_head = NULL;
@@ -1640,6 +2392,26 @@ eval_include_dep (const char *names, struct floc *f, enum incdep_op op)
        tail = cur;
     }
 
+  if (op == incdep_db)
+    {
+      /* binary databases, these are quickly dealt with on this thread. */
+
+      cur = head;
+      while (cur)
+        {
+          struct incdep *next = cur->next;
+          big_int start = nano_timestamp ();
+          if (!incdep_read_file (cur, f))
+            {
+              eval_include_dep_db (cur, f);
+              incdep_db_stats.files++;
+            }
+          incdep_freeit (cur);
+          incdep_db_stats.time += nano_timestamp () - start;
+          cur = next;
+        }
+    }
+  else
 #ifdef ELECTRIC_HEAP
   if (1)
 #else
@@ -1669,6 +2441,15 @@ eval_include_dep (const char *names, struct floc *f, enum incdep_op op)
 
       incdep_lock ();
 
+#ifdef INTERN_IN_WORKER
+      /* The workers add to the file strcache while there is work queued.
+         If they are all idle, take the chance to let it rehash first. */
+      if (!incdep_head_todo && !incdep_num_reading)
+        strcache2_set_concurrent (&file_strcache, 0);
+      if (incdep_num_threads)
+        strcache2_set_concurrent (&file_strcache, 1);
+#endif
+
       if (incdep_tail_todo)
         incdep_tail_todo->next = head;
       else
@@ -1685,5 +2466,45 @@ eval_include_dep (const char *names, struct floc *f, enum incdep_op op)
     }
 }
 
-#endif /* CONFIG_WITH_INCLUDEDEP */
+#ifdef CONFIG_WITH_PRINT_STATS_SWITCH
+/* Prints the includedep statistics. */
+void
+print_incdep_stats (void)
+{
+  struct incdep_stats tot;
+  char buf1[64];
+  char buf2[64];
+  char buf3[64];
+  unsigned i;
+
+  memset (&tot, 0, sizeof (tot));
+  for (i = 0; i < sizeof (incdep_stats) / sizeof (incdep_stats[0]); i++)
+    {
+      tot.read_time  += incdep_stats[i].read_time;
+      tot.parse_time += incdep_stats[i].parse_time;
+      tot.bytes      += incdep_stats[i].bytes;
+      tot.files      += incdep_stats[i].files;
+      tot.mapped     += incdep_stats[i].mapped;
+      tot.chunks     += incdep_stats[i].chunks;
+    }
+  if (!tot.files)
+    return;
+
+  format_elapsed_nano (buf1, sizeof (buf1), tot.read_time);
+  format_elapsed_nano (buf2, sizeof (buf2), tot.parse_time);
+  format_elapsed_nano (buf3, sizeof (buf3), incdep_flush_time);
+  printf (_("\n# includedep: %u files (%u mapped), %lu bytes, %u extra chunks, %u worker threads\n"),
+          tot.files, tot.mapped, tot.bytes, tot.chunks, incdep_max_threads_used);
+  printf (_("#             read %s, parse %s (all threads), flush %s\n"),
+          buf1, buf2, buf3);
+  if (incdep_db_stats.files)
+    {
+      format_elapsed_nano (buf1, sizeof (buf1), incdep_db_stats.time);
+      printf (_("#             %u databases (%u compacted), %u records, %u targets (%u superseded) in %s\n"),
+              incdep_db_stats.files, incdep_db_stats.compacted, incdep_db_stats.records,
+              incdep_db_stats.targets, incdep_db_stats.superseded, buf1);
+    }
+}
+#endif /* CONFIG_WITH_PRINT_STATS_SWITCH */
 
+#endif /* CONFIG_WITH_INCLUDEDEP */
@@ -29,13 +29,27 @@ this program.  If not, see <http://www.gnu.org/licenses/>.  */
 #ifdef CONFIG_WITH_KMK_BUILTIN
 # include "kmkbuiltin.h"
 #endif
+#if defined (CONFIG_WITH_KMK_BUILTIN_ASYNC) \
+ && (defined (WINDOWS32) || defined (__EMX__) || defined (VMS) || defined (__MSDOS__) || defined (_AMIGA))
+# undef CONFIG_WITH_KMK_BUILTIN_ASYNC /* needs fork() */
+#endif
 #ifdef KMK
 # include "kbuild.h"
 #endif
+#ifdef CONFIG_WITH_POSIX_SPAWN
+# include <spawn.h>
+#endif
 
 
 #include <string.h>
 
+#if defined (CONFIG_WITH_CRITICAL_PATH) && defined (MAKE_JOBSERVER) && !defined (__EMX__)
+# include <poll.h>
+#endif
+#ifdef CONFIG_WITH_JOB_ADMISSION
+# include <sys/resource.h>
+#endif
+
 /* Default shell to use.  */
 #ifdef WINDOWS32
 #include <windows.h>
@@ -228,6 +242,16 @@ static int good_stdin_used = 0;
 
 static struct child *waiting_jobs = 0;
 
+#ifdef CONFIG_WITH_CRITICAL_PATH
+/* Whether new jobs are scheduled along the critical path.  The linear
+   modes (-j1, .NOTPARALLEL) are left alone.  */
+# ifdef CONFIG_WITH_EXTENDED_NOTPARALLEL
+#  define CRITPATH_SCHEDULING() (critpath_scheduling && job_slots != 1 && not_parallel >= 0)
+# else
+#  define CRITPATH_SCHEDULING() (critpath_scheduling && job_slots != 1 && !not_parallel)
+# endif
+#endif
+
 /* Non-zero if we use a *real* shell (always so on Unix).  */
 
 int unixy_shell = 1;
@@ -444,7 +468,264 @@ child_handler (int sig UNUSED)
   */
 }
 
+#ifdef CONFIG_WITH_OUTPUT_SYNC
+/* --output-sync: The output of each job is written to unlinked temporary
+   files while it runs and copied to the real stdout and stderr in one go
+   when the job is done.  The data normally never leaves the page cache, so
+   this works as a memory buffer that spills to disk only when the job
+   produces a lot of output or memory is tight.  The files are recycled, so
+   the cost per command is four dup2 calls, and a read and a write per job
+   that actually said something.  Recursive make commands are not buffered,
+   the sub-make buffers its own jobs.  */
+
+/* Whether to buffer the output of the jobs.  There is no point when they
+   run one by one.  */
+#define OUTPUT_SYNC_WANTED() (output_sync_flag && job_slots != 1 && !just_print_flag)
+
+/* 1 if the buffering is usable, 0 if not, -1 if not yet initialized.  */
+static int output_sync_ok = -1;
+
+/* Nonzero if stdout and stderr are the same file, in which case a single
+   buffer is used for both to keep the order of the lines.  */
+static int output_sync_combined;
+
+/* Duplicates of the real stdout and stderr.  */
+static int output_sync_real_fds[2] = { -1, -1 };
+
+/* The child whose buffers stdout and stderr currently point to.  */
+static struct child *output_sync_redirected;
+
+/* Recycled buffers.  */
+static int *output_sync_free;
+static unsigned int output_sync_free_count;
+static unsigned int output_sync_free_size;
+
+/* Saves the real stdout and stderr.  Returns nonzero if output can be
+   buffered.  */
+
+static int
+output_sync_init (void)
+{
+  struct stat st_out;
+  struct stat st_err;
+
+  if (output_sync_ok != -1)
+    return output_sync_ok;
+  output_sync_ok = 0;
+
+  if (fstat (1, &st_out) != 0 || fstat (2, &st_err) != 0)
+    return 0;
+  output_sync_combined = st_out.st_dev == st_err.st_dev
+                      && st_out.st_ino == st_err.st_ino;
+
+  output_sync_real_fds[0] = dup (1);
+  output_sync_real_fds[1] = dup (2);
+  if (output_sync_real_fds[0] < 0 || output_sync_real_fds[1] < 0)
+    {
+      if (output_sync_real_fds[0] >= 0)
+        close (output_sync_real_fds[0]);
+      if (output_sync_real_fds[1] >= 0)
+        close (output_sync_real_fds[1]);
+      output_sync_real_fds[0] = output_sync_real_fds[1] = -1;
+      return 0;
+    }
+  CLOSE_ON_EXEC (output_sync_real_fds[0]);
+  CLOSE_ON_EXEC (output_sync_real_fds[1]);
+
+  output_sync_ok = 1;
+  return 1;
+}
+
+/* Returns an empty buffer, -1 on failure.  */
+
+static int
+output_sync_new_buffer (void)
+{
+  const char *tmpdir;
+  char *template;
+  int fd;
+
+  if (output_sync_free_count)
+    return output_sync_free[--output_sync_free_count];
+
+  tmpdir = getenv ("TMPDIR");
+  if (tmpdir == NULL || *tmpdir == '\0')
+    tmpdir = "/tmp";
+  template = alloca (strlen (tmpdir) + sizeof ("/kmkoutXXXXXX"));
+  strcpy (template, tmpdir);
+  strcat (template, "/kmkoutXXXXXX");
+
+  fd = mkstemp (template);
+  if (fd < 0)
+    {
+      perror_with_name (_("output-sync: "), template);
+      return -1;
+    }
+  unlink (template);
+  CLOSE_ON_EXEC (fd);
+  return fd;
+}
+
+/* Empties the buffer FD and puts it on the free list.  */
+
+static void
+output_sync_free_buffer (int fd)
+{
+  if (ftruncate (fd, 0) != 0 || lseek (fd, 0, SEEK_SET) != 0)
+    {
+      close (fd);
+      return;
+    }
+  if (output_sync_free_count >= output_sync_free_size)
+    {
+      output_sync_free_size = output_sync_free_size ? output_sync_free_size * 2 : 16;
+      output_sync_free = xrealloc (output_sync_free,
+                                   output_sync_free_size * sizeof (int));
+    }
+  output_sync_free[output_sync_free_count++] = fd;
+}
+
+/* Points stdout and stderr at the buffers of CHILD, getting it some if it
+   doesn't have any yet.  Returns nonzero if it did.  */
+
+static int
+output_sync_begin (struct child *child)
+{
+  if (!output_sync_init ())
+    return 0;
+
+  if (child->output_fds[0] < 0)
+    {
+      child->output_fds[0] = output_sync_new_buffer ();
+      if (child->output_fds[0] < 0)
+        return 0;
+      if (output_sync_combined)
+        child->output_fds[1] = child->output_fds[0];
+      else
+        {
+          child->output_fds[1] = output_sync_new_buffer ();
+          if (child->output_fds[1] < 0)
+            {
+              output_sync_free_buffer (child->output_fds[0]);
+              child->output_fds[0] = -1;
+              return 0;
+            }
+        }
+    }
+
+  fflush (stdout);
+  fflush (stderr);
+  if (   dup2 (child->output_fds[0], 1) < 0
+      || dup2 (child->output_fds[1], 2) < 0)
+    {
+      dup2 (output_sync_real_fds[0], 1);
+      dup2 (output_sync_real_fds[1], 2);
+      return 0;
+    }
+  output_sync_redirected = child;
+  return 1;
+}
+
+/* Points stdout and stderr back at the real ones.  */
+
+static void
+output_sync_end (void)
+{
+  if (!output_sync_redirected)
+    return;
+  fflush (stdout);
+  fflush (stderr);
+  dup2 (output_sync_real_fds[0], 1);
+  dup2 (output_sync_real_fds[1], 2);
+  output_sync_redirected = 0;
+}
+
+/* Copies the content of the buffer FD to OUT_FD.  */
+
+static void
+output_sync_copy (int fd, int out_fd)
+{
+  static char buf[65536];
+  ssize_t cb;
+
+  if (lseek (fd, 0, SEEK_CUR) <= 0)
+    return; /* Nothing was written, the common case. */
+  if (lseek (fd, 0, SEEK_SET) != 0)
+    return;
+
+  for (;;)
+    {
+      char *pch = buf;
+      EINTRLOOP (cb, read (fd, buf, sizeof (buf)));
+      if (cb <= 0)
+        break;
+      while (cb > 0)
+        {
+          ssize_t cbWritten;
+          EINTRLOOP (cbWritten, write (out_fd, pch, cb));
+          if (cbWritten <= 0)
+            return;
+          pch += cbWritten;
+          cb -= cbWritten;
+        }
+    }
+}
+
+/* Prints what CHILD has written so far and returns its buffers to the free
+   list.  A write lock on stdout keeps sub-makes sharing it from getting
+   their output in between.  */
+
+static void
+output_sync_flush (struct child *child)
+{
+  struct flock fl;
+  int locked;
+
+  if (child->output_fds[0] < 0)
+    return;
+  if (output_sync_redirected == child)
+    output_sync_end ();
+
+  memset (&fl, 0, sizeof (fl));
+  fl.l_type = F_WRLCK;
+  fl.l_whence = SEEK_SET;
+  EINTRLOOP (locked, fcntl (output_sync_real_fds[0], F_SETLKW, &fl));
+
+  output_sync_copy (child->output_fds[0], output_sync_real_fds[0]);
+  if (child->output_fds[1] != child->output_fds[0])
+    output_sync_copy (child->output_fds[1], output_sync_real_fds[1]);
+
+  if (locked == 0)
+    {
+      fl.l_type = F_UNLCK;
+      fcntl (output_sync_real_fds[0], F_SETLK, &fl);
+    }
+
+  output_sync_free_buffer (child->output_fds[0]);
+  if (child->output_fds[1] != child->output_fds[0])
+    output_sync_free_buffer (child->output_fds[1]);
+  child->output_fds[0] = child->output_fds[1] = -1;
+}
+
+/* Starts the current command of CHILD, buffering its output if wanted.  */
+
+static void
+start_job_command_synced (struct child *child)
+{
+  if (OUTPUT_SYNC_WANTED () && output_sync_begin (child))
+    {
+      start_job_command (child);
+      output_sync_end ();
+    }
+  else
+    start_job_command (child);
+}
+#endif /* CONFIG_WITH_OUTPUT_SYNC */
+
 extern int shell_function_pid, shell_function_completed;
+#ifdef CONFIG_WITH_SHELL_CACHE
+extern int shell_function_status;
+#endif
 
 /* Reap all dead children, storing the returned status and the new command
    state (`cs_finished') in the `file' member of the `struct child' for the
@@ -489,6 +770,10 @@ reap_children (int block, int err)
 #ifdef CONFIG_WITH_KMK_BUILTIN
       struct child *completed_child = NULL;
 #endif
+#ifdef CONFIG_WITH_JOB_ADMISSION
+      struct rusage usage;
+      memset (&usage, 0, sizeof (usage));
+#endif
 
       if (err && block)
 	{
@@ -576,6 +861,8 @@ reap_children (int block, int err)
 # else
               status = (WAIT_T)completed_child->status;
 # endif
+              /* The status is used up; the child may run more commands.  */
+              completed_child->has_status = 0;
             }
           else
 #endif /* CONFIG_WITH_KMK_BUILTIN */
@@ -586,6 +873,12 @@ reap_children (int block, int err)
 	      vmsWaitForChildren (&status);
 	      pid = c->pid;
 #else
+# ifdef CONFIG_WITH_JOB_ADMISSION
+              /* wait4 also gives us the peak memory use of the command.  */
+	      if (admit_enabled)
+		pid = wait4 (-1, &status, block ? 0 : WNOHANG, &usage);
+	      else
+# endif
 #ifdef WAIT_NOHANG
 	      if (!block)
 		pid = WAIT_NOHANG (&status);
@@ -723,6 +1016,9 @@ reap_children (int block, int err)
 	    shell_function_completed = -1;
 	  else
 	    shell_function_completed = 1;
+#ifdef CONFIG_WITH_SHELL_CACHE
+	  shell_function_status = exit_sig ? 128 + exit_sig : exit_code;
+#endif
 	  break;
 	}
 
@@ -745,6 +1041,11 @@ reap_children (int block, int err)
                     (unsigned long int) c, (long) c->pid,
                     c->remote ? _(" (remote)") : ""));
 
+#ifdef CONFIG_WITH_JOB_ADMISSION
+      if (admit_enabled && !remote)
+        admit_note_usage (c, &usage);
+#endif
+
       if (c->sh_batch_file) {
         DB (DB_JOBS, (_("Cleaning up temp batch file %s\n"),
                       c->sh_batch_file));
@@ -769,6 +1070,9 @@ reap_children (int block, int err)
              delete non-precious targets, and abort.  */
           static int delete_on_error = -1;
 
+#ifdef CONFIG_WITH_OUTPUT_SYNC
+          output_sync_flush (c);
+#endif
           if (!dontcare)
 #ifdef KMK
             {
@@ -796,6 +1100,9 @@ reap_children (int block, int err)
           if (child_failed)
             {
               /* The commands failed, but we don't care.  */
+#ifdef CONFIG_WITH_OUTPUT_SYNC
+              output_sync_flush (c);
+#endif
               child_error (c->file->name,
                            exit_code, exit_sig, coredump, 1);
               child_failed = 0;
@@ -819,7 +1126,11 @@ reap_children (int block, int err)
                      Also, start_remote_job may need state set up
                      by start_remote_job_p.  */
                   c->remote = start_remote_job_p (0);
+#ifdef CONFIG_WITH_OUTPUT_SYNC
+                  start_job_command_synced (c);
+#else
                   start_job_command (c);
+#endif
                   /* Fatal signals are left blocked in case we were
                      about to put that child on the chain.  But it is
                      already there, so it is safe for a fatal signal to
@@ -848,6 +1159,9 @@ reap_children (int block, int err)
          ran; notice_finish_file looks for cs_running to tell it that
          it's interesting to check the file's modtime again now.  */
 
+#ifdef CONFIG_WITH_OUTPUT_SYNC
+      output_sync_flush (c);
+#endif
       if (! handling_fatal_signal)
         /* Notice if the target of the commands has been changed.
            This also propagates its values for command_state and
@@ -898,8 +1212,21 @@ reap_children (int block, int err)
 static void
 free_child (struct child *child)
 {
+#ifdef CONFIG_WITH_OUTPUT_SYNC
+  output_sync_flush (child);
+#endif
 #ifdef CONFIG_WITH_PRINT_TIME_SWITCH
   print_job_time (child);
+#endif
+#ifdef CONFIG_WITH_CRITICAL_PATH
+  if (   child->start_ts != -1
+      && child->file->update_status == 0
+      && !handling_fatal_signal)
+    critpath_record_job (child->file, nano_timestamp () - child->start_ts,
+                         child->peak_rss_kb);
+#endif
+#ifdef CONFIG_WITH_JOB_ADMISSION
+  admit_job_done (child);
 #endif
   if (!jobserver_tokens)
     fatal (NILF, "INTERNAL: Freeing child 0x%08lx (%s) but no tokens left!\n",
@@ -1039,6 +1366,196 @@ set_child_handler_action_flags (int set_handler, int set_alarm)
 #endif
 
 
+#ifdef CONFIG_WITH_KMK_BUILTIN_ASYNC
+/* Forks a worker process for executing the kmk_builtin_ command at P2 in
+   ARGV if it's one of the slow ones.  The worker runs the builtin (and any
+   command it wishes to spawn) and exits with its status.  FLAGS are the
+   COMMANDS_* flags of the command line.
+
+   Returns 1 with fatal signals blocked and CHILD->pid set if the worker was
+   started; 0 if the command should be executed synchronously.  */
+
+static int
+start_builtin_worker (struct child *child, char **p2, char **argv, int flags)
+{
+  int argc = 1;
+  pid_t pid;
+
+  if (p2 != argv)
+    {
+      if (!kmk_builtin_is_async (1, p2))
+        return 0;
+    }
+  else
+    {
+      while (argv[argc])
+        argc++;
+      if (!kmk_builtin_is_async (argc, argv))
+        return 0;
+    }
+
+  /* Flush the output streams so they won't have things written twice.  */
+  fflush (stdout);
+  fflush (stderr);
+
+  block_sigs ();
+  pid = fork ();
+  if (pid == 0)
+    {
+      /* We are the worker.  Our copies of the fatal signal handlers would
+         go after the other children and targets, so restore the defaults. */
+      char **argv_spawn = NULL;
+      pid_t pid_spawned = 0;
+      int rc;
+# if defined (POSIX) && defined (NSIG)
+      int sig;
+      for (sig = 1; sig < NSIG; sig++)
+        if (sigismember (&fatal_signal_set, sig))
+          signal (sig, SIG_DFL);
+# endif
+      unblock_sigs ();
+
+      if (!(flags & COMMANDS_RECURSE) && job_fds[0] >= 0)
+        {
+          close (job_fds[0]);
+          close (job_fds[1]);
+        }
+      if (job_rfd >= 0)
+        close (job_rfd);
+
+      if (p2 != argv)
+        rc = kmk_builtin_command (*p2, &argv_spawn, &pid_spawned);
+      else
+        rc = kmk_builtin_command_parsed (argc, argv, &argv_spawn, &pid_spawned);
+
+      /* conditional check == true; execute the (non-builtin) command. */
+      if (!rc && argv_spawn)
+        {
+          fflush (stdout);
+          fflush (stderr);
+          child_execute_job (0, 1, argv_spawn, target_environment (child->file));
+        }
+
+      fflush (stdout);
+      fflush (stderr);
+      _exit (rc >= 0 && rc <= 255 ? rc : 1);
+    }
+  if (pid < 0)
+    {
+      /* Fork failed, do it the synchronous way.  */
+      unblock_sigs ();
+      return 0;
+    }
+
+  DB (DB_JOBS, (_("Started builtin worker %ld for `%s'\n"),
+                (long) pid, child->file->name));
+  child->pid = pid;
+  return 1;
+}
+#endif /* CONFIG_WITH_KMK_BUILTIN_ASYNC */
+
+#ifdef KMK
+/* Checks whether SHELL is the kBuild shell (kmk_ash or kmk_kash).  */
+
+static int
+is_kmk_shell_name (const char *shell)
+{
+  const char *psz;
+
+  if (!strcmp (shell, get_default_kbuild_shell ()))
+    return 1;
+  psz = strstr (shell, "/kmk_ash");
+  if (psz)
+    psz += sizeof ("/kmk_ash") - 1;
+  else
+    {
+      psz = strstr (shell, "/kmk_kash");
+      if (psz)
+        psz += sizeof ("/kmk_kash") - 1;
+    }
+# if defined (__OS2__) || defined (_WIN32) || defined (WINDOWS32)
+  return psz && (*psz == '\0' || !stricmp (psz, ".exe"));
+# else
+  return psz && *psz == '\0';
+# endif
+}
+#endif /* KMK */
+
+#ifdef CONFIG_WITH_KASH
+/* Statistics for the recipe lines run in kash instances.  */
+static unsigned long kash_lines_done;
+static unsigned long kash_lines_spawned;
+static unsigned long kash_lines_declined;
+
+/* Runs the `kmk_ash -c line' command in ARGV in a kash instance within
+   kmk instead of in a new shell process.  The instance takes care of the
+   builtins, assignments, cd and redirections itself and spawns only the
+   last command if it's an external program.  STDIN_FD is the standard
+   input for the line.
+
+   Returns the pid of the spawned program, 0 if the line completed without
+   one (*STATUSP is then its exit status), or -1 if the line needs a real
+   shell process (pipelines, command substitution and such).  */
+
+static pid_t
+start_kash_job (struct child *child, char **argv, int flags, int stdin_fd,
+                int *statusp)
+{
+  int close_jobserver = !(flags & COMMANDS_RECURSE);
+  pid_t pid;
+  int rc;
+
+  if (   !argv[1] || strcmp (argv[1], "-c")
+      || !argv[2] || argv[3]
+      || !is_kmk_shell_name (argv[0]))
+    return -1;
+
+  /* Keep the jobserver pipe from the program, like child_spawn_job.
+     Our dup of its read end is never passed on.  */
+  if (close_jobserver && job_fds[0] >= 0)
+    {
+      CLOSE_ON_EXEC (job_fds[0]);
+      CLOSE_ON_EXEC (job_fds[1]);
+    }
+  if (job_rfd >= 0)
+    CLOSE_ON_EXEC (job_rfd);
+
+  rc = shell_run_inproc (3, argv, child->environment, stdin_fd, statusp, &pid);
+
+  if (close_jobserver && job_fds[0] >= 0)
+    {
+      fcntl (job_fds[0], F_SETFD, 0);
+      fcntl (job_fds[1], F_SETFD, 0);
+    }
+  if (job_rfd >= 0)
+    fcntl (job_rfd, F_SETFD, 0);
+
+  if (rc != 0)
+    {
+      kash_lines_declined++;
+      return -1;
+    }
+  if (pid > 0)
+    {
+      DB (DB_JOBS, (_("kash spawned %ld for `%s'\n"), (long) pid, argv[2]));
+      kash_lines_spawned++;
+      return pid;
+    }
+  DB (DB_JOBS, (_("kash completed `%s' with status %d\n"), argv[2], *statusp));
+  kash_lines_done++;
+  return 0;
+}
+
+void
+print_kash_stats (void)
+{
+  if (!kash_lines_done && !kash_lines_spawned && !kash_lines_declined)
+    return;
+  printf (_("\n# kash: %lu lines completed in-process, %lu spawned their last command, %lu needed a shell process\n"),
+          kash_lines_done, kash_lines_spawned, kash_lines_declined);
+}
+#endif /* CONFIG_WITH_KASH */
+
 /* Start a job to run the commands specified in CHILD.
    CHILD is updated to reflect the commands and ID of the child process.
 
@@ -1064,6 +1581,11 @@ start_job_command (struct child *child)
   if (!child->command_ptr)
     goto next_command;
 
+#ifdef CONFIG_WITH_DIR_SNAPSHOTS
+  /* The command may change any file.  */
+  dir_snapshot_gen++;
+#endif
+
 #ifdef CONFIG_WITH_PRINT_TIME_SWITCH
   if (child->start_ts == -1)
     child->start_ts = nano_timestamp ();
@@ -1113,6 +1635,12 @@ start_job_command (struct child *child)
   child->file->cmds->lines_flags[child->command_line - 1]
     |= flags & COMMANDS_RECURSE;
 
+#ifdef CONFIG_WITH_OUTPUT_SYNC
+  /* Don't hold back the output of sub-makes, they sync their own jobs.  */
+  if ((flags & COMMANDS_RECURSE) && child->output_fds[0] >= 0)
+    output_sync_flush (child);
+#endif
+
   /* Figure out an argument list from this command line.  */
 
   {
@@ -1256,6 +1784,16 @@ start_job_command (struct child *child)
       assert (*p2);
       set_command_state (child->file, cs_running);
       child->pid = 0;
+
+# ifdef CONFIG_WITH_KMK_BUILTIN_ASYNC
+      /* Run the slow builtins in a forked worker when running jobs in
+         parallel so they don't hold up the other job slots.  The worker
+         gets its own umask, stdio buffers and builtin state, and its exit
+         status is collected by reap_children like any other child's.  */
+      if (job_slots != 1 && start_builtin_worker (child, p2, argv, flags))
+        goto builtin_worker_started;
+# endif
+
       if (p2 != argv)
         rc = kmk_builtin_command (*p2, &argv_spawn, &child->pid);
       else
@@ -1426,6 +1964,35 @@ start_job_command (struct child *child)
 
 #else  /* !__EMX__ */
 
+# ifdef CONFIG_WITH_KASH
+      {
+        int status;
+        child->pid = start_kash_job (child, argv, flags,
+                                     child->good_stdin ? 0 : bad_stdin,
+                                     &status);
+        if (child->pid == 0)
+          {
+            /* Completed in-process, like a builtin command.  */
+            unblock_sigs ();
+            free (argv[0]);
+            free (argv);
+            set_command_state (child->file, cs_running);
+            if (!status)
+              goto next_command;
+            child->pid = (pid_t)42424242;
+            child->status = status << 8;
+            child->has_status = 1;
+            return;
+          }
+      }
+      if (child->pid < 0)
+# endif
+# ifdef CONFIG_WITH_POSIX_SPAWN
+      child->pid = child_spawn_job (child->good_stdin ? 0 : bad_stdin, 1, argv,
+                                    child->environment,
+                                    !(flags & COMMANDS_RECURSE));
+      if (child->pid < 0)
+# endif
       child->pid = vfork ();
       environ = parent_environ;	/* Restore value child may have clobbered.  */
       if (child->pid == 0)
@@ -1559,6 +2126,9 @@ start_job_command (struct child *child)
 #endif /* WINDOWS32 */
 #endif	/* __MSDOS__ or Amiga or WINDOWS32 */
 
+#ifdef CONFIG_WITH_KMK_BUILTIN_ASYNC
+ builtin_worker_started:
+#endif
   /* Bump the number of jobs started in this second.  */
   ++job_counter;
 
@@ -1588,6 +2158,80 @@ start_job_command (struct child *child)
 #endif
 }
 
+#ifdef CONFIG_WITH_CRITICAL_PATH
+/* Puts C on the `waiting_jobs' chain after the jobs with the same or higher
+   priority, but ahead of any not-parallel jobs.  */
+
+static void
+insert_waiting_job_by_priority (struct child *c)
+{
+  struct child **pp = &waiting_jobs;
+
+  while (*pp
+# ifdef CONFIG_WITH_EXTENDED_NOTPARALLEL
+         && !((*pp)->file->command_flags & COMMANDS_NOTPARALLEL)
+# endif
+         && (*pp)->priority >= c->priority)
+    pp = &(*pp)->next;
+  c->next = *pp;
+  *pp = c;
+}
+
+/* Gets a job slot or jobserver token for the critical path scheduler
+   without blocking.  Returns nonzero on success.  */
+
+static int
+get_job_slot_for_critpath (void)
+{
+  if (job_slots != 0)
+    return job_slots_used < job_slots;
+
+# ifdef MAKE_JOBSERVER
+  /* Our "free" token is available when we have no jobs.  */
+  if (job_fds[0] >= 0 && jobserver_tokens)
+    {
+      char token;
+      int got_token;
+      int saved_errno;
+#  ifndef __EMX__
+      struct pollfd pfd;
+#  endif
+
+      /* Same dance as in new_job: the child handler closes job_rfd, so
+         the read cannot get stuck if a sub-make snatches the token after
+         poll said there was one.  */
+      if (job_rfd < 0)
+        job_rfd = dup (job_fds[0]);
+#  ifndef __EMX__
+      pfd.fd = job_rfd;
+      pfd.events = POLLIN;
+      pfd.revents = 0;
+      if (poll (&pfd, 1, 0) <= 0)
+        return 0;
+#  endif
+
+      set_child_handler_action_flags (1, 0);
+      got_token = read (job_rfd, &token, 1);
+      saved_errno = errno;
+      set_child_handler_action_flags (0, 0);
+      if (got_token == 1)
+        {
+          DB (DB_JOBS, (_("Obtained token for the critical path scheduler.\n")));
+          return 1;
+        }
+      if (saved_errno != EINTR && saved_errno != EBADF)
+        {
+          errno = saved_errno;
+          pfatal_with_name (_("read jobs pipe"));
+        }
+      return 0;
+    }
+# endif /* MAKE_JOBSERVER */
+
+  return 1;
+}
+#endif /* CONFIG_WITH_CRITICAL_PATH */
+
 /* Try to start a child running.
    Returns nonzero if the child was started (and maybe finished), or zero if
    the load was too high and the child was put on the `waiting_jobs' chain.  */
@@ -1621,9 +2265,17 @@ start_waiting_job (struct child *c)
      is too high, make this one wait.  */
   if (!c->remote
 #ifdef CONFIG_WITH_EXTENDED_NOTPARALLEL
-      && ((job_slots_used > 0 && (not_parallel > 0 || load_too_high ()))
+      && ((job_slots_used > 0 && (not_parallel > 0 || load_too_high ()
+# ifdef CONFIG_WITH_JOB_ADMISSION
+                                  || admit_hold_back (c)
+# endif
+                                  ))
 #else
-      && ((job_slots_used > 0 && load_too_high ())
+      && ((job_slots_used > 0 && (load_too_high ()
+# ifdef CONFIG_WITH_JOB_ADMISSION
+                                  || admit_hold_back (c)
+# endif
+                                  ))
 #endif
 #ifdef WINDOWS32
 	  || (process_used_slots () >= MAXIMUM_WAIT_OBJECTS)
@@ -1634,8 +2286,15 @@ start_waiting_job (struct child *c)
         /* Put this child on the chain of children waiting for the load average
            to go down.  */
         set_command_state (f, cs_running);
-        c->next = waiting_jobs;
-        waiting_jobs = c;
+# ifdef CONFIG_WITH_CRITICAL_PATH
+        if (c->need_slot)
+          insert_waiting_job_by_priority (c);
+        else
+# endif
+          {
+            c->next = waiting_jobs;
+            waiting_jobs = c;
+          }
 
 #else  /* CONFIG_WITH_EXTENDED_NOTPARALLEL */
 
@@ -1651,6 +2310,10 @@ start_waiting_job (struct child *c)
           c->next = 0;
           prev->next = c;
         }
+# ifdef CONFIG_WITH_CRITICAL_PATH
+      else if (c->need_slot)
+        insert_waiting_job_by_priority (c);
+# endif
       else /* FIXME: insert after the last node with COMMANDS_NOTPARALLEL set */
         waiting_jobs = c;
       DB (DB_KMK, (_("queued child %p (`%s')\n"), (void *)c, c->file->name));
@@ -1658,8 +2321,34 @@ start_waiting_job (struct child *c)
       return 0;
     }
 
+#ifdef CONFIG_WITH_CRITICAL_PATH
+  /* The critical path scheduler hands out the job slots here rather than
+     in new_job, and only to the waiting job with the highest priority.  */
+  if (c->need_slot && !c->remote)
+    {
+      if (   (waiting_jobs && waiting_jobs->priority > c->priority)
+          || !get_job_slot_for_critpath ())
+        {
+          set_command_state (f, cs_running);
+          insert_waiting_job_by_priority (c);
+          DB (DB_JOBS, (_("Queued child 0x%08lx (%s) with priority %lu.\n"),
+                        (unsigned long int) c, c->file->name, c->priority));
+          return 0;
+        }
+      c->need_slot = 0;
+      ++jobserver_tokens;
+    }
+#endif
+#ifdef CONFIG_WITH_JOB_ADMISSION
+  admit_job_started (c);
+#endif
+
   /* Start the first command; reap_children will run later command lines.  */
+#ifdef CONFIG_WITH_OUTPUT_SYNC
+  start_job_command_synced (c);
+#else
   start_job_command (c);
+#endif
 
   switch (f->command_state)
     {
@@ -1704,6 +2393,9 @@ new_job (struct file *file)
 
   /* Let any previously decided-upon jobs that are waiting
      for the load to go down start before this new one.  */
+#ifdef CONFIG_WITH_CRITICAL_PATH
+  if (!CRITPATH_SCHEDULING ())
+#endif
   start_waiting_jobs ();
 
   /* Reap any children that might have finished recently.  */
@@ -1828,6 +2520,9 @@ new_job (struct file *file)
 #ifdef CONFIG_WITH_PRINT_TIME_SWITCH
   c->start_ts = -1;
 #endif
+#ifdef CONFIG_WITH_OUTPUT_SYNC
+  c->output_fds[0] = c->output_fds[1] = -1;
+#endif
 
   /* Cache dontcare flag because file->dontcare can be changed once we
      return. Check dontcare inheritance mechanism for details.  */
@@ -1836,6 +2531,20 @@ new_job (struct file *file)
   /* Fetch the first command line to be run.  */
   job_next_command (c);
 
+#ifdef CONFIG_WITH_CRITICAL_PATH
+  /* When scheduling along the critical path, start_waiting_job gets the
+     job slot or token.  Not blocking here lets update_goal_chain find all
+     the jobs that are ready, so the one with the highest priority can be
+     started whenever a slot frees up.  */
+  if (CRITPATH_SCHEDULING ())
+    {
+      c->need_slot = 1;
+      c->priority = critpath_priority (file);
+    }
+  else
+    {
+#endif
+
   /* Wait for a job slot to be freed up.  If we allow an infinite number
      don't bother; also job_slots will == 0 if we're using the jobserver.  */
 
@@ -1941,6 +2650,9 @@ new_job (struct file *file)
 #endif
 
   ++jobserver_tokens;
+#ifdef CONFIG_WITH_CRITICAL_PATH
+    }
+#endif
 
   /* The job is now primed.  Start it running.
      (This will notice if there is in fact no recipe.)  */
@@ -1953,7 +2665,13 @@ new_job (struct file *file)
                    c->file->name));
 
 
+#ifndef CONFIG_WITH_CRITICAL_PATH
   start_waiting_job (c);
+#else
+  /* If it was queued, let the job with the highest priority have a go.  */
+  if (!start_waiting_job (c) && c->need_slot)
+    start_waiting_jobs ();
+#endif
 
 #ifndef CONFIG_WITH_EXTENDED_NOTPARALLEL
   if (job_slots == 1 || not_parallel)
@@ -2233,6 +2951,127 @@ child_execute_job (int stdin_fd, int stdout_fd, char **argv, char **envp)
   /* Run the command.  */
   exec_command (argv, envp);
 }
+
+#ifdef CONFIG_WITH_POSIX_SPAWN
+/* Searches the PATH in ENVP for PROGRAM like execvp does.  Returns the
+   full name in a heap block, or NULL if not found.  */
+static char *
+spawn_search_path (const char *program, char **envp)
+{
+  const char *path = NULL;
+  unsigned int prog_len;
+  char *buf;
+  char **ep;
+
+  if (strchr (program, '/') != NULL)
+    return xstrdup (program);
+
+  for (ep = envp; *ep != NULL; ep++)
+    if (!strncmp (*ep, "PATH=", 5))
+      {
+        path = *ep + 5;
+        break;
+      }
+  if (path == NULL)
+    path = ":/bin:/usr/bin";
+
+  prog_len = strlen (program);
+  buf = xmalloc (strlen (path) + 1 + prog_len + 1);
+  for (;;)
+    {
+      const char *end = strchr (path, PATH_SEPARATOR_CHAR);
+      unsigned int len = end ? (unsigned int)(end - path) : strlen (path);
+      struct stat st;
+
+      if (len == 0)
+        memcpy (buf, program, prog_len + 1); /* current directory */
+      else
+        {
+          memcpy (buf, path, len);
+          buf[len] = '/';
+          memcpy (&buf[len + 1], program, prog_len + 1);
+        }
+      if (   stat (buf, &st) == 0
+          && S_ISREG (st.st_mode)
+          && access (buf, X_OK) == 0)
+        return buf;
+
+      if (!end)
+        break;
+      path = end + 1;
+    }
+  free (buf);
+  return NULL;
+}
+
+/* Starts the command in ARGV using posix_spawn.  This avoids duplicating
+   the address space of a big kmk process (fork) and the restrictions of
+   executing code in a vfork child.  STDIN_FD, STDOUT_FD and ENVP are as
+   for child_execute_job.  If CLOSE_JOBSERVER is set the jobserver pipe
+   isn't passed on to the child.  Our dup of its read end never is.
+
+   Returns the pid of the child on success.  Returns -1 if the command
+   should be started the traditional way; this is the case when the
+   program wasn't found, isn't an executable binary or we're running with
+   different effective and real IDs, so exec_command gets to deal with
+   shell scripts and produce the usual error messages.  */
+pid_t
+child_spawn_job (int stdin_fd, int stdout_fd, char **argv, char **envp,
+                 int close_jobserver)
+{
+  posix_spawn_file_actions_t file_actions;
+  posix_spawnattr_t attr;
+  sigset_t empty;
+  char *program;
+  pid_t pid;
+  int rc;
+
+  if (getuid () != geteuid () || getgid () != getegid ())
+    return -1;
+  program = spawn_search_path (argv[0], envp);
+  if (!program)
+    return -1;
+
+  posix_spawn_file_actions_init (&file_actions);
+  if (stdin_fd != 0)
+    {
+      posix_spawn_file_actions_adddup2 (&file_actions, stdin_fd, 0);
+      posix_spawn_file_actions_addclose (&file_actions, stdin_fd);
+    }
+  if (stdout_fd != 1)
+    {
+      posix_spawn_file_actions_adddup2 (&file_actions, stdout_fd, 1);
+      posix_spawn_file_actions_addclose (&file_actions, stdout_fd);
+    }
+  if (close_jobserver && job_fds[0] >= 0)
+    {
+      posix_spawn_file_actions_addclose (&file_actions, job_fds[0]);
+      posix_spawn_file_actions_addclose (&file_actions, job_fds[1]);
+    }
+  if (job_rfd >= 0)
+    posix_spawn_file_actions_addclose (&file_actions, job_rfd);
+
+  /* The caller has blocked the fatal signals, the child shouldn't. */
+  posix_spawnattr_init (&attr);
+  sigemptyset (&empty);
+  posix_spawnattr_setsigmask (&attr, &empty);
+  posix_spawnattr_setflags (&attr, POSIX_SPAWN_SETSIGMASK);
+
+  rc = posix_spawn (&pid, program, &file_actions, &attr, argv, envp);
+
+  posix_spawnattr_destroy (&attr);
+  posix_spawn_file_actions_destroy (&file_actions);
+  free (program);
+
+  if (rc != 0)
+    {
+      DB (DB_JOBS, (_("posix_spawn failed for `%s': %s\n"),
+                    argv[0], strerror (rc)));
+      return -1;
+    }
+  return pid;
+}
+#endif /* CONFIG_WITH_POSIX_SPAWN */
 #endif /* !AMIGA && !__MSDOS__ && !VMS */
 #endif /* !WINDOWS32 */
 
@@ -2630,25 +3469,8 @@ construct_command_argv_internal (char *line, char **restp, char *shell,
       is_kmk_shell = 1;
       shell = (char *)get_default_kbuild_shell ();
     }
-  else if (!strcmp (shell, get_default_kbuild_shell()))
-    is_kmk_shell = 1;
   else
-    {
-      const char *psz = strstr (shell, "/kmk_ash");
-      if (psz)
-        psz += sizeof ("/kmk_ash") - 1;
-      else
-        {
-          psz = strstr (shell, "/kmk_kash");
-          if (psz)
-            psz += sizeof ("/kmk_kash") - 1;
-        }
-# if defined (__OS2__) || defined (_WIN32) || defined (WINDOWS32)
-      is_kmk_shell = psz && (*psz == '\0' || !stricmp (psz, ".exe"));
-# else
-      is_kmk_shell = psz && *psz == '\0';
-# endif
-    }
+    is_kmk_shell = is_kmk_shell_name (shell);
   if (is_kmk_shell)
     {
       sh_chars = sh_chars_kash;
@@ -35,6 +35,15 @@ this program.  If not, see <http://www.gnu.org/licenses/>.  */
 # define CLOSE_ON_EXEC(_d) (void) fcntl ((_d), F_SETFD, FD_CLOEXEC)
 #endif
 
+#if defined (CONFIG_WITH_OUTPUT_SYNC) \
+ && (defined (WINDOWS32) || defined (__EMX__) || defined (VMS) || defined (__MSDOS__) || defined (_AMIGA))
+# undef CONFIG_WITH_OUTPUT_SYNC /* needs dup2() and friends */
+#endif
+#if defined (CONFIG_WITH_JOB_ADMISSION) \
+ && (defined (WINDOWS32) || defined (__EMX__) || defined (VMS) || defined (__MSDOS__) || defined (_AMIGA))
+# undef CONFIG_WITH_JOB_ADMISSION /* needs wait4() */
+#endif
+
 /* Structure describing a running or dead child process.  */
 
 struct child
@@ -68,6 +77,20 @@ struct child
     unsigned int dontcare:1;    /* Saved dontcare flag.  */
 #ifdef CONFIG_WITH_PRINT_TIME_SWITCH
     big_int start_ts;           /* nano_timestamp of the first command.  */
+#endif
+#ifdef CONFIG_WITH_OUTPUT_SYNC
+    int output_fds[2];          /* Buffers for stdout and stderr, -1 if the
+                                   output isn't buffered.  Both are the same
+                                   file when stdout and stderr are.  */
+#endif
+#ifdef CONFIG_WITH_CRITICAL_PATH
+    unsigned long priority;     /* critpath_priority of the file.  */
+    unsigned int need_slot:1;   /* Nonzero if start_waiting_job must get a
+                                   job slot or jobserver token first.  */
+    unsigned long peak_rss_kb;  /* Peak RSS of the commands, 0 if unknown.  */
+#endif
+#ifdef CONFIG_WITH_JOB_ADMISSION
+    unsigned long admit_kb;     /* Memory charged by admit_job_started.  */
 #endif
   };
 
@@ -86,6 +109,23 @@ int child_execute_job (int stdin_fd, int stdout_fd, char **argv, char **envp);
 #else
 void child_execute_job (int stdin_fd, int stdout_fd, char **argv, char **envp);
 #endif
+#if defined (CONFIG_WITH_POSIX_SPAWN) \
+ && (defined (WINDOWS32) || defined (__EMX__) || defined (VMS) || defined (__MSDOS__) || defined (_AMIGA))
+# undef CONFIG_WITH_POSIX_SPAWN
+#endif
+#ifdef CONFIG_WITH_POSIX_SPAWN
+pid_t child_spawn_job (int stdin_fd, int stdout_fd, char **argv, char **envp,
+                       int close_jobserver);
+#endif
+#ifdef CONFIG_WITH_KASH
+# if !defined (KMK) || !defined (CONFIG_WITH_KMK_BUILTIN)
+#  error "CONFIG_WITH_KASH requires KMK and CONFIG_WITH_KMK_BUILTIN"
+# endif
+/* src/kash/main.c */
+int shell_run_inproc (int argc, char **argv, char **envp, int stdin_fd,
+                      int *statusp, pid_t *pidp);
+void print_kash_stats (void);
+#endif
 #ifdef _AMIGA
 void exec_command (char **argv);
 #elif defined(__EMX__)
@@ -96,6 +136,17 @@ void exec_command (char **argv, char **envp);
 
 extern unsigned int job_slots_used;
 
+#ifdef CONFIG_WITH_JOB_ADMISSION
+struct rusage;
+extern int admit_enabled;
+void admit_start (unsigned int mem_budget_mb, unsigned int max_pressure);
+int admit_hold_back (struct child *c);
+void admit_job_started (struct child *c);
+void admit_note_usage (struct child *c, const struct rusage *usage);
+void admit_job_done (struct child *c);
+void admit_finish (void);
+#endif
+
 void block_sigs (void);
 #ifdef POSIX
 void unblock_sigs (void);
@@ -0,0 +1,301 @@
+#ifdef CONFIG_WITH_JOB_ADMISSION
+/* $Id$ */
+/** @file
+ * jobadmit - Memory and pressure aware job admission.
+ *
+ * The -l load limit reacts far too slowly to protect a build host from
+ * running out of memory when several link jobs or heavy C++ units happen to
+ * run at the same time.  This module decides whether a job may start based
+ * on the memory it is expected to use:
+ *
+ *   - The peak resident set size of every job is taken from the wait4()
+ *     rusage of its commands and kept in the --job-history file, so the
+ *     next run knows how much memory each target needs.  Targets without
+ *     history are assumed to need the average of the jobs seen so far.
+ *
+ *   - With --mem-budget=MB, a job is held back while the predicted peaks
+ *     of the running jobs plus its own would exceed the budget.
+ *
+ *   - A job is held back while its predicted peak exceeds MemAvailable in
+ *     /proc/meminfo, less what the jobs started since it was read expect.
+ *
+ *   - With --max-pressure=PCT, jobs are held back while the 10 second
+ *     "some" average in /proc/pressure/cpu or /proc/pressure/memory is at
+ *     or above PCT percent.
+ *
+ * As with -l, a job is never held back when nothing else is running, so a
+ * job bigger than the budget still gets to run, alone.
+ */
+
+/*
+ * Copyright (c) 2026 The kBuild contributors
+ *
+ * This file is part of kBuild.
+ *
+ * kBuild is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * kBuild is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with kBuild.  If not, see <http://www.gnu.org/licenses/>
+ *
+ */
+
+/*******************************************************************************
+*   Header Files                                                               *
+*******************************************************************************/
+#include "make.h"
+#include "filedef.h"
+#include "job.h"
+#include "debug.h"
+#include <sys/resource.h>
+
+#ifndef CONFIG_WITH_CRITICAL_PATH
+# error "CONFIG_WITH_JOB_ADMISSION requires CONFIG_WITH_CRITICAL_PATH"
+#endif
+
+
+/*******************************************************************************
+*   Defined Constants And Macros                                               *
+*******************************************************************************/
+/* How long the /proc readings are used before reading them again. */
+#define ADMIT_SAMPLE_INTERVAL   BIG_INT_C(100000000) /* 100 ms */
+/* Value of admit_mem_available when it isn't known. */
+#define ADMIT_UNKNOWN           (~0UL)
+
+
+/*******************************************************************************
+*   Global Variables                                                           *
+*******************************************************************************/
+/* Nonzero if the admission control is active; job.c then collects the
+   rusage of the children. */
+int admit_enabled;
+
+/* The limits, 0 if not set. */
+static unsigned long admit_budget_kb;
+static unsigned int admit_max_pressure;
+
+/* The sum of the predicted peaks of the running jobs and its maximum. */
+static unsigned long admit_committed_kb;
+static unsigned long admit_max_committed_kb;
+
+/* The jobs measured in this run, for predicting those without history. */
+static unsigned long admit_measured_jobs;
+static big_int admit_measured_kb;
+
+/* The last /proc readings, when they were made and the predicted peaks of
+   the jobs started since. */
+static big_int admit_sample_ts;
+static unsigned long admit_mem_available;
+static unsigned int admit_cpu_pressure;
+static unsigned int admit_mem_pressure;
+static unsigned long admit_since_sample_kb;
+
+/* The number of times a job was held back, by reason. */
+static unsigned int admit_held_budget;
+static unsigned int admit_held_memory;
+static unsigned int admit_held_pressure;
+
+
+/* Turns on the admission control with a budget of MEM_BUDGET_MB megabytes
+   and a pressure limit of MAX_PRESSURE percent, either may be 0.  */
+
+void
+admit_start (unsigned int mem_budget_mb, unsigned int max_pressure)
+{
+  admit_budget_kb = (unsigned long)mem_budget_mb * 1024;
+  admit_max_pressure = max_pressure;
+  admit_sample_ts = -1;
+  admit_enabled = 1;
+}
+
+/* Reads the start of the file PATH into BUF, zero terminated.  Returns
+   nonzero on success.  */
+
+static int
+admit_read_file (const char *path, char *buf, unsigned int size)
+{
+  int fd;
+  int cb;
+
+  EINTRLOOP (fd, open (path, O_RDONLY));
+  if (fd < 0)
+    return 0;
+  EINTRLOOP (cb, read (fd, buf, size - 1));
+  close (fd);
+  if (cb <= 0)
+    return 0;
+  buf[cb] = '\0';
+  return 1;
+}
+
+/* Gets the integer percentage of "some avg10=" in the PSI file PATH, 0 if
+   not available.  */
+
+static unsigned int
+admit_read_pressure (const char *path)
+{
+  char buf[256];
+  const char *psz;
+
+  if (!admit_read_file (path, buf, sizeof (buf)))
+    return 0;
+  psz = strstr (buf, "some avg10=");
+  if (!psz)
+    return 0;
+  return (unsigned int) strtoul (psz + sizeof ("some avg10=") - 1, NULL, 10);
+}
+
+/* Refreshes the /proc readings if they are getting old.  */
+
+static void
+admit_sample (void)
+{
+  big_int now = nano_timestamp ();
+  char buf[2048];
+  const char *psz;
+
+  if (admit_sample_ts != -1 && now - admit_sample_ts < ADMIT_SAMPLE_INTERVAL)
+    return;
+  admit_sample_ts = now;
+  admit_since_sample_kb = 0;
+
+  admit_mem_available = ADMIT_UNKNOWN;
+  if (   admit_read_file ("/proc/meminfo", buf, sizeof (buf))
+      && (psz = strstr (buf, "MemAvailable:")) != NULL)
+    admit_mem_available = strtoul (psz + sizeof ("MemAvailable:") - 1, NULL, 10);
+
+  if (admit_max_pressure)
+    {
+      admit_cpu_pressure = admit_read_pressure ("/proc/pressure/cpu");
+      admit_mem_pressure = admit_read_pressure ("/proc/pressure/memory");
+    }
+}
+
+/* The predicted peak resident set size of the job C in KB.  */
+
+static unsigned long
+admit_predict (struct child *c)
+{
+  unsigned long kb = critpath_peak_rss (c->file);
+  if (!kb && admit_measured_jobs)
+    kb = (unsigned long) (admit_measured_kb / admit_measured_jobs);
+  return kb;
+}
+
+/* Called by start_waiting_job when other jobs are running.  Returns
+   nonzero if C should wait for some of them to finish.  */
+
+int
+admit_hold_back (struct child *c)
+{
+  unsigned long kb;
+
+  if (!admit_enabled)
+    return 0;
+  kb = admit_predict (c);
+
+  if (admit_budget_kb && admit_committed_kb + kb > admit_budget_kb)
+    {
+      DB (DB_JOBS, (_("Holding back `%s': %lu KB + %lu KB committed exceeds the %lu KB budget.\n"),
+                    c->file->name, kb, admit_committed_kb, admit_budget_kb));
+      admit_held_budget++;
+      return 1;
+    }
+
+  admit_sample ();
+  if (   admit_mem_available != ADMIT_UNKNOWN
+      && kb + admit_since_sample_kb > admit_mem_available)
+    {
+      DB (DB_JOBS, (_("Holding back `%s': %lu KB + %lu KB starting exceeds the %lu KB available.\n"),
+                    c->file->name, kb, admit_since_sample_kb, admit_mem_available));
+      admit_held_memory++;
+      return 1;
+    }
+
+  if (   admit_max_pressure
+      && (   admit_cpu_pressure >= admit_max_pressure
+          || admit_mem_pressure >= admit_max_pressure))
+    {
+      DB (DB_JOBS, (_("Holding back `%s': cpu pressure %u%%, memory pressure %u%%.\n"),
+                    c->file->name, admit_cpu_pressure, admit_mem_pressure));
+      admit_held_pressure++;
+      return 1;
+    }
+
+  return 0;
+}
+
+/* Called when the job C is started, charges its predicted memory.  */
+
+void
+admit_job_started (struct child *c)
+{
+  if (!admit_enabled || c->admit_kb)
+    return;
+  c->admit_kb = admit_predict (c);
+  admit_committed_kb += c->admit_kb;
+  admit_since_sample_kb += c->admit_kb;
+  if (admit_committed_kb > admit_max_committed_kb)
+    admit_max_committed_kb = admit_committed_kb;
+}
+
+/* Called by reap_children with the rusage of a command of C.  */
+
+void
+admit_note_usage (struct child *c, const struct rusage *usage)
+{
+  unsigned long kb = (unsigned long) usage->ru_maxrss;
+#ifdef __APPLE__
+  kb /= 1024; /* bytes */
+#endif
+  if (kb > c->peak_rss_kb)
+    c->peak_rss_kb = kb;
+}
+
+/* Called when the job C is done, releases its memory.  */
+
+void
+admit_job_done (struct child *c)
+{
+  if (!admit_enabled)
+    return;
+  admit_committed_kb -= c->admit_kb < admit_committed_kb
+                      ? c->admit_kb : admit_committed_kb;
+  c->admit_kb = 0;
+  if (c->peak_rss_kb)
+    {
+      admit_measured_jobs++;
+      admit_measured_kb += c->peak_rss_kb;
+    }
+}
+
+/* Called at exit.  Prints a summary of what was held back.  */
+
+void
+admit_finish (void)
+{
+  if (!admit_enabled)
+    return;
+  admit_enabled = 0;
+  if (!admit_measured_jobs)
+    return;
+
+  printf (_("\n# Job admission: %lu jobs averaging %lu MB, at most %lu MB committed"),
+          admit_measured_jobs,
+          (unsigned long) (admit_measured_kb / admit_measured_jobs / 1024),
+          admit_max_committed_kb / 1024);
+  if (admit_budget_kb)
+    printf (_(" of %lu MB"), admit_budget_kb / 1024);
+  printf (_(", held back %u times (%u budget, %u memory, %u pressure)\n"),
+          admit_held_budget + admit_held_memory + admit_held_pressure,
+          admit_held_budget, admit_held_memory, admit_held_pressure);
+}
+
+#endif /* CONFIG_WITH_JOB_ADMISSION */
@@ -166,6 +166,102 @@ int kmk_builtin_command(const char *pszCmd, char ***ppapszArgvToSpawn, pid_t *pP
 }
 
 
+#ifdef CONFIG_WITH_KMK_BUILTIN_ASYNC
+/**
+ * Checks an rm argument for the recursive option.
+ *
+ * @returns 1 if it asks for recursion, -1 if it ends the options, 0 if
+ *          neither.
+ * @param   pszArg  The argument.
+ * @param   cchArg  The length of the argument.
+ */
+static int kmk_builtin_is_rm_recursive_arg(const char *pszArg, size_t cchArg)
+{
+    size_t off;
+
+    if (cchArg < 2 || pszArg[0] != '-')
+        return 0;
+    if (pszArg[1] == '-')
+    {
+        if (cchArg == 2)
+            return -1;
+        return cchArg == sizeof("--recursive") - 1
+            && !strncmp(pszArg, "--recursive", cchArg);
+    }
+    for (off = 1; off < cchArg; off++)
+        if (pszArg[off] == 'r' || pszArg[off] == 'R')
+            return 1;
+    return 0;
+}
+
+
+/**
+ * Checks whether a builtin command is worth running asynchronously.
+ *
+ * Only the commands which may take a while (copying, hashing, comparing,
+ * recursive removal and such) qualify, the cheap ones are done quicker on
+ * the spot than it takes to fork a worker for them.
+ *
+ * @returns 1 if it should be run asynchronously, 0 if not.
+ * @param   argc    The argument count. This is 1 for unparsed commands.
+ * @param   argv    The arguments, argv[0] is the kmk_builtin_ command.  For
+ *                  unparsed commands it is the whole command line.
+ */
+int kmk_builtin_is_async(int argc, char **argv)
+{
+    static const char * const s_apszAsync[] =
+    {
+        "cat", "cmp", "cp", "install", "kDepIDB", "md5sum", "sleep"
+    };
+    const char *pszCmd = argv[0];
+    size_t      cchCmd;
+    unsigned    i;
+
+    if (strncmp(pszCmd, "kmk_builtin_", sizeof("kmk_builtin_") - 1))
+        return 0;
+    pszCmd += sizeof("kmk_builtin_") - 1;
+    cchCmd = strcspn(pszCmd, " \t");
+
+    for (i = 0; i < sizeof(s_apszAsync) / sizeof(s_apszAsync[0]); i++)
+        if (    !strncmp(pszCmd, s_apszAsync[i], cchCmd)
+            &&  !s_apszAsync[i][cchCmd])
+            return 1;
+
+    /* rm is only interesting when it's recursive. */
+    if (cchCmd == 2 && !strncmp(pszCmd, "rm", 2))
+    {
+        int rc = 0;
+        if (argc == 1)
+        {
+            /* Unparsed, look at the words following the command.  A
+               quoted option is missed, which only means running inline. */
+            const char *psz = pszCmd + 2;
+            for (;;)
+            {
+                size_t cchArg;
+                while (isspace((unsigned char)*psz))
+                    psz++;
+                if (!*psz)
+                    break;
+                cchArg = 0;
+                while (psz[cchArg] && !isspace((unsigned char)psz[cchArg]))
+                    cchArg++;
+                rc = kmk_builtin_is_rm_recursive_arg(psz, cchArg);
+                if (rc)
+                    break;
+                psz += cchArg;
+            }
+        }
+        else
+            for (i = 1; i < (unsigned)argc && !rc; i++)
+                rc = kmk_builtin_is_rm_recursive_arg(argv[i], strlen(argv[i]));
+        return rc > 0;
+    }
+    return 0;
+}
+#endif /* CONFIG_WITH_KMK_BUILTIN_ASYNC */
+
+
 int kmk_builtin_command_parsed(int argc, char **argv, char ***ppapszArgvToSpawn, pid_t *pPidSpawned)
 {
     const char *pszCmd = argv[0];
@@ -33,6 +33,9 @@
 
 int kmk_builtin_command(const char *pszCmd, char ***ppapszArgvToSpawn, pid_t *pPidSpawned);
 int kmk_builtin_command_parsed(int argc, char **argv, char ***ppapszArgvToSpawn, pid_t *pPidSpawned);
+#ifdef CONFIG_WITH_KMK_BUILTIN_ASYNC
+int kmk_builtin_is_async(int argc, char **argv);
+#endif
 
 extern int kmk_builtin_append(int argc, char **argv, char **envp);
 extern int kmk_builtin_cp(int argc, char **argv, char **envp);
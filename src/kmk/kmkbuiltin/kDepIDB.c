@@ -785,7 +785,7 @@ static int ProcessIDB(FILE *pInput)
 
 static void usage(const char *a_argv0)
 {
-    printf("usage: %s -o <output> -t <target> [-fqs] <vc idb-file>\n"
+    printf("usage: %s <-o <output> | -d <dep-db>> -t <target> [-fqs] <vc idb-file>\n"
            "   or: %s --help\n"
            "   or: %s --version\n",
            a_argv0, a_argv0, a_argv0);
@@ -799,6 +799,7 @@ int kmk_builtin_kDepIDB(int argc, char *argv[], char **envp)
     /* Arguments. */
     FILE       *pOutput = NULL;
     const char *pszOutput = NULL;
+    const char *pszDb = NULL;
     FILE       *pInput = NULL;
     const char *pszTarget = NULL;
     int         fStubs = 0;
@@ -866,6 +867,29 @@ int kmk_builtin_kDepIDB(int argc, char *argv[], char **envp)
                     break;
                 }
 
+                /*
+                 * Binary dependency database to append to.
+                 */
+                case 'd':
+                {
+                    if (pszDb)
+                    {
+                        fprintf(stderr, "%s: syntax error: only one dependency database!\n", argv[0]);
+                        return 1;
+                    }
+                    pszDb = &argv[i][2];
+                    if (!*pszDb)
+                    {
+                        if (++i >= argc)
+                        {
+                            fprintf(stderr, "%s: syntax error: The '-d' argument is missing the filename.\n", argv[0]);
+                            return 1;
+                        }
+                        pszDb = argv[i];
+                    }
+                    break;
+                }
+
                 /*
                  * Target name.
                  */
@@ -968,7 +992,7 @@ int kmk_builtin_kDepIDB(int argc, char *argv[], char **envp)
         fprintf(stderr, "%s: syntax error: No input!\n", argv[0]);
         return 1;
     }
-    if (!pOutput)
+    if (!pOutput && !pszDb)
     {
         fprintf(stderr, "%s: syntax error: No output!\n", argv[0]);
         return 1;
@@ -991,25 +1015,33 @@ int kmk_builtin_kDepIDB(int argc, char *argv[], char **envp)
     if (!i)
     {
         depOptimize(fFixCase, fQuiet);
-        fprintf(pOutput, "%s:", pszTarget);
-        depPrint(pOutput);
-        if (fStubs)
-            depPrintStubs(pOutput);
+        if (pOutput)
+        {
+            fprintf(pOutput, "%s:", pszTarget);
+            depPrint(pOutput);
+            if (fStubs)
+                depPrintStubs(pOutput);
+        }
+        if (pszDb)
+            i = depDbAppend(pszDb, pszTarget, fStubs);
     }
 
     /*
      * Close the output, delete output on failure.
      */
-    if (!i && ferror(pOutput))
+    if (pOutput)
     {
-        i = 1;
-        fprintf(stderr, "%s: error: Error writing to '%s'.\n", argv[0], pszOutput);
-    }
-    fclose(pOutput);
-    if (i)
-    {
-        if (unlink(pszOutput))
-            fprintf(stderr, "%s: warning: failed to remove output file '%s' on failure.\n", argv[0], pszOutput);
+        if (!i && ferror(pOutput))
+        {
+            i = 1;
+            fprintf(stderr, "%s: error: Error writing to '%s'.\n", argv[0], pszOutput);
+        }
+        fclose(pOutput);
+        if (i)
+        {
+            if (unlink(pszOutput))
+                fprintf(stderr, "%s: warning: failed to remove output file '%s' on failure.\n", argv[0], pszOutput);
+        }
     }
 
     depCleanup();
@@ -183,6 +183,13 @@ int pretty_command_printing;
 int print_stats_flag;
 #endif
 
+#ifdef CONFIG_WITH_OUTPUT_SYNC
+/* Nonzero means to buffer the output of each job and print it in one go
+   when the job is done (--output-sync).  */
+
+int output_sync_flag;
+#endif
+
 #ifdef CONFIG_WITH_PRINT_TIME_SWITCH
 /* Minimum number of seconds to report, -1 if disabled. */
 
@@ -305,6 +312,49 @@ static struct stringlist *old_files = 0;
 
 static struct stringlist *new_files = 0;
 
+#ifdef CONFIG_WITH_MAKEFILE_SNAPSHOT
+/* List of files given with --snapshot switches.  The last one is used.  */
+
+static struct stringlist *snapshot_files = 0;
+#endif
+
+#ifdef CONFIG_WITH_EXPAND_PROFILER
+/* List of files given with --profile switches.  The last one is used.  */
+
+static struct stringlist *profile_files = 0;
+
+/* The number of entries in the --profile summary.  */
+
+static int profile_top = 20;
+static int default_profile_top = 20;
+#endif
+
+#ifdef CONFIG_WITH_CRITICAL_PATH
+/* List of files given with --job-history switches.  The last one is used.  */
+
+static struct stringlist *job_history_files = 0;
+#endif
+
+#ifdef CONFIG_WITH_JOB_ADMISSION
+/* The memory budget of the jobs in MB (--mem-budget) and the CPU and memory
+   pressure in percent at which jobs are held back (--max-pressure).  */
+
+static int mem_budget = 0;
+static int default_mem_budget = 0;
+static int max_pressure = 0;
+static int default_max_pressure = 0;
+#endif
+
+#ifdef CONFIG_WITH_SERVER
+/* Sockets given with --server and --client switches, the last one of each
+   is used, and the number of idle seconds before the server exits.  */
+
+static struct stringlist *server_sockets = 0;
+static struct stringlist *client_sockets = 0;
+static int server_timeout = 0;
+static int default_server_timeout = 0;
+#endif
+
 /* If nonzero, we should just print usage and exit.  */
 
 static int print_usage_flag = 0;
@@ -459,6 +509,46 @@ static const char *const usage[] =
 #ifdef CONFIG_WITH_MAKE_STATS
     N_("\
   --statistics                Gather extra statistics for $(make-stats ).\n"),
+#endif
+#ifdef CONFIG_WITH_MAKEFILE_SNAPSHOT
+    N_("\
+  --snapshot=FILE             Load the parsed makefiles from FILE if still\n\
+                              valid, otherwise read them and save FILE.\n"),
+#endif
+#ifdef CONFIG_WITH_EXPAND_PROFILER
+    N_("\
+  --profile=FILE              Profile function and $(call) expansion, writing\n\
+                              folded stacks to FILE.\n"),
+    N_("\
+  --profile-top=N             Number of entries in the profile summary.\n"),
+#endif
+#ifdef CONFIG_WITH_OUTPUT_SYNC
+    N_("\
+  --output-sync               Buffer the output of each job and print it\n\
+                              when the job is done.\n"),
+#endif
+#ifdef CONFIG_WITH_CRITICAL_PATH
+    N_("\
+  --job-history=FILE          Record the recipe times in FILE and use them\n\
+                              to start the critical path jobs first.\n"),
+#endif
+#ifdef CONFIG_WITH_JOB_ADMISSION
+    N_("\
+  --mem-budget=MB             Don't start jobs whose recorded peak memory use\n\
+                              would take the running jobs over MB.\n"),
+    N_("\
+  --max-pressure=PCT          Don't start jobs while the CPU or memory\n\
+                              pressure is PCT percent or more.\n"),
+#endif
+#ifdef CONFIG_WITH_SERVER
+    N_("\
+  --server=SOCKET             Read the makefiles once and serve builds with\n\
+                              the same arguments and environment on SOCKET.\n"),
+    N_("\
+  --server-timeout=SEC        Stop the server after SEC idle seconds.\n"),
+    N_("\
+  --client=SOCKET             Let the server on SOCKET do the build if it\n\
+                              can, otherwise build as usual.\n"),
 #endif
     NULL
   };
@@ -527,6 +617,38 @@ static const struct command_switch switches[] =
 #if defined (CONFIG_WITH_MAKE_STATS) || defined (CONFIG_WITH_MINIMAL_STATS)
     { CHAR_MAX+16, flag, (char *) &make_expensive_statistics, 1, 1, 1, 0, 0,
        "statistics" },
+#endif
+#ifdef CONFIG_WITH_MAKEFILE_SNAPSHOT
+    { CHAR_MAX+17, string, (char *) &snapshot_files, 0, 0, 0, 0, 0,
+      "snapshot" },
+#endif
+#ifdef CONFIG_WITH_EXPAND_PROFILER
+    { CHAR_MAX+18, string, (char *) &profile_files, 0, 0, 0, 0, 0,
+      "profile" },
+    { CHAR_MAX+19, positive_int, (char *) &profile_top, 0, 0, 0, 0,
+      (char *) &default_profile_top, "profile-top" },
+#endif
+#ifdef CONFIG_WITH_CRITICAL_PATH
+    { CHAR_MAX+20, string, (char *) &job_history_files, 0, 0, 0, 0, 0,
+      "job-history" },
+#endif
+#ifdef CONFIG_WITH_OUTPUT_SYNC
+    { CHAR_MAX+21, flag, (char *) &output_sync_flag, 1, 1, 0, 0, 0,
+      "output-sync" },
+#endif
+#ifdef CONFIG_WITH_JOB_ADMISSION
+    { CHAR_MAX+22, positive_int, (char *) &mem_budget, 0, 0, 0, 0,
+      (char *) &default_mem_budget, "mem-budget" },
+    { CHAR_MAX+23, positive_int, (char *) &max_pressure, 1, 1, 0, 0,
+      (char *) &default_max_pressure, "max-pressure" },
+#endif
+#ifdef CONFIG_WITH_SERVER
+    { CHAR_MAX+24, string, (char *) &server_sockets, 0, 0, 0, 0, 0,
+      "server" },
+    { CHAR_MAX+25, positive_int, (char *) &server_timeout, 0, 0, 0, 0,
+      (char *) &default_server_timeout, "server-timeout" },
+    { CHAR_MAX+26, string, (char *) &client_sockets, 0, 0, 0, 0, 0,
+      "client" },
 #endif
     { 't', flag, &touch_flag, 1, 1, 1, 0, 0, "touch" },
     { 'v', flag, &print_version_flag, 1, 1, 0, 0, 0, "version" },
@@ -1732,6 +1854,17 @@ main (int argc, char **argv, char **envp)
 
   decode_debug_flags ();
 
+#ifdef CONFIG_WITH_SERVER
+  /* Let a server do the build if there is one for this exact command
+     line, environment and directory.  Sub-makes always build locally.  */
+  if (server_sockets != 0 || client_sockets != 0)
+    {
+      server_prepare (argc, argv, envp, server_sockets != 0);
+      if (server_sockets == 0 && jobserver_fds == 0)
+        server_client (client_sockets->list[client_sockets->idx - 1]);
+    }
+#endif
+
 #ifdef KMK
   set_make_priority_and_affinity ();
 #endif
@@ -2176,10 +2309,39 @@ main (int argc, char **argv, char **envp)
     default_goal_name = &v->value;
   }
 
+#ifdef CONFIG_WITH_EXPAND_PROFILER
+  if (profile_files != 0)
+    expand_profile_start (profile_files->list[profile_files->idx - 1],
+                          profile_top);
+#endif
+#ifdef CONFIG_WITH_CRITICAL_PATH
+  if (job_history_files != 0)
+    critpath_load_history (job_history_files->list[job_history_files->idx - 1]);
+#endif
+#ifdef CONFIG_WITH_JOB_ADMISSION
+  if (mem_budget > 0 || max_pressure > 0)
+    admit_start (mem_budget, max_pressure);
+#endif
+
   /* Read all the makefiles.  */
 
+#ifndef CONFIG_WITH_MAKEFILE_SNAPSHOT
   read_makefiles
     = read_all_makefiles (makefiles == 0 ? 0 : makefiles->list);
+#else
+  /* Unless we can get them from a valid snapshot.  Makefiles read from
+     stdin ends up in a temporary file, so don't bother in that case.  */
+  if (snapshot_files == 0 || stdin_nm != 0)
+    read_makefiles
+      = read_all_makefiles (makefiles == 0 ? 0 : makefiles->list);
+  else if (!snapshot_load (snapshot_files->list[snapshot_files->idx - 1],
+                           argc, argv, envp, &read_makefiles))
+    {
+      read_makefiles
+        = read_all_makefiles (makefiles == 0 ? 0 : makefiles->list);
+      snapshot_save (read_makefiles);
+    }
+#endif
 
 #ifdef WINDOWS32
   /* look one last time after reading all Makefiles */
@@ -2731,6 +2893,41 @@ main (int argc, char **argv, char **envp)
   if (stdin_nm && unlink (stdin_nm) < 0 && errno != ENOENT)
     perror_with_name (_("unlink (temporary file): "), stdin_nm);
 
+#ifdef CONFIG_WITH_SERVER
+  /* In server mode this only returns in the child process that does the
+     build for a client.  It gets a fresh jobserver pipe so that tokens
+     lost by a request that was killed don't add up.  */
+  if (server_sockets != 0)
+    {
+      server_run (server_sockets->list[server_sockets->idx - 1],
+                  server_timeout);
+# ifdef MAKE_JOBSERVER
+      if (master_job_slots > 1)
+        {
+          int fds[2];
+          char c = '+';
+          unsigned int i;
+
+          if (pipe (fds) < 0
+              || dup2 (fds[0], job_fds[0]) < 0
+              || dup2 (fds[1], job_fds[1]) < 0
+              || dup2 (fds[0], job_rfd) < 0)
+            pfatal_with_name (_("creating jobs pipe"));
+          close (fds[0]);
+          close (fds[1]);
+          for (i = 1; i < master_job_slots; i++)
+            {
+              int r;
+
+              EINTRLOOP (r, write (job_fds[1], &c, 1));
+              if (r != 1)
+                pfatal_with_name (_("init jobserver pipe"));
+            }
+        }
+# endif
+    }
+#endif
+
   {
     int status;
 
@@ -2797,6 +2994,13 @@ main (int argc, char **argv, char **envp)
 
     DB (DB_BASIC, (_("Updating goal targets....\n")));
 
+#ifdef CONFIG_WITH_STAT_PREFETCH
+    prefetch_goal_mtimes (goals);
+#endif
+#ifdef CONFIG_WITH_CRITICAL_PATH
+    critpath_prepare (goals);
+#endif
+
     switch (update_goal_chain (goals))
     {
       case -1:
@@ -3719,7 +3923,40 @@ print_stats ()
   printf (_("\n# Make statistics, printed on %s"), ctime (&when));
 
   print_variable_stats ();
+# ifdef CONFIG_WITH_COMPILER
+  print_expand_prog_stats ();
+# endif
   print_file_stats ();
+# ifdef CONFIG_WITH_MAKEFILE_SNAPSHOT
+  print_snapshot_stats ();
+# endif
+# ifdef CONFIG_WITH_INCLUDEDEP
+  print_incdep_stats ();
+# endif
+# ifdef CONFIG_WITH_STAT_PREFETCH
+  print_stat_prefetch_stats ();
+# endif
+# ifdef CONFIG_WITH_DIR_SNAPSHOTS
+  print_dir_snapshot_stats ();
+# endif
+# ifdef CONFIG_WITH_SERVER
+  print_server_stats ();
+# endif
+# ifdef CONFIG_WITH_PATTERN_RULE_INDEX
+  print_rule_stats ();
+# endif
+# ifdef CONFIG_WITH_VPATH_CACHE
+  print_vpath_stats ();
+# endif
+# ifdef CONFIG_WITH_SHELL_CACHE
+  print_shell_cache_stats ();
+# endif
+# ifdef CONFIG_WITH_KASH
+  print_kash_stats ();
+# endif
+# if defined (CONFIG_WITH_IF_CONDITIONALS) && defined (CONFIG_WITH_STRCACHE2)
+  print_expr_stats ();
+# endif
 # ifndef CONFIG_WITH_STRCACHE2
   strcache_print_stats ("#");
 # else
@@ -3831,6 +4068,15 @@ die (int status)
       if (print_stats_flag)
         print_stats ();
 #endif
+#ifdef CONFIG_WITH_EXPAND_PROFILER
+      expand_profile_finish ();
+#endif
+#ifdef CONFIG_WITH_CRITICAL_PATH
+      critpath_finish ();
+#endif
+#ifdef CONFIG_WITH_JOB_ADMISSION
+      admit_finish ();
+#endif
 
 #ifdef NDEBUG /* bird: Don't waste time on debug sanity checks.  */
       if (print_data_base_flag || db_level)
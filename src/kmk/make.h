@@ -213,6 +213,7 @@ extern long make_stats_reallocations;
 extern unsigned long make_stats_allocated;
 extern unsigned long make_stats_ht_lookups;
 extern unsigned long make_stats_ht_collisions;
+extern unsigned long make_stats_ht_probes;
 
 # ifdef __APPLE__
 #  include <malloc/malloc.h>
@@ -447,7 +448,9 @@ struct floc
 #if defined (CONFIG_WITH_MATH) \
  || defined (CONFIG_WITH_NANOTS) \
  || defined (CONFIG_WITH_FILE_SIZE) \
- || defined (CONFIG_WITH_PRINT_TIME_SWITCH) /* bird */
+ || defined (CONFIG_WITH_PRINT_TIME_SWITCH) \
+ || defined (CONFIG_WITH_MULTIKEY_SORT) \
+ || defined (CONFIG_WITH_SHELL_CACHE) /* bird */
 # ifdef _MSC_VER
 typedef __int64 big_int;
 #  define BIG_INT_C(c)      (c ## LL)
@@ -550,6 +553,33 @@ void build_vpath_lists (void);
 void construct_vpath_list (char *pattern, char *dirpath);
 const char *vpath_search (const char *file, FILE_TIMESTAMP *mtime_ptr);
 int gpath_search (const char *file, unsigned int len);
+#ifdef CONFIG_WITH_MAKEFILE_SNAPSHOT
+unsigned int enum_vpath_lists (void (*) (const char *, const char *, const char **, void *),
+                               void *);
+void add_vpath_list (const char *pattern, const char *percent, const char **searchpath);
+#endif
+#ifdef CONFIG_WITH_VPATH_CACHE
+void vpath_cache_flush (void);
+void vpath_cache_file_entered (const char *name);
+void print_vpath_stats (void);
+#endif
+#ifdef CONFIG_WITH_SERVER
+void dir_contents_forget (const char *name);
+void read_open_directories (void);
+void map_directories (void (*func) (const char *name));
+
+extern int server_recording;
+void server_prepare (int argc, char **argv, char **envp, int recording);
+void server_client (const char *sockname);
+void server_run (const char *sockname, int idle_timeout);
+void server_record_input (const char *name, unsigned int len);
+void server_record_dir_read (const char *name);
+void print_server_stats (void);
+#endif
+
+#ifdef CONFIG_WITH_SHELL_CACHE
+void print_shell_cache_stats (void);
+#endif
 
 void construct_include_path (const char **arg_dirs);
 
@@ -569,6 +599,48 @@ struct alloccache_free_ent
   struct alloccache_free_ent *next;
 };
 
+#ifdef CONFIG_WITH_ALLOCCACHE_MAGAZINES
+/* The _mt variants of the alloc and free functions may be used by any
+   thread.  Each thread keeps two magazines of free items per cache and
+   trades full and empty ones with the depot of the cache in batches. */
+# define ALLOCCACHE_MAGAZINE_SIZE   64
+/* The max number of caches, the slot of a cache indexes the per thread
+   magazine arrays. */
+# define ALLOCCACHE_MAX_SLOTS       32
+# if defined (CONFIG_WITHOUT_THREADS)
+#  define ALLOCCACHE_TLS
+# elif defined (_MSC_VER)
+#  define ALLOCCACHE_TLS            __declspec(thread)
+# elif defined (__GNUC__) && !defined (__OS2__)
+#  define ALLOCCACHE_TLS            __thread
+# else
+#  define ALLOCCACHE_NO_TLS   /* _mt calls are serialized by a lock. */
+#  define ALLOCCACHE_TLS
+# endif
+
+struct alloccache_magazine
+{
+  struct alloccache_magazine *next;
+  unsigned int count;
+  void *items[ALLOCCACHE_MAGAZINE_SIZE];
+};
+
+/* Per thread magazines and statistics. */
+struct alloccache_thread
+{
+  struct alloccache_thread *next;       /* All threads, for printing. */
+  struct alloccache_thread *next_idle;  /* Terminated threads for reuse. */
+  unsigned int id;
+  int active;
+  struct alloccache_magazine *loaded[ALLOCCACHE_MAX_SLOTS];
+  struct alloccache_magazine *previous[ALLOCCACHE_MAX_SLOTS];
+  unsigned long loads[ALLOCCACHE_MAX_SLOTS];    /* Full magazines taken from the depot. */
+  unsigned long unloads[ALLOCCACHE_MAX_SLOTS];  /* Full magazines given to the depot. */
+  unsigned long alloc_count[ALLOCCACHE_MAX_SLOTS];
+  unsigned long free_count[ALLOCCACHE_MAX_SLOTS];
+};
+#endif
+
 struct alloccache
 {
   char *free_start;
@@ -582,6 +654,19 @@ struct alloccache
   struct alloccache *next;
   void *grow_arg;
   void *(*grow_alloc)(void *grow_arg, unsigned int size);
+#ifdef CONFIG_WITH_ALLOCCACHE_MAGAZINES
+  /* The depot, protected by the lock of the slot. */
+  unsigned int slot;
+  unsigned int depot_total_count;       /* Items carved by the depot. */
+  char *depot_start;                    /* Unused space for filling magazines. */
+  char *depot_end;
+  struct alloccache_magazine *depot_full;
+  struct alloccache_magazine *depot_empty;
+  unsigned int depot_full_count;
+  unsigned int depot_empty_count;
+  unsigned int depot_full_items;        /* Items in the full magazines. */
+  unsigned long depot_fills;            /* Magazines filled from fresh space. */
+#endif
 };
 
 void alloccache_init (struct alloccache *cache, unsigned int size, const char *name,
@@ -621,6 +706,55 @@ alloccache_calloc (struct alloccache *cache)
   return item;
 }
 
+#ifdef CONFIG_WITH_ALLOCCACHE_MAGAZINES
+extern ALLOCCACHE_TLS struct alloccache_thread *alloccache_cur_thread;
+void *alloccache_alloc_mt_slow (struct alloccache *cache);
+void alloccache_free_mt_slow (struct alloccache *cache, void *item);
+void alloccache_thread_term (void);
+
+/* Allocate an item, thread safe. */
+MY_INLINE void *
+alloccache_alloc_mt (struct alloccache *cache)
+{
+# ifndef ALLOCCACHE_NO_TLS
+  struct alloccache_thread *thrd = alloccache_cur_thread;
+  struct alloccache_magazine *mag;
+  if (thrd && (mag = thrd->loaded[cache->slot]) != NULL && mag->count)
+    {
+      MAKE_STATS(thrd->alloc_count[cache->slot]++;);
+      return mag->items[--mag->count];
+    }
+# endif
+  return alloccache_alloc_mt_slow (cache);
+}
+
+/* Allocate a cleared item, thread safe. */
+MY_INLINE void *
+alloccache_calloc_mt (struct alloccache *cache)
+{
+  void *item = alloccache_alloc_mt (cache);
+  memset (item, '\0', cache->size);
+  return item;
+}
+
+/* Free an item, thread safe. */
+MY_INLINE void
+alloccache_free_mt (struct alloccache *cache, void *item)
+{
+# ifndef ALLOCCACHE_NO_TLS
+  struct alloccache_thread *thrd = alloccache_cur_thread;
+  struct alloccache_magazine *mag;
+  if (thrd && (mag = thrd->loaded[cache->slot]) != NULL && mag->count < ALLOCCACHE_MAGAZINE_SIZE)
+    {
+      MAKE_STATS(thrd->free_count[cache->slot]++;);
+      mag->items[mag->count++] = item;
+      return;
+    }
+# endif
+  alloccache_free_mt_slow (cache, item);
+}
+#endif /* CONFIG_WITH_ALLOCCACHE_MAGAZINES */
+
 
 /* the alloc caches */
 extern struct alloccache dep_cache;
@@ -710,6 +844,9 @@ extern int second_target_expansion;
 #ifdef CONFIG_PRETTY_COMMAND_PRINTING
 extern int pretty_command_printing;
 #endif
+#ifdef CONFIG_WITH_OUTPUT_SYNC
+extern int output_sync_flag;
+#endif
 #ifdef CONFIG_WITH_PRINT_TIME_SWITCH
 extern int print_time_min, print_time_width;
 #endif
@@ -911,6 +1048,9 @@ static inline void *__my_memchr (__const void *__s, int __c, size_t __n)
 #ifdef CONFIG_WITH_IF_CONDITIONALS
 extern int expr_eval_if_conditionals(const char *line, const struct floc *flocp);
 extern char *expr_eval_to_string(char *o, const char *expr);
+# if defined(CONFIG_WITH_PRINT_STATS_SWITCH) && defined(CONFIG_WITH_STRCACHE2)
+extern void print_expr_stats(void);
+# endif
 #endif
 
 #ifdef KMK
@@ -924,3 +1064,12 @@ extern big_int nano_timestamp (void);
 extern int format_elapsed_nano (char *buf, size_t size, big_int ts);
 #endif
 
+#ifdef CONFIG_WITH_EXPAND_PROFILER
+/* expandprof.c */
+extern int expand_profile_enabled;
+extern void expand_profile_start (const char *filename, unsigned int top);
+extern void expand_profile_enter (const char *kind, const char *name);
+extern void expand_profile_leave (long bytes);
+extern void expand_profile_finish (void);
+#endif
+
@@ -1280,8 +1280,19 @@ nano_timestamp (void)
       ts = bigint.QuadPart * 100;
     }
 
+#elif HAVE_CLOCK_GETTIME && defined (CLOCK_MONOTONIC)
+  /* The expansion profiler needs better than micro second resolution. */
+  struct timespec tp;
+  if (!clock_gettime (CLOCK_MONOTONIC, &tp))
+    ts = (big_int)tp.tv_sec * 1000000000
+       + tp.tv_nsec;
+  else
+    {
+      error (NILF, _("clock_gettime failed"));
+      ts = -1;
+    }
+
 #elif HAVE_GETTIMEOFDAY
-/* FIXME: Linux and others have the realtime clock_* api, detect and use it. */
   struct timeval tv;
   if (!gettimeofday (&tv, NULL))
     ts = (big_int)tv.tv_sec * 1000000000
@@ -1002,16 +1002,20 @@ eval (struct ebuffer *ebuf, int set_default)
 
 #ifdef CONFIG_WITH_INCLUDEDEP
       assert (strchr (p2, '\0') == eol);
-      if (word1eq ("includedep") || word1eq ("includedep-queue") || word1eq ("includedep-flush"))
+      if (word1eq ("includedep") || word1eq ("includedep-queue") || word1eq ("includedep-flush")
+          || word1eq ("includedep-db"))
         {
           /* We have found an `includedep' line specifying one or more dep files
              to be read at this point. This include variation does no
              globbing and do not support multiple names. It's trying to save
-             time by being dead simple as well as ignoring errors. */
+             time by being dead simple as well as ignoring errors.
+             `includedep-db' reads binary dependency databases instead. */
           enum incdep_op op = p[wlen - 1] == 'p'
                             ? incdep_read_it
                             : p[wlen - 1] == 'e'
-                            ? incdep_queue : incdep_flush;
+                            ? incdep_queue
+                            : p[wlen - 1] == 'b'
+                            ? incdep_db : incdep_flush;
           char *free_me = NULL;
           unsigned int buf_len;
           char *name = p2;
@@ -2083,6 +2087,7 @@ conditional_line (char *line, char *eol, int len, const struct floc *flocp)
       char termin = *line == '(' ? ',' : *line;
 #ifdef CONFIG_WITH_VALUE_LENGTH
       char *buf_pos;
+      unsigned long s1_off;
 #endif
 
       if (termin != ',' && termin != '"' && termin != '\'')
@@ -2137,6 +2142,8 @@ conditional_line (char *line, char *eol, int len, const struct floc *flocp)
 #else
       s1 = variable_expand_string_2 (NULL, s1, l, &buf_pos);
       ++buf_pos;
+      /* Expanding the second string may move the buffer.  */
+      s1_off = s1 - variable_buffer;
 #endif
 
       if (termin != ',')
@@ -2191,6 +2198,7 @@ conditional_line (char *line, char *eol, int len, const struct floc *flocp)
         buf_pos = variable_buffer_output (buf_pos, "\0\0\0\0\0\0\0\0",
                                           8 - ((size_t)buf_pos & 7));
       s2 = variable_expand_string_2 (buf_pos, s2, l, &buf_pos);
+      s1 = variable_buffer + s1_off;
 #endif
 #ifdef CONFIG_WITH_SET_CONDITIONALS
       if (cmdtype == c_if1of || cmdtype == c_ifn1of)
@@ -2474,6 +2482,7 @@ record_target_var (struct nameseq *filenames, char *defn,
               v->origin = gv->origin;
               v->recursive = gv->recursive;
               v->append = 0;
+              VARIABLE_CHANGED (v);
             }
         }
     }
@@ -427,6 +427,13 @@ update_file_1 (struct file *file, unsigned int depth)
   int running = 0;
 #ifdef CONFIG_WITH_EXPLICIT_MULTITARGET
   struct file *f2, *f3;
+#endif
+
+#if defined (CONFIG_WITH_STAT_PREFETCH) && defined (CONFIG_WITH_DIR_SNAPSHOTS)
+  /* Drop the prefetched timestamps if they may have gone stale. */
+  stat_prefetch_check_gen ();
+#endif
+#ifdef CONFIG_WITH_EXPLICIT_MULTITARGET
 
   /* Always work on the primary multi target file. */
 
@@ -1146,6 +1153,12 @@ notice_finished_file (struct file *file)
 	}
     }
 
+#ifdef CONFIG_WITH_DIR_SNAPSHOTS
+  /* The commands may have changed any file, not just this one.  */
+  if (ran || touched)
+    dir_snapshot_gen++;
+#endif
+
   if (file->mtime_before_update == UNKNOWN_MTIME)
     file->mtime_before_update = file->last_mtime;
 #ifdef CONFIG_WITH_EXPLICIT_MULTITARGET
@@ -1572,7 +1585,19 @@ f_mtime (struct file *file, int search)
   else
 #endif
     {
+#ifdef CONFIG_WITH_DIR_SNAPSHOTS
+      /* Files that haven't been remade can be looked up in the directory
+         snapshot, anything else needs a fresh stat().  */
+      int rc = -1;
+      if (file->command_state == cs_not_started)
+        rc = dir_snapshot_mtime (file->name, &mtime);
+      if (rc < 0)
+        mtime = name_mtime (file->name);
+      else if (rc == 0)
+        mtime = NONEXISTENT_MTIME;
+#else
       mtime = name_mtime (file->name);
+#endif
 
       if (mtime == NONEXISTENT_MTIME && search && !file->ignore_vpath)
 	{
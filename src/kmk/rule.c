@@ -28,6 +28,9 @@ this program.  If not, see <http://www.gnu.org/licenses/>.  */
 #include "rule.h"
 
 static void freerule (struct rule *rule, struct rule *lastrule);
+#ifdef CONFIG_WITH_PATTERN_RULE_INDEX
+static void build_rule_index (void);
+#endif
 
 /* Chain of all pattern rules.  */
 
@@ -61,6 +64,13 @@ struct file *suffix_file;
 /* Maximum length of a suffix.  */
 
 unsigned int maxsuffix;
+
+#ifdef CONFIG_WITH_PATTERN_RULE_INDEX
+/* Set when the pattern rule chain has been changed since the pattern rule
+   index was built.  */
+
+static int rule_index_stale = 1;
+#endif
 
 /* Compute the maximum dependency length and maximum number of
    dependencies of all implicit rules.  Also sets the subdir
@@ -145,6 +155,10 @@ count_implicit_rule_limits (void)
 
   if (name != 0)
     free (name);
+
+#ifdef CONFIG_WITH_PATTERN_RULE_INDEX
+  build_rule_index ();
+#endif
 }
 
 /* Create a pattern rule from a suffix rule.
@@ -291,6 +305,9 @@ new_pattern_rule (struct rule *rule, int override)
   rule->terminal = 0;
 
   rule->next = 0;
+#ifdef CONFIG_WITH_PATTERN_RULE_INDEX
+  rule_index_stale = 1;
+#endif
 
   /* Search for an identical rule.  */
   lastrule = 0;
@@ -451,6 +468,9 @@ freerule (struct rule *rule, struct rule *lastrule)
     lastrule->next = next;
   if (last_pattern_rule == rule)
     last_pattern_rule = lastrule;
+#ifdef CONFIG_WITH_PATTERN_RULE_INDEX
+  rule_index_stale = 1;
+#endif
 }
 
 /* Create a new pattern rule with the targets in the nil-terminated array
@@ -562,3 +582,209 @@ print_rule_data_base (void)
                num_pattern_rules, rules);
     }
 }
+
+#ifdef CONFIG_WITH_PATTERN_RULE_INDEX
+/* The pattern rule index.
+
+   pattern_search used to match every target pattern of every pattern rule
+   against the file name.  The index is a trie of the target suffixes (the
+   part after the `%') read from the end, so walking the file name backwards
+   down the trie ends in the node for the longest suffix it has.  Each node
+   has the targets whose suffix is a tail of the node's suffix, in the order
+   of the rule chain, so that is the complete list of candidates for all
+   names ending that way and they are tried in the same order as before.  */
+
+struct rule_suffix_node
+  {
+    struct rule_suffix_node *next;      /* Next sibling.  */
+    struct rule_suffix_node *children;  /* One more suffix character.  */
+    struct rule_target *targets;        /* The candidates, in rule order.  */
+    unsigned int num;                   /* Number of TARGETS.  */
+    unsigned int own;                   /* Targets with exactly this suffix.  */
+    unsigned int alloc;                 /* Allocated TARGETS while building.  */
+    unsigned char ch;                   /* The suffix character.  */
+  };
+
+/* The root of the trie, i.e. the empty suffix.  */
+static struct rule_suffix_node *rule_index;
+
+/* Statistics.  */
+static unsigned int rule_index_nodes;
+static unsigned int rule_index_targets;
+static unsigned int rule_index_builds;
+static unsigned long pattern_rule_stat_searches;
+unsigned long pattern_rule_stat_examined;
+unsigned long pattern_rule_stat_matched;
+static unsigned long pattern_rule_stat_unindexed;
+
+static void
+free_rule_index (struct rule_suffix_node *node)
+{
+  while (node)
+    {
+      struct rule_suffix_node *next = node->next;
+      free_rule_index (node->children);
+      if (node->own)
+        free (node->targets);
+      free (node);
+      node = next;
+    }
+}
+
+static struct rule_suffix_node *
+new_rule_index_node (unsigned char ch)
+{
+  struct rule_suffix_node *node = xmalloc (sizeof (*node));
+  memset (node, 0, sizeof (*node));
+  node->ch = ch;
+  rule_index_nodes++;
+  return node;
+}
+
+/* Gives each node the targets of its parent followed by its own, merged
+   back into rule order.  Until now TARGETS has only held the node's own
+   targets.  */
+
+static void
+link_rule_index (struct rule_suffix_node *node, struct rule_target *parent,
+                 unsigned int num_parent)
+{
+  for (; node; node = node->next)
+    {
+      if (!node->own)
+        {
+          node->targets = parent;
+          node->num = num_parent;
+        }
+      else if (num_parent)
+        {
+          struct rule_target *own = node->targets;
+          struct rule_target *merged;
+          unsigned int i = 0, j = 0, k = 0;
+
+          merged = xmalloc ((num_parent + node->own) * sizeof (*merged));
+          while (i < num_parent && j < node->own)
+            if (parent[i].seq < own[j].seq)
+              merged[k++] = parent[i++];
+            else
+              merged[k++] = own[j++];
+          while (i < num_parent)
+            merged[k++] = parent[i++];
+          while (j < node->own)
+            merged[k++] = own[j++];
+          free (own);
+          node->targets = merged;
+          node->num = k;
+        }
+      else
+        node->num = node->own;
+
+      link_rule_index (node->children, node->targets, node->num);
+    }
+}
+
+/* (Re)builds the index from the pattern rule chain.  */
+
+static void
+build_rule_index (void)
+{
+  struct rule *rule;
+  unsigned int seq = 0;
+
+  free_rule_index (rule_index);
+  rule_index_nodes = 0;
+  rule_index = new_rule_index_node (0);
+
+  for (rule = pattern_rules; rule != 0; rule = rule->next)
+    {
+      unsigned int ti;
+      for (ti = 0; ti < rule->num; ++ti, ++seq)
+        {
+          const char *suffix = rule->suffixes[ti];
+          const char *p = suffix + strlen (suffix);
+          struct rule_suffix_node *node = rule_index;
+
+          while (p > suffix)
+            {
+              unsigned char ch = *--p;
+              struct rule_suffix_node *child;
+
+              for (child = node->children; child; child = child->next)
+                if (child->ch == ch)
+                  break;
+              if (!child)
+                {
+                  child = new_rule_index_node (ch);
+                  child->next = node->children;
+                  node->children = child;
+                }
+              node = child;
+            }
+
+          if (node->own == node->alloc)
+            {
+              node->alloc = node->alloc ? node->alloc * 2 : 4;
+              node->targets = xrealloc (node->targets,
+                                        node->alloc * sizeof (*node->targets));
+            }
+          node->targets[node->own].rule = rule;
+          node->targets[node->own].ti = ti;
+          node->targets[node->own].seq = seq;
+          node->own++;
+        }
+    }
+
+  rule_index->num = rule_index->own;
+  link_rule_index (rule_index->children, rule_index->targets, rule_index->num);
+
+  rule_index_targets = seq;
+  rule_index_builds++;
+  rule_index_stale = 0;
+}
+
+/* Returns the pattern rule targets that may match the file name NAME of
+   LEN chars, i.e. those whose suffix NAME ends with, in rule order.  The
+   prefixes have not been checked.  The array is only valid until the
+   pattern rules are changed.  */
+
+const struct rule_target *
+find_pattern_rule_targets (const char *name, unsigned int len,
+                           unsigned int *nump)
+{
+  struct rule_suffix_node *node;
+  const char *p = name + len;
+
+  if (rule_index_stale)
+    build_rule_index ();
+
+  node = rule_index;
+  while (p > name)
+    {
+      unsigned char ch = *--p;
+      struct rule_suffix_node *child;
+
+      for (child = node->children; child; child = child->next)
+        if (child->ch == ch)
+          break;
+      if (!child)
+        break;
+      node = child;
+    }
+
+  pattern_rule_stat_searches++;
+  pattern_rule_stat_unindexed += rule_index_targets;
+  *nump = node->num;
+  return node->targets;
+}
+
+void
+print_rule_stats (void)
+{
+  printf (_("\n# pattern rule index: %u targets, %u suffix nodes, built %u times\n"),
+          rule_index_targets, rule_index_nodes, rule_index_builds);
+  printf (_("#  %lu searches: %lu targets examined (%lu without the index), %lu matched\n"),
+          pattern_rule_stat_searches, pattern_rule_stat_examined,
+          pattern_rule_stat_unindexed, pattern_rule_stat_matched);
+}
+
+#endif /* CONFIG_WITH_PATTERN_RULE_INDEX */
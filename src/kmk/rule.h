@@ -32,6 +32,16 @@ struct rule
     char in_use;		/* If in use by a parent pattern_search.  */
   };
 
+#ifdef CONFIG_WITH_PATTERN_RULE_INDEX
+/* A target of a pattern rule, as returned by find_pattern_rule_targets.  */
+struct rule_target
+  {
+    struct rule *rule;          /* The rule.  */
+    unsigned int ti;            /* The index of the target in the rule.  */
+    unsigned int seq;           /* The position of the target in the chain.  */
+  };
+#endif
+
 /* For calling install_pattern_rule.  */
 struct pspec
   {
@@ -57,3 +67,11 @@ void install_pattern_rule (struct pspec *p, int terminal);
 void create_pattern_rule (const char **targets, const char **target_percents,
                           unsigned int num, int terminal, struct dep *deps,
                           struct commands *commands, int override);
+#ifdef CONFIG_WITH_PATTERN_RULE_INDEX
+const struct rule_target *find_pattern_rule_targets (const char *name,
+                                                     unsigned int len,
+                                                     unsigned int *nump);
+void print_rule_stats (void);
+extern unsigned long pattern_rule_stat_examined;
+extern unsigned long pattern_rule_stat_matched;
+#endif
@@ -0,0 +1,1302 @@
+#ifdef CONFIG_WITH_SERVER
+/* $Id$ */
+/** @file
+ * server - Resident kmk serving builds to clients over a unix socket.
+ *
+ * With --server=SOCKET kmk reads the makefiles and remakes them as usual,
+ * and then, instead of building the goals, listens on SOCKET.  Each build
+ * request from a `kmk --client=SOCKET' invocation is served by a forked
+ * child process that starts out with the parsed database, the file graph
+ * and the timestamps of the server, and goes on to build the goals exactly
+ * like the client would have.  The client passes its stdin, stdout and
+ * stderr along and exits with the status of the build.
+ *
+ * The timestamps are kept current with inotify.  A watch is added for the
+ * directory of every file in the database and for every directory dir.c
+ * has read, so that a change to a file only invalidates that file.  The
+ * timestamps of invalidated files are fetched again before the next child
+ * is forked, which means a no-op build needs no stat() calls at all.
+ *
+ * Requests are only served when the client has the same working directory,
+ * arguments and environment as the server, since all of these may affect
+ * how the makefiles are read; jobs are therefore always spawned with the
+ * client's environment.  Anything else is refused and the client does the
+ * build itself.  The server exits, and the clients go back to building
+ * themselves, when something it read while parsing changes: makefiles and
+ * files they depend on, includedep files, names checked by $(wildcard )
+ * and directories it globbed.  Changes made by $(shell ) commands run
+ * while reading the makefiles are not tracked.
+ */
+
+/*
+ * Copyright (c) 2026 The kBuild contributors
+ *
+ * This file is part of kBuild.
+ *
+ * kBuild is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * kBuild is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with kBuild.  If not, see <http://www.gnu.org/licenses/>
+ *
+ */
+
+/*******************************************************************************
+*   Header Files                                                               *
+*******************************************************************************/
+#include "make.h"
+#include "filedef.h"
+#include "hash.h"
+#include "debug.h"
+#include <stddef.h>
+
+#if defined (__linux__)
+# include <sys/socket.h>
+# include <sys/un.h>
+# include <sys/inotify.h>
+# include <sys/wait.h>
+# include <poll.h>
+# include <signal.h>
+# include <fcntl.h>
+# define HAVE_SERVER
+#endif
+
+
+/*******************************************************************************
+*   Defined Constants And Macros                                               *
+*******************************************************************************/
+/* Request header magic, bump the number when changing the protocol. */
+#define SERVER_MAGIC            "kmksrv1"
+/* The max size of a request (working directory, arguments, environment). */
+#define SERVER_MAX_REQUEST      (64 * 1024 * 1024)
+/* The reply status when a request isn't served. */
+#define SERVER_REFUSED          -1
+/* The changes to watch the directories for. */
+#define SERVER_WATCH_MASK       (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE \
+                                 | IN_CREATE | IN_DELETE | IN_MOVED_FROM \
+                                 | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+
+
+/*******************************************************************************
+*   Structures and Typedefs                                                    *
+*******************************************************************************/
+/* The request header.  The client's stdin, stdout and stderr come along
+   with it, followed by LEN bytes of fingerprint.  The reply is a single
+   int with the exit status or SERVER_REFUSED. */
+struct server_request
+{
+  char magic[8];
+  unsigned int len;
+};
+
+#ifdef HAVE_SERVER
+/* A directory with files from the database in it. */
+struct server_dir
+{
+  const char *name;             /* Name without trailing slash (strcache'ed). */
+  char *prefix;                 /* What goes in front of the entry names. */
+  unsigned int prefix_len;
+  int wd;                       /* Watch descriptor, -1 if not watched. */
+  struct server_dir *next_same_wd; /* Other names for the directory. */
+  struct server_dir *next;      /* Next in the list of all directories. */
+  struct file **files;          /* The files in the database in it. */
+  unsigned int num_files;
+  unsigned int max_files;
+  unsigned char inputs;         /* Has files that were read while parsing. */
+  unsigned char globbed;        /* Was globbed while parsing. */
+  unsigned char forget;         /* Entries were added or removed. */
+};
+
+/* A file that was read while parsing. */
+struct server_input
+{
+  const char *name;             /* strcache'ed */
+};
+#endif /* HAVE_SERVER */
+
+
+/*******************************************************************************
+*   Global Variables                                                           *
+*******************************************************************************/
+/* Nonzero while reading the makefiles in server mode. */
+int server_recording;
+
+/* What a client must match to be served. */
+static char *server_fingerprint;
+static unsigned int server_fingerprint_len;
+static unsigned int server_fingerprint_size;
+
+#ifdef HAVE_SERVER
+/* The directories by name and all of them in a list. */
+static struct hash_table server_dirs;
+static struct server_dir *server_dir_head;
+/* The directories by watch descriptor. */
+static struct server_dir **server_wds;
+static int server_wds_size;
+
+/* The names read while parsing. */
+static struct hash_table server_inputs;
+
+/* Files to get the timestamps of before the next request. */
+static struct file **server_requeue;
+static unsigned int server_requeue_count;
+static unsigned int server_requeue_size;
+
+/* The sockets and the inotify instance. */
+static const char *server_socket_name;
+static ino_t server_socket_ino;
+static int server_listen_fd = -1;
+static int server_inotify_fd = -1;
+/* SIGCHLD self pipe and the handler it replaced. */
+static int server_sigchld_pipe[2] = { -1, -1 };
+static struct sigaction server_old_sigchld;
+
+/* Why the server can't go on serving requests, NULL if it can. */
+static char *server_stale_reason;
+
+/* Scratch buffer for the paths of changed files. */
+static char *server_path_buf;
+static unsigned int server_path_size;
+#endif /* HAVE_SERVER */
+
+/* Statistics, the child gets them as of when it was forked. */
+static unsigned int server_stat_requests;
+static unsigned int server_stat_refused;
+static unsigned long server_stat_events;
+static unsigned long server_stat_invalidated;
+static unsigned long server_stat_restat;
+static unsigned int server_stat_dirs;
+static unsigned int server_stat_unwatched;
+
+
+/*******************************************************************************
+*   Fingerprint                                                                *
+*******************************************************************************/
+
+/* Appends STR and its terminator to the fingerprint. */
+static void
+server_fingerprint_add (const char *str)
+{
+  unsigned int len = strlen (str) + 1;
+  if (server_fingerprint_len + len > server_fingerprint_size)
+    {
+      server_fingerprint_size = (server_fingerprint_len + len) * 2;
+      server_fingerprint = xrealloc (server_fingerprint,
+                                     server_fingerprint_size);
+    }
+  memcpy (server_fingerprint + server_fingerprint_len, str, len);
+  server_fingerprint_len += len;
+}
+
+/* Returns the number of arguments starting at ARGV[I] that are server
+   options, or 0 if ARGV[I] isn't one. */
+static int
+server_option_args (int argc, char **argv, int i)
+{
+  static const char * const options[] =
+    { "--server", "--server-timeout", "--client" };
+  unsigned int j;
+
+  for (j = 0; j < sizeof (options) / sizeof (options[0]); j++)
+    {
+      unsigned int len = strlen (options[j]);
+      if (!strncmp (argv[i], options[j], len))
+        {
+          if (argv[i][len] == '=')
+            return 1;
+          if (argv[i][len] == '\0')
+            return i + 1 < argc ? 2 : 1;
+        }
+    }
+  return 0;
+}
+
+/* qsort callback for the environment. */
+static int
+server_env_compare (const void *pv1, const void *pv2)
+{
+  return strcmp (*(const char * const *)pv1, *(const char * const *)pv2);
+}
+
+/* Works out what the clients have to match to be served: the kmk build,
+   working directory, arguments (except the server options) and the sorted
+   environment.  RECORDING is nonzero when we're the server and should note
+   what's read while parsing the makefiles. */
+void
+server_prepare (int argc, char **argv, char **envp, int recording)
+{
+  static const char * const ignored_env[] =
+    { "_=", "SHLVL=", "OLDPWD=", "MAKE_RESTARTS=" };
+  char cwd[GET_PATH_MAX];
+  const char **env;
+  unsigned int num_env;
+  unsigned int i;
+
+  server_fingerprint_add (SERVER_MAGIC " " __DATE__ " " __TIME__);
+  server_fingerprint_add (getcwd (cwd, sizeof (cwd)) ? cwd : "");
+  for (i = 1; i < (unsigned int)argc; )
+    {
+      int skip = server_option_args (argc, argv, i);
+      if (skip)
+        i += skip;
+      else
+        server_fingerprint_add (argv[i++]);
+    }
+  server_fingerprint_add ("\n--environment--\n");
+
+  /* Leave out what differs between shells for no good reason, and
+     MAKE_RESTARTS which only a restarted server has. */
+  for (num_env = 0; envp[num_env]; num_env++)
+    /* nothing */;
+  env = xmalloc ((num_env + 1) * sizeof (env[0]));
+  for (i = num_env = 0; envp[i]; i++)
+    {
+      unsigned int j;
+      for (j = 0; j < sizeof (ignored_env) / sizeof (ignored_env[0]); j++)
+        if (!strncmp (envp[i], ignored_env[j], strlen (ignored_env[j])))
+          break;
+      if (j >= sizeof (ignored_env) / sizeof (ignored_env[0]))
+        env[num_env++] = envp[i];
+    }
+  qsort (env, num_env, sizeof (env[0]), server_env_compare);
+  for (i = 0; i < num_env; i++)
+    server_fingerprint_add (env[i]);
+  free (env);
+
+  server_recording = recording;
+}
+
+#ifdef HAVE_SERVER
+
+/*******************************************************************************
+*   Socket Helpers                                                             *
+*******************************************************************************/
+
+/* Reads exactly LEN bytes, returns 0 on success. */
+static int
+server_read_all (int fd, void *buf, unsigned int len)
+{
+  char *p = buf;
+  while (len > 0)
+    {
+      ssize_t cb;
+      EINTRLOOP (cb, read (fd, p, len));
+      if (cb <= 0)
+        return -1;
+      p += cb;
+      len -= cb;
+    }
+  return 0;
+}
+
+/* Writes exactly LEN bytes, returns 0 on success. */
+static int
+server_write_all (int fd, const void *buf, unsigned int len)
+{
+  const char *p = buf;
+  while (len > 0)
+    {
+      ssize_t cb;
+      EINTRLOOP (cb, send (fd, p, len, MSG_NOSIGNAL));
+      if (cb <= 0)
+        return -1;
+      p += cb;
+      len -= cb;
+    }
+  return 0;
+}
+
+/* Fills in the address for SOCKNAME, returns -1 if it's too long. */
+static int
+server_make_addr (const char *sockname, struct sockaddr_un *addr)
+{
+  unsigned int len = strlen (sockname);
+  if (len >= sizeof (addr->sun_path))
+    return -1;
+  memset (addr, 0, sizeof (*addr));
+  addr->sun_family = AF_UNIX;
+  memcpy (addr->sun_path, sockname, len + 1);
+  return 0;
+}
+
+/* Connects to the server on SOCKNAME, returns the socket or -1. */
+static int
+server_connect (const char *sockname)
+{
+  struct sockaddr_un addr;
+  int fd;
+  int rc;
+
+  if (server_make_addr (sockname, &addr))
+    return -1;
+  fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+  EINTRLOOP (rc, connect (fd, (struct sockaddr *)&addr, sizeof (addr)));
+  if (rc < 0)
+    {
+      close (fd);
+      return -1;
+    }
+  return fd;
+}
+
+
+/*******************************************************************************
+*   Client                                                                     *
+*******************************************************************************/
+
+/* Sends the request, our stdin, stdout and stderr along with the header. */
+static int
+server_send_request (int fd)
+{
+  struct server_request req;
+  struct msghdr msg;
+  struct iovec iov;
+  union
+  {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE (3 * sizeof (int))];
+  } ctl;
+  struct cmsghdr *cmsg;
+  int fds[3] = { 0, 1, 2 };
+  ssize_t cb;
+
+  memset (&req, 0, sizeof (req));
+  memcpy (req.magic, SERVER_MAGIC, sizeof (SERVER_MAGIC));
+  req.len = server_fingerprint_len;
+
+  iov.iov_base = &req;
+  iov.iov_len = sizeof (req);
+  memset (&msg, 0, sizeof (msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = ctl.buf;
+  msg.msg_controllen = sizeof (ctl.buf);
+  cmsg = CMSG_FIRSTHDR (&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN (sizeof (fds));
+  memcpy (CMSG_DATA (cmsg), fds, sizeof (fds));
+
+  EINTRLOOP (cb, sendmsg (fd, &msg, MSG_NOSIGNAL));
+  if (cb != sizeof (req))
+    return -1;
+  return server_write_all (fd, server_fingerprint, server_fingerprint_len);
+}
+
+/* Lets the server on SOCKNAME do the build.  Only returns if that's not
+   possible, in which case we do the build ourselves. */
+void
+server_client (const char *sockname)
+{
+  int fd;
+  int status;
+
+  fd = server_connect (sockname);
+  if (fd < 0)
+    {
+      DB (DB_BASIC, (_("No kmk server on `%s', building locally.\n"),
+                     sockname));
+      return;
+    }
+
+  fflush (stdout);
+  fflush (stderr);
+  if (   server_send_request (fd)
+      || server_read_all (fd, &status, sizeof (status)))
+    {
+      DB (DB_BASIC, (_("Lost the connection to the kmk server on `%s', building locally.\n"),
+                     sockname));
+      close (fd);
+      return;
+    }
+  close (fd);
+
+  if (status == SERVER_REFUSED)
+    {
+      DB (DB_BASIC, (_("The kmk server on `%s' can't do this build, building locally.\n"),
+                     sockname));
+      return;
+    }
+  exit (status);
+}
+
+
+/*******************************************************************************
+*   Directories and Inputs                                                     *
+*******************************************************************************/
+
+/* Returns the length of the directory part of NAME, slash included. */
+static unsigned int
+server_dir_len (const char *name)
+{
+  const char *slash = strrchr (name, '/');
+  return slash ? slash - name + 1 : 0;
+}
+
+/* Looks up the directory with the LEN long name or prefix NAME, creating it
+   if CREATE is set. */
+static struct server_dir *
+server_get_dir (const char *name, unsigned int len, int create)
+{
+  struct server_dir key;
+  struct server_dir **slot;
+  struct server_dir *d;
+  unsigned int name_len = len;
+
+  /* Strip trailing slashes, except from the root. */
+  while (name_len > 1 && name[name_len - 1] == '/')
+    name_len--;
+  if (name_len == 0 || (name_len == 1 && name[0] == '.'))
+    key.name = strcache_add_len (".", 1);
+  else
+    key.name = strcache_add_len (name, name_len);
+
+  slot = (struct server_dir **) hash_find_slot_strcached (&server_dirs, &key);
+  d = *slot;
+  if (!HASH_VACANT (d) || !create)
+    return HASH_VACANT (d) ? NULL : d;
+
+  d = xmalloc (sizeof (*d));
+  memset (d, 0, sizeof (*d));
+  d->name = key.name;
+  if (key.name[0] == '.' && key.name[1] == '\0')
+    d->prefix = xstrdup ("");
+  else if (key.name[0] == '/' && key.name[1] == '\0')
+    d->prefix = xstrdup ("/");
+  else
+    {
+      d->prefix = xmalloc (name_len + 2);
+      memcpy (d->prefix, name, name_len);
+      d->prefix[name_len] = '/';
+      d->prefix[name_len + 1] = '\0';
+    }
+  d->prefix_len = strlen (d->prefix);
+  d->wd = -1;
+  d->next = server_dir_head;
+  server_dir_head = d;
+  hash_insert_at (&server_dirs, d, slot);
+  server_stat_dirs++;
+  return d;
+}
+
+/* The directory of the file NAME. */
+static struct server_dir *
+server_get_file_dir (const char *name, int create)
+{
+  return server_get_dir (name, server_dir_len (name), create);
+}
+
+/* Initializes the tables the first time they're needed. */
+static void
+server_init_tables (void)
+{
+  if (server_dirs.ht_vec == 0)
+    {
+      hash_init_strcached (&server_dirs, 1024, &file_strcache,
+                           offsetof (struct server_dir, name));
+      hash_init_strcached (&server_inputs, 256, &file_strcache,
+                           offsetof (struct server_input, name));
+    }
+}
+
+/* Strips leading "./" from NAME. */
+static const char *
+server_strip_dot_slash (const char *name, unsigned int *lenp)
+{
+  while (*lenp > 2 && name[0] == '.' && name[1] == '/')
+    {
+      name += 2;
+      *lenp -= 2;
+      while (*lenp > 1 && name[0] == '/')
+        name++, --*lenp;
+    }
+  return name;
+}
+
+/* Notes that NAME was read while parsing, a change to it makes the server
+   useless. */
+void
+server_record_input (const char *name, unsigned int len)
+{
+  struct server_input key;
+  struct server_input **slot;
+  struct server_input *input;
+
+  server_init_tables ();
+  name = server_strip_dot_slash (name, &len);
+  key.name = strcache_add_len (name, len);
+  slot = (struct server_input **) hash_find_slot_strcached (&server_inputs, &key);
+  if (!HASH_VACANT (*slot))
+    return;
+  input = xmalloc (sizeof (*input));
+  input->name = key.name;
+  hash_insert_at (&server_inputs, input, slot);
+  server_get_file_dir (key.name, 1)->inputs = 1;
+}
+
+/* Notes that the directory NAME was read while parsing, adding or removing
+   entries makes the server useless. */
+void
+server_record_dir_read (const char *name)
+{
+  unsigned int len = strlen (name);
+  server_init_tables ();
+  name = server_strip_dot_slash (name, &len);
+  server_get_dir (name, len, 1)->globbed = 1;
+}
+
+/* Checks whether PATH was read while parsing. */
+static int
+server_is_input (const char *path)
+{
+  struct server_input key;
+  key.name = strcache2_lookup_file (&file_strcache, path, strlen (path));
+  return key.name != NULL
+      && hash_find_item_strcached (&server_inputs, &key) != NULL;
+}
+
+
+/*******************************************************************************
+*   Timestamps                                                                 *
+*******************************************************************************/
+
+/* Gets the timestamp of F (the double-colon head) if f_mtime would just
+   stat() it and the directory is watched. */
+static void
+server_warm_file (struct file *f, FILE_TIMESTAMP now)
+{
+  struct stat st;
+  FILE_TIMESTAMP mtime;
+  struct file *f2;
+  int e;
+
+  if (   f->last_mtime != UNKNOWN_MTIME
+      || f->phony
+      || f->intermediate
+#ifndef NO_ARCHIVES
+      || ar_name (f->name)
+#endif
+     )
+    return;
+
+  /* Changes to the target of a symlink don't show up in its directory. */
+  EINTRLOOP (e, lstat (f->name, &st));
+  if (e != 0 || S_ISLNK (st.st_mode))
+    return;
+  mtime = FILE_TIMESTAMP_STAT_MODTIME (f->name, st);
+  if (mtime > now)
+    return;
+  for (f2 = f; f2; f2 = f2->prev)
+    f2->last_mtime = mtime;
+  server_stat_restat++;
+}
+
+/* The current time, as prefetch_goal_mtimes uses it. */
+static FILE_TIMESTAMP
+server_now (void)
+{
+  int resolution;
+  FILE_TIMESTAMP now = file_timestamp_now (&resolution);
+  return now + resolution - 1;
+}
+
+/* Forgets the timestamp of F and queues it for getting it again. */
+static void
+server_invalidate_file (struct file *f)
+{
+  struct file *f2;
+
+  if (f->double_colon)
+    f = f->double_colon;
+  for (f2 = f; f2; f2 = f2->prev)
+    f2->last_mtime = UNKNOWN_MTIME;
+  server_stat_invalidated++;
+
+  if (!f->server_queued)
+    {
+      f->server_queued = 1;
+      if (server_requeue_count >= server_requeue_size)
+        {
+          server_requeue_size = server_requeue_size ? server_requeue_size * 2 : 256;
+          server_requeue = xrealloc (server_requeue,
+                                     server_requeue_size * sizeof (server_requeue[0]));
+        }
+      server_requeue[server_requeue_count++] = f;
+    }
+}
+
+/* hash_map_arg callback that adds a file to its directory and marks what
+   was looked at when remaking the makefiles as input. */
+static void
+server_add_file (const void *item, void *arg)
+{
+  struct file *f = (struct file *)item;
+  struct file *f2;
+  struct server_dir *d;
+  (void)arg;
+
+  for (f2 = f; f2; f2 = f2->prev)
+    if (f2->updated || f2->command_state != cs_not_started)
+      {
+        server_record_input (f2->name, strlen (f2->name));
+        if (f2->hname != f2->name)
+          server_record_input (f2->hname, strlen (f2->hname));
+      }
+
+#ifndef NO_ARCHIVES
+  if (ar_name (f->name))
+    return;
+#endif
+  d = server_get_file_dir (f->name, 1);
+  if (d->num_files >= d->max_files)
+    {
+      d->max_files = d->max_files ? d->max_files * 2 : 16;
+      d->files = xrealloc (d->files, d->max_files * sizeof (d->files[0]));
+    }
+  d->files[d->num_files++] = f;
+}
+
+/* map_directories callback. */
+static void
+server_add_dir (const char *name)
+{
+  server_get_dir (name, strlen (name), 1);
+}
+
+/* Marks the server as stale, FMT has one %s for ARG. */
+static void
+server_set_stale (const char *fmt, const char *arg)
+{
+  if (!server_stale_reason)
+    {
+      server_stale_reason = xmalloc (strlen (fmt) + strlen (arg) + 1);
+      sprintf (server_stale_reason, fmt, arg);
+    }
+}
+
+/* Tries to add a watch for D. */
+static int
+server_watch_dir (struct server_dir *d)
+{
+  int wd = inotify_add_watch (server_inotify_fd, d->name, SERVER_WATCH_MASK);
+  if (wd < 0)
+    return -1;
+
+  if (wd >= server_wds_size)
+    {
+      int old_size = server_wds_size;
+      server_wds_size = (wd + 1) * 2;
+      server_wds = xrealloc (server_wds, server_wds_size * sizeof (server_wds[0]));
+      memset (&server_wds[old_size], 0,
+              (server_wds_size - old_size) * sizeof (server_wds[0]));
+    }
+  d->wd = wd;
+  d->next_same_wd = server_wds[wd];
+  server_wds[wd] = d;
+  return 0;
+}
+
+/* D isn't watched (any more), so forget the timestamps of its files. */
+static void
+server_unwatched_dir (struct server_dir *d)
+{
+  unsigned int i;
+
+  d->wd = -1;
+  d->next_same_wd = NULL;
+  d->forget = 1;
+  for (i = 0; i < d->num_files; i++)
+    {
+      struct file *f;
+      for (f = d->files[i]; f; f = f->prev)
+        f->last_mtime = UNKNOWN_MTIME;
+    }
+  server_stat_unwatched++;
+}
+
+
+/*******************************************************************************
+*   Events                                                                     *
+*******************************************************************************/
+
+/* Builds the path of NAME in D in the scratch buffer. */
+static const char *
+server_event_path (struct server_dir *d, const char *name)
+{
+  unsigned int len = strlen (name);
+  if (d->prefix_len + len + 1 > server_path_size)
+    {
+      server_path_size = (d->prefix_len + len + 1) * 2;
+      server_path_buf = xrealloc (server_path_buf, server_path_size);
+    }
+  memcpy (server_path_buf, d->prefix, d->prefix_len);
+  memcpy (server_path_buf + d->prefix_len, name, len + 1);
+  return server_path_buf;
+}
+
+/* Handles one inotify event. */
+static void
+server_handle_event (const struct inotify_event *ev)
+{
+  struct server_dir *d;
+
+  server_stat_events++;
+  if (ev->mask & IN_Q_OVERFLOW)
+    {
+      server_set_stale (_("%sinotify events were lost"), "");
+      return;
+    }
+  if (ev->wd < 0 || ev->wd >= server_wds_size || !server_wds[ev->wd])
+    return;
+  d = server_wds[ev->wd];
+
+  if (ev->mask & IN_MOVE_SELF)
+    {
+      server_set_stale (_("directory `%s' was moved"), d->name);
+      return;
+    }
+  if (ev->mask & IN_IGNORED)
+    {
+      /* The directory is gone. */
+      server_wds[ev->wd] = NULL;
+      while (d)
+        {
+          struct server_dir *next = d->next_same_wd;
+          if (d->inputs || d->globbed)
+            server_set_stale (_("directory `%s' was removed"), d->name);
+          server_unwatched_dir (d);
+          d = next;
+        }
+      return;
+    }
+  if (ev->len == 0)
+    return;
+
+  for (; d; d = d->next_same_wd)
+    {
+      const char *path = server_event_path (d, ev->name);
+      struct file *f;
+
+      if (server_is_input (path))
+        server_set_stale (_("`%s' changed"), path);
+      if (ev->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO))
+        {
+          if (d->globbed)
+            server_set_stale (_("directory `%s' changed"), d->name);
+          if ((ev->mask & (IN_ISDIR | IN_MOVED_FROM)) == (IN_ISDIR | IN_MOVED_FROM))
+            server_set_stale (_("directory `%s' was moved"), path);
+          d->forget = 1;
+        }
+
+      f = lookup_file (path);
+      if (f)
+        server_invalidate_file (f);
+    }
+}
+
+/* Reads and handles the pending inotify events. */
+static void
+server_read_events (void)
+{
+  union
+  {
+    struct inotify_event ev;
+    char buf[65536];
+  } u;
+
+  for (;;)
+    {
+      ssize_t cb;
+      char *p;
+
+      EINTRLOOP (cb, read (server_inotify_fd, u.buf, sizeof (u.buf)));
+      if (cb <= 0)
+        {
+          if (cb < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+            pfatal_with_name ("inotify");
+          return;
+        }
+
+      for (p = u.buf; p < u.buf + cb; )
+        {
+          const struct inotify_event *ev = (const struct inotify_event *)p;
+          server_handle_event (ev);
+          p += sizeof (*ev) + ev->len;
+        }
+    }
+}
+
+/* Gets everything ready for forking a child: watches directories that
+   have shown up, forgets directory contents that have changed and gets
+   the timestamps of the files that changed. */
+static void
+server_refresh (void)
+{
+  FILE_TIMESTAMP now = server_now ();
+  struct server_dir *d;
+  unsigned int i;
+
+  for (d = server_dir_head; d; d = d->next)
+    {
+      if (d->wd < 0 && server_watch_dir (d) == 0)
+        {
+          /* It showed up, so what we knew about it is wrong. */
+          if (d->inputs || d->globbed)
+            server_set_stale (_("directory `%s' appeared"), d->name);
+          for (i = 0; i < d->num_files; i++)
+            server_warm_file (d->files[i]->double_colon
+                              ? d->files[i]->double_colon : d->files[i], now);
+          d->forget = 1;
+        }
+      if (d->forget)
+        {
+          d->forget = 0;
+          dir_contents_forget (d->name);
+        }
+    }
+
+  for (i = 0; i < server_requeue_count; i++)
+    {
+      struct file *f = server_requeue[i];
+      f->server_queued = 0;
+      d = server_get_file_dir (f->name, 0);
+      if (d && d->wd >= 0)
+        server_warm_file (f, now);
+    }
+  server_requeue_count = 0;
+
+  read_open_directories ();
+#ifdef CONFIG_WITH_DIR_SNAPSHOTS
+  /* The snapshots were taken before any of this. */
+  dir_snapshot_gen++;
+#endif
+}
+
+
+/*******************************************************************************
+*   Server                                                                     *
+*******************************************************************************/
+
+/* Removes the socket if it's still ours and exits. */
+static void
+server_exit (const char *reason)
+{
+  struct stat st;
+
+  DB (DB_BASIC, (_("kmk server on `%s' exiting: %s\n"),
+                 server_socket_name, reason));
+  if (   stat (server_socket_name, &st) == 0
+      && st.st_ino == server_socket_ino)
+    unlink (server_socket_name);
+  fflush (stdout);
+  exit (0);
+}
+
+/* SIGCHLD handler, wakes up server_wait. */
+static void
+server_sigchld (int sig)
+{
+  int saved_errno = errno;
+  char c = 0;
+  (void)sig;
+  if (write (server_sigchld_pipe[1], &c, 1) < 0)
+    { /* the pipe is full, which is fine */ }
+  errno = saved_errno;
+}
+
+/* Sets up the socket at SOCKNAME.  A temporary name is used until it is
+   listening, so the clients never see a dead socket there. */
+static void
+server_listen (const char *sockname)
+{
+  struct sockaddr_un addr;
+  char *tmpname;
+  struct stat st;
+  mode_t old_umask;
+  int fd;
+  int rc;
+
+  fd = server_connect (sockname);
+  if (fd >= 0)
+    fatal (NILF, _("a kmk server is already running on `%s'"), sockname);
+
+  tmpname = xmalloc (strlen (sockname) + 32);
+  sprintf (tmpname, "%s.%ld", sockname, (long)getpid ());
+  if (server_make_addr (tmpname, &addr))
+    fatal (NILF, _("the socket name `%s' is too long"), sockname);
+  unlink (tmpname);
+
+  fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    pfatal_with_name ("socket");
+  old_umask = umask (077);
+  rc = bind (fd, (struct sockaddr *)&addr, sizeof (addr));
+  umask (old_umask);
+  if (rc < 0)
+    pfatal_with_name (tmpname);
+  if (   listen (fd, 64) < 0
+      || stat (tmpname, &st) < 0
+      || rename (tmpname, sockname) < 0)
+    {
+      unlink (tmpname);
+      pfatal_with_name (sockname);
+    }
+  free (tmpname);
+
+  server_socket_name = sockname;
+  server_socket_ino = st.st_ino;
+  server_listen_fd = fd;
+}
+
+/* Reads the request from CONN and checks that we can serve it.  The fds
+   the client passed along are returned in FDS. */
+static int
+server_read_request (int conn, int fds[3])
+{
+  struct server_request req;
+  struct ucred cred;
+  socklen_t cred_len = sizeof (cred);
+  struct msghdr msg;
+  struct iovec iov;
+  union
+  {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE (3 * sizeof (int))];
+  } ctl;
+  struct cmsghdr *cmsg;
+  char *fingerprint;
+  ssize_t cb;
+  int rc;
+
+  if (   getsockopt (conn, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) < 0
+      || cred.uid != geteuid ())
+    return -1;
+
+  iov.iov_base = &req;
+  iov.iov_len = sizeof (req);
+  memset (&msg, 0, sizeof (msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = ctl.buf;
+  msg.msg_controllen = sizeof (ctl.buf);
+  EINTRLOOP (cb, recvmsg (conn, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL));
+  cmsg = CMSG_FIRSTHDR (&msg);
+  if (   cmsg == NULL
+      || cmsg->cmsg_level != SOL_SOCKET
+      || cmsg->cmsg_type != SCM_RIGHTS
+      || cmsg->cmsg_len != CMSG_LEN (3 * sizeof (int)))
+    return -1;
+  memcpy (fds, CMSG_DATA (cmsg), 3 * sizeof (int));
+
+  if (   cb != sizeof (req)
+      || memcmp (req.magic, SERVER_MAGIC, sizeof (SERVER_MAGIC))
+      || req.len > SERVER_MAX_REQUEST)
+    rc = -1;
+  else if (req.len != server_fingerprint_len)
+    rc = 1;
+  else
+    {
+      fingerprint = xmalloc (req.len + 1);
+      if (server_read_all (conn, fingerprint, req.len))
+        rc = -1;
+      else
+        rc = memcmp (fingerprint, server_fingerprint, req.len) ? 1 : 0;
+      free (fingerprint);
+    }
+
+  if (rc)
+    {
+      close (fds[0]);
+      close (fds[1]);
+      close (fds[2]);
+    }
+  return rc;
+}
+
+/* Waits for the child PID doing the build for the client on CONN and
+   returns its exit status.  The child is killed if the client goes away. */
+static int
+server_wait (pid_t pid, int conn)
+{
+  int watch_conn = 1;
+  int wstatus;
+
+  for (;;)
+    {
+      struct pollfd pfds[3];
+      pid_t rc;
+
+      EINTRLOOP (rc, waitpid (pid, &wstatus, WNOHANG));
+      if (rc == pid)
+        break;
+      if (rc < 0)
+        return MAKE_FAILURE;
+
+      pfds[0].fd = server_sigchld_pipe[0];
+      pfds[0].events = POLLIN;
+      pfds[1].fd = server_inotify_fd;
+      pfds[1].events = POLLIN;
+      pfds[2].fd = watch_conn ? conn : -1;
+      pfds[2].events = POLLIN;
+      if (poll (pfds, 3, -1) < 0)
+        {
+          if (errno != EINTR)
+            pfatal_with_name ("poll");
+          continue;
+        }
+
+      if (pfds[0].revents)
+        {
+          char buf[64];
+          while (read (server_sigchld_pipe[0], buf, sizeof (buf)) > 0)
+            /* nothing */;
+        }
+      /* Keep up with the events so the queue doesn't overflow. */
+      if (pfds[1].revents)
+        server_read_events ();
+      if (pfds[2].revents)
+        {
+          /* The client isn't supposed to send anything more, so either it
+             hung up or it's confused. */
+          char c;
+          ssize_t cb = recv (conn, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+          if (cb <= 0)
+            {
+              DB (DB_BASIC, (_("kmk server: the client went away, killing the build.\n")));
+              kill (pid, SIGTERM);
+            }
+          watch_conn = 0;
+        }
+    }
+
+  if (WIFEXITED (wstatus))
+    return WEXITSTATUS (wstatus);
+  return MAKE_FAILURE;
+}
+
+/* Serves the request on CONN.  Returns nonzero in the child, which goes
+   on to do the build. */
+static int
+server_serve (int conn)
+{
+  int fds[3];
+  int status;
+  pid_t pid;
+  int rc;
+
+  rc = server_read_request (conn, fds);
+  if (rc < 0)
+    {
+      close (conn);
+      return 0;
+    }
+
+  /* Make sure we know about everything that happened before the request. */
+  if (rc == 0)
+    {
+      server_read_events ();
+      if (!server_stale_reason)
+        server_refresh ();
+      if (server_stale_reason)
+        {
+          close (fds[0]);
+          close (fds[1]);
+          close (fds[2]);
+          rc = 1;
+        }
+    }
+  if (rc)
+    {
+      DB (DB_BASIC, (_("kmk server: refusing a request for a different build.\n")));
+      status = SERVER_REFUSED;
+      server_stat_refused++;
+      server_write_all (conn, &status, sizeof (status));
+      close (conn);
+      if (server_stale_reason)
+        server_exit (server_stale_reason);
+      return 0;
+    }
+
+  server_stat_requests++;
+  fflush (stdout);
+  fflush (stderr);
+  pid = fork ();
+  if (pid == 0)
+    {
+      int i;
+
+      sigaction (SIGCHLD, &server_old_sigchld, NULL);
+      close (server_listen_fd);
+      close (server_inotify_fd);
+      close (server_sigchld_pipe[0]);
+      close (server_sigchld_pipe[1]);
+      close (conn);
+      for (i = 0; i < 3; i++)
+        {
+          if (dup2 (fds[i], i) < 0)
+            pfatal_with_name ("dup2");
+          close (fds[i]);
+        }
+      return 1;
+    }
+
+  close (fds[0]);
+  close (fds[1]);
+  close (fds[2]);
+  if (pid < 0)
+    {
+      perror_with_name ("fork", "");
+      status = SERVER_REFUSED;
+    }
+  else
+    status = server_wait (pid, conn);
+  server_write_all (conn, &status, sizeof (status));
+  close (conn);
+
+  DB (DB_BASIC, (_("kmk server: request %u done with status %d.\n"),
+                 server_stat_requests, status));
+  return 0;
+}
+
+/* Turns this kmk into a server listening on SOCKNAME.  Returns in the
+   child process doing the build for a client request.  */
+void
+server_run (const char *sockname, int idle_timeout)
+{
+  struct sigaction sa;
+  struct server_dir *d;
+  FILE_TIMESTAMP now;
+  unsigned int i;
+
+  server_recording = 0;
+  server_init_tables ();
+  server_inotify_fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+  if (server_inotify_fd < 0)
+    pfatal_with_name ("inotify_init1");
+
+  /* Watch the directories of all the files we know about and those dir.c
+     has read, and get the timestamps of the files that are there. */
+  map_file_data_base (server_add_file, NULL);
+  map_directories (server_add_dir);
+  for (d = server_dir_head; d; d = d->next)
+    if (server_watch_dir (d) < 0)
+      {
+        /* We can't tell when the makefiles change if this fails. */
+        if (errno != ENOENT && errno != ENOTDIR && (d->inputs || d->globbed))
+          fatal (NILF, _("cannot watch `%s': %s"), d->name, strerror (errno));
+        server_unwatched_dir (d);
+      }
+
+#ifdef MAKE_SYMLINKS
+  if (!check_symlink_flag)
+#endif
+    {
+      now = server_now ();
+      for (d = server_dir_head; d; d = d->next)
+        if (d->wd >= 0)
+          for (i = 0; i < d->num_files; i++)
+            server_warm_file (d->files[i], now);
+    }
+
+  if (   pipe2 (server_sigchld_pipe, O_NONBLOCK | O_CLOEXEC) < 0)
+    pfatal_with_name ("pipe");
+  memset (&sa, 0, sizeof (sa));
+  sa.sa_handler = server_sigchld;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset (&sa.sa_mask);
+  sigaction (SIGCHLD, &sa, &server_old_sigchld);
+
+  server_listen (sockname);
+  DB (DB_BASIC, (_("kmk server listening on `%s', watching %u directories.\n"),
+                 sockname, server_stat_dirs - server_stat_unwatched));
+
+  for (;;)
+    {
+      struct pollfd pfds[2];
+      int rc;
+
+      pfds[0].fd = server_listen_fd;
+      pfds[0].events = POLLIN;
+      pfds[1].fd = server_inotify_fd;
+      pfds[1].events = POLLIN;
+      rc = poll (pfds, 2, idle_timeout > 0 ? idle_timeout * 1000 : -1);
+      if (rc < 0)
+        {
+          if (errno != EINTR)
+            pfatal_with_name ("poll");
+          continue;
+        }
+      if (rc == 0)
+        server_exit (_("idle timeout"));
+
+      if (pfds[1].revents)
+        server_read_events ();
+      if (server_stale_reason)
+        server_exit (server_stale_reason);
+
+      if (pfds[0].revents & POLLIN)
+        {
+          int conn;
+          EINTRLOOP (conn, accept4 (server_listen_fd, NULL, NULL, SOCK_CLOEXEC));
+          if (conn >= 0 && server_serve (conn))
+            return;
+          if (server_stale_reason)
+            server_exit (server_stale_reason);
+        }
+    }
+}
+
+#else  /* !HAVE_SERVER */
+
+void
+server_client (const char *sockname)
+{
+  (void)sockname;
+}
+
+void
+server_run (const char *sockname, int idle_timeout)
+{
+  (void)sockname;
+  (void)idle_timeout;
+  fatal (NILF, _("--server is not supported on this platform"));
+}
+
+void
+server_record_input (const char *name, unsigned int len)
+{
+  (void)name;
+  (void)len;
+}
+
+void
+server_record_dir_read (const char *name)
+{
+  (void)name;
+}
+
+#endif /* !HAVE_SERVER */
+
+/* Prints the statistics, only the child serving a request has any. */
+void
+print_server_stats (void)
+{
+  if (!server_stat_requests)
+    return;
+  printf (_("\n# server: request %u (%u refused), %u directories (%u unwatched)\n"),
+          server_stat_requests, server_stat_refused, server_stat_dirs,
+          server_stat_unwatched);
+  printf (_("#  %lu events, %lu timestamps invalidated, %lu files stat'ed by the server\n"),
+          server_stat_events, server_stat_invalidated, server_stat_restat);
+}
+
+#endif /* CONFIG_WITH_SERVER */
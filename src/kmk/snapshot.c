@@ -0,0 +1,1549 @@
+#ifdef CONFIG_WITH_MAKEFILE_SNAPSHOT
+/* $Id$ */
+/** @file
+ * snapshot - Persistent snapshot of the parsed makefile database.
+ *
+ * Reading header.kmk, footer.kmk and the makefiles of a large tree can take
+ * several seconds, most of it spent in eval() expanding the same templates
+ * over and over again.  When --snapshot=FILE is given, the state left behind
+ * by read_all_makefiles() is written to FILE: the string pool (with the
+ * strcache2 hash values), the global, target and pattern specific variables,
+ * the file/dep graph, the pattern rules, the vpath directives and the chain
+ * of read makefiles.  The next time kmk is started with the same arguments,
+ * environment and working directory, and none of the makefiles (including
+ * includedep files) have changed, the file is mapped and the database is
+ * reconstructed from it without parsing anything.
+ *
+ * The snapshot only knows about the makefiles themselves.  Makefiles that
+ * base decisions on $(shell ), $(wildcard ) or file-exists checks of other
+ * files will see the results of the run that wrote the snapshot, so this is
+ * opt-in.  Messages from $(info ), $(warning ) and friends are not replayed.
+ */
+
+/*
+ * Copyright (c) 2026 The kBuild contributors
+ *
+ * This file is part of kBuild.
+ *
+ * kBuild is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * kBuild is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with kBuild.  If not, see <http://www.gnu.org/licenses/>
+ *
+ */
+
+/*******************************************************************************
+*   Header Files                                                               *
+*******************************************************************************/
+#include "make.h"
+#include <assert.h>
+#include "dep.h"
+#include "filedef.h"
+#include "job.h"
+#include "commands.h"
+#include "variable.h"
+#include "rule.h"
+#include "debug.h"
+#include "strcache2.h"
+#include "../lib/crc32.h"
+
+#ifdef HAVE_FCNTL_H
+# include <fcntl.h>
+#else
+# include <sys/file.h>
+#endif
+#if !defined(WINDOWS32) && !defined(__OS2__)
+# include <sys/mman.h>
+# define HAVE_MMAP_SNAPSHOT
+#endif
+#ifdef WINDOWS32
+# include <io.h>
+#endif
+
+#ifndef CONFIG_WITH_STRCACHE2
+# error "CONFIG_WITH_MAKEFILE_SNAPSHOT requires CONFIG_WITH_STRCACHE2"
+#endif
+
+
+/*******************************************************************************
+*   Defined Constants And Macros                                               *
+*******************************************************************************/
+/* The file magic and format version.  Bump the version whenever any of
+   the records below or the structures they are derived from change.  */
+#define SNAPSHOT_MAGIC          "kmkSnap\n"
+#define SNAPSHOT_VERSION        2
+
+/* Nil string / commands index. */
+#define SNAPSHOT_NIL            (~0U)
+
+/* struct file flags. */
+#define SNAP_F_PRECIOUS         0x0001
+#define SNAP_F_LOW_RES_TIME     0x0002
+#define SNAP_F_IS_TARGET        0x0004
+#define SNAP_F_CMD_TARGET       0x0008
+#define SNAP_F_PHONY            0x0010
+#define SNAP_F_INTERMEDIATE     0x0020
+#define SNAP_F_SECONDARY        0x0040
+#define SNAP_F_DONTCARE         0x0080
+#define SNAP_F_IGNORE_VPATH     0x0100
+#define SNAP_F_MULTI_MAYBE      0x0200
+#define SNAP_F_2ND_TARGET_EXP   0x0400
+#define SNAP_F_DOUBLE_COLON     0x0800
+#define SNAP_F_HAS_VARIABLES    0x1000
+#define SNAP_F_UPDATING         0x2000  /* borrowed by record_files for snap_deps. */
+
+/* struct dep flags; bits 8 thru 15 holds the 'changed' member. */
+#define SNAP_D_HAS_FILE         0x0001
+#define SNAP_D_IGNORE_MTIME     0x0002
+#define SNAP_D_STATICPATTERN    0x0004
+#define SNAP_D_2ND_EXPANSION    0x0008
+#define SNAP_D_INCLUDEDEP       0x0010
+
+/* struct variable flags; flavor, origin and export are shifted in above. */
+#define SNAP_V_RECURSIVE        0x0001
+#define SNAP_V_APPEND           0x0002
+#define SNAP_V_CONDITIONAL      0x0004
+#define SNAP_V_PER_TARGET       0x0008
+#define SNAP_V_SPECIAL          0x0010
+#define SNAP_V_EXPORTABLE       0x0020
+#define SNAP_V_FLAVOR_SHIFT     8
+#define SNAP_V_ORIGIN_SHIFT     12
+#define SNAP_V_EXPORT_SHIFT     16
+
+
+/*******************************************************************************
+*   Structures and Typedefs                                                    *
+*******************************************************************************/
+/* The file header.  Everything following it is a stream of 32-bit words
+   and length prefixed, zero terminated and 32-bit padded byte blobs. */
+struct snapshot_hdr
+{
+  char magic[8];
+  unsigned int version;
+  unsigned int sizeof_ptr;              /* sanity */
+  unsigned int sizeof_file_timestamp;   /* sanity */
+  unsigned int body_crc32;              /* crc32 of everything after the header. */
+  unsigned int body_size;
+  unsigned int num_inputs;
+  unsigned int num_file_strings;
+  unsigned int num_var_strings;
+  unsigned int num_commands;
+  unsigned int reserved;
+  big_int key;                          /* environment, arguments and cwd. */
+};
+
+/* Growable output buffer. */
+struct snapshot_buf
+{
+  char *buf;
+  size_t len;
+  size_t size;
+};
+
+/* Pointer to index mapping entry (strings and commands). */
+struct snapshot_ptr_ent
+{
+  const void *ptr;
+  unsigned int idx;
+};
+
+/* The state of a snapshot save operation. */
+struct snapshot_writer
+{
+  struct snapshot_buf inputs;
+  struct snapshot_buf file_strings;
+  struct snapshot_buf var_strings;
+  struct snapshot_buf commands;
+  struct snapshot_buf body;
+  struct hash_table file_str_map;
+  struct hash_table var_str_map;
+  struct hash_table cmds_map;
+  unsigned int num_inputs;
+  unsigned int num_file_strings;
+  unsigned int num_var_strings;
+  unsigned int num_commands;
+  unsigned int num_files;
+  int incomplete;                       /* don't write it. */
+};
+
+/* Cursor used when loading a snapshot. */
+struct snapshot_reader
+{
+  const char *cur;
+  const char *end;
+  int bad;
+  const char **file_strings;
+  unsigned int num_file_strings;
+  const char **var_strings;
+  unsigned int num_var_strings;
+  struct commands **commands;
+  unsigned int num_commands;
+};
+
+
+/*******************************************************************************
+*   Global Variables                                                           *
+*******************************************************************************/
+/* The --snapshot=FILE argument, NULL if not active. */
+static const char *snapshot_filename;
+
+/* The key calculated by snapshot_load and reused by snapshot_save. */
+static big_int snapshot_key;
+
+/* includedep files read by the makefiles. */
+static const char **snapshot_incdep_inputs;
+static unsigned int snapshot_incdep_count;
+static unsigned int snapshot_incdep_alloc;
+
+/* Statistics for --print-stats. */
+static int snapshot_loaded;
+static const char *snapshot_stale_reason;
+static big_int snapshot_validate_time;
+static big_int snapshot_load_time;
+static big_int snapshot_save_time;
+static unsigned int snapshot_stat_inputs;
+static unsigned int snapshot_stat_variables;
+static unsigned int snapshot_stat_files;
+static unsigned int snapshot_stat_rules;
+static unsigned long snapshot_stat_size;
+
+
+/*******************************************************************************
+*   Writer helpers                                                             *
+*******************************************************************************/
+
+static void
+snapshot_buf_append (struct snapshot_buf *b, const void *data, size_t len)
+{
+  if (b->len + len > b->size)
+    {
+      b->size = b->size ? b->size * 2 : 0x10000;
+      while (b->size < b->len + len)
+        b->size *= 2;
+      b->buf = xrealloc (b->buf, b->size);
+    }
+  memcpy (b->buf + b->len, data, len);
+  b->len += len;
+}
+
+static void
+snapshot_put_u32 (struct snapshot_buf *b, unsigned int u32)
+{
+  snapshot_buf_append (b, &u32, sizeof (u32));
+}
+
+static void
+snapshot_put_u64 (struct snapshot_buf *b, big_int u64)
+{
+  snapshot_buf_append (b, &u64, sizeof (u64));
+}
+
+/* Appends a length prefixed, zero terminated and padded blob. */
+static void
+snapshot_put_blob (struct snapshot_buf *b, const char *str, unsigned int len)
+{
+  static const char zeros[4] = { 0, 0, 0, 0 };
+  snapshot_put_u32 (b, len);
+  snapshot_buf_append (b, str, len);
+  snapshot_buf_append (b, zeros, 4 - (len & 3));
+}
+
+static unsigned long
+snapshot_ptr_hash_1 (const void *key)
+{
+  return (size_t)((const struct snapshot_ptr_ent *)key)->ptr >> 3;
+}
+
+static unsigned long
+snapshot_ptr_hash_2 (const void *key)
+{
+  return ((size_t)((const struct snapshot_ptr_ent *)key)->ptr >> 6) | 1;
+}
+
+static int
+snapshot_ptr_cmp (const void *x, const void *y)
+{
+  const void *px = ((const struct snapshot_ptr_ent *)x)->ptr;
+  const void *py = ((const struct snapshot_ptr_ent *)y)->ptr;
+  return px == py ? 0 : px < py ? -1 : 1;
+}
+
+/* Looks up PTR in MAP, returns the slot. */
+static struct snapshot_ptr_ent **
+snapshot_map_slot (struct hash_table *map, const void *ptr)
+{
+  struct snapshot_ptr_ent key;
+  key.ptr = ptr;
+  return (struct snapshot_ptr_ent **) hash_find_slot (map, &key);
+}
+
+static void
+snapshot_map_insert (struct hash_table *map, struct snapshot_ptr_ent **slot,
+                     const void *ptr, unsigned int idx)
+{
+  struct snapshot_ptr_ent *ent = xmalloc (sizeof (*ent));
+  ent->ptr = ptr;
+  ent->idx = idx;
+  hash_insert_at (map, ent, slot);
+}
+
+/* Emits a file string cache string index, adding it to the table the first
+   time around.  STR may be NULL. */
+static void
+snapshot_put_fstr (struct snapshot_writer *w, const char *str)
+{
+  struct snapshot_ptr_ent **slot;
+  struct strcache2_entry const *entry;
+
+  if (!str)
+    {
+      snapshot_put_u32 (&w->body, SNAPSHOT_NIL);
+      return;
+    }
+
+  /* Floc file names and such are not necessarily cached. */
+  if (!strcache_iscached (str))
+    str = strcache_add (str);
+
+  slot = snapshot_map_slot (&w->file_str_map, str);
+  if (HASH_VACANT (*slot))
+    {
+      entry = strcache2_get_entry (&file_strcache, str);
+      snapshot_put_u32 (&w->file_strings, entry->hash);
+      snapshot_put_blob (&w->file_strings, str, entry->length);
+      snapshot_map_insert (&w->file_str_map, slot, str, w->num_file_strings++);
+    }
+  snapshot_put_u32 (&w->body, (*slot)->idx);
+}
+
+/* Emits a variable name string index (variable_strcache). */
+static void
+snapshot_put_vstr (struct snapshot_writer *w, const char *name)
+{
+  struct snapshot_ptr_ent **slot;
+  struct strcache2_entry const *entry;
+
+  assert (strcache2_is_cached (&variable_strcache, name));
+  slot = snapshot_map_slot (&w->var_str_map, name);
+  if (HASH_VACANT (*slot))
+    {
+      entry = strcache2_get_entry (&variable_strcache, name);
+      snapshot_put_u32 (&w->var_strings, entry->hash);
+      snapshot_put_blob (&w->var_strings, name, entry->length);
+      snapshot_map_insert (&w->var_str_map, slot, name, w->num_var_strings++);
+    }
+  snapshot_put_u32 (&w->body, (*slot)->idx);
+}
+
+/* Emits a commands index, adding the commands to the table the first
+   time around.  The table preserves sharing between targets. */
+static void
+snapshot_put_cmds (struct snapshot_writer *w, const struct commands *cmds)
+{
+  struct snapshot_ptr_ent **slot;
+
+  if (!cmds)
+    {
+      snapshot_put_u32 (&w->body, SNAPSHOT_NIL);
+      return;
+    }
+
+  slot = snapshot_map_slot (&w->cmds_map, cmds);
+  if (HASH_VACANT (*slot))
+    {
+      /* The file name goes into the string table, so temporarily
+         redirect the body. */
+      struct snapshot_buf body = w->body;
+      w->body = w->commands;
+      snapshot_put_fstr (w, cmds->fileinfo.filenm);
+      snapshot_put_u32 (&w->body, cmds->fileinfo.lineno);
+#ifdef CONFIG_WITH_MEMORY_OPTIMIZATIONS
+      snapshot_put_u32 (&w->body, cmds->refs);
+#else
+      snapshot_put_u32 (&w->body, 0);
+#endif
+      snapshot_put_blob (&w->body, cmds->commands, strlen (cmds->commands));
+      w->commands = w->body;
+      w->body = body;
+      snapshot_map_insert (&w->cmds_map, slot, cmds, w->num_commands++);
+    }
+  snapshot_put_u32 (&w->body, (*slot)->idx);
+}
+
+static void
+snapshot_put_floc (struct snapshot_writer *w, const struct floc *flocp)
+{
+  snapshot_put_fstr (w, flocp->filenm);
+  snapshot_put_u32 (&w->body, flocp->lineno);
+}
+
+/* Emits a variable record without the name. */
+static void
+snapshot_put_variable_common (struct snapshot_writer *w, const struct variable *v,
+                              unsigned int value_len)
+{
+  unsigned int flags = 0;
+  if (v->recursive)
+    flags |= SNAP_V_RECURSIVE;
+  if (v->append)
+    flags |= SNAP_V_APPEND;
+  if (v->conditional)
+    flags |= SNAP_V_CONDITIONAL;
+  if (v->per_target)
+    flags |= SNAP_V_PER_TARGET;
+  if (v->special)
+    flags |= SNAP_V_SPECIAL;
+  if (v->exportable)
+    flags |= SNAP_V_EXPORTABLE;
+  flags |= (unsigned int)v->flavor << SNAP_V_FLAVOR_SHIFT;
+  flags |= (unsigned int)v->origin << SNAP_V_ORIGIN_SHIFT;
+  flags |= (unsigned int)v->export << SNAP_V_EXPORT_SHIFT;
+  snapshot_put_u32 (&w->body, flags);
+  snapshot_put_u32 (&w->body, v->exp_count);
+  snapshot_put_floc (w, &v->fileinfo);
+  snapshot_put_blob (&w->body, v->value, value_len);
+}
+
+/* Emits all variables in SET. Automatic and special variables are skipped
+   since they are recreated by main() or calculated on demand. */
+static void
+snapshot_put_variable_set (struct snapshot_writer *w, struct variable_set *set)
+{
+  struct variable **vp = (struct variable **) set->table.ht_vec;
+  struct variable **end = &vp[set->table.ht_size];
+  unsigned int count = 0;
+  size_t count_off = w->body.len;
+
+  snapshot_put_u32 (&w->body, 0);
+  for (; vp < end; vp++)
+    {
+      struct variable *v = *vp;
+      if (HASH_VACANT (v) || v->origin == o_automatic || v->special)
+        continue;
+      snapshot_put_vstr (w, v->name);
+#ifdef CONFIG_WITH_VALUE_LENGTH
+      assert (v->value_length == strlen (v->value));
+      snapshot_put_variable_common (w, v, v->value_length);
+#else
+      snapshot_put_variable_common (w, v, strlen (v->value));
+#endif
+      count++;
+    }
+  memcpy (w->body.buf + count_off, &count, sizeof (count));
+  snapshot_stat_variables += count;
+}
+
+/* Emits a dependency chain. */
+static void
+snapshot_put_deps (struct snapshot_writer *w, const struct dep *d)
+{
+  const struct dep *d2;
+  unsigned int count = 0;
+
+  for (d2 = d; d2; d2 = d2->next)
+    count++;
+  snapshot_put_u32 (&w->body, count);
+
+  for (; d; d = d->next)
+    {
+      unsigned int flags = d->changed << 8;
+      if (d->name == 0)
+        flags |= SNAP_D_HAS_FILE;
+      if (d->ignore_mtime)
+        flags |= SNAP_D_IGNORE_MTIME;
+      if (d->staticpattern)
+        flags |= SNAP_D_STATICPATTERN;
+      if (d->need_2nd_expansion)
+        flags |= SNAP_D_2ND_EXPANSION;
+#ifdef CONFIG_WITH_INCLUDEDEP
+      if (d->includedep)
+        flags |= SNAP_D_INCLUDEDEP;
+#endif
+      snapshot_put_u32 (&w->body, flags);
+      snapshot_put_fstr (w, dep_name (d));
+      snapshot_put_fstr (w, d->stem);
+    }
+}
+
+/* Emits one struct file record. */
+static void
+snapshot_put_file (struct snapshot_writer *w, const struct file *f)
+{
+  unsigned int flags = 0;
+
+  if (f->precious)
+    flags |= SNAP_F_PRECIOUS;
+  if (f->low_resolution_time)
+    flags |= SNAP_F_LOW_RES_TIME;
+  if (f->is_target)
+    flags |= SNAP_F_IS_TARGET;
+  if (f->cmd_target)
+    flags |= SNAP_F_CMD_TARGET;
+  if (f->phony)
+    flags |= SNAP_F_PHONY;
+  if (f->intermediate)
+    flags |= SNAP_F_INTERMEDIATE;
+  if (f->secondary)
+    flags |= SNAP_F_SECONDARY;
+  if (f->dontcare)
+    flags |= SNAP_F_DONTCARE;
+  if (f->ignore_vpath)
+    flags |= SNAP_F_IGNORE_VPATH;
+#ifdef CONFIG_WITH_EXPLICIT_MULTITARGET
+  if (f->multi_maybe)
+    flags |= SNAP_F_MULTI_MAYBE;
+#endif
+#ifdef CONFIG_WITH_2ND_TARGET_EXPANSION
+  if (f->need_2nd_target_expansion)
+    flags |= SNAP_F_2ND_TARGET_EXP;
+#endif
+  if (f->double_colon)
+    flags |= SNAP_F_DOUBLE_COLON;
+  if (f->variables)
+    flags |= SNAP_F_HAS_VARIABLES;
+  if (f->updating)
+    flags |= SNAP_F_UPDATING;
+
+  snapshot_put_fstr (w, f->name);
+  snapshot_put_u32 (&w->body, flags);
+  snapshot_put_u32 (&w->body, f->command_flags);
+  snapshot_put_fstr (w, f->stem);
+  snapshot_put_cmds (w, f->cmds);
+#ifdef CONFIG_WITH_EXPLICIT_MULTITARGET
+  snapshot_put_fstr (w, f->multi_head ? f->multi_head->name : NULL);
+  snapshot_put_fstr (w, f->multi_next ? f->multi_next->name : NULL);
+#else
+  snapshot_put_fstr (w, NULL);
+  snapshot_put_fstr (w, NULL);
+#endif
+  snapshot_put_deps (w, f->deps);
+  if (f->variables)
+    snapshot_put_variable_set (w, f->variables->set);
+  w->num_files++;
+}
+
+/* hash_map_arg callback for the file hash table.  Double-colon entries are
+   emitted in chain order so they are recreated in the same order. */
+static void
+snapshot_put_file_chain (const void *item, void *arg)
+{
+  const struct file *f = item;
+  for (; f != 0; f = f->prev)
+    snapshot_put_file ((struct snapshot_writer *)arg, f);
+}
+
+/* vpath enumeration callback. */
+static void
+snapshot_put_vpath (const char *pattern, const char *percent,
+                    const char **searchpath, void *arg)
+{
+  struct snapshot_writer *w = arg;
+  unsigned int i;
+
+  snapshot_put_fstr (w, pattern);
+  snapshot_put_u32 (&w->body, percent ? percent - pattern : SNAPSHOT_NIL);
+  for (i = 0; searchpath[i] != 0; i++)
+    /* nothing */;
+  snapshot_put_u32 (&w->body, i);
+  for (i = 0; searchpath[i] != 0; i++)
+    snapshot_put_fstr (w, searchpath[i]);
+}
+
+/* Records an input file: name, existence, size, modification time and the
+   crc32 of the content.  Returns 0 if it doesn't exist. */
+static int
+snapshot_put_input (struct snapshot_writer *w, const char *name)
+{
+  struct stat st;
+  unsigned int crc = 0;
+  int exists;
+
+  if (stat (name, &st) == 0)
+    {
+      int fd;
+      exists = 1;
+#ifdef O_BINARY
+      fd = open (name, O_RDONLY | O_BINARY, 0);
+#else
+      fd = open (name, O_RDONLY, 0);
+#endif
+      if (fd >= 0)
+        {
+          char *buf = xmalloc (st.st_size + 1);
+          if (read (fd, buf, st.st_size) == st.st_size)
+            crc = crc32 (0, buf, st.st_size);
+          else
+            w->incomplete = 1;
+          free (buf);
+          close (fd);
+        }
+      else
+        w->incomplete = 1;
+    }
+  else
+    {
+      exists = 0;
+      memset (&st, 0, sizeof (st));
+    }
+
+  snapshot_put_blob (&w->inputs, name, strlen (name));
+  snapshot_put_u32 (&w->inputs, exists);
+  snapshot_put_u32 (&w->inputs, crc);
+  snapshot_put_u64 (&w->inputs, (big_int)st.st_size);
+  snapshot_put_u64 (&w->inputs, exists ? FILE_TIMESTAMP_STAT_MODTIME (name, st) : 0);
+  w->num_inputs++;
+  return exists;
+}
+
+
+/*******************************************************************************
+*   Reader helpers                                                             *
+*******************************************************************************/
+
+static unsigned int
+snapshot_get_u32 (struct snapshot_reader *r)
+{
+  unsigned int u32;
+  if (r->end - r->cur < (long)sizeof (u32))
+    {
+      r->bad = 1;
+      return 0;
+    }
+  memcpy (&u32, r->cur, sizeof (u32));
+  r->cur += sizeof (u32);
+  return u32;
+}
+
+static big_int
+snapshot_get_u64 (struct snapshot_reader *r)
+{
+  big_int u64;
+  if (r->end - r->cur < (long)sizeof (u64))
+    {
+      r->bad = 1;
+      return 0;
+    }
+  memcpy (&u64, r->cur, sizeof (u64));
+  r->cur += sizeof (u64);
+  return u64;
+}
+
+/* Returns a pointer to the blob in the mapping, LENP receives the length. */
+static const char *
+snapshot_get_blob (struct snapshot_reader *r, unsigned int *lenp)
+{
+  const char *str;
+  unsigned int len = snapshot_get_u32 (r);
+  unsigned int padded = (len + 4) & ~3U;
+  if (r->bad || (unsigned long)(r->end - r->cur) < padded)
+    {
+      r->bad = 1;
+      *lenp = 0;
+      return "";
+    }
+  str = r->cur;
+  r->cur += padded;
+  *lenp = len;
+  return str;
+}
+
+static const char *
+snapshot_get_fstr (struct snapshot_reader *r)
+{
+  unsigned int idx = snapshot_get_u32 (r);
+  if (idx == SNAPSHOT_NIL)
+    return NULL;
+  if (idx >= r->num_file_strings)
+    {
+      r->bad = 1;
+      return NULL;
+    }
+  return r->file_strings[idx];
+}
+
+static const char *
+snapshot_get_vstr (struct snapshot_reader *r)
+{
+  unsigned int idx = snapshot_get_u32 (r);
+  if (idx >= r->num_var_strings)
+    {
+      r->bad = 1;
+      return NULL;
+    }
+  return r->var_strings[idx];
+}
+
+static struct commands *
+snapshot_get_cmds (struct snapshot_reader *r)
+{
+  unsigned int idx = snapshot_get_u32 (r);
+  if (idx == SNAPSHOT_NIL)
+    return NULL;
+  if (idx >= r->num_commands)
+    {
+      r->bad = 1;
+      return NULL;
+    }
+  return r->commands[idx];
+}
+
+/* Looks up a file, entering it if necessary.  Like record_target_var, this
+   avoids creating new double-colon entries. */
+static struct file *
+snapshot_lookup_or_enter_file (const char *name)
+{
+  struct file *f = lookup_file_cached (name);
+  if (!f)
+    f = enter_file (name);
+  return f;
+}
+
+/* Reads a variable record (sans name) and defines it in SET. */
+static struct variable *
+snapshot_get_variable (struct snapshot_reader *r, const char *name,
+                       struct variable_set *set)
+{
+  struct variable *v;
+  struct floc floc;
+  unsigned int flags = snapshot_get_u32 (r);
+  unsigned int exp_count = snapshot_get_u32 (r);
+  unsigned int value_len;
+  const char *value;
+
+  floc.filenm = snapshot_get_fstr (r);
+  floc.lineno = snapshot_get_u32 (r);
+  value = snapshot_get_blob (r, &value_len);
+  if (r->bad || !name)
+    {
+      r->bad = 1;
+      return NULL;
+    }
+
+  /* Use o_automatic to override whatever main() defined before reading,
+     then restore the real origin. */
+  v = define_variable_in_set (name, strcache2_get_len (&variable_strcache, name),
+                              value, value_len, 1 /* duplicate */, o_automatic,
+                              flags & SNAP_V_RECURSIVE ? 1 : 0, set,
+                              floc.filenm ? &floc : NILF);
+  v->append      = (flags & SNAP_V_APPEND) != 0;
+  v->conditional = (flags & SNAP_V_CONDITIONAL) != 0;
+  v->per_target  = (flags & SNAP_V_PER_TARGET) != 0;
+  v->exportable  = (flags & SNAP_V_EXPORTABLE) != 0;
+  v->exp_count   = exp_count;
+  v->flavor = (enum variable_flavor)((flags >> SNAP_V_FLAVOR_SHIFT) & 7);
+  v->origin = (enum variable_origin)((flags >> SNAP_V_ORIGIN_SHIFT) & 15);
+  v->export = (enum variable_export)((flags >> SNAP_V_EXPORT_SHIFT) & 3);
+  return v;
+}
+
+static void
+snapshot_get_variable_set (struct snapshot_reader *r, struct variable_set *set)
+{
+  unsigned int count = snapshot_get_u32 (r);
+  while (count-- > 0 && !r->bad)
+    {
+      const char *name = snapshot_get_vstr (r);
+      snapshot_get_variable (r, name, set);
+      snapshot_stat_variables++;
+    }
+}
+
+static struct dep *
+snapshot_get_deps (struct snapshot_reader *r)
+{
+  struct dep *deps = 0;
+  struct dep **nextp = &deps;
+  unsigned int count = snapshot_get_u32 (r);
+
+  while (count-- > 0 && !r->bad)
+    {
+      unsigned int flags = snapshot_get_u32 (r);
+      const char *name = snapshot_get_fstr (r);
+      struct dep *d;
+      if (!name)
+        {
+          r->bad = 1;
+          break;
+        }
+
+      d = alloc_dep ();
+      if (flags & SNAP_D_HAS_FILE)
+        d->file = snapshot_lookup_or_enter_file (name);
+      else
+        d->name = name;
+      d->stem = snapshot_get_fstr (r);
+      d->changed = (flags >> 8) & 0xff;
+      d->ignore_mtime = (flags & SNAP_D_IGNORE_MTIME) != 0;
+      d->staticpattern = (flags & SNAP_D_STATICPATTERN) != 0;
+      d->need_2nd_expansion = (flags & SNAP_D_2ND_EXPANSION) != 0;
+#ifdef CONFIG_WITH_INCLUDEDEP
+      d->includedep = (flags & SNAP_D_INCLUDEDEP) != 0;
+#endif
+      *nextp = d;
+      nextp = &d->next;
+    }
+  return deps;
+}
+
+/* Reads one struct file record and applies it. */
+static void
+snapshot_get_file (struct snapshot_reader *r)
+{
+  const char *name = snapshot_get_fstr (r);
+  unsigned int flags = snapshot_get_u32 (r);
+  unsigned int command_flags = snapshot_get_u32 (r);
+  const char *stem = snapshot_get_fstr (r);
+  struct commands *cmds = snapshot_get_cmds (r);
+  const char *multi_head = snapshot_get_fstr (r);
+  const char *multi_next = snapshot_get_fstr (r);
+  struct file *f;
+
+  if (r->bad || !name)
+    {
+      r->bad = 1;
+      return;
+    }
+
+  /* The first entry of a double-colon chain comes first; once it has its
+     double_colon member set, enter_file appends new entries to the chain. */
+  f = lookup_file_cached (name);
+  if (!f)
+    f = enter_file (name);
+  else if (f->double_colon)
+    f = enter_file (name);
+  if (flags & SNAP_F_DOUBLE_COLON && !f->double_colon)
+    f->double_colon = f;
+
+  f->precious            = (flags & SNAP_F_PRECIOUS) != 0;
+  f->low_resolution_time = (flags & SNAP_F_LOW_RES_TIME) != 0;
+  f->is_target           = (flags & SNAP_F_IS_TARGET) != 0;
+  f->cmd_target          = (flags & SNAP_F_CMD_TARGET) != 0;
+  f->phony               = (flags & SNAP_F_PHONY) != 0;
+  f->intermediate        = (flags & SNAP_F_INTERMEDIATE) != 0;
+  f->secondary           = (flags & SNAP_F_SECONDARY) != 0;
+  f->dontcare            = (flags & SNAP_F_DONTCARE) != 0;
+  f->ignore_vpath        = (flags & SNAP_F_IGNORE_VPATH) != 0;
+  f->updating            = (flags & SNAP_F_UPDATING) != 0;
+#ifdef CONFIG_WITH_EXPLICIT_MULTITARGET
+  f->multi_maybe         = (flags & SNAP_F_MULTI_MAYBE) != 0;
+  f->multi_head = multi_head ? snapshot_lookup_or_enter_file (multi_head) : 0;
+  f->multi_next = multi_next ? snapshot_lookup_or_enter_file (multi_next) : 0;
+#endif
+#ifdef CONFIG_WITH_2ND_TARGET_EXPANSION
+  f->need_2nd_target_expansion = (flags & SNAP_F_2ND_TARGET_EXP) != 0;
+#endif
+  f->command_flags = command_flags;
+  f->stem = stem;
+  f->cmds = cmds;
+
+  /* The snapshot state replaces anything main() put there. */
+  if (f->deps)
+    free_dep_chain (f->deps);
+  f->deps = snapshot_get_deps (r);
+
+  if (flags & SNAP_F_HAS_VARIABLES)
+    {
+      initialize_file_variables (f, 1);
+      snapshot_get_variable_set (r, f->variables->set);
+    }
+  snapshot_stat_files++;
+}
+
+/* Reads the pattern specific variables. */
+static void
+snapshot_get_pattern_vars (struct snapshot_reader *r)
+{
+  unsigned int count = snapshot_get_u32 (r);
+  while (count-- > 0 && !r->bad)
+    {
+      const char *target = snapshot_get_fstr (r);
+      unsigned int percent_off = snapshot_get_u32 (r);
+      unsigned int name_len;
+      const char *name = snapshot_get_blob (r, &name_len);
+      unsigned int flags = snapshot_get_u32 (r);
+      unsigned int exp_count = snapshot_get_u32 (r);
+      struct floc floc;
+      unsigned int value_len;
+      const char *value;
+      struct pattern_var *p;
+      struct variable *v;
+
+      floc.filenm = snapshot_get_fstr (r);
+      floc.lineno = snapshot_get_u32 (r);
+      value = snapshot_get_blob (r, &value_len);
+      if (r->bad || !target || percent_off >= strlen (target))
+        {
+          r->bad = 1;
+          break;
+        }
+
+      p = create_pattern_var (target, target + percent_off);
+      v = &p->variable;
+      memset (v, 0, sizeof (*v));
+      v->name = savestring (name, name_len);
+      v->length = name_len;
+      v->value = savestring (value, value_len);
+#ifdef CONFIG_WITH_VALUE_LENGTH
+      v->value_length = value_len;
+      v->value_alloc_len = value_len + 1;
+#endif
+      v->fileinfo = floc;
+      v->recursive   = (flags & SNAP_V_RECURSIVE) != 0;
+      v->append      = (flags & SNAP_V_APPEND) != 0;
+      v->conditional = (flags & SNAP_V_CONDITIONAL) != 0;
+      v->per_target  = (flags & SNAP_V_PER_TARGET) != 0;
+      v->exportable  = (flags & SNAP_V_EXPORTABLE) != 0;
+      v->exp_count   = exp_count;
+      v->flavor = (enum variable_flavor)((flags >> SNAP_V_FLAVOR_SHIFT) & 7);
+      v->origin = (enum variable_origin)((flags >> SNAP_V_ORIGIN_SHIFT) & 15);
+      v->export = (enum variable_export)((flags >> SNAP_V_EXPORT_SHIFT) & 3);
+      snapshot_stat_variables++;
+    }
+}
+
+/* Reads the pattern rules. */
+static void
+snapshot_get_rules (struct snapshot_reader *r)
+{
+  unsigned int count = snapshot_get_u32 (r);
+  while (count-- > 0 && !r->bad)
+    {
+      unsigned int num = snapshot_get_u32 (r);
+      unsigned int terminal = snapshot_get_u32 (r);
+      const char **targets;
+      const char **percents;
+      unsigned int i;
+      struct dep *deps;
+      struct commands *cmds;
+
+      if (r->bad || num == 0 || num > 0xffff)
+        {
+          r->bad = 1;
+          break;
+        }
+      targets = xmalloc (num * sizeof (const char *));
+      percents = xmalloc (num * sizeof (const char *));
+      for (i = 0; i < num; i++)
+        {
+          unsigned int off;
+          targets[i] = snapshot_get_fstr (r);
+          off = snapshot_get_u32 (r);
+          if (r->bad || !targets[i] || off >= strlen (targets[i]))
+            {
+              r->bad = 1;
+              return;
+            }
+          percents[i] = targets[i] + off;
+        }
+      deps = snapshot_get_deps (r);
+      cmds = snapshot_get_cmds (r);
+      if (r->bad)
+        return;
+      create_pattern_rule (targets, percents, num, terminal, deps, cmds, 1);
+      snapshot_stat_rules++;
+    }
+}
+
+/* Reads the vpath directives, adding them in reverse order since
+   add_vpath_list prepends like construct_vpath_list does. */
+static void
+snapshot_get_vpaths (struct snapshot_reader *r)
+{
+  unsigned int count = snapshot_get_u32 (r);
+  const char **patterns;
+  unsigned int *percents;
+  const char ***searchpaths;
+  unsigned int i, j;
+
+  if (r->bad || count == 0)
+    return;
+  patterns = xmalloc (count * sizeof (const char *));
+  percents = xmalloc (count * sizeof (unsigned int));
+  searchpaths = xmalloc (count * sizeof (const char **));
+  for (i = 0; i < count && !r->bad; i++)
+    {
+      unsigned int ndirs;
+      patterns[i] = snapshot_get_fstr (r);
+      percents[i] = snapshot_get_u32 (r);
+      ndirs = snapshot_get_u32 (r);
+      if (r->bad || !patterns[i] || ndirs > 0x100000)
+        {
+          r->bad = 1;
+          break;
+        }
+      searchpaths[i] = xmalloc ((ndirs + 1) * sizeof (const char *));
+      for (j = 0; j < ndirs; j++)
+        searchpaths[i][j] = snapshot_get_fstr (r);
+      searchpaths[i][ndirs] = 0;
+    }
+  if (!r->bad)
+    while (i-- > 0)
+      add_vpath_list (patterns[i],
+                      percents[i] != SNAPSHOT_NIL ? patterns[i] + percents[i] : NULL,
+                      searchpaths[i]);
+  free (patterns);
+  free (percents);
+  free (searchpaths);
+}
+
+
+/*******************************************************************************
+*   Key calculation and validation                                             *
+*******************************************************************************/
+
+/* FNV-1a, 64-bit. */
+static big_int
+snapshot_hash_str (big_int hash, const char *str)
+{
+  const unsigned char *p = (const unsigned char *)str;
+  do
+    {
+      hash ^= *p;
+      hash *= BIG_INT_C(0x100000001b3);
+    }
+  while (*p++);
+  return hash;
+}
+
+/* Calculates the key for this invocation: format version, build, working
+   directory, arguments (command line variables included) and environment. */
+static big_int
+snapshot_calc_key (int argc, char **argv, char **envp)
+{
+  big_int hash = BIG_INT_C(0xcbf29ce484222325);
+  char cwd[GET_PATH_MAX];
+  int i;
+
+  hash = snapshot_hash_str (hash, SNAPSHOT_MAGIC __DATE__ " " __TIME__);
+  if (getcwd (cwd, sizeof (cwd)))
+    hash = snapshot_hash_str (hash, cwd);
+  for (i = 0; i < argc; i++)
+    hash = snapshot_hash_str (hash, argv[i]);
+  hash = snapshot_hash_str (hash, "\n--environment--\n");
+  for (i = 0; envp[i]; i++)
+    hash = snapshot_hash_str (hash, envp[i]);
+  return hash;
+}
+
+/* Checks whether the recorded input files are unchanged.  A file with a
+   different timestamp but the same size and content is still accepted. */
+static int
+snapshot_validate_inputs (struct snapshot_reader *r, unsigned int num_inputs)
+{
+  while (num_inputs-- > 0)
+    {
+      unsigned int name_len;
+      const char *name = snapshot_get_blob (r, &name_len);
+      unsigned int exists = snapshot_get_u32 (r);
+      unsigned int crc = snapshot_get_u32 (r);
+      big_int size = snapshot_get_u64 (r);
+      big_int mtime = snapshot_get_u64 (r);
+      struct stat st;
+      int fd;
+      char *buf;
+      int same;
+
+      if (r->bad)
+        {
+          snapshot_stale_reason = "corrupt input list";
+          return 0;
+        }
+      snapshot_stat_inputs++;
+
+      if (stat (name, &st) != 0)
+        {
+          if (exists)
+            {
+              snapshot_stale_reason = "makefile removed";
+              return 0;
+            }
+          continue;
+        }
+      if (!exists)
+        {
+          snapshot_stale_reason = "makefile appeared";
+          return 0;
+        }
+      if ((big_int)st.st_size != size)
+        {
+          snapshot_stale_reason = "makefile changed";
+          return 0;
+        }
+      if ((big_int)FILE_TIMESTAMP_STAT_MODTIME (name, st) == mtime)
+        continue;
+
+      /* Touched, check the content. */
+#ifdef O_BINARY
+      fd = open (name, O_RDONLY | O_BINARY, 0);
+#else
+      fd = open (name, O_RDONLY, 0);
+#endif
+      if (fd < 0)
+        {
+          snapshot_stale_reason = "makefile unreadable";
+          return 0;
+        }
+      buf = xmalloc (st.st_size + 1);
+      same = read (fd, buf, st.st_size) == st.st_size
+          && crc32 (0, buf, st.st_size) == crc;
+      free (buf);
+      close (fd);
+      if (!same)
+        {
+          snapshot_stale_reason = "makefile changed";
+          return 0;
+        }
+      DB (DB_VERBOSE, (_("Snapshot input `%s' was touched but is unchanged.\n"), name));
+    }
+  return 1;
+}
+
+
+/*******************************************************************************
+*   Public Interface                                                           *
+*******************************************************************************/
+
+/* Called by eval_include_dep for each includedep file so it can be part of
+   the validation. */
+void
+snapshot_record_input (const char *name, unsigned int len)
+{
+  if (!snapshot_filename)
+    return;
+  if (snapshot_incdep_count >= snapshot_incdep_alloc)
+    {
+      snapshot_incdep_alloc = snapshot_incdep_alloc ? snapshot_incdep_alloc * 2 : 256;
+      snapshot_incdep_inputs = xrealloc ((void *)snapshot_incdep_inputs,
+                                         snapshot_incdep_alloc * sizeof (const char *));
+    }
+  snapshot_incdep_inputs[snapshot_incdep_count++] = strcache_add_len (name, len);
+}
+
+/* Tries to load the snapshot FILENAME instead of reading the makefiles.
+   Returns 1 and sets *READ_MAKEFILESP on success, 0 if the makefiles must
+   be read.  In the latter case snapshot_save should be called afterwards. */
+int
+snapshot_load (const char *filename, int argc, char **argv, char **envp,
+               struct dep **read_makefilesp)
+{
+  struct snapshot_reader r;
+  struct snapshot_hdr hdr;
+  struct dep *read_makefiles = 0;
+  struct dep **nextp = &read_makefiles;
+  struct stat st;
+  const char *base;
+  big_int start_ts = nano_timestamp ();
+  big_int valid_ts;
+  unsigned int i, count;
+  int fd;
+
+  snapshot_filename = filename;
+  snapshot_key = snapshot_calc_key (argc, argv, envp);
+
+  /* Open and map it. */
+#ifdef O_BINARY
+  fd = open (filename, O_RDONLY | O_BINARY, 0);
+#else
+  fd = open (filename, O_RDONLY, 0);
+#endif
+  if (fd < 0)
+    {
+      snapshot_stale_reason = "no snapshot";
+      snapshot_validate_time = nano_timestamp () - start_ts;
+      return 0;
+    }
+  if (   fstat (fd, &st) != 0
+      || st.st_size < (off_t)sizeof (hdr)
+      || read (fd, &hdr, sizeof (hdr)) != sizeof (hdr)
+      || memcmp (hdr.magic, SNAPSHOT_MAGIC, sizeof (hdr.magic))
+      || hdr.version != SNAPSHOT_VERSION
+      || hdr.sizeof_ptr != sizeof (void *)
+      || hdr.sizeof_file_timestamp != sizeof (FILE_TIMESTAMP)
+      || hdr.body_size != st.st_size - sizeof (hdr))
+    {
+      close (fd);
+      snapshot_stale_reason = "bad header";
+      snapshot_validate_time = nano_timestamp () - start_ts;
+      return 0;
+    }
+  if (hdr.key != snapshot_key)
+    {
+      close (fd);
+      snapshot_stale_reason = "different arguments, environment or directory";
+      snapshot_validate_time = nano_timestamp () - start_ts;
+      return 0;
+    }
+
+#ifdef HAVE_MMAP_SNAPSHOT
+  base = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (base == (const char *)MAP_FAILED)
+    {
+      close (fd);
+      snapshot_stale_reason = "mmap failed";
+      snapshot_validate_time = nano_timestamp () - start_ts;
+      return 0;
+    }
+#else
+  base = xmalloc (st.st_size);
+  lseek (fd, 0, SEEK_SET);
+  if (read (fd, (char *)base, st.st_size) != st.st_size)
+    {
+      free ((char *)base);
+      close (fd);
+      snapshot_stale_reason = "read failed";
+      snapshot_validate_time = nano_timestamp () - start_ts;
+      return 0;
+    }
+#endif
+  close (fd);
+  snapshot_stat_size = st.st_size;
+
+  memset (&r, 0, sizeof (r));
+  r.cur = base + sizeof (hdr);
+  r.end = base + st.st_size;
+
+  /* Validate: body checksum and input files. */
+  if (crc32 (0, r.cur, hdr.body_size) != hdr.body_crc32)
+    snapshot_stale_reason = "checksum mismatch";
+  else if (snapshot_validate_inputs (&r, hdr.num_inputs))
+    snapshot_stale_reason = NULL;
+  valid_ts = nano_timestamp ();
+  snapshot_validate_time = valid_ts - start_ts;
+  if (snapshot_stale_reason)
+    {
+#ifdef HAVE_MMAP_SNAPSHOT
+      munmap ((void *)base, st.st_size);
+#else
+      free ((char *)base);
+#endif
+      return 0;
+    }
+
+  /* Intern the strings. */
+  r.num_file_strings = hdr.num_file_strings;
+  r.file_strings = xmalloc ((hdr.num_file_strings + 1) * sizeof (const char *));
+  for (i = 0; i < hdr.num_file_strings && !r.bad; i++)
+    {
+      unsigned int hash = snapshot_get_u32 (&r);
+      unsigned int len;
+      const char *str = snapshot_get_blob (&r, &len);
+      r.file_strings[i] = strcache2_add_hashed_file (&file_strcache, str, len, hash);
+    }
+  r.num_var_strings = hdr.num_var_strings;
+  r.var_strings = xmalloc ((hdr.num_var_strings + 1) * sizeof (const char *));
+  for (i = 0; i < hdr.num_var_strings && !r.bad; i++)
+    {
+      unsigned int hash = snapshot_get_u32 (&r);
+      unsigned int len;
+      const char *str = snapshot_get_blob (&r, &len);
+      r.var_strings[i] = strcache2_add_hashed (&variable_strcache, str, len, hash);
+    }
+
+  /* The commands. */
+  r.num_commands = hdr.num_commands;
+  r.commands = xmalloc ((hdr.num_commands + 1) * sizeof (struct commands *));
+  for (i = 0; i < hdr.num_commands && !r.bad; i++)
+    {
+      struct commands *cmds;
+      unsigned int len;
+      const char *text;
+
+#ifndef CONFIG_WITH_ALLOC_CACHES
+      cmds = xmalloc (sizeof (struct commands));
+#else
+      cmds = alloccache_alloc (&commands_cache);
+#endif
+      memset (cmds, 0, sizeof (*cmds));
+      cmds->fileinfo.filenm = snapshot_get_fstr (&r);
+      cmds->fileinfo.lineno = snapshot_get_u32 (&r);
+#ifdef CONFIG_WITH_MEMORY_OPTIMIZATIONS
+      cmds->refs = snapshot_get_u32 (&r);
+#else
+      snapshot_get_u32 (&r);
+#endif
+      text = snapshot_get_blob (&r, &len);
+      cmds->commands = savestring (text, len);
+      r.commands[i] = cmds;
+    }
+
+  /* The global state. */
+  posix_pedantic = snapshot_get_u32 (&r);
+  second_expansion = snapshot_get_u32 (&r);
+#ifdef CONFIG_WITH_2ND_TARGET_EXPANSION
+  second_target_expansion = snapshot_get_u32 (&r);
+#else
+  snapshot_get_u32 (&r);
+#endif
+  export_all_variables = snapshot_get_u32 (&r);
+
+  /* Variables, files, pattern variables, pattern rules and vpaths. */
+  snapshot_get_variable_set (&r, current_variable_set_list->set);
+  count = snapshot_get_u32 (&r);
+  while (count-- > 0 && !r.bad)
+    snapshot_get_file (&r);
+  snapshot_get_pattern_vars (&r);
+  snapshot_get_rules (&r);
+  snapshot_get_vpaths (&r);
+
+  /* The default goal file. */
+  {
+    const char *name = snapshot_get_fstr (&r);
+    default_goal_file = name ? lookup_file_cached (name) : 0;
+  }
+
+  /* The makefile chain. */
+  count = snapshot_get_u32 (&r);
+  while (count-- > 0 && !r.bad)
+    {
+      const char *name = snapshot_get_fstr (&r);
+      unsigned int changed = snapshot_get_u32 (&r);
+      struct dep *d;
+      if (!name)
+        {
+          r.bad = 1;
+          break;
+        }
+      d = alloc_dep ();
+      d->file = snapshot_lookup_or_enter_file (name);
+      d->changed = changed;
+      *nextp = d;
+      nextp = &d->next;
+    }
+
+  free ((void *)r.file_strings);
+  free ((void *)r.var_strings);
+  free (r.commands);
+#ifdef HAVE_MMAP_SNAPSHOT
+  munmap ((void *)base, st.st_size);
+#else
+  free ((char *)base);
+#endif
+
+  /* We've modified the database at this point, so there is no going back. */
+  if (r.bad)
+    fatal (NILF, _("%s: corrupt snapshot, please delete it"), filename);
+
+  snapshot_load_time = nano_timestamp () - valid_ts;
+  snapshot_loaded = 1;
+  *read_makefilesp = read_makefiles;
+  DB (DB_BASIC, (_("Loaded makefile snapshot `%s'.\n"), filename));
+  return 1;
+}
+
+/* Writes the state left by read_all_makefiles to the snapshot file.
+   READ_MAKEFILES is the chain it returned. */
+void
+snapshot_save (struct dep *read_makefiles)
+{
+  struct snapshot_writer w;
+  struct snapshot_hdr hdr;
+  struct pattern_var *p;
+  struct rule *rule;
+  struct dep *d;
+  big_int start_ts = nano_timestamp ();
+  unsigned int i, count;
+  size_t count_off;
+  char *tmp_name;
+  FILE *fp;
+  int ok;
+
+  if (!snapshot_filename)
+    return;
+
+#ifdef CONFIG_WITH_INCLUDEDEP
+  /* Flush queued includedep files so they are part of the snapshot.  This
+     would otherwise happen in snap_deps. */
+  incdep_flush_and_term ();
+#endif
+
+  memset (&w, 0, sizeof (w));
+  hash_init (&w.file_str_map, 16384, snapshot_ptr_hash_1, snapshot_ptr_hash_2,
+             snapshot_ptr_cmp);
+  hash_init (&w.var_str_map, 8192, snapshot_ptr_hash_1, snapshot_ptr_hash_2,
+             snapshot_ptr_cmp);
+  hash_init (&w.cmds_map, 1024, snapshot_ptr_hash_1, snapshot_ptr_hash_2,
+             snapshot_ptr_cmp);
+
+  /* The inputs.  Don't save anything if a required makefile is missing. */
+  for (d = read_makefiles; d != 0; d = d->next)
+    if (!snapshot_put_input (&w, dep_name (d)) && !(d->changed & RM_DONTCARE))
+      w.incomplete = 1;
+  for (i = 0; i < snapshot_incdep_count; i++)
+    snapshot_put_input (&w, snapshot_incdep_inputs[i]);
+
+  /* The global state. */
+  snapshot_put_u32 (&w.body, posix_pedantic);
+  snapshot_put_u32 (&w.body, second_expansion);
+#ifdef CONFIG_WITH_2ND_TARGET_EXPANSION
+  snapshot_put_u32 (&w.body, second_target_expansion);
+#else
+  snapshot_put_u32 (&w.body, 0);
+#endif
+  snapshot_put_u32 (&w.body, export_all_variables);
+
+  /* The global variables. */
+  snapshot_put_variable_set (&w, current_variable_set_list->set);
+
+  /* The files. */
+  count_off = w.body.len;
+  snapshot_put_u32 (&w.body, 0);
+  map_file_data_base (snapshot_put_file_chain, &w);
+  memcpy (w.body.buf + count_off, &w.num_files, sizeof (w.num_files));
+  snapshot_stat_files = w.num_files;
+
+  /* The pattern specific variables. */
+  count = 0;
+  for (p = pattern_var_list (); p != 0; p = p->next)
+    count++;
+  snapshot_put_u32 (&w.body, count);
+  for (p = pattern_var_list (); p != 0; p = p->next)
+    {
+      snapshot_put_fstr (&w, p->target);
+      snapshot_put_u32 (&w.body, p->suffix - 1 - p->target);
+      snapshot_put_blob (&w.body, p->variable.name, strlen (p->variable.name));
+      snapshot_put_variable_common (&w, &p->variable, strlen (p->variable.value));
+      snapshot_stat_variables++;
+    }
+
+  /* The pattern rules. */
+  count = 0;
+  for (rule = pattern_rules; rule != 0; rule = rule->next)
+    count++;
+  snapshot_put_u32 (&w.body, count);
+  snapshot_stat_rules = count;
+  for (rule = pattern_rules; rule != 0; rule = rule->next)
+    {
+      snapshot_put_u32 (&w.body, rule->num);
+      snapshot_put_u32 (&w.body, rule->terminal);
+      for (i = 0; i < rule->num; i++)
+        {
+          snapshot_put_fstr (&w, rule->targets[i]);
+          snapshot_put_u32 (&w.body, rule->suffixes[i] - 1 - rule->targets[i]);
+        }
+      snapshot_put_deps (&w, rule->deps);
+      snapshot_put_cmds (&w, rule->cmds);
+    }
+
+  /* The vpath directives. */
+  count_off = w.body.len;
+  snapshot_put_u32 (&w.body, 0);
+  count = enum_vpath_lists (snapshot_put_vpath, &w);
+  memcpy (w.body.buf + count_off, &count, sizeof (count));
+
+  /* The default goal and the makefile chain. */
+  snapshot_put_fstr (&w, default_goal_file ? default_goal_file->name : NULL);
+  count = 0;
+  for (d = read_makefiles; d != 0; d = d->next)
+    count++;
+  snapshot_put_u32 (&w.body, count);
+  for (d = read_makefiles; d != 0; d = d->next)
+    {
+      snapshot_put_fstr (&w, dep_name (d));
+      snapshot_put_u32 (&w.body, d->changed);
+    }
+
+  /* Assemble the header and write it all to a temporary file which is
+     then renamed into place, so concurrent kmk instances never see a
+     partial snapshot. */
+  memset (&hdr, 0, sizeof (hdr));
+  memcpy (hdr.magic, SNAPSHOT_MAGIC, sizeof (hdr.magic));
+  hdr.version = SNAPSHOT_VERSION;
+  hdr.sizeof_ptr = sizeof (void *);
+  hdr.sizeof_file_timestamp = sizeof (FILE_TIMESTAMP);
+  hdr.num_inputs = w.num_inputs;
+  hdr.num_file_strings = w.num_file_strings;
+  hdr.num_var_strings = w.num_var_strings;
+  hdr.num_commands = w.num_commands;
+  hdr.key = snapshot_key;
+  hdr.body_size = w.inputs.len + w.file_strings.len + w.var_strings.len
+                + w.commands.len + w.body.len;
+  hdr.body_crc32 = crc32 (0, w.inputs.buf, w.inputs.len);
+  hdr.body_crc32 = crc32 (hdr.body_crc32, w.file_strings.buf, w.file_strings.len);
+  hdr.body_crc32 = crc32 (hdr.body_crc32, w.var_strings.buf, w.var_strings.len);
+  hdr.body_crc32 = crc32 (hdr.body_crc32, w.commands.buf, w.commands.len);
+  hdr.body_crc32 = crc32 (hdr.body_crc32, w.body.buf, w.body.len);
+  snapshot_stat_size = sizeof (hdr) + hdr.body_size;
+
+  if (!w.incomplete)
+    {
+      tmp_name = xmalloc (strlen (snapshot_filename) + 32);
+      sprintf (tmp_name, "%s.%ld.tmp", snapshot_filename, (long)getpid ());
+      fp = fopen (tmp_name, "wb");
+      if (fp)
+        {
+          ok = fwrite (&hdr, sizeof (hdr), 1, fp) == 1
+            && fwrite (w.inputs.buf, 1, w.inputs.len, fp) == w.inputs.len
+            && fwrite (w.file_strings.buf, 1, w.file_strings.len, fp) == w.file_strings.len
+            && fwrite (w.var_strings.buf, 1, w.var_strings.len, fp) == w.var_strings.len
+            && fwrite (w.commands.buf, 1, w.commands.len, fp) == w.commands.len
+            && fwrite (w.body.buf, 1, w.body.len, fp) == w.body.len;
+          ok = fclose (fp) == 0 && ok;
+#if defined (WINDOWS32) || defined (__OS2__)
+          if (ok)
+            unlink (snapshot_filename);
+#endif
+          if (!ok || rename (tmp_name, snapshot_filename) != 0)
+            {
+              error (NILF, _("warning: failed to write snapshot `%s': %s"),
+                     snapshot_filename, strerror (errno));
+              unlink (tmp_name);
+            }
+        }
+      else
+        error (NILF, _("warning: failed to create snapshot `%s': %s"),
+               tmp_name, strerror (errno));
+      free (tmp_name);
+    }
+  else
+    DB (DB_BASIC, (_("Not writing snapshot `%s' as some makefiles are missing.\n"),
+                   snapshot_filename));
+
+  free (w.inputs.buf);
+  free (w.file_strings.buf);
+  free (w.var_strings.buf);
+  free (w.commands.buf);
+  free (w.body.buf);
+  hash_free (&w.file_str_map, 1);
+  hash_free (&w.var_str_map, 1);
+  hash_free (&w.cmds_map, 1);
+
+  snapshot_save_time = nano_timestamp () - start_ts;
+}
+
+/* Prints the snapshot statistics (--print-stats). */
+void
+print_snapshot_stats (void)
+{
+  char buf1[64];
+  char buf2[64];
+
+  if (!snapshot_filename)
+    return;
+
+  format_elapsed_nano (buf1, sizeof (buf1), snapshot_validate_time);
+  if (snapshot_loaded)
+    {
+      format_elapsed_nano (buf2, sizeof (buf2), snapshot_load_time);
+      printf (_("\n# snapshot: loaded `%s' (%lu bytes); validation %s (%u inputs), loading %s\n"),
+              snapshot_filename, snapshot_stat_size, buf1, snapshot_stat_inputs, buf2);
+    }
+  else
+    {
+      format_elapsed_nano (buf2, sizeof (buf2), snapshot_save_time);
+      printf (_("\n# snapshot: `%s' not used (%s); validation %s, saving %s (%lu bytes)\n"),
+              snapshot_filename, snapshot_stale_reason ? snapshot_stale_reason : "?",
+              buf1, buf2, snapshot_stat_size);
+    }
+  printf (_("#           %u variables, %u files, %u pattern rules\n"),
+          snapshot_stat_variables, snapshot_stat_files, snapshot_stat_rules);
+}
+
+#endif /* CONFIG_WITH_MAKEFILE_SNAPSHOT */
@@ -0,0 +1,456 @@
+#ifdef CONFIG_WITH_STAT_PREFETCH
+/* $Id$ */
+/** @file
+ * statprefetch - Parallel stat() of the goal prerequisite closure.
+ *
+ * update_file_1() gets the timestamps one at a time as it walks the
+ * dependency graph depth first, so on a no-op build of a large tree kmk
+ * spends most of its time waiting on serialized stat() calls, each of
+ * which is a round trip when the tree lives on NFS.  Once snap_deps() has
+ * completed the graph, prefetch_goal_mtimes() collects all the files
+ * reachable from the goals, sorts them by directory, and lets a small pool
+ * of threads do the stat() calls a directory batch at a time.  The results
+ * are stored in last_mtime so that file_mtime() doesn't have to go to the
+ * system when the serial pass gets to them.
+ *
+ * Only files that exist and need no special treatment by f_mtime() get a
+ * timestamp this way.  Missing files (VPATH / library search), archive
+ * members, intermediate files and files with timestamps in the future are
+ * left alone and will be handled by f_mtime() as before.
+ *
+ * A recipe or $(shell ) may change any file as a side effect, so once
+ * dir_snapshot_gen has moved on the timestamps of the files the serial pass
+ * hasn't got to yet are dropped again (stat_prefetch_check_gen).  Without
+ * the generation counter, targets of rules are left alone as well.
+ */
+
+/*
+ * Copyright (c) 2026 The kBuild contributors
+ *
+ * This file is part of kBuild.
+ *
+ * kBuild is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * kBuild is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with kBuild.  If not, see <http://www.gnu.org/licenses/>
+ *
+ */
+
+/*******************************************************************************
+*   Header Files                                                               *
+*******************************************************************************/
+#include "make.h"
+#include <assert.h>
+#include "dep.h"
+#include "filedef.h"
+#include "debug.h"
+
+#if !defined(WINDOWS32) && !defined(__OS2__) && !defined(CONFIG_WITHOUT_THREADS)
+# include <pthread.h>
+# define HAVE_PTHREAD
+#endif
+
+
+/*******************************************************************************
+*   Defined Constants And Macros                                               *
+*******************************************************************************/
+/* The max number of threads doing stat() calls, including the main thread. */
+#define STAT_PREFETCH_MAX_THREADS   8
+/* The max number of files in a batch.  Directories with more files than
+   this are split up into several batches. */
+#define STAT_PREFETCH_BATCH_SIZE    64
+/* Don't bother with threads unless there are this many files to stat. */
+#define STAT_PREFETCH_MIN_FILES     128
+
+
+/*******************************************************************************
+*   Structures and Typedefs                                                    *
+*******************************************************************************/
+struct stat_prefetch_entry
+{
+  struct file *file;            /* The file (double_colon head). */
+  unsigned int dir_len;         /* Length of the directory part of the name. */
+  int err;                      /* 0 or the errno from stat(). */
+  time_t sec;                   /* st_mtime */
+  int nsec;                     /* The nanosecond part of st_mtime. */
+};
+
+
+/*******************************************************************************
+*   Global Variables                                                           *
+*******************************************************************************/
+/* The files being prefetched and the start index of each batch. */
+static struct stat_prefetch_entry *stat_prefetch_entries;
+static unsigned int *stat_prefetch_batches;
+static unsigned int stat_prefetch_num_batches;
+
+/* The next batch to process. */
+static unsigned int volatile stat_prefetch_next_batch;
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t stat_prefetch_mtx = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+#ifdef CONFIG_WITH_DIR_SNAPSHOTS
+/* The files that got a timestamp and the dir_snapshot_gen at the time. */
+static struct file **stat_prefetch_stored;
+static unsigned int stat_prefetch_num_stored;
+static unsigned int stat_prefetch_gen;
+#endif
+
+/* Statistics. */
+static unsigned int stat_prefetch_stat_files;
+static unsigned int stat_prefetch_stat_batches;
+static unsigned int stat_prefetch_stat_threads;
+static unsigned int stat_prefetch_stat_hits;
+static unsigned int stat_prefetch_stat_dropped;
+static big_int stat_prefetch_stat_time;
+
+
+/* Length of the directory part of NAME, including the final slash. */
+static unsigned int
+stat_prefetch_dir_len (const char *name)
+{
+  const char *slash = strrchr (name, '/');
+#ifdef HAVE_DOS_PATHS
+  const char *bslash = strrchr (name, '\\');
+  if (!slash || (bslash && bslash > slash))
+    slash = bslash;
+#endif
+  return slash ? slash - name + 1 : 0;
+}
+
+/* qsort callback that orders the entries by directory and then by name. */
+static int
+stat_prefetch_compare (const void *pv1, const void *pv2)
+{
+  const struct stat_prefetch_entry *e1 = (const struct stat_prefetch_entry *)pv1;
+  const struct stat_prefetch_entry *e2 = (const struct stat_prefetch_entry *)pv2;
+  unsigned int len = e1->dir_len < e2->dir_len ? e1->dir_len : e2->dir_len;
+  int rc = memcmp (e1->file->name, e2->file->name, len);
+  if (rc)
+    return rc;
+  if (e1->dir_len != e2->dir_len)
+    return e1->dir_len < e2->dir_len ? -1 : 1;
+  return strcmp (e1->file->name + len, e2->file->name + len);
+}
+
+/* Grabs the next unprocessed batch, returns -1 when there are none left. */
+static int
+stat_prefetch_grab_batch (void)
+{
+  int batch = -1;
+#ifdef HAVE_PTHREAD
+  pthread_mutex_lock (&stat_prefetch_mtx);
+#endif
+  if (stat_prefetch_next_batch < stat_prefetch_num_batches)
+    batch = stat_prefetch_next_batch++;
+#ifdef HAVE_PTHREAD
+  pthread_mutex_unlock (&stat_prefetch_mtx);
+#endif
+  return batch;
+}
+
+/* Does the stat() calls for batches until there are no more left.  This
+   runs on the worker threads as well as the main thread and must not touch
+   anything but the entries of the batches it grabs. */
+static void
+stat_prefetch_worker (void)
+{
+  int batch;
+  while ((batch = stat_prefetch_grab_batch ()) >= 0)
+    {
+      unsigned int i   = stat_prefetch_batches[batch];
+      unsigned int end = stat_prefetch_batches[batch + 1];
+      for (; i < end; i++)
+        {
+          struct stat_prefetch_entry *ent = &stat_prefetch_entries[i];
+          struct stat st;
+          int e;
+
+          EINTRLOOP (e, stat (ent->file->name, &st));
+          if (e == 0)
+            {
+              ent->err = 0;
+              ent->sec = st.st_mtime;
+#if FILE_TIMESTAMP_HI_RES
+              ent->nsec = st.st_mtim.ST_MTIM_NSEC;
+#else
+              ent->nsec = 0;
+#endif
+            }
+          else
+            ent->err = errno ? errno : ENOENT;
+        }
+    }
+}
+
+#ifdef HAVE_PTHREAD
+static void *
+stat_prefetch_worker_pthread (void *ignored)
+{
+  (void)ignored;
+  stat_prefetch_worker ();
+  return NULL;
+}
+#endif
+
+/* Walks the dependency graph from GOALS and collects the files that want
+   prefetching.  Returns the number of entries. */
+static unsigned int
+stat_prefetch_collect (struct dep *goals, unsigned int *sizep)
+{
+  unsigned int count = 0;
+  unsigned int size = *sizep;
+  unsigned int stack_size = 256;
+  unsigned int depth = 0;
+  struct file **stack = xmalloc (stack_size * sizeof (*stack));
+  struct dep *d;
+
+  for (d = goals; d; d = d->next)
+    if (d->file)
+      {
+        if (depth >= stack_size)
+          {
+            stack_size *= 2;
+            stack = xrealloc (stack, stack_size * sizeof (*stack));
+          }
+        stack[depth++] = d->file;
+      }
+
+  while (depth > 0)
+    {
+      struct file *f = stack[--depth];
+      struct file *f2;
+
+      while (f->renamed)
+        f = f->renamed;
+      if (f->double_colon)
+        f = f->double_colon;
+      if (f->stat_prefetched)
+        continue;
+      f->stat_prefetched = 1;
+
+      if (f->last_mtime == UNKNOWN_MTIME
+          && !f->phony
+          && !f->intermediate
+#ifndef NO_ARCHIVES
+          && !ar_name (f->name)
+#endif
+#ifndef CONFIG_WITH_DIR_SNAPSHOTS
+          && !f->is_target
+#endif
+          )
+        {
+          if (count >= size)
+            {
+              size = size ? size * 2 : 1024;
+              stat_prefetch_entries = xrealloc (stat_prefetch_entries,
+                                                size * sizeof (stat_prefetch_entries[0]));
+            }
+          stat_prefetch_entries[count].file = f;
+          stat_prefetch_entries[count].dir_len = stat_prefetch_dir_len (f->name);
+          stat_prefetch_entries[count].err = -1;
+          count++;
+        }
+
+      for (f2 = f; f2; f2 = f2->prev)
+        for (d = f2->deps; d; d = d->next)
+          if (d->file && !d->file->stat_prefetched)
+            {
+              if (depth >= stack_size)
+                {
+                  stack_size *= 2;
+                  stack = xrealloc (stack, stack_size * sizeof (*stack));
+                }
+              stack[depth++] = d->file;
+            }
+    }
+
+  free (stack);
+  *sizep = size;
+  return count;
+}
+
+/* Splits the sorted entries into batches of files from the same directory. */
+static void
+stat_prefetch_make_batches (unsigned int count)
+{
+  unsigned int i;
+  unsigned int start = 0;
+
+  stat_prefetch_batches = xmalloc ((count + 1) * sizeof (stat_prefetch_batches[0]));
+  stat_prefetch_num_batches = 0;
+  for (i = 1; i <= count; i++)
+    if (   i == count
+        || i - start >= STAT_PREFETCH_BATCH_SIZE
+        || stat_prefetch_entries[i].dir_len != stat_prefetch_entries[start].dir_len
+        || memcmp (stat_prefetch_entries[i].file->name,
+                   stat_prefetch_entries[start].file->name,
+                   stat_prefetch_entries[start].dir_len))
+      {
+        stat_prefetch_batches[stat_prefetch_num_batches++] = start;
+        start = i;
+      }
+  stat_prefetch_batches[stat_prefetch_num_batches] = count;
+}
+
+/* Stores the results in the files. */
+static unsigned int
+stat_prefetch_apply (unsigned int count)
+{
+  unsigned int hits = 0;
+  unsigned int i;
+  int resolution;
+  FILE_TIMESTAMP now = file_timestamp_now (&resolution);
+  now += resolution - 1;
+
+#ifdef CONFIG_WITH_DIR_SNAPSHOTS
+  free (stat_prefetch_stored);
+  stat_prefetch_stored = xmalloc (count * sizeof (stat_prefetch_stored[0]));
+  stat_prefetch_num_stored = 0;
+  stat_prefetch_gen = dir_snapshot_gen;
+#endif
+
+  for (i = 0; i < count; i++)
+    {
+      struct stat_prefetch_entry *ent = &stat_prefetch_entries[i];
+      struct file *f;
+      FILE_TIMESTAMP mtime;
+
+      /* Leave missing files to f_mtime and the VPATH search. */
+      if (ent->err != 0)
+        continue;
+
+      /* Leave files with bogus timestamps to f_mtime so it can warn. */
+      mtime = file_timestamp_cons (ent->file->name, ent->sec, ent->nsec);
+      if (mtime > now)
+        continue;
+
+      for (f = ent->file; f != 0; f = f->prev)
+        f->last_mtime = mtime;
+#ifdef CONFIG_WITH_DIR_SNAPSHOTS
+      stat_prefetch_stored[stat_prefetch_num_stored++] = ent->file;
+#endif
+      hits++;
+    }
+  return hits;
+}
+
+#ifdef CONFIG_WITH_DIR_SNAPSHOTS
+/* Called by update_file_1 before it looks at a file.  If something may
+   have changed the file system since the timestamps were read, drop the
+   ones of the files that haven't been considered yet so f_mtime gets them
+   again when their turn comes, like it would have without prefetching.  */
+void
+stat_prefetch_check_gen (void)
+{
+  unsigned int i;
+
+  if (!stat_prefetch_num_stored || stat_prefetch_gen == dir_snapshot_gen)
+    return;
+
+  for (i = 0; i < stat_prefetch_num_stored; i++)
+    {
+      struct file *f = stat_prefetch_stored[i];
+      if (   !f->updated
+          && !f->updating
+          && f->command_state == cs_not_started)
+        {
+          for (; f != 0; f = f->prev)
+            f->last_mtime = UNKNOWN_MTIME;
+          stat_prefetch_stat_dropped++;
+        }
+    }
+
+  free (stat_prefetch_stored);
+  stat_prefetch_stored = NULL;
+  stat_prefetch_num_stored = 0;
+}
+#endif
+
+/* Gets the timestamps of all the files reachable from GOALS in parallel. */
+void
+prefetch_goal_mtimes (struct dep *goals)
+{
+  big_int start = nano_timestamp ();
+  unsigned int size = 0;
+  unsigned int count;
+  unsigned int threads = 1;
+  unsigned int hits = 0;
+#ifdef HAVE_PTHREAD
+  pthread_t tids[STAT_PREFETCH_MAX_THREADS];
+  unsigned int i;
+#endif
+
+  /* The symlink checking in name_mtime needs more than a stat call. */
+#ifdef MAKE_SYMLINKS
+  if (check_symlink_flag)
+    return;
+#endif
+
+  count = stat_prefetch_collect (goals, &size);
+  if (count >= STAT_PREFETCH_MIN_FILES)
+    {
+      qsort (stat_prefetch_entries, count, sizeof (stat_prefetch_entries[0]),
+             stat_prefetch_compare);
+      stat_prefetch_make_batches (count);
+      stat_prefetch_next_batch = 0;
+
+#ifdef HAVE_PTHREAD
+      threads = stat_prefetch_num_batches < STAT_PREFETCH_MAX_THREADS
+              ? stat_prefetch_num_batches : STAT_PREFETCH_MAX_THREADS;
+      for (i = 0; i + 1 < threads; i++)
+        if (pthread_create (&tids[i], NULL, stat_prefetch_worker_pthread, NULL))
+          break;
+      threads = i + 1;
+#endif
+
+      stat_prefetch_worker ();
+
+#ifdef HAVE_PTHREAD
+      for (i = 0; i + 1 < threads; i++)
+        pthread_join (tids[i], NULL);
+#endif
+
+      stat_prefetch_stat_files += count;
+      stat_prefetch_stat_batches += stat_prefetch_num_batches;
+      hits = stat_prefetch_apply (count);
+      stat_prefetch_stat_hits += hits;
+      if (threads > stat_prefetch_stat_threads)
+        stat_prefetch_stat_threads = threads;
+
+      free (stat_prefetch_batches);
+      stat_prefetch_batches = NULL;
+      stat_prefetch_num_batches = 0;
+    }
+
+  free (stat_prefetch_entries);
+  stat_prefetch_entries = NULL;
+  stat_prefetch_stat_time += nano_timestamp () - start;
+
+  DB (DB_VERBOSE, (_("Prefetched the timestamps of %u out of %u files using %u threads.\n"),
+                   hits, count, threads));
+}
+
+/* Prints the statistics. */
+void
+print_stat_prefetch_stats (void)
+{
+  char buf[64];
+
+  format_elapsed_nano (buf, sizeof (buf), stat_prefetch_stat_time);
+  printf (_("\n# stat prefetch: %u files in %u batches, %u timestamps stored, %u dropped, %u threads, %s\n"),
+          stat_prefetch_stat_files, stat_prefetch_stat_batches,
+          stat_prefetch_stat_hits, stat_prefetch_stat_dropped,
+          stat_prefetch_stat_threads, buf);
+}
+
+#endif /* CONFIG_WITH_STAT_PREFETCH */
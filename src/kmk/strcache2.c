@@ -40,10 +40,24 @@ typedef unsigned int   uint32_t;
 typedef signed char    int8_t;
 typedef signed short   int16_t;
 typedef signed int     int32_t;
+typedef unsigned __int64 uint64_t;
+# define UINT64_C(c) (c ## ULL)
 #else
 # include <stdint.h>
 #endif
 
+/* SSE2 is always there on AMD64, AVX2 has to be detected at runtime and
+   requires a compiler that can target it per function. */
+#if defined (__SSE2__) || defined (_M_X64) || (defined (_M_IX86_FP) && _M_IX86_FP >= 2)
+# define STRCACHE2_HAVE_SSE2
+# include <emmintrin.h>
+# if defined (__GNUC__) && (defined (__x86_64__) || defined (__i386__)) \
+  && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#  define STRCACHE2_HAVE_AVX2
+#  include <immintrin.h>
+# endif
+#endif
+
 #ifdef WINDOWS32
 # include <io.h>
 # include <process.h>
@@ -83,6 +97,23 @@ typedef signed int     int32_t;
                                                   | (((const uint8_t *)(ptr))[1]) )
 # endif
 
+/** Strings of this length or longer are compared by strcache2_is_equal_long. */
+#define STRCACHE2_LONG_COMPARE          16
+
+#ifdef STRCACHE2_HAVE_CONCURRENT
+/** Atomically replaces *PP with NEW_PTR if it equals OLD_PTR, returns
+ *  non-zero on success.  Implies a full memory barrier. */
+# ifdef _MSC_VER
+#  define strcache2_atomic_cmpxchg_ptr(pp, new_ptr, old_ptr) \
+    (InterlockedCompareExchangePointer ((void * volatile *)(pp), (new_ptr), (old_ptr)) == (void *)(old_ptr))
+#  define strcache2_atomic_inc(pu)  InterlockedIncrement ((long volatile *)(pu))
+# else
+#  define strcache2_atomic_cmpxchg_ptr(pp, new_ptr, old_ptr) \
+    __sync_bool_compare_and_swap ((pp), (old_ptr), (new_ptr))
+#  define strcache2_atomic_inc(pu)  __sync_fetch_and_add ((pu), 1)
+# endif
+#endif
+
 
 /*******************************************************************************
 *   Global Variables                                                           *
@@ -90,6 +121,11 @@ typedef signed int     int32_t;
 /* List of initialized string caches. */
 static struct strcache2 *strcache_head;
 
+/* The compare kernel for long strings, see strcache2_select_kernels. */
+static int strcache2_is_equal_long_words (const char *xs, const char *ys, unsigned int length);
+static int (*strcache2_is_equal_long) (const char *xs, const char *ys, unsigned int length)
+  = strcache2_is_equal_long_words;
+
 
 /** Finds the closest primary number for power of two value (or something else
  *  useful if not support).   */
@@ -194,10 +230,79 @@ strcache2_case_sensitive_hash_big (const char *str, unsigned int len)
 }
 #endif /* BIG_HASH_SIZE */
 
+/* Loads 4 bytes from an unaligned address, in host byte order. */
+MY_INLINE uint32_t
+strcache2_get_unaligned_32bits (const char *ptr)
+{
+  uint32_t u32;
+  memcpy (&u32, ptr, sizeof (u32));
+  return u32;
+}
+
+/* Loads 8 bytes from an unaligned address, in host byte order. */
+MY_INLINE uint64_t
+strcache2_get_unaligned_64bits (const char *ptr)
+{
+  uint64_t u64;
+  memcpy (&u64, ptr, sizeof (u64));
+  return u64;
+}
+
 MY_INLINE unsigned int
 strcache2_case_sensitive_hash (const char *str, unsigned int len)
 {
 #if 1
+  /* Word at a time: each 8 byte chunk is xor'ed in and mixed with a multiply
+     and a shift, and the murmur3 finalizer does the avalanching (only the
+     low bits are used for the table index).  The last chunk is loaded so
+     that it ends with the string, overlapping the previous one, and strings
+     shorter than 8 bytes are picked up with two overlapping 4 byte loads or
+     three single bytes.  This avoids a switch on the remainder, which the
+     mix of string lengths makes mispredict.  The length is part of the seed,
+     so the overlapping doesn't cause collisions.
+
+     On the strings of a kmk -p dump of the kBuild tree (29 bytes on average)
+     this is faster than the Hsieh function below with the same collision
+     rates (see strcache2bench.c).
+
+     The value depends on the host byte order, which is fine as long as the
+     hashes aren't shared between hosts.  */
+  uint64_t hash = len * UINT64_C(0x9e3779b97f4a7c15);
+  uint64_t last;
+
+  if (len >= 8)
+    {
+      const char *end = str + len;
+      while (len > 8)
+        {
+          hash ^= strcache2_get_unaligned_64bits (str);
+          hash *= UINT64_C(0xff51afd7ed558ccd);
+          hash ^= hash >> 32;
+          str += 8;
+          len -= 8;
+        }
+      last = strcache2_get_unaligned_64bits (end - 8);
+    }
+  else if (len >= 4)
+    last = strcache2_get_unaligned_32bits (str)
+         | (uint64_t)strcache2_get_unaligned_32bits (str + len - 4) << 32;
+  else if (len > 0)
+    last = ((uint32_t)(uint8_t)str[0] << 16)
+         | ((uint32_t)(uint8_t)str[len >> 1] << 8)
+         |  (uint32_t)(uint8_t)str[len - 1];
+  else
+    last = 0;
+  hash ^= last;
+  hash *= UINT64_C(0xff51afd7ed558ccd);
+
+  hash ^= hash >> 33;
+  hash *= UINT64_C(0xff51afd7ed558ccd);
+  hash ^= hash >> 33;
+  hash *= UINT64_C(0xc4ceb9fe1a85ec53);
+  hash ^= hash >> 33;
+  return (unsigned int)hash;
+
+#elif 1
   /* Paul Hsieh hash SuperFast function:
      http://www.azillionmonkeys.com/qed/hash.html
 
@@ -590,6 +695,105 @@ strcache2_memcmp_inlined (const char *xs, const char *ys, unsigned int length)
     }
 }
 
+/* Checks if two strings of STRCACHE2_LONG_COMPARE or more bytes are equal,
+   8 bytes at a time.  The last load ends with the strings and may overlap
+   the previous one.  */
+static int
+strcache2_is_equal_long_words (const char *xs, const char *ys, unsigned int length)
+{
+  const char *xlast = xs + length - 8;
+  const char *ylast = ys + length - 8;
+
+  assert (length >= STRCACHE2_LONG_COMPARE);
+  while (xs < xlast)
+    {
+      if (strcache2_get_unaligned_64bits (xs) != strcache2_get_unaligned_64bits (ys))
+        return 0;
+      xs += 8;
+      ys += 8;
+    }
+  return strcache2_get_unaligned_64bits (xlast) == strcache2_get_unaligned_64bits (ylast);
+}
+
+#ifdef STRCACHE2_HAVE_SSE2
+/* SSE2 version of strcache2_is_equal_long_words, 16 bytes at a time. */
+static int
+strcache2_is_equal_long_sse2 (const char *xs, const char *ys, unsigned int length)
+{
+  const char *xlast = xs + length - 16;
+  const char *ylast = ys + length - 16;
+  __m128i x, y;
+
+  assert (length >= STRCACHE2_LONG_COMPARE);
+  while (xs < xlast)
+    {
+      x = _mm_loadu_si128 ((const __m128i *)xs);
+      y = _mm_loadu_si128 ((const __m128i *)ys);
+      if (_mm_movemask_epi8 (_mm_cmpeq_epi8 (x, y)) != 0xffff)
+        return 0;
+      xs += 16;
+      ys += 16;
+    }
+  x = _mm_loadu_si128 ((const __m128i *)xlast);
+  y = _mm_loadu_si128 ((const __m128i *)ylast);
+  return _mm_movemask_epi8 (_mm_cmpeq_epi8 (x, y)) == 0xffff;
+}
+#endif /* STRCACHE2_HAVE_SSE2 */
+
+#ifdef STRCACHE2_HAVE_AVX2
+/* AVX2 version of strcache2_is_equal_long_words, 32 bytes at a time.  Strings
+   shorter than that are done as two overlapping 16 byte halves. */
+__attribute__((__target__("avx2")))
+static int
+strcache2_is_equal_long_avx2 (const char *xs, const char *ys, unsigned int length)
+{
+  const char *xlast;
+  const char *ylast;
+  __m256i x, y;
+
+  assert (length >= STRCACHE2_LONG_COMPARE);
+  if (length < 32)
+    {
+      __m128i eq;
+      eq = _mm_cmpeq_epi8 (_mm_loadu_si128 ((const __m128i *)xs),
+                           _mm_loadu_si128 ((const __m128i *)ys));
+      eq = _mm_and_si128 (eq,
+                          _mm_cmpeq_epi8 (_mm_loadu_si128 ((const __m128i *)(xs + length - 16)),
+                                          _mm_loadu_si128 ((const __m128i *)(ys + length - 16))));
+      return _mm_movemask_epi8 (eq) == 0xffff;
+    }
+
+  xlast = xs + length - 32;
+  ylast = ys + length - 32;
+  while (xs < xlast)
+    {
+      x = _mm256_loadu_si256 ((const __m256i *)xs);
+      y = _mm256_loadu_si256 ((const __m256i *)ys);
+      if ((unsigned int)_mm256_movemask_epi8 (_mm256_cmpeq_epi8 (x, y)) != 0xffffffffU)
+        return 0;
+      xs += 32;
+      ys += 32;
+    }
+  x = _mm256_loadu_si256 ((const __m256i *)xlast);
+  y = _mm256_loadu_si256 ((const __m256i *)ylast);
+  return (unsigned int)_mm256_movemask_epi8 (_mm256_cmpeq_epi8 (x, y)) == 0xffffffffU;
+}
+#endif /* STRCACHE2_HAVE_AVX2 */
+
+/* Picks the best strcache2_is_equal_long kernel for the CPU we're running on. */
+static void
+strcache2_select_kernels (void)
+{
+#ifdef STRCACHE2_HAVE_SSE2
+  strcache2_is_equal_long = strcache2_is_equal_long_sse2;
+#endif
+#ifdef STRCACHE2_HAVE_AVX2
+  __builtin_cpu_init ();
+  if (__builtin_cpu_supports ("avx2"))
+    strcache2_is_equal_long = strcache2_is_equal_long_avx2;
+#endif
+}
+
 MY_INLINE int
 strcache2_is_equal (struct strcache2 *cache, struct strcache2_entry const *entry,
                     const char *str, unsigned int length, unsigned int hash)
@@ -604,7 +808,10 @@ strcache2_is_equal (struct strcache2 *cache, struct strcache2_entry const *entry
 #if 0
   return memcmp (str, entry + 1, length) == 0;
 #elif 1
-  return strcache2_memcmp_inlined (str, (const char *)(entry + 1), length) == 0;
+  /* The long ones are done by a SIMD kernel if the CPU has one. */
+  if (length < STRCACHE2_LONG_COMPARE)
+    return strcache2_memcmp_inlined (str, (const char *)(entry + 1), length) == 0;
+  return strcache2_is_equal_long (str, (const char *)(entry + 1), length);
 #else
   return strcache2_memcmp_inline_short (str, (const char *)(entry + 1), length) == 0;
 #endif
@@ -637,6 +844,9 @@ strcache2_rehash (struct strcache2 *cache)
 #ifndef STRCACHE2_USE_MASK
   unsigned int hash_shift;
 #endif
+#ifdef STRCACHE2_HAVE_CONCURRENT
+  assert (!cache->concurrent);
+#endif
 
   /* Allocate a new hash table twice the size of the current. */
   cache->hash_size <<= 1;
@@ -702,12 +912,118 @@ strcache2_new_seg (struct strcache2 *cache, unsigned int minlen)
   seg->cursor = seg->start;
   seg->avail  = seg->size;
 
+#ifdef STRCACHE2_HAVE_CONCURRENT
+  /* In concurrent mode each thread allocates its own segments, so it is
+     only the list insertion that needs care. */
+  if (cache->concurrent)
+    {
+      do
+        seg->next = cache->seg_head;
+      while (!strcache2_atomic_cmpxchg_ptr (&cache->seg_head, seg, seg->next));
+      return seg;
+    }
+#endif
   seg->next = cache->seg_head;
   cache->seg_head = seg;
 
   return seg;
 }
 
+#ifdef STRCACHE2_HAVE_CONCURRENT
+/* Searches the hash chain from ENTRY up to (but not including) STOP for
+   the given string.  */
+MY_INLINE struct strcache2_entry *
+strcache2_find_in_chain (struct strcache2 *cache, struct strcache2_entry *entry,
+                         struct strcache2_entry *stop, const char *str,
+                         unsigned int length, unsigned int hash)
+{
+  if (!cache->case_insensitive)
+    {
+      for (; entry != stop; entry = entry->next)
+        if (strcache2_is_equal (cache, entry, str, length, hash))
+          return entry;
+    }
+  else
+    {
+      for (; entry != stop; entry = entry->next)
+        if (strcache2_is_iequal (cache, entry, str, length, hash))
+          return entry;
+    }
+  return NULL;
+}
+
+/* Enters a new string into the cache in concurrent mode.
+
+   The entry is allocated from the segment owned by the calling thread and
+   inserted at the head of the hash chain using compare and exchange.  If
+   that fails, someone else has added one or more entries to the chain
+   since we looked, and we must make sure it isn't the same string before
+   trying again.  STOP is the chain head the caller has already searched,
+   NULL if it has not done so.  Entries are never removed or moved around
+   while in concurrent mode (the rehashing is deferred), so the lookups
+   don't need any locking.  */
+static const char *
+strcache2_enter_string_concurrent (struct strcache2 *cache, unsigned int thrd,
+                                   unsigned int idx, const char *str,
+                                   unsigned int length, unsigned int hash,
+                                   struct strcache2_entry *stop)
+{
+  struct strcache2_entry **slot = &cache->hash_tab[idx];
+  struct strcache2_entry *head;
+  struct strcache2_entry *entry;
+  struct strcache2_seg *seg;
+  unsigned int size;
+  char *str_copy;
+
+  assert (thrd < STRCACHE2_MAX_THREADS);
+
+  /* Allocate space for the string in the thread's own segment, but
+     don't commit the allocation till it has been inserted. */
+
+  size = length + 1 + sizeof (struct strcache2_entry);
+  size = (size + STRCACHE2_ENTRY_ALIGNMENT - 1) & ~(STRCACHE2_ENTRY_ALIGNMENT - 1U);
+
+  seg = cache->thread_segs[thrd];
+  if (MY_PREDICT_FALSE(!seg || seg->avail < size))
+    seg = cache->thread_segs[thrd] = strcache2_new_seg (cache, size);
+
+  entry = (struct strcache2_entry *) seg->cursor;
+  assert (!((size_t)entry & (STRCACHE2_ENTRY_ALIGNMENT - 1)));
+  entry->user = NULL;
+  entry->length = length;
+  entry->hash = hash;
+  str_copy = (char *) memcpy (entry + 1, str, length);
+  str_copy[length] = '\0';
+
+  /* Insert it. */
+
+  for (;;)
+    {
+      struct strcache2_entry *found;
+
+      head = *(struct strcache2_entry * volatile *)slot;
+      found = strcache2_find_in_chain (cache, head, stop, str, length, hash);
+      if (found)
+        return (const char *)(found + 1);
+
+      entry->next = head;
+      if (strcache2_atomic_cmpxchg_ptr (slot, entry, head))
+        break;
+      strcache2_atomic_inc (&cache->concurrent_retry_count);
+      stop = head;
+    }
+
+  seg->cursor += size;
+  seg->avail -= size;
+
+  if (head)
+    strcache2_atomic_inc (&cache->collision_count);
+  strcache2_atomic_inc (&cache->count);
+  strcache2_atomic_inc (&cache->concurrent_add_count);
+  return str_copy;
+}
+#endif /* STRCACHE2_HAVE_CONCURRENT */
+
 /* Internal worker that enters a new string into the cache. */
 static const char *
 strcache2_enter_string (struct strcache2 *cache, unsigned int idx,
@@ -719,6 +1035,12 @@ strcache2_enter_string (struct strcache2 *cache, unsigned int idx,
   unsigned int size;
   char *str_copy;
 
+#ifdef STRCACHE2_HAVE_CONCURRENT
+  /* The main thread is thread 0. */
+  if (MY_PREDICT_FALSE(cache->concurrent))
+    return strcache2_enter_string_concurrent (cache, 0, idx, str, length, hash, NULL);
+#endif
+
   /* Allocate space for the string. */
 
   size = length + 1 + sizeof (struct strcache2_entry);
@@ -757,6 +1079,50 @@ strcache2_enter_string (struct strcache2 *cache, unsigned int idx,
   return str_copy;
 }
 
+#ifdef STRCACHE2_HAVE_CONCURRENT
+/* Adds a string from any thread while the cache is in concurrent mode.
+   THRD identifies the calling thread, 0 is reserved for the main thread. */
+const char *
+strcache2_add_concurrent (struct strcache2 *cache, unsigned int thrd,
+                          const char *str, unsigned int length)
+{
+  struct strcache2_entry *head;
+  struct strcache2_entry const *entry;
+  unsigned int hash = cache->case_insensitive
+                    ? strcache2_case_insensitive_hash (str, length)
+                    : strcache2_case_sensitive_hash (str, length);
+  unsigned int idx;
+
+  assert (cache->concurrent);
+  assert (!memchr (str, '\0', length));
+
+  idx = STRCACHE2_MOD_IT (cache, hash);
+  head = ((struct strcache2_entry * volatile *)cache->hash_tab)[idx];
+  entry = strcache2_find_in_chain (cache, head, NULL, str, length, hash);
+  if (entry)
+    return (const char *)(entry + 1);
+  return strcache2_enter_string_concurrent (cache, thrd, idx, str, length, hash, head);
+}
+
+/* Enters or leaves concurrent mode.
+
+   This must be called by the main thread while no other threads are
+   accessing the cache.  Since rehashing isn't possible in concurrent mode,
+   it is done when leaving it.  */
+void
+strcache2_set_concurrent (struct strcache2 *cache, int enabled)
+{
+  if (enabled)
+    cache->concurrent = 1;
+  else if (cache->concurrent)
+    {
+      cache->concurrent = 0;
+      while (cache->count >= cache->rehash_count)
+        strcache2_rehash (cache);
+    }
+}
+#endif /* STRCACHE2_HAVE_CONCURRENT */
+
 /* The public add string interface. */
 const char *
 strcache2_add (struct strcache2 *cache, const char *str, unsigned int length)
@@ -1117,7 +1483,9 @@ strcache2_init (struct strcache2 *cache, const char *name, unsigned int size,
                 unsigned int def_seg_size, int case_insensitive, int thread_safe)
 {
   unsigned hash_shift;
+#ifndef STRCACHE2_HAVE_CONCURRENT
   assert (!thread_safe);
+#endif
 
   /* calc the size as a power of two */
   if (!size)
@@ -1157,6 +1525,14 @@ strcache2_init (struct strcache2 *cache, const char *name, unsigned int size,
   cache->def_seg_size = def_seg_size;
   cache->lock = NULL;
   cache->name = name;
+#ifdef STRCACHE2_HAVE_CONCURRENT
+  cache->concurrent = 0;
+  cache->concurrent_add_count = 0;
+  cache->concurrent_retry_count = 0;
+  memset (cache->thread_segs, '\0', sizeof (cache->thread_segs));
+#endif
+
+  strcache2_select_kernels ();
 
   /* allocate the hash table and first segment. */
   cache->hash_tab = (struct strcache2_entry **)
@@ -1167,6 +1543,12 @@ strcache2_init (struct strcache2 *cache, const char *name, unsigned int size,
   /* link it */
   cache->next = strcache_head;
   strcache_head = cache;
+
+#ifdef STRCACHE2_HAVE_CONCURRENT
+  /* Thread safe caches start out in concurrent mode. */
+  if (thread_safe)
+    strcache2_set_concurrent (cache, 1);
+#endif
 }
 
 
@@ -1288,6 +1670,11 @@ strcache2_print_stats (struct strcache2 *cache, const char *prefix)
             cache->collision_3rd_count,  (unsigned int)((100.0 * cache->collision_3rd_count) / cache->lookup_count));
   printf (_("\n%s  hash insert collisions = %u (%u%%)\n"),
           prefix, cache->collision_count,(unsigned int)((100.0 * cache->collision_count) / cache->count));
+#ifdef STRCACHE2_HAVE_CONCURRENT
+  if (cache->concurrent_add_count)
+    printf (_("%s  concurrent inserts = %u  compare and exchange retries = %u\n"),
+            prefix, cache->concurrent_add_count, cache->concurrent_retry_count);
+#endif
   printf (_("%s  %5u (%u%%) empty hash table slots\n"),
           prefix, chain_depths[0],       (unsigned int)((100.0 * chain_depths[0])  / cache->hash_size));
   printf (_("%s  %5u (%u%%) occupied hash table slots\n"),
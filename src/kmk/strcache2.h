@@ -32,6 +32,15 @@
 
 #define STRCACHE2_USE_MASK 1
 
+/* Concurrent mode needs atomic compare and exchange. */
+#if defined (_MSC_VER) \
+ || (defined (__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 1)))
+# define STRCACHE2_HAVE_CONCURRENT
+#endif
+/* The max number of threads adding strings in concurrent mode. Thread 0 is
+   the main thread. */
+#define STRCACHE2_MAX_THREADS   32
+
 /* string cache memory segment. */
 struct strcache2_seg
 {
@@ -87,7 +96,13 @@ struct strcache2
     unsigned int hash_size;             /* The hash table size. */
     unsigned int def_seg_size;          /* The default segment size. */
     void *lock;                         /* The lock handle. */
-    struct strcache2_seg *seg_head;     /* The memory segment list. */
+    struct strcache2_seg * volatile seg_head; /* The memory segment list. */
+#ifdef STRCACHE2_HAVE_CONCURRENT
+    int concurrent;                     /* Concurrent mode, see strcache2_set_concurrent. */
+    unsigned int concurrent_add_count;  /* The number of strings added in concurrent mode. */
+    unsigned int concurrent_retry_count;/* The number of failed compare and exchanges. */
+    struct strcache2_seg *thread_segs[STRCACHE2_MAX_THREADS]; /* Per thread segment. */
+#endif
     struct strcache2 *next;             /* The next string cache. */
     const char *name;                   /* Cache name. */
 };
@@ -115,6 +130,11 @@ const char *strcache2_ilookup (struct strcache2 *cache, const char *str, unsigne
 # define strcache2_add_hashed_file  strcache2_add_hashed
 # define strcache2_lookup_file      strcache2_lookup
 #endif
+#ifdef STRCACHE2_HAVE_CONCURRENT
+void strcache2_set_concurrent (struct strcache2 *cache, int enabled);
+const char *strcache2_add_concurrent (struct strcache2 *cache, unsigned int thrd,
+                                      const char *str, unsigned int length);
+#endif
 int strcache2_is_cached (struct strcache2 *cache, const char *str);
 int strcache2_verify_entry (struct strcache2 *cache, const char *str);
 unsigned int strcache2_get_hash2_fallback (struct strcache2 *cache, const char *str);
@@ -0,0 +1,227 @@
+/* $Id$ */
+/** @file
+ * strcache2bench - Standalone benchmark for the strcache2 hashing and compares.
+ *
+ * Reads one or more files, typically the database dump of a real kmk run
+ * (kmk -p), and interns every word in them into a string cache.  The time
+ * it takes to hash the words, to add them and to look them up again is
+ * printed together with the usual strcache2 statistics, so different hash
+ * functions and compare kernels can be compared on the same input.
+ *
+ * Usage: strcache2bench [-r rounds] file [file2 [..]]
+ */
+
+/*
+ * Copyright (c) 2026 The kBuild contributors
+ *
+ * This file is part of kBuild.
+ *
+ * kBuild is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * kBuild is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with kBuild.  If not, see <http://www.gnu.org/licenses/>
+ *
+ */
+
+/*******************************************************************************
+*   Header Files                                                               *
+*******************************************************************************/
+#include "make.h"
+#include "strcache2.h"
+
+#include <assert.h>
+#ifdef WINDOWS32
+# include <Windows.h>
+#endif
+
+
+/*******************************************************************************
+*   Structures and Typedefs                                                    *
+*******************************************************************************/
+/* A word from the input files. */
+struct bench_word
+{
+  const char *str;
+  unsigned int len;
+};
+
+
+/*******************************************************************************
+*   Global Variables                                                           *
+*******************************************************************************/
+/* The words to intern, duplicates included. */
+static struct bench_word *bench_words;
+static unsigned int bench_word_count;
+static unsigned int bench_word_max;
+/* Where the hash sum goes so the hashing isn't optimized away. */
+static volatile unsigned int bench_hash_sum;
+
+
+/* strcache2.c only needs this one from misc.c. */
+
+void *
+xmalloc (unsigned int size)
+{
+  void *pv = malloc (size ? size : 1);
+  if (!pv)
+    {
+      fprintf (stderr, "strcache2bench: out of memory (%u bytes)\n", size);
+      exit (2);
+    }
+  return pv;
+}
+
+/* Get a nanosecond timestamp, see nano_timestamp in misc.c. */
+
+static big_int
+bench_timestamp (void)
+{
+#if defined (WINDOWS32)
+  LARGE_INTEGER freq;
+  LARGE_INTEGER pc;
+  QueryPerformanceFrequency (&freq);
+  QueryPerformanceCounter (&pc);
+  return (big_int)((long double)pc.QuadPart / (long double)freq.QuadPart * 1000000000);
+#elif HAVE_CLOCK_GETTIME && defined (CLOCK_MONOTONIC)
+  struct timespec tp;
+  clock_gettime (CLOCK_MONOTONIC, &tp);
+  return (big_int)tp.tv_sec * 1000000000 + tp.tv_nsec;
+#else
+  struct timeval tv;
+  gettimeofday (&tv, NULL);
+  return (big_int)tv.tv_sec * 1000000000 + tv.tv_usec * 1000;
+#endif
+}
+
+/* Reads FILENAME into memory and adds its words to the list. */
+
+static int
+bench_read_file (const char *filename)
+{
+  FILE *file = fopen (filename, "rb");
+  char *buf;
+  char *cur;
+  char *end;
+  long size;
+
+  if (!file)
+    {
+      perror (filename);
+      return 1;
+    }
+  fseek (file, 0, SEEK_END);
+  size = ftell (file);
+  fseek (file, 0, SEEK_SET);
+  buf = xmalloc (size + 1);
+  if (fread (buf, 1, size, file) != (size_t)size)
+    {
+      perror (filename);
+      fclose (file);
+      return 1;
+    }
+  fclose (file);
+  buf[size] = '\0';
+
+  /* Split it into words, the buffer is never freed. */
+  cur = buf;
+  end = buf + size;
+  while (cur < end)
+    {
+      char *start;
+      while (cur < end && isspace ((unsigned char)*cur))
+        cur++;
+      start = cur;
+      while (cur < end && !isspace ((unsigned char)*cur) && *cur)
+        cur++;
+      if (cur == start)
+        {
+          cur++;
+          continue;
+        }
+
+      if (bench_word_count >= bench_word_max)
+        {
+          bench_word_max = bench_word_max ? bench_word_max * 2 : 65536;
+          bench_words = realloc (bench_words, bench_word_max * sizeof (bench_words[0]));
+          if (!bench_words)
+            xmalloc (~0U);
+        }
+      bench_words[bench_word_count].str = start;
+      bench_words[bench_word_count].len = (unsigned int)(cur - start);
+      bench_word_count++;
+    }
+  return 0;
+}
+
+/* Prints the time ELAPSED spent on COUNT strings. */
+
+static void
+bench_print (const char *what, big_int elapsed, unsigned long count)
+{
+  printf ("%-8s %10lu strings in %8lu us, %6.1f ns per string\n", what, count,
+          (unsigned long)(elapsed / 1000), (double)elapsed / count);
+}
+
+int
+main (int argc, char **argv)
+{
+  struct strcache2 cache;
+  unsigned int rounds = 20;
+  unsigned int round;
+  unsigned int i;
+  unsigned int found = 0;
+  unsigned int sum = 0;
+  big_int start;
+  int rc = 0;
+
+  for (i = 1; i < (unsigned int)argc; i++)
+    {
+      if (!strcmp (argv[i], "-r") && i + 1 < (unsigned int)argc)
+        rounds = atoi (argv[++i]);
+      else
+        rc |= bench_read_file (argv[i]);
+    }
+  if (rc || !bench_word_count || !rounds)
+    {
+      fprintf (stderr, "usage: strcache2bench [-r rounds] file [file2 [..]]\n");
+      return 1;
+    }
+
+  /* The hash function alone. */
+  start = bench_timestamp ();
+  for (round = 0; round < rounds; round++)
+    for (i = 0; i < bench_word_count; i++)
+      {
+        unsigned int hash2;
+        sum += strcache2_hash_str (bench_words[i].str, bench_words[i].len, &hash2);
+      }
+  bench_print ("hash", bench_timestamp () - start, (unsigned long)rounds * bench_word_count);
+
+  /* Adding them, mostly duplicates. */
+  strcache2_init (&cache, "bench", 0, 0, 0, 0);
+  start = bench_timestamp ();
+  for (i = 0; i < bench_word_count; i++)
+    strcache2_add (&cache, bench_words[i].str, bench_words[i].len);
+  bench_print ("add", bench_timestamp () - start, bench_word_count);
+
+  /* Looking them up, this is where the compares are. */
+  start = bench_timestamp ();
+  for (round = 0; round < rounds; round++)
+    for (i = 0; i < bench_word_count; i++)
+      found += strcache2_lookup (&cache, bench_words[i].str, bench_words[i].len) != NULL;
+  bench_print ("lookup", bench_timestamp () - start, (unsigned long)rounds * bench_word_count);
+  assert (found == rounds * bench_word_count);
+
+  strcache2_print_stats (&cache, "#");
+  strcache2_term (&cache);
+  bench_hash_sum = sum;
+  return 0;
+}
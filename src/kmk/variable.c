@@ -62,10 +62,24 @@ create_pattern_var (const char *target, const char *suffix)
   p->target = target;
   p->len = strlen (target);
   p->suffix = suffix + 1;
+#ifdef CONFIG_WITH_COMPILER
+  p->variable.expand_count = 0;
+  p->variable.expandprog = 0;
+#endif
 
   return p;
 }
 
+#ifdef CONFIG_WITH_MAKEFILE_SNAPSHOT
+/* Returns the head of the pattern-specific variable chain.  */
+
+struct pattern_var *
+pattern_var_list (void)
+{
+  return pattern_vars;
+}
+#endif
+
 /* Look up a target in the pattern-specific variable list.  */
 
 static struct pattern_var *
@@ -165,6 +179,35 @@ static struct variable_set global_variable_set;
 static struct variable_set_list global_setlist
   = { 0, &global_variable_set };
 struct variable_set_list *current_variable_set_list = &global_setlist;
+
+#ifdef CONFIG_WITH_VARIABLE_SET_BLOOM
+/* Mixes the strcache pointer hash of a variable name for the variable set
+   Bloom filters.  The two bit numbers are taken from the upper 16 bits,
+   which are the well mixed ones.  */
+MY_INLINE unsigned int
+variable_set_bloom_mix (unsigned int ptr_hash)
+{
+  return ptr_hash * 0x9e3779b1U;
+}
+
+/* Records the name with the mixed hash BLOOM in the filter of SET.  */
+MY_INLINE void
+variable_set_bloom_add (struct variable_set *set, unsigned int bloom)
+{
+  set->bloom[bloom >> 29]       |= 1U << ((bloom >> 24) & 31);
+  set->bloom[(bloom >> 21) & 7] |= 1U << ((bloom >> 16) & 31);
+}
+
+/* Returns 0 if the name with the mixed hash BLOOM was never added to SET,
+   1 if it might have been.  */
+MY_INLINE unsigned int
+variable_set_bloom_test (const struct variable_set *set, unsigned int bloom)
+{
+  return (set->bloom[bloom >> 29]       >> ((bloom >> 24) & 31))
+       & (set->bloom[(bloom >> 21) & 7] >> ((bloom >> 16) & 31))
+       & 1;
+}
+#endif /* CONFIG_WITH_VARIABLE_SET_BLOOM */
 
 /* Implement variables.  */
 
@@ -179,6 +222,10 @@ init_hash_global_variable_set (void)
   hash_init_strcached (&global_variable_set.table, VARIABLE_BUCKETS,
                        &variable_strcache, offsetof (struct variable, name));
 #endif /* CONFIG_WITH_STRCACHE2 */
+#ifdef CONFIG_WITH_HASH_TAGS
+  /* Only the global set; lookup_cached_variable probes the others itself. */
+  hash_enable_tags (&global_variable_set.table);
+#endif
 }
 
 /* Define variable named NAME with value VALUE in SET.  VALUE is copied.
@@ -288,6 +335,7 @@ define_variable_in_set (const char *name, unsigned int length,
             free (v->value);
 	  v->value = xstrdup (value);
 #endif /* !CONFIG_WITH_VALUE_LENGTH */
+          VARIABLE_CHANGED (v);
           if (flocp != 0)
             v->fileinfo = *flocp;
           else
@@ -313,6 +361,10 @@ define_variable_in_set (const char *name, unsigned int length,
 #endif
   v->length = length;
   hash_insert_at (&set->table, v, var_slot);
+#ifdef CONFIG_WITH_VARIABLE_SET_BLOOM
+  variable_set_bloom_add (set, variable_set_bloom_mix (
+    strcache2_calc_ptr_hash (&variable_strcache, name)));
+#endif
 #ifdef CONFIG_WITH_VALUE_LENGTH
   if (value_len == ~0U)
     value_len = strlen (value);
@@ -353,6 +405,10 @@ define_variable_in_set (const char *name, unsigned int length,
   v->export = v_default;
   MAKE_STATS_2(v->changes = 0);
   MAKE_STATS_2(v->reallocs = 0);
+#ifdef CONFIG_WITH_COMPILER
+  v->expand_count = 0;
+  v->expandprog = 0;
+#endif
 
   v->exportable = 1;
   if (*name != '_' && (*name < 'A' || *name > 'Z')
@@ -470,6 +526,7 @@ lookup_special_var (struct variable *var)
          the list is up to date or needs to be recomputed.  */
 
       last_var_count = global_variable_set.table.ht_fill;
+      VARIABLE_CHANGED (var);
     }
 
   return var;
@@ -486,6 +543,9 @@ lookup_cached_variable (const char *name)
   unsigned int hash_2;
   unsigned int idx;
   struct variable *v;
+#ifdef CONFIG_WITH_VARIABLE_SET_BLOOM
+  unsigned int bloom;
+#endif
 
   /* first set, first entry, both unrolled. */
 
@@ -499,10 +559,22 @@ lookup_cached_variable (const char *name)
     }
 
   hash_1 = strcache2_calc_ptr_hash (&variable_strcache, name);
-  ht = &setlist->set->table;
-  MAKE_STATS (ht->ht_lookups++);
-  idx = hash_1 & (ht->ht_size - 1);
-  v = ht->ht_vec[idx];
+#ifdef CONFIG_WITH_VARIABLE_SET_BLOOM
+  /* The hash_2 calculation touches the string entry, so it is put off
+     until a set actually has a collision.  */
+  bloom = variable_set_bloom_mix (hash_1);
+  hash_2 = 0;
+  if (!variable_set_bloom_test (setlist->set, bloom))
+    v = 0;
+  else
+#endif
+    {
+      ht = &setlist->set->table;
+      MAKE_STATS (ht->ht_lookups++);
+      MAKE_STATS (ht->ht_probes++);
+      idx = hash_1 & (ht->ht_size - 1);
+      v = ht->ht_vec[idx];
+    }
   if (v != 0)
     {
       if (   (void *)v != hash_deleted_item
@@ -517,6 +589,7 @@ lookup_cached_variable (const char *name)
           idx &= (ht->ht_size - 1);
           v = (struct variable *) ht->ht_vec[idx];
           MAKE_STATS (ht->ht_collisions++); /* there are hardly any deletions, so don't bother with not counting deleted clashes. */
+          MAKE_STATS (ht->ht_probes++);
 
           if (v == 0)
             break;
@@ -525,8 +598,10 @@ lookup_cached_variable (const char *name)
             return MY_PREDICT_FALSE (v->special) ? lookup_special_var (v) : v;
         } /* inner collision loop */
     }
+#ifndef CONFIG_WITH_VARIABLE_SET_BLOOM
   else
     hash_2 = strcache2_get_hash (&variable_strcache, name) | 1;
+#endif
 
 
   /* The other sets, if any. */
@@ -543,9 +618,18 @@ lookup_cached_variable (const char *name)
           return 0;
         }
 
+#ifdef CONFIG_WITH_VARIABLE_SET_BLOOM
+      if (!variable_set_bloom_test (setlist->set, bloom))
+        {
+          setlist = setlist->next;
+          continue;
+        }
+#endif
+
       /* first iteration unrolled */
       ht = &setlist->set->table;
       MAKE_STATS (ht->ht_lookups++);
+      MAKE_STATS (ht->ht_probes++);
       idx = hash_1 & (ht->ht_size - 1);
       v = ht->ht_vec[idx];
       if (v != 0)
@@ -555,12 +639,17 @@ lookup_cached_variable (const char *name)
             return MY_PREDICT_FALSE (v->special) ? lookup_special_var (v) : v;
 
           /* the rest of the loop  */
+#ifdef CONFIG_WITH_VARIABLE_SET_BLOOM
+          if (!hash_2)
+            hash_2 = strcache2_get_hash (&variable_strcache, name) | 1;
+#endif
           for (;;)
             {
               idx += hash_2;
               idx &= (ht->ht_size - 1);
               v = (struct variable *) ht->ht_vec[idx];
               MAKE_STATS (ht->ht_collisions++); /* see reason above */
+              MAKE_STATS (ht->ht_probes++);
 
               if (v == 0)
                 break;
@@ -713,6 +802,23 @@ lookup_variable (const char *name, unsigned int length)
 #endif
 }
 
+#ifdef CONFIG_WITH_COMPILER
+/* Lookup a variable whose name is the variable_strcache entry NAME.
+   The expansion programs resolve the names when they're compiled.  */
+
+struct variable *
+lookup_variable_strcached (const char *name)
+{
+# ifdef KMK
+  struct variable *v = lookup_cached_variable (name);
+  assert (lookup_variable_for_assert (name, strcache2_get_len (&variable_strcache, name)) == v);
+  return v;
+# else
+  return lookup_variable (name, strcache2_get_len (&variable_strcache, name));
+# endif
+}
+#endif /* CONFIG_WITH_COMPILER */
+
 /* Lookup a variable whose name is a string starting at NAME
    and with LENGTH chars in set SET.  NAME need not be null-terminated.
    Returns address of the `struct variable' containing all info
@@ -745,6 +851,12 @@ lookup_variable_in_set (const char *name, unsigned int length,
       return v;
     }
 
+#ifdef CONFIG_WITH_VARIABLE_SET_BLOOM
+  if (!variable_set_bloom_test (set, variable_set_bloom_mix (
+          strcache2_calc_ptr_hash (&variable_strcache, cached_name))))
+    return NULL;
+#endif
+
   var_key.name = cached_name;
   var_key.length = length;
 
@@ -786,6 +898,9 @@ initialize_file_variables (struct file *file, int reading)
       hash_init_strcached (&l->set->table, PERFILE_VARIABLE_BUCKETS,
                            &variable_strcache, offsetof (struct variable, name));
 #endif /* CONFIG_WITH_STRCACHE2 */
+#ifdef CONFIG_WITH_VARIABLE_SET_BLOOM
+      memset (l->set->bloom, 0, sizeof (l->set->bloom));
+#endif
       file->variables = l;
     }
 
@@ -897,6 +1012,9 @@ create_new_variable_set (void)
   hash_init_strcached (&set->table, SMALL_SCOPE_VARIABLE_BUCKETS,
                        &variable_strcache, offsetof (struct variable, name));
 #endif /* CONFIG_WITH_STRCACHE2 */
+#ifdef CONFIG_WITH_VARIABLE_SET_BLOOM
+  memset (set->bloom, 0, sizeof (set->bloom));
+#endif
 
 #ifndef CONFIG_WITH_ALLOC_CACHES
   setlist = (struct variable_set_list *)
@@ -922,6 +1040,7 @@ free_variable_name_and_value (const void *item)
   if (!v->rdonly_val)
 #endif
     free (v->value);
+  VARIABLE_CHANGED (v);
 }
 
 void
@@ -1026,11 +1145,18 @@ merge_variable_sets (struct variable_set *to_set,
                                                            *from_var_slot);
 #endif /* CONFIG_WITH_STRCACHE2 */
 	if (HASH_VACANT (*to_var_slot))
-	  hash_insert_at (&to_set->table, from_var, to_var_slot);
+	  {
+	    hash_insert_at (&to_set->table, from_var, to_var_slot);
+#ifdef CONFIG_WITH_VARIABLE_SET_BLOOM
+	    variable_set_bloom_add (to_set, variable_set_bloom_mix (
+	      strcache2_calc_ptr_hash (&variable_strcache, from_var->name)));
+#endif
+	  }
 	else
 	  {
 	    /* GKM FIXME: delete in from_set->table */
 	    free (from_var->value);
+	    VARIABLE_CHANGED (from_var);
 	    free (from_var);
 	  }
       }
@@ -1199,6 +1325,7 @@ define_automatic_variables (void)
   && defined (CONFIG_WITH_LOOP_FUNCTIONS) \
   && defined (CONFIG_WITH_ROOT_FUNC) \
   && defined (CONFIG_WITH_STRING_FUNCTIONS) \
+  && defined (CONFIG_WITH_SHELL_CACHE) \
   && defined (KMK_HELPERS)
   (void) define_variable ("KMK_FEATURES", 12,
                           "append-dash-n abspath includedep-queue"
@@ -1225,6 +1352,7 @@ define_automatic_variables (void)
                           " for while"
                           " root"
                           " length insert pos lastpos substr translate"
+                          " shell-cached"
                           " kb-src-tool kb-obj-base kb-obj-suff kb-src-prop kb-src-one kb-exp-tmpl "
                           , o_default, 0);
 # else /* MSC can't deal with strings mixed with #if/#endif, thus the slow way. */
@@ -1299,6 +1427,9 @@ define_automatic_variables (void)
 #  if defined (CONFIG_WITH_STRING_FUNCTIONS)
   strcat (buf, " length insert pos lastpos substr translate");
 #  endif
+#  if defined (CONFIG_WITH_SHELL_CACHE)
+  strcat (buf, " shell-cached");
+#  endif
 #  if defined (KMK_HELPERS)
   strcat (buf, " kb-src-tool kb-obj-base kb-obj-suff kb-src-prop kb-src-one kb-exp-tmpl");
 #  endif
@@ -1355,6 +1486,7 @@ define_automatic_variables (void)
 	  free(shell->value);
 	  shell->value = xstrdup (default_shell);
 	  shell->origin = o_default;
+	  VARIABLE_CHANGED (shell);
 	}
 
     /* Some people do not like cmd to be used as the default
@@ -1411,6 +1543,7 @@ define_automatic_variables (void)
       v->value_length = strlen (v->value);
       v->value_alloc_len = v->value_length + 1;
 # endif
+      VARIABLE_CHANGED (v);
     }
 #endif
 
@@ -1701,6 +1834,7 @@ void append_string_to_variable (struct variable *v, const char *value, unsigned
   else
     memcpy (v->value, value, value_len + 1);
   v->value_length = new_value_len;
+  VARIABLE_CHANGED (v);
 }
 
 static struct variable *
@@ -105,14 +105,47 @@ struct variable
 #ifdef CONFIG_WITH_MAKE_STATS
     unsigned int changes;
     unsigned int reallocs;
+#endif
+#ifdef CONFIG_WITH_COMPILER
+    unsigned int expand_count:2;  /* Expansions since the last change.  */
+    struct expand_prog *expandprog; /* The compiled value, see expand.c.  */
 #endif
   };
 
+#ifdef CONFIG_WITH_COMPILER
+# if !defined (CONFIG_WITH_VALUE_LENGTH) || !defined (CONFIG_WITH_STRCACHE2)
+#  error "CONFIG_WITH_COMPILER requires CONFIG_WITH_VALUE_LENGTH and CONFIG_WITH_STRCACHE2"
+# endif
+/* Must be used whenever the value of a variable is changed so that the
+   expansion program compiled from the old value is dropped.  */
+# define VARIABLE_CHANGED(v) \
+    do { \
+        if (MY_PREDICT_FALSE ((v)->expandprog != 0)) \
+          variable_expand_prog_changed (v); \
+        (v)->expand_count = 0; \
+    } while (0)
+#else
+# define VARIABLE_CHANGED(v) do { } while (0)
+#endif
+
+#ifdef CONFIG_WITH_VARIABLE_SET_BLOOM
+# if !defined (KMK) || !defined (CONFIG_WITH_STRCACHE2)
+#  error "CONFIG_WITH_VARIABLE_SET_BLOOM requires KMK and CONFIG_WITH_STRCACHE2"
+# endif
+/* The number of 32-bit words in the Bloom filter of a variable set.  */
+# define VARIABLE_SET_BLOOM_WORDS 8
+#endif
+
 /* Structure that represents a variable set.  */
 
 struct variable_set
   {
     struct hash_table table;	/* Hash table of variables.  */
+#ifdef CONFIG_WITH_VARIABLE_SET_BLOOM
+    /* Two bits are set for each name ever added to the table so lookups can
+       pass over sets that cannot hold a name without probing the table.  */
+    unsigned int bloom[VARIABLE_SET_BLOOM_WORDS];
+#endif
   };
 
 /* Structure that represents a list of variable sets.  */
@@ -285,6 +318,18 @@ may_be_function_name (const char *name, const char *eos)
   return 0;
 }
 #endif /* CONFIG_WITH_VALUE_LENGTH */
+#ifdef CONFIG_WITH_COMPILER
+typedef char *(*make_function_ptr_t) (char *, char **, const char *);
+int lookup_function_for_compiler (const char *name, unsigned int len,
+                                  make_function_ptr_t *func_ptrp,
+                                  unsigned char *minargsp, unsigned char *maxargsp,
+                                  char *expargsp, const char **funcnamep);
+char *find_next_argument (char startparen, char endparen,
+                          const char *ptr, const char *end);
+# ifdef CONFIG_WITH_EXPAND_PROFILER
+int is_func_call (make_function_ptr_t func_ptr);
+# endif
+#endif
 
 /* expand.c */
 #ifndef CONFIG_WITH_VALUE_LENGTH
@@ -295,6 +340,12 @@ char *recursively_expand_for_file (struct variable *v, struct file *file,
                                    unsigned int *value_lenp);
 #define recursively_expand(v)   recursively_expand_for_file (v, NULL, NULL)
 #endif
+#ifdef CONFIG_WITH_COMPILER
+void variable_expand_prog_changed (struct variable *v);
+# ifdef CONFIG_WITH_PRINT_STATS_SWITCH
+void print_expand_prog_stats (void);
+# endif
+#endif
 
 /* variable.c */
 struct variable_set_list *create_new_variable_set (void);
@@ -340,6 +391,9 @@ struct variable *try_variable_definition (const struct floc *flocp, char *line,
 void init_hash_global_variable_set (void);
 void hash_init_function_table (void);
 struct variable *lookup_variable (const char *name, unsigned int length);
+#ifdef CONFIG_WITH_COMPILER
+struct variable *lookup_variable_strcached (const char *name);
+#endif
 struct variable *lookup_variable_in_set (const char *name, unsigned int length,
                                          const struct variable_set *set);
 
@@ -431,6 +485,9 @@ char **target_environment (struct file *file);
 
 struct pattern_var *create_pattern_var (const char *target,
                                         const char *suffix);
+#ifdef CONFIG_WITH_MAKEFILE_SNAPSHOT
+struct pattern_var *pattern_var_list (void);
+#endif
 
 extern int export_all_variables;
 #ifdef CONFIG_WITH_STRCACHE2
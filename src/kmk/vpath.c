@@ -22,6 +22,10 @@ this program.  If not, see <http://www.gnu.org/licenses/>.  */
 #ifdef WINDOWS32
 #include "pathstuff.h"
 #endif
+#ifdef CONFIG_WITH_VPATH_CACHE
+# include <assert.h>
+# include <stddef.h>
+#endif
 
 
 /* Structure used to represent a selective VPATH searchpath.  */
@@ -47,6 +51,70 @@ static struct vpath *general_vpath;
 /* Structure for GPATH given in the variable.  */
 
 static struct vpath *gpaths;
+
+#ifdef CONFIG_WITH_VPATH_CACHE
+# ifndef CONFIG_WITH_STRCACHE2
+#  error "CONFIG_WITH_VPATH_CACHE requires CONFIG_WITH_STRCACHE2"
+# endif
+
+/* The vpath search cache.
+
+   The same names are looked up in the same search paths over and over, and
+   most probes miss.  The cache remembers where vpath_search can resume for
+   each name: every directory before that point was a clean miss, i.e. no
+   file by that name in the data base and none in the cached directory
+   contents.  A name that was found resumes at the directory it was found in,
+   which is probed as usual, so the result and the modtime are as fresh as
+   without the cache.  A name that wasn't found anywhere is answered without
+   probing at all.
+
+   A clean miss stays one until a file with that name is entered into the
+   data base, which drops the entry of the name searched for (see
+   vpath_cache_file_entered), or until the vpath lists change or a directory
+   is read again, which drop all entries.  Files that are removed or made
+   impossible only turn more probes into misses.  */
+
+struct vpath_cache_entry
+  {
+    const char *file;           /* The name searched for, the strcached key.  */
+    struct vpath *path;         /* Where to resume, NULL if nowhere.  */
+    unsigned int idx;           /* The searchpath index in PATH.  */
+  };
+
+/* The search path directories as lookup_file sees them: a leading "./" is
+   stripped and the trailing slash is left off unless it's all there is.  */
+
+struct vpath_cache_dir
+  {
+    const char *name;
+    unsigned int len;
+    const char *searchpath;     /* The searchpath entry it came from.  */
+  };
+
+static struct hash_table vpath_cache;
+static struct vpath_cache_dir *vpath_cache_dirs;
+static unsigned int vpath_cache_num_dirs;
+
+/* Statistics.  */
+static unsigned long vpath_stat_searches;
+static unsigned long vpath_stat_misses;
+static unsigned long vpath_stat_resumed;
+static unsigned long vpath_stat_probes;
+static unsigned long vpath_stat_dropped;
+static unsigned int vpath_stat_flushes;
+
+static void vpath_cache_init_dirs (void);
+
+/* Returns the search path after V in the order vpath_search tries them.  */
+
+static struct vpath *
+next_vpath (struct vpath *v)
+{
+  if (v == general_vpath)
+    return 0;
+  return v->next ? v->next : general_vpath;
+}
+#endif /* CONFIG_WITH_VPATH_CACHE */
 
 
 /* Reverse the chain of selective VPATH lists so they will be searched in the
@@ -63,6 +131,10 @@ build_vpath_lists ()
   char expr[64];
 #endif 
 
+#ifdef CONFIG_WITH_VPATH_CACHE
+  vpath_cache_flush ();
+#endif
+
   /* Reverse the chain.  */
   for (old = vpaths; old != 0; old = nexto)
     {
@@ -179,6 +251,10 @@ construct_vpath_list (char *pattern, char *dirpath)
   if (pattern != 0)
     percent = find_percent (pattern);
 
+#ifdef CONFIG_WITH_VPATH_CACHE
+  vpath_cache_flush ();
+#endif
+
   if (dirpath == 0)
     {
       /* Remove matching listings.  */
@@ -310,6 +386,56 @@ construct_vpath_list (char *pattern, char *dirpath)
     free (vpath);
 }
 
+#ifdef CONFIG_WITH_MAKEFILE_SNAPSHOT
+/* Calls FUNC for each selective VPATH in the (not yet reversed) VPATHS
+   chain.  Returns the number of entries.  Used by snapshot_save.  */
+
+unsigned int
+enum_vpath_lists (void (*func) (const char *, const char *, const char **, void *),
+                  void *arg)
+{
+  struct vpath *path;
+  unsigned int count = 0;
+
+  for (path = vpaths; path != 0; path = path->next, count++)
+    func (path->pattern, path->percent, path->searchpath, arg);
+  return count;
+}
+
+/* Puts a selective VPATH at the head of the VPATHS chain the same way
+   construct_vpath_list does.  PATTERN is cached, PERCENT points into it and
+   SEARCHPATH is a null-terminated xmalloc'ed list that we take ownership of.
+   Used by snapshot_load.  */
+
+void
+add_vpath_list (const char *pattern, const char *percent, const char **searchpath)
+{
+  struct vpath *path = xmalloc (sizeof (struct vpath));
+  unsigned int maxlen = 0;
+  unsigned int i;
+
+#ifdef CONFIG_WITH_VPATH_CACHE
+  vpath_cache_flush ();
+#endif
+
+  for (i = 0; searchpath[i] != 0; i++)
+    {
+      unsigned int len = strlen (searchpath[i]);
+      searchpath[i] = dir_name (searchpath[i]);
+      if (len > maxlen)
+        maxlen = len;
+    }
+
+  path->searchpath = searchpath;
+  path->maxlen = maxlen;
+  path->next = vpaths;
+  vpaths = path;
+  path->pattern = pattern;
+  path->patlen = strlen (pattern);
+  path->percent = percent;
+}
+
+#endif /* CONFIG_WITH_MAKEFILE_SNAPSHOT */
 /* Search the GPATH list for a pathname string that matches the one passed
    in.  If it is found, return 1.  Otherwise we return 0.  */
 
@@ -330,11 +456,22 @@ gpath_search (const char *file, unsigned int len)
 /* Search the given VPATH list for a directory where the name pointed to by
    FILE exists.  If it is found, we return a cached name of the existing file
    and set *MTIME_PTR (if MTIME_PTR is not NULL) to its modtime (or zero if no
-   stat call was done).  Otherwise we return NULL.  */
+   stat call was done).  Otherwise we return NULL.
 
+   With the vpath cache the search starts at entry START, and *RESUME_PTR is
+   set to the first entry that wasn't a clean miss unless it's already set
+   (i.e. not ~0U).  */
+
+#ifndef CONFIG_WITH_VPATH_CACHE
 static const char *
 selective_vpath_search (struct vpath *path, const char *file,
                         FILE_TIMESTAMP *mtime_ptr)
+#else
+static const char *
+selective_vpath_search (struct vpath *path, const char *file,
+                        FILE_TIMESTAMP *mtime_ptr, unsigned int start,
+                        unsigned int *resume_ptr)
+#endif
 {
   int not_target;
   char *name;
@@ -380,9 +517,16 @@ selective_vpath_search (struct vpath *path, const char *file,
   name = alloca (maxvpath + 1 + name_dplen + 1 + flen + 1);
 
   /* Try each VPATH entry.  */
+#ifndef CONFIG_WITH_VPATH_CACHE
   for (i = 0; vpath[i] != 0; ++i)
+#else
+  for (i = start; vpath[i] != 0; ++i)
+#endif
     {
       int exists_in_cache = 0;
+#ifdef CONFIG_WITH_VPATH_CACHE
+      int mentioned = 0;
+#endif
       char *p;
 
       p = name;
@@ -443,6 +587,9 @@ selective_vpath_search (struct vpath *path, const char *file,
 	struct file *f = lookup_file (name);
 	if (f != 0)
           {
+#ifdef CONFIG_WITH_VPATH_CACHE
+            mentioned = 1;
+#endif
             exists = not_target || f->is_target;
             if (exists && mtime_ptr
                 && (f->last_mtime == OLD_MTIME || f->last_mtime == NEW_MTIME))
@@ -472,6 +619,12 @@ selective_vpath_search (struct vpath *path, const char *file,
 #endif
 	}
 
+#ifdef CONFIG_WITH_VPATH_CACHE
+      vpath_stat_probes++;
+      if (*resume_ptr == ~0U && (mentioned || exists_in_cache))
+        *resume_ptr = i;
+#endif
+
       if (exists)
 	{
 	  /* The file is in the directory cache.
@@ -531,6 +684,15 @@ const char *
 vpath_search (const char *file, FILE_TIMESTAMP *mtime_ptr)
 {
   struct vpath *v;
+#ifdef CONFIG_WITH_VPATH_CACHE
+  struct vpath_cache_entry key;
+  struct vpath_cache_entry **slot;
+  struct vpath_cache_entry *entry = 0;
+  struct vpath *resume_path = 0;
+  unsigned int resume_idx = ~0U;
+  unsigned int start = 0;
+  const char *found = 0;
+#endif
 
   /* If there are no VPATH entries or FILENAME starts at the root,
      there is nothing we can do.  */
@@ -542,6 +704,70 @@ vpath_search (const char *file, FILE_TIMESTAMP *mtime_ptr)
       || (vpaths == 0 && general_vpath == 0))
     return 0;
 
+#ifdef CONFIG_WITH_VPATH_CACHE
+  vpath_stat_searches++;
+  if (!vpath_cache.ht_vec)
+    hash_init_strcached (&vpath_cache, 1024, &file_strcache,
+                         offsetof (struct vpath_cache_entry, file));
+  if (!vpath_cache_dirs)
+    vpath_cache_init_dirs ();
+
+  /* Only names in the strcache can have an entry.  */
+  key.file = strcache2_lookup_file (&file_strcache, file, strlen (file));
+  if (key.file)
+    {
+      entry = hash_find_item_strcached (&vpath_cache, &key);
+      if (entry && !entry->path)
+        {
+          vpath_stat_misses++;
+          return 0;
+        }
+    }
+
+  if (entry)
+    {
+      vpath_stat_resumed++;
+      v = entry->path;
+      start = entry->idx;
+    }
+  else
+    v = vpaths ? vpaths : general_vpath;
+
+  for (; v != 0; v = next_vpath (v))
+    {
+      if (v == general_vpath || pattern_matches (v->pattern, v->percent, file))
+        {
+          unsigned int idx = ~0U;
+          found = selective_vpath_search (v, file, mtime_ptr, start, &idx);
+          if (idx != ~0U && !resume_path)
+            {
+              resume_path = v;
+              resume_idx = idx;
+            }
+          if (found)
+            break;
+        }
+      start = 0;
+    }
+  assert (!found || resume_path);
+
+  /* Remember where to resume the next search for FILE.  */
+  if (!key.file)
+    key.file = strcache_add (file);
+  slot = (struct vpath_cache_entry **) hash_find_slot_strcached (&vpath_cache, &key);
+  entry = *slot;
+  if (HASH_VACANT (entry))
+    {
+      entry = xmalloc (sizeof (*entry));
+      entry->file = key.file;
+      hash_insert_at (&vpath_cache, entry, slot);
+    }
+  entry->path = resume_path;
+  entry->idx = resume_idx;
+
+  return found;
+#else  /* !CONFIG_WITH_VPATH_CACHE */
+
   for (v = vpaths; v != 0; v = v->next)
     if (pattern_matches (v->pattern, v->percent, file))
       {
@@ -558,7 +784,142 @@ vpath_search (const char *file, FILE_TIMESTAMP *mtime_ptr)
     }
 
   return 0;
+#endif /* !CONFIG_WITH_VPATH_CACHE */
+}
+
+#ifdef CONFIG_WITH_VPATH_CACHE
+/* Drops all entries of the vpath cache.  Called when the vpath lists change
+   and when dir.c forgets the contents of a directory.  */
+
+void
+vpath_cache_flush (void)
+{
+  if (vpath_cache.ht_vec && vpath_cache.ht_fill)
+    {
+      hash_free_items (&vpath_cache);
+      vpath_stat_flushes++;
+    }
+  if (vpath_cache_dirs)
+    {
+      free (vpath_cache_dirs);
+      vpath_cache_dirs = 0;
+      vpath_cache_num_dirs = 0;
+    }
+}
+
+/* Adds the directories of PATH to vpath_cache_dirs.  */
+
+static void
+vpath_cache_add_dirs (struct vpath *path)
+{
+  const char **dirs;
+
+  for (dirs = path->searchpath; *dirs != 0; dirs++)
+    {
+      const char *name = *dirs;
+      unsigned int len;
+
+      while (name[0] == '.' && name[1] == '/' && name[2] != '\0')
+        {
+          name += 2;
+          while (*name == '/')
+            ++name;
+        }
+      len = strlen (name);
+      if (len > 1 && name[len - 1] == '/')
+        --len;
+      if (len == 0 || (len == 1 && name[0] == '.'))
+        continue;
+
+      vpath_cache_dirs[vpath_cache_num_dirs].name = name;
+      vpath_cache_dirs[vpath_cache_num_dirs].len = len;
+      vpath_cache_dirs[vpath_cache_num_dirs].searchpath = *dirs;
+      vpath_cache_num_dirs++;
+    }
+}
+
+/* Collects the search path directories for vpath_cache_file_entered.  */
+
+static void
+vpath_cache_init_dirs (void)
+{
+  struct vpath *v;
+  unsigned int count = 0;
+
+  for (v = vpaths ? vpaths : general_vpath; v != 0; v = next_vpath (v))
+    {
+      const char **dirs;
+      for (dirs = v->searchpath; *dirs != 0; dirs++)
+        count++;
+    }
+
+  vpath_cache_dirs = xmalloc ((count + 1) * sizeof (vpath_cache_dirs[0]));
+  vpath_cache_num_dirs = 0;
+  for (v = vpaths ? vpaths : general_vpath; v != 0; v = next_vpath (v))
+    vpath_cache_add_dirs (v);
+}
+
+/* Called by enter_file and rehash_file when NAME becomes a name in the file
+   data base.  NAME may be a name some search tried in one of its
+   directories, so the entry of the name searched for is dropped.  Not if
+   it's in the directory the search resumes at, which is the case when
+   remake.c renames a file to what the search found.  */
+
+void
+vpath_cache_file_entered (const char *name)
+{
+  struct vpath_cache_entry key;
+  unsigned int len;
+  unsigned int i;
+
+  if (!vpath_cache.ht_fill)
+    return;
+
+  len = strcache_get_len (name);
+  for (i = 0; i < vpath_cache_num_dirs; i++)
+    {
+      const struct vpath_cache_dir *dir = &vpath_cache_dirs[i];
+      const char *rest;
+
+      if (dir->len >= len || memcmp (name, dir->name, dir->len))
+        continue;
+      if (dir->name[dir->len - 1] == '/')
+        rest = name + dir->len;
+      else if (name[dir->len] == '/')
+        rest = name + dir->len + 1;
+      else
+        continue;
+
+      key.file = strcache2_lookup_file (&file_strcache, rest,
+                                        len - (rest - name));
+      if (key.file)
+        {
+          struct vpath_cache_entry *entry;
+          entry = hash_find_item_strcached (&vpath_cache, &key);
+          if (entry
+              && (!entry->path
+                  || entry->path->searchpath[entry->idx] != dir->searchpath))
+            {
+              hash_delete_strcached (&vpath_cache, entry);
+              free (entry);
+              vpath_stat_dropped++;
+            }
+        }
+    }
+}
+
+void
+print_vpath_stats (void)
+{
+  if (!vpath_stat_searches)
+    return;
+  printf (_("\n# vpath cache: %lu searches, %lu misses and %lu resumed from the cache\n"),
+          vpath_stat_searches, vpath_stat_misses, vpath_stat_resumed);
+  printf (_("#  %lu directories probed, %lu entries dropped, %u flushes, %lu entries\n"),
+          vpath_stat_probes, vpath_stat_dropped, vpath_stat_flushes,
+          vpath_cache.ht_fill);
 }
+#endif /* CONFIG_WITH_VPATH_CACHE */
 
 /* Print the data base of VPATH search paths.  */
 
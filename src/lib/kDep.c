@@ -33,9 +33,11 @@
 #include <ctype.h>
 #include <limits.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 #include "k/kDefs.h"
 #if K_OS == K_OS_WINDOWS
 # include <windows.h>
+# include <io.h>
  extern void nt_fullpath(const char *pszPath, char *pszFull, size_t cchFull); /* nt_fullpath.c */
 #else
 # include <dirent.h>
@@ -45,6 +47,10 @@
 
 #include "kDep.h"
 
+#ifndef O_BINARY
+# define O_BINARY 0
+#endif
+
 
 /*******************************************************************************
 *   Global Variables                                                           *
@@ -282,6 +288,165 @@ void depPrintStubs(FILE *pOutput)
 }
 
 
+/**
+ * Fills in a path table entry for depDbAppend.
+ *
+ * @param   pPath           The path table entry.
+ * @param   pchStrings      The string table.
+ * @param   poffStrings     The string table offset, updated.
+ * @param   pszFilename     The filename.
+ * @param   cchFilename     The length of the filename.
+ */
+static void depDbAddPath(PKDEPDBPATH pPath, char *pchStrings, unsigned *poffStrings,
+                         const char *pszFilename, size_t cchFilename)
+{
+    pPath->offString = *poffStrings;
+    pPath->cchString = (unsigned)cchFilename;
+    memcpy(&pchStrings[*poffStrings], pszFilename, cchFilename);
+    pchStrings[*poffStrings + cchFilename] = '\0';
+    *poffStrings += (unsigned)cchFilename + 1;
+}
+
+
+/**
+ * Opens a binary dependency database for appending.
+ *
+ * Where fcntl locks are available, a shared lock is taken and the open is
+ * retried if kmk replaced the file with a compacted copy while we were
+ * waiting for it (see KDEPDBREC).
+ *
+ * @returns The file descriptor, -1 and errno on failure.
+ * @param   pszDb       The database file, created if it doesn't exist.
+ */
+static int depDbOpen(const char *pszDb)
+{
+    for (;;)
+    {
+#if K_OS != K_OS_WINDOWS && K_OS != K_OS_OS2
+        struct flock Lock;
+        struct stat  StFd;
+        struct stat  StPath;
+#endif
+        int fd = open(pszDb, O_RDWR | O_CREAT | O_APPEND | O_BINARY, 0666);
+#if K_OS != K_OS_WINDOWS && K_OS != K_OS_OS2
+        if (fd < 0)
+            return fd;
+        memset(&Lock, 0, sizeof(Lock));
+        Lock.l_type   = F_RDLCK;
+        Lock.l_whence = SEEK_SET;
+        while (fcntl(fd, F_SETLKW, &Lock) == -1 && errno == EINTR)
+            /* retry */;
+        /* If locking isn't supported (ENOLCK and such), just go ahead. */
+        if (    !fstat(fd, &StFd)
+            &&  !stat(pszDb, &StPath)
+            &&  (StFd.st_ino != StPath.st_ino || StFd.st_dev != StPath.st_dev))
+        {
+            close(fd);
+            continue;
+        }
+#endif
+        return fd;
+    }
+}
+
+
+/**
+ * Appends a record with the dependencies of a target to a binary dependency
+ * database (see KDEPDBREC).
+ *
+ * The record is written with a single write to a file opened in append mode,
+ * so several processes can append to the same database at the same time.
+ *
+ * @returns 0 on success, 1 on failure (the error has been displayed).
+ * @param   pszDb       The database file, created if it doesn't exist.
+ * @param   pszTarget   The target the dependencies are for.
+ * @param   fStubs      Whether kmk should create empty rules for the
+ *                      dependencies, see depPrintStubs.
+ */
+int depDbAppend(const char *pszDb, const char *pszTarget, int fStubs)
+{
+    size_t      cchTarget = strlen(pszTarget);
+    size_t      cbStrings = cchTarget + 1;
+    unsigned    cPaths = 1;
+    unsigned    offStrings = 0;
+    size_t      cbRec;
+    PKDEPDBREC  pRec;
+    PKDEPDBPATH paPaths;
+    unsigned   *paEdges;
+    char       *pchStrings;
+    PDEP        pDep;
+    int         fd;
+    int         rc = 0;
+
+    /*
+     * Calc the size of the record and allocate it.
+     */
+    for (pDep = g_pDeps; pDep; pDep = pDep->pNext)
+    {
+        cPaths++;
+        cbStrings += pDep->cchFilename + 1;
+    }
+    cbRec = sizeof(*pRec) + cPaths * sizeof(paPaths[0]) + (cPaths + 1) * sizeof(paEdges[0]) + cbStrings;
+    cbRec = (cbRec + KDEPDB_ALIGN - 1) & ~(size_t)(KDEPDB_ALIGN - 1);
+    pRec = (PKDEPDBREC)calloc(1, cbRec);
+    if (!pRec)
+    {
+        fprintf(stderr, "\nOut of memory! (requested %lx bytes)\n\n", (unsigned long)cbRec);
+        exit(1);
+    }
+    paPaths    = (PKDEPDBPATH)(pRec + 1);
+    paEdges    = (unsigned *)&paPaths[cPaths];
+    pchStrings = (char *)&paEdges[cPaths + 1];
+
+    /*
+     * Fill it in. The target is path 0 and the dependencies follow in
+     * the order they were added, there is just one edge list.
+     */
+    pRec->u32Magic  = KDEPDBREC_MAGIC;
+    pRec->cbRec     = (unsigned)cbRec;
+    pRec->fFlags    = fStubs ? KDEPDBREC_F_STUBS : 0;
+    pRec->cPaths    = cPaths;
+    pRec->cEdges    = cPaths + 1;
+    pRec->cbStrings = (unsigned)cbStrings;
+
+    depDbAddPath(&paPaths[0], pchStrings, &offStrings, pszTarget, cchTarget);
+    paEdges[0] = 0;
+    paEdges[1] = cPaths - 1;
+    cPaths = 1;
+    for (pDep = g_pDeps; pDep; pDep = pDep->pNext, cPaths++)
+    {
+        depDbAddPath(&paPaths[cPaths], pchStrings, &offStrings, pDep->szFilename, pDep->cchFilename);
+        paEdges[cPaths + 1] = cPaths;
+    }
+
+    /*
+     * Append it.
+     */
+    fd = depDbOpen(pszDb);
+    if (fd >= 0)
+    {
+        if (write(fd, pRec, (unsigned)cbRec) != (int)cbRec)
+        {
+            fprintf(stderr, "kDep: error: Error writing to '%s': %s\n", pszDb, strerror(errno));
+            rc = 1;
+        }
+        if (close(fd))
+        {
+            fprintf(stderr, "kDep: error: Error closing '%s': %s\n", pszDb, strerror(errno));
+            rc = 1;
+        }
+    }
+    else
+    {
+        fprintf(stderr, "kDep: error: Failed to open '%s': %s\n", pszDb, strerror(errno));
+        rc = 1;
+    }
+
+    free(pRec);
+    return rc;
+}
+
+
 /* sdbm:
    This algorithm was created for sdbm (a public-domain reimplementation of
    ndbm) database library. it was found to do well in scrambling bits,
@@ -40,10 +40,68 @@ typedef struct DEP
 } DEP, *PDEP;
 
 
+
+/** @name Binary dependency database.
+ *
+ * The database is a sequence of self contained records that the tools
+ * append to with a single write, so several of them can share one file
+ * without any locking. A record looks like this:
+ *
+ *      KDEPDBREC     header
+ *      KDEPDBPATH    aPaths[cPaths]    - the interned path table.
+ *      unsigned      aEdges[cEdges]    - {iTarget, cDeps, iDep0..iDepN}...
+ *      char          achStrings[]      - zero terminated path strings.
+ *      padding up to KDEPDB_ALIGN.
+ *
+ * The fields are in host byte order, a database from a host with a different
+ * byte order will fail the magic check. When a target appears in more than
+ * one record, the last one wins.
+ *
+ * Where fcntl locks are available, the writers hold a shared lock while
+ * appending and start over if the file was replaced while they waited for it.
+ * This lets kmk compact the database by renaming a rewritten copy over it
+ * while holding an exclusive lock.
+ * @{ */
+/** The record magic ('kDD2'). */
+#define KDEPDBREC_MAGIC         0x6b444432
+/** The record alignment. */
+#define KDEPDB_ALIGN            8
+/** Record flag: Each dependency gets an empty rule like depPrintStubs. */
+#define KDEPDBREC_F_STUBS       0x00000001
+
+/** A dependency database record header. */
+typedef struct KDEPDBREC
+{
+    /** KDEPDBREC_MAGIC. */
+    unsigned    u32Magic;
+    /** The size of the entire record, including this header. */
+    unsigned    cbRec;
+    /** Flags, KDEPDBREC_F_XXX. */
+    unsigned    fFlags;
+    /** The number of entries in the path table. */
+    unsigned    cPaths;
+    /** The number of unsigned entries in the edge array. */
+    unsigned    cEdges;
+    /** The size of the string table. */
+    unsigned    cbStrings;
+} KDEPDBREC, *PKDEPDBREC;
+
+/** A dependency database path table entry. */
+typedef struct KDEPDBPATH
+{
+    /** The offset of the string into the string table. */
+    unsigned    offString;
+    /** The length of the string. */
+    unsigned    cchString;
+} KDEPDBPATH, *PKDEPDBPATH;
+/** @} */
+
+
 extern PDEP depAdd(const char *pszFilename, size_t cchFilename);
 extern void depOptimize(int fFixCase, int fQuiet);
 extern void depPrint(FILE *pOutput);
 extern void depPrintStubs(FILE *pOutput);
+extern int  depDbAppend(const char *pszDb, const char *pszTarget, int fStubs);
 extern void depCleanup(void);
 
 #endif